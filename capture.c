@@ -0,0 +1,389 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define GL_GLEXT_PROTOTYPES
+#include "GL/gl.h"
+
+#include "capture.h"
+#include "utils.h"
+
+/*
+ * Frame capture without stalling the render thread.
+ *
+ * A synchronous glReadPixels() waits for the GPU to finish the frame
+ * and then copies it, all on the render thread.  Instead, each frame is
+ * read into the next of a ring of pixel buffer objects, which the GPU
+ * fills asynchronously, and a fence is inserted after it.  On later
+ * frames, the render thread maps the buffers whose fences have
+ * signaled, without waiting, and hands them to a writer thread, which
+ * copies them into the output file, mapped in memory and allocated up
+ * front for every frame, and flips them upright on the way.  Once a
+ * buffer has been written, the render thread unmaps it for reuse.  If
+ * the whole ring is still in use, the frame is dropped from the
+ * capture rather than waited for, unless the capture is lossless: then
+ * the oldest buffer is waited for, so that the nth frame in the file is
+ * always the nth frame rendered, as golden image comparisons expect.
+ *
+ * Files named *.y4m get a YUV4MPEG2 header and each frame is converted
+ * to 8-bit BT.601 YCbCr 4:4:4 by the writer; any other file gets raw
+ * RGBA rows, top first.
+ */
+
+#define CAPTURE_RING_SIZE 4
+
+enum CaptureSlotState {
+    CAPTURE_SLOT_FREE,
+    CAPTURE_SLOT_READING,   // glReadPixels() issued, fence pending
+    CAPTURE_SLOT_MAPPED,    // handed to the writer
+    CAPTURE_SLOT_WRITTEN,   // in the file, to be unmapped
+};
+
+struct CaptureSlot {
+    GLuint buffer;
+    GLsync fence;
+    enum CaptureSlotState state;
+    const uint8_t *pixels;  // while mapped
+    unsigned int frame;     // position in the file
+};
+
+struct Capture {
+    char *path;
+    int width, height;
+    int y4m;
+    size_t headerSize;
+    size_t frameSize;       // in the file
+    size_t pixelsSize;      // as read back
+    unsigned int maxFrames;
+    int lossless;           // wait for a slot rather than drop a frame
+    unsigned int frames;    // read back so far
+    unsigned int dropped;
+
+    int fd;
+    uint8_t *pFile;
+    size_t fileSize;
+
+    struct CaptureSlot slots[CAPTURE_RING_SIZE];
+    unsigned int nextSlot;  // to read the next frame into
+    unsigned int oldestSlot;
+    unsigned int busySlots;
+
+    // Slot states past READING, and the counters below, are under lock.
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t slotMapped;
+    pthread_cond_t slotWritten;
+    unsigned int written;
+    int quit;
+};
+
+static void WriteRgba(const struct Capture *pCapture, const uint8_t *pixels, uint8_t *dst)
+{
+    const size_t rowSize = (size_t)pCapture->width * 4;
+    int y;
+
+    // GL reads the bottom row first.
+    for (y = 0; y < pCapture->height; y++) {
+        memcpy(dst + y * rowSize, pixels + (pCapture->height - 1 - y) * rowSize, rowSize);
+    }
+}
+
+static void WriteY4m(const struct Capture *pCapture, const uint8_t *pixels, uint8_t *dst)
+{
+    const size_t planeSize = (size_t)pCapture->width * pCapture->height;
+    uint8_t *pY, *pU, *pV;
+    int x, y;
+
+    memcpy(dst, "FRAME\n", 6);
+    pY = dst + 6;
+    pU = pY + planeSize;
+    pV = pU + planeSize;
+
+    for (y = 0; y < pCapture->height; y++) {
+        const uint8_t *src = pixels + (size_t)(pCapture->height - 1 - y) * pCapture->width * 4;
+
+        for (x = 0; x < pCapture->width; x++, src += 4) {
+            int r = src[0], g = src[1], b = src[2];
+
+            *pY++ = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            *pU++ = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            *pV++ = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+    }
+}
+
+// Write the mapped slots into the file, in the order they were read.
+static void *CaptureWriter(void *arg)
+{
+    struct Capture *pCapture = arg;
+    unsigned int slot = 0;
+
+    pthread_mutex_lock(&pCapture->lock);
+
+    for (;;) {
+        struct CaptureSlot *pSlot = &pCapture->slots[slot];
+        uint8_t *dst;
+
+        while (!pCapture->quit && pSlot->state != CAPTURE_SLOT_MAPPED) {
+            pthread_cond_wait(&pCapture->slotMapped, &pCapture->lock);
+        }
+        if (pSlot->state != CAPTURE_SLOT_MAPPED) {
+            break;
+        }
+
+        pthread_mutex_unlock(&pCapture->lock);
+
+        dst = pCapture->pFile + pCapture->headerSize + (size_t)pSlot->frame * pCapture->frameSize;
+        if (pCapture->y4m) {
+            WriteY4m(pCapture, pSlot->pixels, dst);
+        } else {
+            WriteRgba(pCapture, pSlot->pixels, dst);
+        }
+
+        pthread_mutex_lock(&pCapture->lock);
+        pSlot->state = CAPTURE_SLOT_WRITTEN;
+        pCapture->written++;
+        pthread_cond_signal(&pCapture->slotWritten);
+        slot = (slot + 1) % CAPTURE_RING_SIZE;
+    }
+
+    pthread_mutex_unlock(&pCapture->lock);
+
+    return NULL;
+}
+
+/*
+ * Capture up to maxFrames frames of the given size, rendered with the
+ * context current on the calling thread, to the file at path, which is
+ * created or truncated.  frameRate only goes into a Y4M header.  With
+ * lossless set, no frame is dropped, at the cost of stalling the render
+ * thread when the GPU or the writer falls behind.
+ */
+struct Capture *CreateCapture(const char *path, int width, int height,
+                              double frameRate, unsigned int maxFrames, int lossless)
+{
+    struct Capture *pCapture;
+    const char *suffix = strrchr(path, '.');
+    char header[128];
+    GLint major = 0, minor = 0;
+    int i, ret;
+
+    // Fences need OpenGL 3.2.
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if (major < 3 || (major == 3 && minor < 2)) {
+        Fatal("Capture requires OpenGL 3.2.\n");
+    }
+
+    pCapture = calloc(1, sizeof(*pCapture));
+    if (pCapture == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    pCapture->path = strdup(path);
+    pCapture->width = width;
+    pCapture->height = height;
+    pCapture->y4m = suffix != NULL && strcmp(suffix, ".y4m") == 0;
+    pCapture->maxFrames = maxFrames;
+    pCapture->lossless = lossless;
+    pCapture->pixelsSize = (size_t)width * height * 4;
+
+    if (pCapture->y4m) {
+        snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C444\n",
+                 width, height, (int)(frameRate * 1000.0 + 0.5));
+        pCapture->headerSize = strlen(header);
+        pCapture->frameSize = 6 + (size_t)width * height * 3;
+    } else {
+        pCapture->headerSize = 0;
+        pCapture->frameSize = pCapture->pixelsSize;
+    }
+
+    // Allocate every frame's space now, so that writing never has to.
+    pCapture->fileSize = pCapture->headerSize + (size_t)maxFrames * pCapture->frameSize;
+    pCapture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (pCapture->fd < 0) {
+        Fatal("Unable to create %s: %s\n", path, strerror(errno));
+    }
+    ret = posix_fallocate(pCapture->fd, 0, pCapture->fileSize);
+    if (ret != 0) {
+        Fatal("Unable to allocate %.1f MB for %s: %s\n",
+              pCapture->fileSize / 1e6, path, strerror(ret));
+    }
+    pCapture->pFile = mmap(NULL, pCapture->fileSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           pCapture->fd, 0);
+    if (pCapture->pFile == MAP_FAILED) {
+        Fatal("Unable to map %s: %s\n", path, strerror(errno));
+    }
+    memcpy(pCapture->pFile, header, pCapture->headerSize);
+
+    for (i = 0; i < CAPTURE_RING_SIZE; i++) {
+        glGenBuffers(1, &pCapture->slots[i].buffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pCapture->slots[i].buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, pCapture->pixelsSize, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    pthread_mutex_init(&pCapture->lock, NULL);
+    pthread_cond_init(&pCapture->slotMapped, NULL);
+    pthread_cond_init(&pCapture->slotWritten, NULL);
+
+    if (pthread_create(&pCapture->writer, NULL, CaptureWriter, pCapture) != 0) {
+        Fatal("Unable to create capture writer thread.\n");
+    }
+
+    printf("Capturing up to %u frames to %s (%.1f MB)\n",
+           maxFrames, path, pCapture->fileSize / 1e6);
+
+    return pCapture;
+}
+
+/*
+ * Hand the read-back frames to the writer, oldest first, and free the
+ * slots it has written.  Block until at least the oldest waitSlots of
+ * the busy slots are free.
+ */
+static void ReclaimSlots(struct Capture *pCapture, unsigned int waitSlots)
+{
+    unsigned int i, freed = 0;
+
+    for (i = 0; i < pCapture->busySlots; i++) {
+        struct CaptureSlot *pSlot =
+            &pCapture->slots[(pCapture->oldestSlot + i) % CAPTURE_RING_SIZE];
+        const int wait = i < waitSlots;
+        enum CaptureSlotState state;
+        GLenum status;
+
+        pthread_mutex_lock(&pCapture->lock);
+        state = pSlot->state;
+        pthread_mutex_unlock(&pCapture->lock);
+
+        if (state != CAPTURE_SLOT_READING) {
+            continue;
+        }
+
+        status = glClientWaitSync(pSlot->fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                                  wait ? 1000000000ull : 0);
+        if (status == GL_TIMEOUT_EXPIRED && !wait) {
+            break;
+        }
+        glDeleteSync(pSlot->fence);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pSlot->buffer);
+        pSlot->pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pCapture->pixelsSize,
+                                         GL_MAP_READ_BIT);
+        if (pSlot->pixels == NULL) {
+            Fatal("Unable to map capture buffer.\n");
+        }
+
+        pthread_mutex_lock(&pCapture->lock);
+        pSlot->state = CAPTURE_SLOT_MAPPED;
+        pthread_cond_signal(&pCapture->slotMapped);
+        pthread_mutex_unlock(&pCapture->lock);
+    }
+
+    while (pCapture->busySlots > 0) {
+        struct CaptureSlot *pSlot = &pCapture->slots[pCapture->oldestSlot];
+        const int wait = freed < waitSlots;
+
+        pthread_mutex_lock(&pCapture->lock);
+        while (wait && pSlot->state == CAPTURE_SLOT_MAPPED) {
+            pthread_cond_wait(&pCapture->slotWritten, &pCapture->lock);
+        }
+        if (pSlot->state != CAPTURE_SLOT_WRITTEN) {
+            pthread_mutex_unlock(&pCapture->lock);
+            break;
+        }
+        pSlot->state = CAPTURE_SLOT_FREE;
+        pthread_mutex_unlock(&pCapture->lock);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pSlot->buffer);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        pSlot->pixels = NULL;
+
+        pCapture->oldestSlot = (pCapture->oldestSlot + 1) % CAPTURE_RING_SIZE;
+        pCapture->busySlots--;
+        freed++;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/*
+ * Call after drawing a frame and before swapping, on the thread that
+ * created the capture: start reading the frame back, and pass on those
+ * read back earlier.  Nothing here waits for the GPU, unless the
+ * capture is lossless and every slot is busy.
+ */
+void CaptureFrame(struct Capture *pCapture)
+{
+    struct CaptureSlot *pSlot = &pCapture->slots[pCapture->nextSlot];
+
+    ReclaimSlots(pCapture, 0);
+
+    if (pCapture->frames == pCapture->maxFrames) {
+        return;
+    }
+
+    if (pCapture->busySlots == CAPTURE_RING_SIZE) {
+        if (!pCapture->lossless) {
+            pCapture->dropped++;
+            return;
+        }
+        ReclaimSlots(pCapture, 1);
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pSlot->buffer);
+    glReadPixels(0, 0, pCapture->width, pCapture->height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    pSlot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    pSlot->frame = pCapture->frames++;
+    pSlot->state = CAPTURE_SLOT_READING;
+
+    pCapture->nextSlot = (pCapture->nextSlot + 1) % CAPTURE_RING_SIZE;
+    pCapture->busySlots++;
+}
+
+/*
+ * Finish writing the frames read back so far, and cut the file down to
+ * them.  Call on the thread that created the capture, with its context
+ * still current.
+ */
+void DestroyCapture(struct Capture *pCapture)
+{
+    int i;
+
+    ReclaimSlots(pCapture, CAPTURE_RING_SIZE);
+
+    pthread_mutex_lock(&pCapture->lock);
+    pCapture->quit = 1;
+    pthread_cond_signal(&pCapture->slotMapped);
+    pthread_mutex_unlock(&pCapture->lock);
+    pthread_join(pCapture->writer, NULL);
+
+    for (i = 0; i < CAPTURE_RING_SIZE; i++) {
+        glDeleteBuffers(1, &pCapture->slots[i].buffer);
+    }
+
+    munmap(pCapture->pFile, pCapture->fileSize);
+    if (ftruncate(pCapture->fd, pCapture->headerSize +
+                  (size_t)pCapture->written * pCapture->frameSize) != 0) {
+        Warning("Unable to truncate %s: %s\n", pCapture->path, strerror(errno));
+    }
+    close(pCapture->fd);
+
+    printf("Captured %u frames to %s, %u dropped\n",
+           pCapture->written, pCapture->path, pCapture->dropped);
+
+    pthread_cond_destroy(&pCapture->slotWritten);
+    pthread_cond_destroy(&pCapture->slotMapped);
+    pthread_mutex_destroy(&pCapture->lock);
+    free(pCapture->path);
+    free(pCapture);
+}
@@ -0,0 +1,12 @@
+#if !defined(CAPTURE_H)
+#define CAPTURE_H
+
+// Frame capture to a file, read back without stalling rendering
+struct Capture;
+
+struct Capture *CreateCapture(const char *path, int width, int height,
+                              double frameRate, unsigned int maxFrames, int lossless);
+void CaptureFrame(struct Capture *pCapture);
+void DestroyCapture(struct Capture *pCapture);
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "utils.h"
+
+/*
+ * A local control socket: a UNIX-domain stream socket on which clients,
+ * e.g. `socat - UNIX-CONNECT:path`, send commands a line at a time.
+ * The listening socket and its clients are sources of the main thread's
+ * event loop, so commands are handled there, between its other events,
+ * and the render threads never block on a client.
+ *
+ * The socket is only accessible to the user running the program, since
+ * its commands change what the displays show.
+ */
+
+static void CloseClient(struct ControlClient *pClient)
+{
+    EventLoopRemoveFd(pClient->pServer->pLoop, pClient->fd);
+    close(pClient->fd);
+
+    pClient->fd = -1;
+    pClient->generation++;
+}
+
+static unsigned int ClientID(const struct ControlServer *pServer,
+                             const struct ControlClient *pClient)
+{
+    return pClient->generation * CONTROL_MAX_CLIENTS + (pClient - pServer->clients);
+}
+
+/*
+ * Split what the client sent into lines for the handler.  A line that
+ * does not fit the buffer is answered with an error, and skipped.
+ */
+static void ReadClient(void *data, uint64_t events)
+{
+    struct ControlClient *pClient = data;
+    struct ControlServer *pServer = pClient->pServer;
+    unsigned int client = ClientID(pServer, pClient);
+    char buffer[CONTROL_MAX_LINE];
+    ssize_t size, i;
+
+    (void)events;
+
+    size = recv(pClient->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    if (size < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (size <= 0) {
+        CloseClient(pClient);
+        return;
+    }
+
+    for (i = 0; i < size; i++) {
+        if (buffer[i] != '\n') {
+            if (pClient->length < sizeof(pClient->line) - 1) {
+                pClient->line[pClient->length++] = buffer[i];
+            } else {
+                pClient->overlong = 1;
+            }
+            continue;
+        }
+
+        if (pClient->overlong) {
+            ControlReply(pServer, client, "error: line too long");
+        } else {
+            // Tolerate clients that end lines with CRLF
+            if (pClient->length > 0 && pClient->line[pClient->length - 1] == '\r') {
+                pClient->length--;
+            }
+            pClient->line[pClient->length] = '\0';
+            pServer->handler(pServer->data, client, pClient->line);
+        }
+
+        pClient->length = 0;
+        pClient->overlong = 0;
+    }
+}
+
+static void AcceptClient(void *data, uint64_t events)
+{
+    struct ControlServer *pServer = data;
+    int fd, i;
+
+    (void)events;
+
+    while ((fd = accept4(pServer->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct ControlClient *pClient = NULL;
+
+        for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+            if (pServer->clients[i].fd < 0) {
+                pClient = &pServer->clients[i];
+                break;
+            }
+        }
+
+        if (pClient == NULL) {
+            static const char busy[] = "error: too many clients\n";
+
+            send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(fd);
+            continue;
+        }
+
+        pClient->fd = fd;
+        pClient->length = 0;
+        pClient->overlong = 0;
+        EventLoopAddFd(pServer->pLoop, fd, ReadClient, pClient);
+    }
+}
+
+/*
+ * Listen on a UNIX-domain socket at path, replacing a socket left there
+ * by an earlier run, and call handler with each line clients send.
+ */
+void OpenControlServer(struct ControlServer *pServer, struct EventLoop *pLoop,
+                       const char *path, ControlHandler handler, void *data)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    mode_t mask;
+    int ret, i;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        Fatal("The control socket path %s is too long.\n", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    memset(pServer, 0, sizeof(*pServer));
+    pServer->pLoop = pLoop;
+    pServer->path = path;
+    pServer->handler = handler;
+    pServer->data = data;
+    for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        pServer->clients[i].pServer = pServer;
+        pServer->clients[i].fd = -1;
+    }
+
+    // Only a socket is replaced, never a file given by mistake.
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    pServer->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (pServer->fd < 0) {
+        Fatal("Unable to create the control socket: %s\n", strerror(errno));
+    }
+
+    // Created with the final permissions, so that no one can connect early
+    mask = umask(0177);
+    ret = bind(pServer->fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+
+    if (ret != 0 || listen(pServer->fd, CONTROL_MAX_CLIENTS) != 0) {
+        Fatal("Unable to listen on %s: %s\n", path, strerror(errno));
+    }
+
+    EventLoopAddFd(pLoop, pServer->fd, AcceptClient, pServer);
+}
+
+/*
+ * Send a line to a client, if it is still connected.  Replies are never
+ * waited for: a client that does not read them loses them.
+ */
+void ControlReply(struct ControlServer *pServer, unsigned int client, const char *format, ...)
+{
+    struct ControlClient *pClient = &pServer->clients[client % CONTROL_MAX_CLIENTS];
+    char line[CONTROL_MAX_LINE * 4];
+    va_list ap;
+    int length;
+
+    if (pClient->fd < 0 || ClientID(pServer, pClient) != client) {
+        return;
+    }
+
+    va_start(ap, format);
+    length = vsnprintf(line, sizeof(line) - 1, format, ap);
+    va_end(ap);
+
+    if (length < 0) {
+        return;
+    }
+    if (length > (int)sizeof(line) - 2) {
+        length = sizeof(line) - 2;
+    }
+    line[length++] = '\n';
+
+    send(pClient->fd, line, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+void CloseControlServer(struct ControlServer *pServer)
+{
+    int i;
+
+    for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (pServer->clients[i].fd >= 0) {
+            CloseClient(&pServer->clients[i]);
+        }
+    }
+
+    EventLoopRemoveFd(pServer->pLoop, pServer->fd);
+    close(pServer->fd);
+    unlink(pServer->path);
+}
@@ -0,0 +1,43 @@
+#if !defined(CONTROL_H)
+#define CONTROL_H
+
+#include <stddef.h>
+
+#include "eventloop.h"
+
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_MAX_LINE 256    // including the newline
+
+/*
+ * Called with each line a client sends, without its newline.  client
+ * names the connection for ControlReply(), even after the handler has
+ * returned; replies to a client that has gone are dropped.
+ */
+typedef void (*ControlHandler)(void *data, unsigned int client, char *line);
+
+struct ControlServer;
+
+struct ControlClient {
+    struct ControlServer *pServer;
+    int fd;                     // -1 if the slot is free
+    unsigned int generation;    // bumped each time the slot is freed
+    char line[CONTROL_MAX_LINE];
+    size_t length;
+    int overlong;               // discarding the rest of a line too long
+};
+
+struct ControlServer {
+    struct EventLoop *pLoop;
+    int fd;
+    const char *path;
+    ControlHandler handler;
+    void *data;
+    struct ControlClient clients[CONTROL_MAX_CLIENTS];
+};
+
+void OpenControlServer(struct ControlServer *pServer, struct EventLoop *pLoop,
+                       const char *path, ControlHandler handler, void *data);
+void ControlReply(struct ControlServer *pServer, unsigned int client, const char *format, ...);
+void CloseControlServer(struct ControlServer *pServer);
+
+#endif /* CONTROL_H */
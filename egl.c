@@ -20,10 +20,13 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <xf86drm.h>
 
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
@@ -39,17 +42,38 @@
 #define EGL_DRM_MASTER_FD_EXT                   0x333C
 #endif
 
+/* XXX khronos eglext.h does not yet have EGL_EXT_stream_acquire_mode */
+#if !defined(EGL_CONSUMER_AUTO_ACQUIRE_EXT)
+#define EGL_CONSUMER_AUTO_ACQUIRE_EXT           0x332B
+#endif
+
+#if !defined(EGL_RESOURCE_BUSY_EXT)
+#define EGL_RESOURCE_BUSY_EXT                   0x3353
+#endif
+
+#if !defined(EGL_PLATFORM_SURFACELESS_MESA)
+#define EGL_PLATFORM_SURFACELESS_MESA           0x31DD
+#endif
+
+/* XXX khronos eglext.h does not yet have EGL_NV_output_drm_flip_event */
+#if !defined(EGL_DRM_FLIP_EVENT_DATA_NV)
+#define EGL_DRM_FLIP_EVENT_DATA_NV              0x333E
+#endif
+
 
 /*
  * The EGL_EXT_device_base extension (or EGL_EXT_device_enumeration
  * and EGL_EXT_device_query) let you enumerate the GPUs in the system.
+ *
+ * Fill devices with up to maxDevices EGLDeviceEXTs that support
+ * EGL_EXT_device_drm, and return how many there are.
  */
-EGLDeviceEXT GetEglDevice(void)
+int GetEglDevices(EGLDeviceEXT *drmDevices, int maxDevices)
 {
     EGLint numDevices, i;
     EGLDeviceEXT *devices = NULL;
-    EGLDeviceEXT device = EGL_NO_DEVICE_EXT;
     EGLBoolean ret;
+    int count = 0;
 
     const char *clientExtensionString =
         eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
@@ -89,7 +113,7 @@ EGLDeviceEXT GetEglDevice(void)
     }
 
     /*
-     * Select which EGLDeviceEXT to use.
+     * Select which EGLDeviceEXTs to use.
      *
      * The EGL_EXT_device_query extension defines the functions:
      *
@@ -106,33 +130,133 @@ EGLDeviceEXT GetEglDevice(void)
      * - EGL_EXT_device_drm lets you query the DRM device file
      * (EGL_DRM_DEVICE_FILE_EXT) of an EGLDeviceEXT.
      *
-     * Future extensions could define other EGLDeviceEXT attributes
-     * such as PCI BusID.
-     *
-     * For now, just choose the first device that supports EGL_EXT_device_drm.
+     * Every device that supports EGL_EXT_device_drm can drive its own
+     * displays; EglDeviceMatches() narrows them down further.
      */
 
-    for (i = 0; i < numDevices; i++) {
+    for (i = 0; i < numDevices && count < maxDevices; i++) {
 
         const char *deviceExtensionString =
             pEglQueryDeviceStringEXT(devices[i], EGL_EXTENSIONS);
 
         if (ExtensionIsSupported(deviceExtensionString, "EGL_EXT_device_drm")) {
-            device = devices[i];
-            break;
+            drmDevices[count++] = devices[i];
         }
     }
 
     free(devices);
 
-    if (device == EGL_NO_DEVICE_EXT) {
+    if (count == 0) {
         Fatal("No EGL_EXT_device_drm-capable EGL device found.\n");
     }
 
-    return device;
+    return count;
+}
+
+
+/*
+ * The PCI bus ID of the GPU behind a DRM fd; returns 0 for devices that
+ * are not on PCI.
+ */
+static int GetPciBusInfo(int drmFd, drmPciBusInfo *pBusInfo)
+{
+    drmDevicePtr pDevice;
+    int ret = 0;
+
+    if (drmGetDevice2(drmFd, 0, &pDevice) != 0) {
+        return 0;
+    }
+
+    if (pDevice->bustype == DRM_BUS_PCI) {
+        *pBusInfo = *pDevice->businfo.pci;
+        ret = 1;
+    }
+
+    drmFreeDevice(&pDevice);
+
+    return ret;
 }
 
+/*
+ * Parse a PCI bus ID in the usual hexadecimal domain:bus:device.function
+ * form, or bus:device.function; *pHasDomain tells which.  Returns 0 if
+ * it is neither.
+ */
+static int ParsePciBusId(const char *busId, drmPciBusInfo *pBusInfo, int *pHasDomain)
+{
+    unsigned int domain = 0, bus, dev, func;
+    int end = -1;
+
+    // sscanf() alone would also take signs, spaces and 0x prefixes.
+    if (busId[strspn(busId, "0123456789abcdefABCDEF:.")] != '\0') {
+        return 0;
+    }
+
+    sscanf(busId, "%x:%x:%x.%x%n", &domain, &bus, &dev, &func, &end);
+    *pHasDomain = end >= 0;
+    if (!*pHasDomain) {
+        sscanf(busId, "%x:%x.%x%n", &bus, &dev, &func, &end);
+    }
+
+    if (end < 0 || busId[end] != '\0' ||
+        domain > 0xffff || bus > 0xff || dev > 0x1f || func > 7) {
+        return 0;
+    }
+
+    pBusInfo->domain = domain;
+    pBusInfo->bus = bus;
+    pBusInfo->dev = dev;
+    pBusInfo->func = func;
+
+    return 1;
+}
+
+/*
+ * Whether an EGLDeviceEXT, opened as drmFd, is the one selected by the
+ * user: either its DRM device file, under any name that resolves to
+ * it (e.g., /dev/dri/by-path/...), or "pci:" followed by its PCI bus
+ * ID, with or without the domain (e.g., pci:0000:01:00.0 or
+ * pci:01:00.0).
+ */
+EGLBoolean EglDeviceMatches(EGLDeviceEXT device, int drmFd, const char *selector)
+{
+    const char *drmDeviceFile = pEglQueryDeviceStringEXT(device, EGL_DRM_DEVICE_FILE_EXT);
+
+    if (strncmp(selector, "pci:", 4) == 0) {
+        drmPciBusInfo wanted = { 0 }, busInfo;
+        int hasDomain = 0;
+
+        if (!ParsePciBusId(selector + 4, &wanted, &hasDomain)) {
+            Fatal("Invalid PCI bus ID in %s; expected pci:[domain:]bus:device.function.\n",
+                  selector);
+        }
+        if (!GetPciBusInfo(drmFd, &busInfo)) {
+            return EGL_FALSE;
+        }
+
+        return (!hasDomain || busInfo.domain == wanted.domain) &&
+               busInfo.bus == wanted.bus && busInfo.dev == wanted.dev &&
+               busInfo.func == wanted.func;
+    }
+
+    if (drmDeviceFile == NULL) {
+        return EGL_FALSE;
+    }
+
+    if (strcmp(drmDeviceFile, selector) == 0) {
+        return EGL_TRUE;
+    } else {
+        char *selectorPath = realpath(selector, NULL);
+        char *devicePath = realpath(drmDeviceFile, NULL);
+        EGLBoolean match = selectorPath != NULL && devicePath != NULL &&
+                           strcmp(selectorPath, devicePath) == 0;
 
+        free(selectorPath);
+        free(devicePath);
+
+        return match;
+    }
+}
 
 /*
  * Use the EGL_EXT_device_drm extension to query the DRM device file
@@ -232,10 +356,7 @@ EGLDisplay GetEglDisplay(EGLDeviceEXT device, int drmFd)
 }
 
 
-/*
- * Set up EGL to present to a DRM KMS plane through an EGLStream.
- */
-EGLSurface SetUpEgl(EGLDisplay eglDpy, uint32_t planeID, int width, int height, int hdr_enabled)
+static EGLConfig ChooseConfig(EGLDisplay eglDpy, int hdr_enabled)
 {
     EGLint configAttribs_sdr[] = {
         EGL_SURFACE_TYPE, EGL_STREAM_BIT_KHR,
@@ -262,15 +383,38 @@ EGLSurface SetUpEgl(EGLDisplay eglDpy, uint32_t planeID, int width, int height,
 
     EGLint *configAttribs = hdr_enabled ? configAttribs_hdr : configAttribs_sdr;
 
-    EGLint contextAttribs[] = { EGL_NONE };
+    EGLConfig eglConfig;
+    EGLint n = 0;
+    EGLBoolean ret;
+
+    ret = eglChooseConfig(eglDpy, configAttribs, &eglConfig, 1, &n);
+
+    if (!ret || !n) {
+        if (hdr_enabled) {
+            Fatal("eglChooseConfig() failed to find a 10-bit HDR-capable EGL config.\n");
+        } else {
+            Fatal("eglChooseConfig() failed.\n");
+        }
+    }
 
+    return eglConfig;
+}
+
+/*
+ * Connect a new EGLStream to the EGLOutputLayer of a DRM KMS plane,
+ * and create an EGLSurface producing into it.
+ */
+static EGLSurface CreateStreamSurface(EGLDisplay eglDpy, EGLConfig eglConfig, uint32_t planeID,
+                                      int width, int height, int manual_acquire,
+                                      int fifo_length, EGLStreamKHR *pStream)
+{
     EGLAttrib layerAttribs[] = {
         EGL_DRM_PLANE_EXT,
         (EGLAttrib)planeID,
         EGL_NONE,
     };
 
-    EGLint streamAttribs[] = { EGL_NONE };
+    EGLint streamAttribs[5];
 
     EGLint surfaceAttribs[] = {
         EGL_WIDTH, width,
@@ -278,14 +422,119 @@ EGLSurface SetUpEgl(EGLDisplay eglDpy, uint32_t planeID, int width, int height,
         EGL_NONE
     };
 
-    EGLConfig eglConfig;
-    EGLContext eglContext;
-    EGLint n = 0;
+    EGLint n = 0, attrib = 0;
     EGLBoolean ret;
     EGLOutputLayerEXT eglLayer;
     EGLStreamKHR eglStream;
     EGLSurface eglSurface;
 
+    /*
+     * Auto acquire is the default for EGLOutputLayer consumers, and
+     * mailbox mode (a FIFO length of 0) for all streams; only pass the
+     * attributes that change them, so that implementations that do not
+     * know about them are not asked to.
+     */
+    if (manual_acquire) {
+        streamAttribs[attrib++] = EGL_CONSUMER_AUTO_ACQUIRE_EXT;
+        streamAttribs[attrib++] = EGL_FALSE;
+    }
+    if (fifo_length > 0) {
+        streamAttribs[attrib++] = EGL_STREAM_FIFO_LENGTH_KHR;
+        streamAttribs[attrib++] = fifo_length;
+    }
+    streamAttribs[attrib] = EGL_NONE;
+
+    /* Find the EGLOutputLayer that corresponds to the DRM KMS plane. */
+
+    ret = pEglGetOutputLayersEXT(eglDpy, layerAttribs, &eglLayer, 1, &n);
+
+    if (!ret || !n) {
+        Fatal("Unable to get EGLOutputLayer for plane 0x%08x\n", planeID);
+    }
+
+    /* Create an EGLStream. */
+
+    eglStream = pEglCreateStreamKHR(eglDpy, streamAttribs);
+
+    if (eglStream == EGL_NO_STREAM_KHR) {
+        Fatal("Unable to create stream.\n");
+    }
+
+    /* Set the EGLOutputLayer as the consumer of the EGLStream. */
+
+    ret = pEglStreamConsumerOutputEXT(eglDpy, eglStream, eglLayer);
+
+    if (!ret) {
+        Fatal("Unable to create EGLOutput stream consumer.\n");
+    }
+
+    /*
+     * EGL_KHR_stream defines that normally stream consumers need to
+     * explicitly retrieve frames from the stream.  But,
+     * EGL_EXT_stream_consumer_egloutput defines that by default:
+     *
+     * On success, <layer> is bound to <stream>, <stream> is placed
+     * in the EGL_STREAM_STATE_CONNECTING_KHR state, and EGL_TRUE is
+     * returned.  Initially, no changes occur to the image displayed
+     * on <layer>. When the <stream> enters state
+     * EGL_STREAM_STATE_NEW_FRAME_AVAILABLE_KHR, <layer> will begin
+     * displaying frames, without further action required on the
+     * application's part, as they become available, taking into
+     * account any timestamps, swap intervals, or other limitations
+     * imposed by the stream or producer attributes.
+     *
+     * So, by default eglSwapBuffers() (to produce new frames) is
+     * sufficient for the frames to be displayed.
+     *
+     * With EGL_EXT_stream_acquire_mode, we created the stream with
+     * EGL_CONSUMER_AUTO_ACQUIRE_EXT set to EGL_FALSE when manual
+     * acquisition was requested.  In that case, frames produced by
+     * eglSwapBuffers() sit in the stream until AcquireFrame() hands
+     * them to the DRM KMS plane, which lets the application decide
+     * when each frame is flipped relative to its own atomic KMS
+     * requests.
+     */
+
+    /*
+     * Create an EGLSurface as the producer of the EGLStream.  Once
+     * the stream's producer and consumer are defined, the stream is
+     * ready to use.  eglSwapBuffers() calls for the EGLSurface will
+     * deliver to the stream's consumer, i.e., the DRM KMS plane
+     * corresponding to the EGLOutputLayer.
+     */
+
+    eglSurface = pEglCreateStreamProducerSurfaceKHR(eglDpy, eglConfig,
+                                                    eglStream, surfaceAttribs);
+    if (eglSurface == EGL_NO_SURFACE) {
+        Fatal("Unable to create EGLSurface stream producer.\n");
+    }
+
+    *pStream = eglStream;
+
+    return eglSurface;
+}
+
+/*
+ * Set up EGL to present to a DRM KMS plane through an EGLStream.
+ *
+ * If manual_acquire is set, the stream's consumer does not pick up
+ * new frames by itself; the application must call AcquireFrame()
+ * after each eglSwapBuffers().
+ *
+ * Each call creates its own context, output layer, stream and surface,
+ * and makes the context current to the calling thread, so with several
+ * heads each render thread sets up its own plane.
+ */
+EGLSurface SetUpEgl(EGLDisplay eglDpy, uint32_t planeID, int width, int height, int hdr_enabled,
+                    int manual_acquire, int fifo_length, EGLStreamKHR *pStream)
+{
+    EGLint contextAttribs[] = { EGL_NONE };
+
+    EGLConfig eglConfig;
+    EGLContext eglContext;
+    EGLBoolean ret;
+    EGLSurface eglSurface;
+
     const char *extensionString = eglQueryString(eglDpy, EGL_EXTENSIONS);
 
     /*
@@ -321,101 +570,315 @@ EGLSurface SetUpEgl(EGLDisplay eglDpy, uint32_t planeID, int width, int height,
         Fatal("EGL_KHR_stream_producer_eglsurface not found.\n");
     }
 
+    /*
+     * EGL_EXT_stream_acquire_mode is needed to turn off the
+     * EGLOutputLayer consumer's automatic frame acquisition.
+     */
+
+    if (manual_acquire &&
+        !ExtensionIsSupported(extensionString,
+                              "EGL_EXT_stream_acquire_mode")) {
+        Fatal("EGL_EXT_stream_acquire_mode not found.\n");
+    }
+
+    /*
+     * EGL_KHR_stream_fifo is needed to queue frames in the stream
+     * instead of replacing the one waiting for display.
+     */
+
+    if (fifo_length > 0 &&
+        !ExtensionIsSupported(extensionString, "EGL_KHR_stream_fifo")) {
+        Fatal("EGL_KHR_stream_fifo not found.\n");
+    }
+
     /* Bind full OpenGL as EGL's client API. */
 
     eglBindAPI(EGL_OPENGL_API);
 
     /* Find a suitable EGL config. */
 
-    ret = eglChooseConfig(eglDpy, configAttribs, &eglConfig, 1, &n);
-
-    if (!ret || !n) {
-        if (hdr_enabled) {
-            Fatal("eglChooseConfig() failed to find a 10-bit HDR-capable EGL config.\n");
-        } else {
-            Fatal("eglChooseConfig() failed.\n");
-        }
-    }
+    eglConfig = ChooseConfig(eglDpy, hdr_enabled);
 
-    /* Create an EGL context using the EGL config. */
+    /*
+     * Create an EGL context using the EGL config.  With
+     * EGL_KHR_no_config_context, the context is not tied to any
+     * config, so that surfaces of the other one (SDR or HDR) can be
+     * made current to it later; see EglCanChangeConfig().
+     */
 
     eglContext =
-        eglCreateContext(eglDpy, eglConfig, EGL_NO_CONTEXT, contextAttribs);
+        eglCreateContext(eglDpy,
+                         EglCanChangeConfig(eglDpy) ? EGL_NO_CONFIG_KHR : eglConfig,
+                         EGL_NO_CONTEXT, contextAttribs);
 
     if (eglContext == NULL) {
         Fatal("eglCreateContext() failed.\n");
     }
 
-    /* Find the EGLOutputLayer that corresponds to the DRM KMS plane. */
+    eglSurface = CreateStreamSurface(eglDpy, eglConfig, planeID, width, height,
+                                     manual_acquire, fifo_length, pStream);
 
-    ret = pEglGetOutputLayersEXT(eglDpy, layerAttribs, &eglLayer, 1, &n);
+    /*
+     * Make current to the EGLSurface, so that OpenGL rendering is
+     * directed to it.
+     */
 
-    if (!ret || !n) {
-        Fatal("Unable to get EGLOutputLayer for plane 0x%08x\n", planeID);
+    ret = eglMakeCurrent(eglDpy, eglSurface, eglSurface, eglContext);
+
+    if (!ret) {
+        Fatal("Unable to make context and surface current.\n");
     }
 
-    /* Create an EGLStream. */
+    return eglSurface;
+}
 
-    eglStream = pEglCreateStreamKHR(eglDpy, streamAttribs);
+/*
+ * Set up rendering with no display at all, for throughput benchmarks:
+ * a pbuffer of the given size on an EGLDisplay of the surfaceless
+ * platform (EGL_MESA_platform_surfaceless), which needs neither a DRM
+ * device nor the EGLStream extensions, so that it also works with
+ * software rendering such as llvmpipe.  Like SetUpEgl(), the pbuffer is
+ * left current on the calling thread.
+ */
+EGLSurface SetUpOffscreenEgl(int width, int height, EGLDisplay *pDpy)
+{
+    EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 1,
+        EGL_NONE,
+    };
+    EGLint surfaceAttribs[] = {
+        EGL_WIDTH, width,
+        EGL_HEIGHT, height,
+        EGL_NONE,
+    };
+    EGLint contextAttribs[] = { EGL_NONE };
 
-    if (eglStream == EGL_NO_STREAM_KHR) {
-        Fatal("Unable to create stream.\n");
+    const char *clientExtensionString =
+        eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay;
+    EGLDisplay eglDpy;
+    EGLConfig eglConfig;
+    EGLContext eglContext;
+    EGLSurface eglSurface;
+    EGLint n = 0;
+
+    /*
+     * Only eglGetPlatformDisplayEXT() is looked up here: the EGLStream
+     * entry points GetEglExtensionFunctionPointers() requires are
+     * missing from implementations like Mesa's.
+     */
+    if (!ExtensionIsSupported(clientExtensionString, "EGL_EXT_platform_base")) {
+        Fatal("EGL_EXT_platform_base not found.\n");
     }
 
-    /* Set the EGLOutputLayer as the consumer of the EGLStream. */
+    if (!ExtensionIsSupported(clientExtensionString,
+                              "EGL_MESA_platform_surfaceless")) {
+        Fatal("EGL_MESA_platform_surfaceless not found.\n");
+    }
 
-    ret = pEglStreamConsumerOutputEXT(eglDpy, eglStream, eglLayer);
+    getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+        eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay == NULL) {
+        Fatal("eglGetProcAddress(eglGetPlatformDisplayEXT) failed.\n");
+    }
 
-    if (!ret) {
-        Fatal("Unable to create EGLOutput stream consumer.\n");
+    eglDpy = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+    if (eglDpy == EGL_NO_DISPLAY) {
+        Fatal("Failed to get a surfaceless EGLDisplay.\n");
     }
 
-    /*
-     * EGL_KHR_stream defines that normally stream consumers need to
-     * explicitly retrieve frames from the stream.  That may be useful
-     * when we attempt to better integrate
-     * EGL_EXT_stream_consumer_egloutput with DRM atomic KMS requests.
-     * But, EGL_EXT_stream_consumer_egloutput defines that by default:
-     *
-     * On success, <layer> is bound to <stream>, <stream> is placed
-     * in the EGL_STREAM_STATE_CONNECTING_KHR state, and EGL_TRUE is
-     * returned.  Initially, no changes occur to the image displayed
-     * on <layer>. When the <stream> enters state
-     * EGL_STREAM_STATE_NEW_FRAME_AVAILABLE_KHR, <layer> will begin
-     * displaying frames, without further action required on the
-     * application's part, as they become available, taking into
-     * account any timestamps, swap intervals, or other limitations
-     * imposed by the stream or producer attributes.
-     *
-     * So, eglSwapBuffers() (to produce new frames) is sufficient for
-     * the frames to be displayed.  That behavior can be altered with
-     * the EGL_EXT_stream_acquire_mode extension.
-     */
+    if (!eglInitialize(eglDpy, NULL, NULL)) {
+        Fatal("Failed to initialize EGLDisplay.\n");
+    }
 
-    /*
-     * Create an EGLSurface as the producer of the EGLStream.  Once
-     * the stream's producer and consumer are defined, the stream is
-     * ready to use.  eglSwapBuffers() calls for the EGLSurface will
-     * deliver to the stream's consumer, i.e., the DRM KMS plane
-     * corresponding to the EGLOutputLayer.
-     */
+    eglBindAPI(EGL_OPENGL_API);
 
-    eglSurface = pEglCreateStreamProducerSurfaceKHR(eglDpy, eglConfig,
-                                                    eglStream, surfaceAttribs);
-    if (eglSurface == EGL_NO_SURFACE) {
-        Fatal("Unable to create EGLSurface stream producer.\n");
+    if (!eglChooseConfig(eglDpy, configAttribs, &eglConfig, 1, &n) || !n) {
+        Fatal("eglChooseConfig() failed to find a pbuffer config.\n");
     }
 
-    /*
-     * Make current to the EGLSurface, so that OpenGL rendering is
-     * directed to it.
-     */
+    eglContext = eglCreateContext(eglDpy, eglConfig, EGL_NO_CONTEXT, contextAttribs);
 
-    ret = eglMakeCurrent(eglDpy, eglSurface, eglSurface, eglContext);
+    if (eglContext == NULL) {
+        Fatal("eglCreateContext() failed.\n");
+    }
 
-    if (!ret) {
+    eglSurface = eglCreatePbufferSurface(eglDpy, eglConfig, surfaceAttribs);
+
+    if (eglSurface == EGL_NO_SURFACE) {
+        Fatal("eglCreatePbufferSurface() failed.\n");
+    }
+
+    if (!eglMakeCurrent(eglDpy, eglSurface, eglSurface, eglContext)) {
         Fatal("Unable to make context and surface current.\n");
     }
 
+    *pDpy = eglDpy;
+
     return eglSurface;
-}
\ No newline at end of file
+}
+
+/*
+ * Whether SetUpEgl() makes a context that is not tied to an EGL config
+ * (EGL_KHR_no_config_context), and so can render to the surfaces of
+ * SetUpStreamSurface() whatever their hdr_enabled.
+ */
+EGLBoolean EglCanChangeConfig(EGLDisplay eglDpy)
+{
+    return ExtensionIsSupported(eglQueryString(eglDpy, EGL_EXTENSIONS),
+                                "EGL_KHR_no_config_context");
+}
+
+/*
+ * Connect another EGLStream to a plane, and create an EGLSurface
+ * producing into it.  Call it after SetUpEgl() on the same thread: the
+ * surface is compatible with the context SetUpEgl() made current, so
+ * the render thread draws into it by making it current in turn.
+ *
+ * This is used for overlay planes (see KmsShowOverlay()), for content
+ * rendered separately from the primary plane's, e.g. a video or UI
+ * layer, that the display engine composites without any GPU work; and
+ * to replace a plane's stream once DestroyStreamSurface() is done with
+ * the old one, e.g. after KmsChangeMode().  A stream's size and FIFO
+ * length are fixed when it is created, so changing them takes a new
+ * stream; a different hdr_enabled than SetUpEgl()'s also takes
+ * EglCanChangeConfig().
+ */
+EGLSurface SetUpStreamSurface(EGLDisplay eglDpy, uint32_t planeID, int width, int height,
+                              int hdr_enabled, int manual_acquire, int fifo_length,
+                              EGLStreamKHR *pStream)
+{
+    EGLConfig eglConfig = ChooseConfig(eglDpy, hdr_enabled);
+
+    return CreateStreamSurface(eglDpy, eglConfig, planeID, width, height,
+                               manual_acquire, fifo_length, pStream);
+}
+
+
+/*
+ * Read the stream's frame counters (EGL_KHR_stream): the number of the
+ * last frame the producer inserted, and of the frame the consumer is
+ * showing.  The difference is the number of frames queued for display.
+ */
+EGLBoolean QueryStreamFrames(EGLDisplay eglDpy, EGLStreamKHR eglStream,
+                             uint64_t *pProduced, uint64_t *pConsumed)
+{
+    EGLuint64KHR produced, consumed;
+
+    if (!pEglQueryStreamu64KHR(eglDpy, eglStream, EGL_PRODUCER_FRAME_KHR, &produced) ||
+        !pEglQueryStreamu64KHR(eglDpy, eglStream, EGL_CONSUMER_FRAME_KHR, &consumed)) {
+        return EGL_FALSE;
+    }
+
+    *pProduced = produced;
+    *pConsumed = consumed;
+
+    return EGL_TRUE;
+}
+
+
+/*
+ * Destroy a surface of SetUpStreamSurface() or SetUpEgl() and its
+ * stream, while the context lives on.  The context is released first,
+ * in case the surface is current.
+ */
+void DestroyStreamSurface(EGLDisplay eglDpy, EGLSurface eglSurface, EGLStreamKHR eglStream)
+{
+    eglMakeCurrent(eglDpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroySurface(eglDpy, eglSurface);
+    pEglDestroyStreamKHR(eglDpy, eglStream);
+}
+
+/*
+ * Undo SetUpEgl() and SetUpStreamSurface() on the render thread once it
+ * is done with them: release the context, then destroy each stream's
+ * producer surface before the stream itself, and finally the context.
+ * streams is NULL for surfaces without one (see SetUpOffscreenEgl()).
+ */
+void TearDownEgl(EGLDisplay eglDpy, EGLContext eglContext,
+                 const EGLSurface *surfaces, const EGLStreamKHR *streams, int count)
+{
+    int i;
+
+    eglMakeCurrent(eglDpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+    for (i = 0; i < count; i++) {
+        eglDestroySurface(eglDpy, surfaces[i]);
+        if (streams != NULL) {
+            pEglDestroyStreamKHR(eglDpy, streams[i]);
+        }
+    }
+
+    eglDestroyContext(eglDpy, eglContext);
+}
+
+
+/*
+ * EGL_NV_output_drm_flip_event lets us pass a pointer with each
+ * acquire, which is handed back in the DRM page flip event generated
+ * when EGL's flip for that frame completes.  It is only usable with
+ * manual acquisition, through eglStreamConsumerAcquireAttribNV().
+ */
+void CheckFlipEventSupport(EGLDisplay eglDpy)
+{
+    const char *extensionString = eglQueryString(eglDpy, EGL_EXTENSIONS);
+
+    if (!ExtensionIsSupported(extensionString, "EGL_NV_stream_attrib")) {
+        Fatal("EGL_NV_stream_attrib not found.\n");
+    }
+
+    if (!ExtensionIsSupported(extensionString,
+                              "EGL_NV_output_drm_flip_event")) {
+        Fatal("EGL_NV_output_drm_flip_event not found.\n");
+    }
+}
+
+
+/*
+ * Acquire the most recent frame from an EGLStream created with
+ * manual_acquire, scheduling it for display on the stream's
+ * EGLOutputLayer.  If flipEventData is not NULL, a DRM page flip
+ * event carrying it is delivered on the DRM fd once the frame is
+ * scanned out (see CheckFlipEventSupport()).
+ *
+ * EGL_EXT_stream_acquire_mode defines EGL_RESOURCE_BUSY_EXT for
+ * EGLOutput consumers that are temporarily unable to flip (e.g.,
+ * during a VT switch); the stream remains valid in that case, so
+ * report the failure and let the caller try again with its next
+ * frame.
+ */
+EGLBoolean AcquireFrame(EGLDisplay eglDpy, EGLStreamKHR eglStream, void *flipEventData)
+{
+    EGLBoolean ret;
+    EGLint error;
+
+    if (flipEventData != NULL) {
+        EGLAttrib acquireAttribs[] = {
+            EGL_DRM_FLIP_EVENT_DATA_NV,
+            (EGLAttrib)flipEventData,
+            EGL_NONE
+        };
+
+        ret = pEglStreamConsumerAcquireAttribNV(eglDpy, eglStream, acquireAttribs);
+    } else {
+        ret = pEglStreamConsumerAcquireKHR(eglDpy, eglStream);
+    }
+
+    if (ret) {
+        return EGL_TRUE;
+    }
+
+    error = eglGetError();
+
+    if (error != EGL_RESOURCE_BUSY_EXT) {
+        Fatal("Unable to acquire stream frame (0x%04x).\n", error);
+    }
+
+    return EGL_FALSE;
+}
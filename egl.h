@@ -26,13 +26,33 @@
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 
-EGLDeviceEXT GetEglDevice(void);
+#define MAX_EGL_DEVICES 8
+
+int GetEglDevices(EGLDeviceEXT *devices, int maxDevices);
+
+EGLBoolean EglDeviceMatches(EGLDeviceEXT device, int drmFd, const char *selector);
 
 int GetDrmFd(EGLDeviceEXT device);
 
 EGLDisplay GetEglDisplay(EGLDeviceEXT device, int drmFd);
 
-EGLSurface SetUpEgl(EGLDisplay eglDpy, uint32_t planeID, int width, int height, int hdr_enabled);
+EGLSurface SetUpEgl(EGLDisplay eglDpy, uint32_t planeID, int width, int height, int hdr_enabled,
+                    int manual_acquire, int fifo_length, EGLStreamKHR *pStream);
+EGLBoolean EglCanChangeConfig(EGLDisplay eglDpy);
+EGLSurface SetUpStreamSurface(EGLDisplay eglDpy, uint32_t planeID, int width, int height,
+                              int hdr_enabled, int manual_acquire, int fifo_length,
+                              EGLStreamKHR *pStream);
+void DestroyStreamSurface(EGLDisplay eglDpy, EGLSurface eglSurface, EGLStreamKHR eglStream);
+EGLSurface SetUpOffscreenEgl(int width, int height, EGLDisplay *pDpy);
+void TearDownEgl(EGLDisplay eglDpy, EGLContext eglContext,
+                 const EGLSurface *surfaces, const EGLStreamKHR *streams, int count);
+
+EGLBoolean QueryStreamFrames(EGLDisplay eglDpy, EGLStreamKHR eglStream,
+                             uint64_t *pProduced, uint64_t *pConsumed);
+
+void CheckFlipEventSupport(EGLDisplay eglDpy);
+
+EGLBoolean AcquireFrame(EGLDisplay eglDpy, EGLStreamKHR eglStream, void *flipEventData);
 
 
 #endif /* EGL_H */
\ No newline at end of file
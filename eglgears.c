@@ -28,156 +28,151 @@
  */
 
 #include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 
+#define GL_GLEXT_PROTOTYPES
 #include "GL/gl.h"
 #include "utils.h"
+#include "gearmesh.h"
 
-static GLfloat view_rotx = 20.0, view_roty = 30.0, view_rotz = 0.0;
-static GLint gear1, gear2, gear3;
-static GLfloat angle = 0.0;
+/*
+ * All state is per thread, so that each head's render thread animates
+ * its own gears in its own context.
+ */
+static _Thread_local GLfloat view_rotx = 20.0, view_roty = 30.0, view_rotz = 0.0;
+static _Thread_local GLfloat angle = 0.0;
+static _Thread_local double fixed_timestep;  /* seconds per frame, if set */
 
 /*
- *
- *  Draw a gear wheel.  You'll probably want to call this function when
- *  building a display list since we do a lot of trig here.
- *
- *  Input:  inner_radius - radius of hole at center
- *          outer_radius - radius at center of teeth
- *          width - width of gear
- *          teeth - number of teeth
- *          tooth_depth - depth of tooth
+ * The three gears' meshes share one vertex buffer and one index buffer,
+ * built once by InitGears().
+ */
+struct gear_draw {
+   GLintptr vertex_offset;
+   GLintptr index_offset;
+   GLsizei index_count;
+   const GLfloat *color;
+};
+
+static _Thread_local GLuint vertex_buffer, index_buffer;
+static _Thread_local struct gear_draw gear_draws[3];
+static _Thread_local unsigned long triangles_per_frame;
+
+/*
+ * Stress mode: instead of the three gears, draw stress_instances copies
+ * of them, spread over a cube, with one instanced draw call per gear
+ * shape.  Each instance's position and rotation phase come from a
+ * per-instance vertex attribute, and the shader spins it by the shared
+ * angle, so the CPU cost per frame does not depend on the count.
  */
+#define MAX_STRESS_INSTANCES 100000
+
+static _Thread_local int stress_instances;
+static _Thread_local GLuint stress_program, instance_buffer;
+static _Thread_local GLint angle_uniform, speed_uniform, color_uniform, light_uniform;
+static _Thread_local GLint stress_first[3], stress_count[3];
+static _Thread_local GLfloat stress_scale;
+
+static const char *stress_vertex_shader =
+   "#version 130\n"
+   "in vec3 position;\n"
+   "in vec3 normal;\n"
+   "in vec4 instance; // xyz offset, w rotation phase in degrees\n"
+   "uniform float angle;\n"
+   "uniform float speed;\n"
+   "uniform vec4 color;\n"
+   "uniform vec3 light;\n"
+   "out vec4 lit_color;\n"
+   "void main()\n"
+   "{\n"
+   "   float a = radians(instance.w + speed * angle);\n"
+   "   mat2 rot = mat2(cos(a), sin(a), -sin(a), cos(a));\n"
+   "   vec3 p = vec3(rot * position.xy, position.z) + instance.xyz;\n"
+   "   vec3 n = normalize(gl_NormalMatrix * vec3(rot * normal.xy, normal.z));\n"
+   "   lit_color = vec4(color.rgb * (0.2 + max(dot(n, light), 0.0)), color.a);\n"
+   "   gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+   "}\n";
+
+static const char *stress_fragment_shader =
+   "#version 130\n"
+   "in vec4 lit_color;\n"
+   "void main()\n"
+   "{\n"
+   "   gl_FragColor = lit_color;\n"
+   "}\n";
+
+static void
+draw_gear(const struct gear_draw *g)
+{
+   glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, g->color);
+
+   glVertexPointer(3, GL_FLOAT, sizeof(struct GearVertex),
+                   (const GLvoid *) (g->vertex_offset +
+                                     offsetof(struct GearVertex, position)));
+   glNormalPointer(GL_FLOAT, sizeof(struct GearVertex),
+                   (const GLvoid *) (g->vertex_offset +
+                                     offsetof(struct GearVertex, normal)));
+   glDrawElements(GL_TRIANGLES, g->index_count, GL_UNSIGNED_INT,
+                  (const GLvoid *) g->index_offset);
+}
+
+
+/* the rotation of each gear relative to the first, as in draw() */
+static const GLfloat gear_speed[3] = { 1.0, -2.0, -2.0 };
+
 static void
-gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
-     GLint teeth, GLfloat tooth_depth)
+draw_stress(void)
 {
    GLint i;
-   GLfloat r0, r1, r2;
-   GLfloat angle, da;
-   GLfloat u, v, len;
-
-   r0 = inner_radius;
-   r1 = outer_radius - tooth_depth / 2.0;
-   r2 = outer_radius + tooth_depth / 2.0;
-
-   da = 2.0 * M_PI / teeth / 4.0;
-
-   glShadeModel(GL_FLAT);
-
-   glNormal3f(0.0, 0.0, 1.0);
-
-   /* draw front face */
-   glBegin(GL_QUAD_STRIP);
-   for (i = 0; i <= teeth; i++) {
-      angle = i * 2.0 * M_PI / teeth;
-      glVertex3f(r0 * cos(angle), r0 * sin(angle), width * 0.5);
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), width * 0.5);
-      if (i < teeth) {
-	 glVertex3f(r0 * cos(angle), r0 * sin(angle), width * 0.5);
-	 glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		    width * 0.5);
-      }
-   }
-   glEnd();
-
-   /* draw front sides of teeth */
-   glBegin(GL_QUADS);
-   da = 2.0 * M_PI / teeth / 4.0;
-   for (i = 0; i < teeth; i++) {
-      angle = i * 2.0 * M_PI / teeth;
-
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), width * 0.5);
-      glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5);
-      glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
-		 width * 0.5);
-      glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		 width * 0.5);
-   }
-   glEnd();
-
-   glNormal3f(0.0, 0.0, -1.0);
-
-   /* draw back face */
-   glBegin(GL_QUAD_STRIP);
-   for (i = 0; i <= teeth; i++) {
-      angle = i * 2.0 * M_PI / teeth;
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), -width * 0.5);
-      glVertex3f(r0 * cos(angle), r0 * sin(angle), -width * 0.5);
-      if (i < teeth) {
-	 glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		    -width * 0.5);
-	 glVertex3f(r0 * cos(angle), r0 * sin(angle), -width * 0.5);
-      }
-   }
-   glEnd();
-
-   /* draw back sides of teeth */
-   glBegin(GL_QUADS);
-   da = 2.0 * M_PI / teeth / 4.0;
-   for (i = 0; i < teeth; i++) {
-      angle = i * 2.0 * M_PI / teeth;
-
-      glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		 -width * 0.5);
-      glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
-		 -width * 0.5);
-      glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5);
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), -width * 0.5);
-   }
-   glEnd();
-
-   /* draw outward faces of teeth */
-   glBegin(GL_QUAD_STRIP);
-   for (i = 0; i < teeth; i++) {
-      angle = i * 2.0 * M_PI / teeth;
-
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), width * 0.5);
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), -width * 0.5);
-      u = r2 * cos(angle + da) - r1 * cos(angle);
-      v = r2 * sin(angle + da) - r1 * sin(angle);
-      len = sqrt(u * u + v * v);
-      u /= len;
-      v /= len;
-      glNormal3f(v, -u, 0.0);
-      glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5);
-      glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5);
-      glNormal3f(cos(angle), sin(angle), 0.0);
-      glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
-		 width * 0.5);
-      glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
-		 -width * 0.5);
-      u = r1 * cos(angle + 3 * da) - r2 * cos(angle + 2 * da);
-      v = r1 * sin(angle + 3 * da) - r2 * sin(angle + 2 * da);
-      glNormal3f(v, -u, 0.0);
-      glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		 width * 0.5);
-      glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		 -width * 0.5);
-      glNormal3f(cos(angle), sin(angle), 0.0);
-   }
 
-   glVertex3f(r1 * cos(0), r1 * sin(0), width * 0.5);
-   glVertex3f(r1 * cos(0), r1 * sin(0), -width * 0.5);
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+   glPushMatrix();
+   glRotatef(view_rotx, 1.0, 0.0, 0.0);
+   glRotatef(view_roty, 0.0, 1.0, 0.0);
+   glRotatef(view_rotz, 0.0, 0.0, 1.0);
+   glScalef(stress_scale, stress_scale, stress_scale);
+
+   glUniform1f(angle_uniform, angle);
+
+   for (i = 0; i < 3; i++) {
+      const struct gear_draw *g = &gear_draws[i];
 
-   glEnd();
+      if (stress_count[i] == 0)
+         continue;
 
-   glShadeModel(GL_SMOOTH);
+      glUniform1f(speed_uniform, gear_speed[i]);
+      glUniform4fv(color_uniform, 1, g->color);
 
-   /* draw inside radius cylinder */
-   glBegin(GL_QUAD_STRIP);
-   for (i = 0; i <= teeth; i++) {
-      angle = i * 2.0 * M_PI / teeth;
-      glNormal3f(-cos(angle), -sin(angle), 0.0);
-      glVertex3f(r0 * cos(angle), r0 * sin(angle), -width * 0.5);
-      glVertex3f(r0 * cos(angle), r0 * sin(angle), width * 0.5);
+      glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(struct GearVertex),
+                            (const GLvoid *) (g->vertex_offset +
+                                              offsetof(struct GearVertex, position)));
+      glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(struct GearVertex),
+                            (const GLvoid *) (g->vertex_offset +
+                                              offsetof(struct GearVertex, normal)));
+
+      glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+      glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                            (const GLvoid *) (stress_first[i] * 4 * sizeof(GLfloat)));
+
+      glDrawElementsInstanced(GL_TRIANGLES, g->index_count, GL_UNSIGNED_INT,
+                              (const GLvoid *) g->index_offset, stress_count[i]);
    }
-   glEnd();
-}
 
+   glPopMatrix();
+}
 
 static void
 draw(void)
 {
+   if (stress_instances > 0) {
+      draw_stress();
+      return;
+   }
+
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
    glPushMatrix();
@@ -188,19 +183,19 @@ draw(void)
    glPushMatrix();
    glTranslatef(-3.0, -2.0, 0.0);
    glRotatef(angle, 0.0, 0.0, 1.0);
-   glCallList(gear1);
+   draw_gear(&gear_draws[0]);
    glPopMatrix();
 
    glPushMatrix();
    glTranslatef(3.1, -2.0, 0.0);
    glRotatef(-2.0 * angle - 9.0, 0.0, 0.0, 1.0);
-   glCallList(gear2);
+   draw_gear(&gear_draws[1]);
    glPopMatrix();
 
    glPushMatrix();
    glTranslatef(-3.1, 4.2, 0.0);
    glRotatef(-2.0 * angle - 25.0, 0.0, 0.0, 1.0);
-   glCallList(gear3);
+   draw_gear(&gear_draws[2]);
    glPopMatrix();
 
    glPopMatrix();
@@ -209,12 +204,12 @@ draw(void)
 static void
 idle(void)
 {
-  static double t0 = -1.;
+  static _Thread_local double t0 = -1.;
   double dt, t = GetTime();
 
   if (t0 < 0.0)
     t0 = t;
-  dt = t - t0;
+  dt = fixed_timestep > 0.0 ? fixed_timestep : t - t0;
   t0 = t;
 
   angle += 70.0 * dt;  /* 70 degrees per second */
@@ -238,12 +233,181 @@ reshape(int width, int height)
    glTranslatef(0.0, 0.0, -40.0);
 }
 
-void InitGears(int width, int height)
+/*
+ * Generate the gears' meshes and upload them to the vertex and index
+ * buffers, which stay bound for drawing.
+ */
+static void
+make_gears(const struct GearShape *shapes, const GLfloat **colors, int count)
+{
+   struct GearVertex *vertices;
+   uint32_t *indices;
+   size_t vertex_count = 0, index_count = 0;
+   int i;
+
+   for (i = 0; i < count; i++) {
+      vertex_count += shapes[i].teeth * GEAR_VERTICES_PER_TOOTH;
+      index_count += shapes[i].teeth * GEAR_INDICES_PER_TOOTH;
+   }
+
+   vertices = malloc(vertex_count * sizeof(*vertices));
+   indices = malloc(index_count * sizeof(*indices));
+
+   if (vertices == NULL || indices == NULL) {
+      Fatal("Memory allocation failure.\n");
+   }
+
+   vertex_count = index_count = 0;
+
+   for (i = 0; i < count; i++) {
+      BuildGearMesh(&shapes[i], &vertices[vertex_count], &indices[index_count]);
+
+      gear_draws[i].vertex_offset = vertex_count * sizeof(*vertices);
+      gear_draws[i].index_offset = index_count * sizeof(*indices);
+      gear_draws[i].index_count = shapes[i].teeth * GEAR_INDICES_PER_TOOTH;
+      gear_draws[i].color = colors[i];
+
+      vertex_count += shapes[i].teeth * GEAR_VERTICES_PER_TOOTH;
+      index_count += shapes[i].teeth * GEAR_INDICES_PER_TOOTH;
+   }
+
+   glGenBuffers(1, &vertex_buffer);
+   glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+   glBufferData(GL_ARRAY_BUFFER, vertex_count * sizeof(*vertices), vertices,
+                GL_STATIC_DRAW);
+
+   glGenBuffers(1, &index_buffer);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_count * sizeof(*indices), indices,
+                GL_STATIC_DRAW);
+
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glEnableClientState(GL_NORMAL_ARRAY);
+
+   free(vertices);
+   free(indices);
+}
+
+static GLuint
+compile_shader(GLenum type, const char *source)
+{
+   GLuint shader = glCreateShader(type);
+   GLint ok = GL_FALSE;
+   char log[1024];
+
+   glShaderSource(shader, 1, &source, NULL);
+   glCompileShader(shader);
+   glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+
+   if (!ok) {
+      glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+      Fatal("Failed to compile stress mode shader:\n%s\n", log);
+   }
+
+   return shader;
+}
+
+/*
+ * Set up instanced drawing of count gears.  Needs OpenGL 3.3 for
+ * glVertexAttribDivisor() and the compatibility profile built-ins.
+ */
+static void
+init_stress(int count, const struct GearShape *shapes)
+{
+   static const GLfloat light[3] = { 0.408248, 0.408248, 0.816497 };
+   const char *version = (const char *) glGetString(GL_VERSION);
+   int major = 0, minor = 0, side, i;
+   GLfloat *instances, spacing = 10.0;
+   GLint ok = GL_FALSE;
+   unsigned int seed = 1;
+
+   if (version == NULL || sscanf(version, "%d.%d", &major, &minor) != 2 ||
+       major * 10 + minor < 33) {
+      Fatal("Stress mode requires OpenGL 3.3; the context has %s.\n",
+            version ? version : "none");
+   }
+
+   stress_program = glCreateProgram();
+   glAttachShader(stress_program, compile_shader(GL_VERTEX_SHADER, stress_vertex_shader));
+   glAttachShader(stress_program, compile_shader(GL_FRAGMENT_SHADER, stress_fragment_shader));
+   glBindAttribLocation(stress_program, 0, "position");
+   glBindAttribLocation(stress_program, 1, "normal");
+   glBindAttribLocation(stress_program, 2, "instance");
+   glLinkProgram(stress_program);
+   glGetProgramiv(stress_program, GL_LINK_STATUS, &ok);
+
+   if (!ok) {
+      Fatal("Failed to link stress mode shaders.\n");
+   }
+
+   glUseProgram(stress_program);
+   angle_uniform = glGetUniformLocation(stress_program, "angle");
+   speed_uniform = glGetUniformLocation(stress_program, "speed");
+   color_uniform = glGetUniformLocation(stress_program, "color");
+   light_uniform = glGetUniformLocation(stress_program, "light");
+   glUniform3fv(light_uniform, 1, light);
+
+   /*
+    * Lay the gears out on a cube grid, in shape order so that each
+    * shape's instances are contiguous, and scale the cube to the size
+    * of the original scene, with some margin.
+    */
+   for (side = 1; side * side * side < count; side++);
+   stress_scale = 12.0 / (side * spacing);
+
+   instances = malloc(count * 4 * sizeof(GLfloat));
+   if (instances == NULL) {
+      Fatal("Memory allocation failure.\n");
+   }
+
+   for (i = 0; i < count; i++) {
+      GLfloat *inst = &instances[i * 4];
+
+      inst[0] = ((i % side) - (side - 1) * 0.5) * spacing;
+      inst[1] = (((i / side) % side) - (side - 1) * 0.5) * spacing;
+      inst[2] = ((i / (side * side)) - (side - 1) * 0.5) * spacing;
+      inst[3] = rand_r(&seed) % 360;
+   }
+
+   for (i = 0; i < 3; i++) {
+      stress_first[i] = count * i / 3;
+      stress_count[i] = count * (i + 1) / 3 - stress_first[i];
+      triangles_per_frame += (unsigned long) stress_count[i] * shapes[i].teeth *
+                             GEAR_INDICES_PER_TOOTH / 3;
+   }
+
+   glGenBuffers(1, &instance_buffer);
+   glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+   glBufferData(GL_ARRAY_BUFFER, count * 4 * sizeof(GLfloat), instances, GL_STATIC_DRAW);
+   free(instances);
+
+   glDisableClientState(GL_VERTEX_ARRAY);
+   glDisableClientState(GL_NORMAL_ARRAY);
+   glEnableVertexAttribArray(0);
+   glEnableVertexAttribArray(1);
+   glEnableVertexAttribArray(2);
+   glVertexAttribDivisor(2, 1);
+
+   stress_instances = count;
+}
+
+/*
+ * If instances is 0, draw the classic three gears; otherwise draw that
+ * many gears with instancing (see init_stress()).
+ */
+void InitGears(int width, int height, int instances)
 {
    static GLfloat pos[4] = { 5.0, 5.0, 10.0, 0.0 };
    static GLfloat red[4] = { 0.8, 0.1, 0.0, 1.0 };
    static GLfloat green[4] = { 0.0, 0.8, 0.2, 1.0 };
    static GLfloat blue[4] = { 0.2, 0.2, 1.0, 1.0 };
+   static const struct GearShape shapes[3] = {
+      { 1.0, 4.0, 1.0, 20, 0.7 },
+      { 0.5, 2.0, 2.0, 10, 0.7 },
+      { 1.3, 2.0, 0.5, 10, 0.7 },
+   };
+   const GLfloat *colors[3] = { red, green, blue };
+   int i;
 
    glLightfv(GL_LIGHT0, GL_POSITION, pos);
    glEnable(GL_CULL_FACE);
@@ -252,23 +416,16 @@ void InitGears(int width, int height)
    glEnable(GL_DEPTH_TEST);
 
    /* make the gears */
-   gear1 = glGenLists(1);
-   glNewList(gear1, GL_COMPILE);
-   glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, red);
-   gear(1.0, 4.0, 1.0, 20, 0.7);
-   glEndList();
-
-   gear2 = glGenLists(1);
-   glNewList(gear2, GL_COMPILE);
-   glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, green);
-   gear(0.5, 2.0, 2.0, 10, 0.7);
-   glEndList();
-
-   gear3 = glGenLists(1);
-   glNewList(gear3, GL_COMPILE);
-   glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, blue);
-   gear(1.3, 2.0, 0.5, 10, 0.7);
-   glEndList();
+   make_gears(shapes, colors, 3);
+
+   if (instances > 0) {
+      if (instances > MAX_STRESS_INSTANCES)
+         Fatal("At most %d gears can be drawn.\n", MAX_STRESS_INSTANCES);
+      init_stress(instances, shapes);
+   } else {
+      for (i = 0; i < 3; i++)
+         triangles_per_frame += shapes[i].teeth * GEAR_INDICES_PER_TOOTH / 3;
+   }
 
    glEnable(GL_NORMALIZE);
 
@@ -277,8 +434,59 @@ void InitGears(int width, int height)
    reshape(width, height);
 }
 
-void DrawGears(void)
+// Draw to a surface of a new size from now on, e.g. after a mode change.
+void ResizeGears(int width, int height)
+{
+   reshape(width, height);
+}
+
+void UpdateGears(void)
 {
     idle();
+}
+
+void DrawGears(void)
+{
     draw();
 }
+
+/*
+ * Animate by the given number of seconds per frame rather than by the
+ * time that has passed, so that the same frames are rendered every run.
+ */
+void SetGearsTimestep(double seconds)
+{
+    fixed_timestep = seconds;
+}
+
+// Wait for the GPU to finish everything submitted, e.g. to time a frame.
+void FinishGears(void)
+{
+    glFinish();
+}
+
+/*
+ * Stand-in content for an overlay plane (e.g., a video or UI layer): a
+ * flat panel with a bar sweeping across it in step with the gears.  It
+ * is drawn with clears only, so it leaves the gears' GL state alone.
+ */
+void DrawOverlay(int index, int width, int height)
+{
+   GLint bar = (GLint) (angle / 360.0 * width);
+
+   glClearColor(0.1, 0.2 + 0.2 * (index % 3), 0.4, 1.0);
+   glClear(GL_COLOR_BUFFER_BIT);
+
+   glEnable(GL_SCISSOR_TEST);
+   glScissor(bar, 0, width / 16 + 1, height);
+   glClearColor(0.9, 0.9, 0.9, 1.0);
+   glClear(GL_COLOR_BUFFER_BIT);
+   glDisable(GL_SCISSOR_TEST);
+
+   glClearColor(0.0, 0.0, 0.0, 0.0);
+}
+
+unsigned long GearsTrianglesPerFrame(void)
+{
+    return triangles_per_frame;
+}
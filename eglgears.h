@@ -23,7 +23,13 @@
 #if !defined(EGLGEARS_H)
 #define EGLGEARS_H
 
-void InitGears(int width, int height);
+void InitGears(int width, int height, int instances);
+void ResizeGears(int width, int height);
+void UpdateGears(void);
+void SetGearsTimestep(double seconds);
 void DrawGears(void);
+void FinishGears(void);
+void DrawOverlay(int index, int width, int height);
+unsigned long GearsTrianglesPerFrame(void);
 
 #endif /* EGLGEARS_H */
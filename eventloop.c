@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "eventloop.h"
+#include "utils.h"
+
+/*
+ * The main thread's event loop: one epoll set multiplexing the DRM fds
+ * (flip events), a signalfd for SIGINT and SIGTERM, timerfds for
+ * periodic work, and any other fds, each with a handler that runs on
+ * the thread calling RunEventLoop().  The thread sleeps in epoll_wait()
+ * whenever nothing is ready.
+ *
+ * Handlers may add and remove sources.  A slot freed while the events
+ * of one epoll_wait() are being dispatched is not reused until they all
+ * have been, so that a later event for the removed fd cannot reach the
+ * handler of a new one.
+ */
+
+#define MAX_EVENTS_PER_WAIT 16
+
+void InitEventLoop(struct EventLoop *pLoop)
+{
+    memset(pLoop, 0, sizeof(*pLoop));
+
+    pLoop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (pLoop->epollFd < 0) {
+        Fatal("Unable to create an epoll instance: %s\n", strerror(errno));
+    }
+}
+
+static void AddSource(struct EventLoop *pLoop, enum EventSourceType type, int fd,
+                      EventHandler handler, void *data)
+{
+    struct EventSource *pSource = NULL;
+    struct epoll_event event = { .events = EPOLLIN };
+    int i;
+
+    for (i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        if (pLoop->sources[i].handler == NULL && !pLoop->sources[i].retired) {
+            pSource = &pLoop->sources[i];
+            break;
+        }
+    }
+
+    if (pSource == NULL) {
+        Fatal("More than %d event sources.\n", EVENT_LOOP_MAX_SOURCES);
+    }
+
+    event.data.ptr = pSource;
+    if (epoll_ctl(pLoop->epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        Fatal("Unable to watch fd %d: %s\n", fd, strerror(errno));
+    }
+
+    pSource->type = type;
+    pSource->fd = fd;
+    pSource->handler = handler;
+    pSource->data = data;
+}
+
+// Call handler with the epoll events whenever fd becomes readable.
+void EventLoopAddFd(struct EventLoop *pLoop, int fd, EventHandler handler, void *data)
+{
+    AddSource(pLoop, EVENT_SOURCE_FD, fd, handler, data);
+}
+
+/*
+ * Call handler every periodNs, with the number of periods that have
+ * elapsed since it was last called.  Returns the timerfd, which can be
+ * given to EventLoopRemoveFd().
+ */
+int EventLoopAddTimer(struct EventLoop *pLoop, uint64_t periodNs,
+                      EventHandler handler, void *data)
+{
+    struct itimerspec spec = {
+        .it_interval.tv_sec = periodNs / 1000000000ull,
+        .it_interval.tv_nsec = periodNs % 1000000000ull,
+    };
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    spec.it_value = spec.it_interval;
+
+    if (fd < 0 || timerfd_settime(fd, 0, &spec, NULL) != 0) {
+        Fatal("Unable to create a timer: %s\n", strerror(errno));
+    }
+
+    AddSource(pLoop, EVENT_SOURCE_TIMER, fd, handler, data);
+
+    return fd;
+}
+
+/*
+ * Call handler with the number of each of the signals received.  The
+ * signals are blocked in the calling thread, so that they are only
+ * delivered through the loop; call this before creating other threads,
+ * so that they inherit the mask.
+ */
+void EventLoopAddSignals(struct EventLoop *pLoop, const int *signals, int count,
+                         EventHandler handler, void *data)
+{
+    sigset_t mask;
+    int fd, i;
+
+    sigemptyset(&mask);
+    for (i = 0; i < count; i++) {
+        sigaddset(&mask, signals[i]);
+    }
+
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+        Fatal("Unable to block signals.\n");
+    }
+
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        Fatal("Unable to create a signalfd: %s\n", strerror(errno));
+    }
+
+    AddSource(pLoop, EVENT_SOURCE_SIGNALS, fd, handler, data);
+}
+
+/*
+ * Stop watching fd.  Timers and signalfds are closed; other fds remain
+ * the caller's.
+ */
+void EventLoopRemoveFd(struct EventLoop *pLoop, int fd)
+{
+    int i;
+
+    for (i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        struct EventSource *pSource = &pLoop->sources[i];
+
+        if (pSource->handler == NULL || pSource->fd != fd) {
+            continue;
+        }
+
+        epoll_ctl(pLoop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+        if (pSource->type != EVENT_SOURCE_FD) {
+            close(fd);
+        }
+
+        pSource->handler = NULL;
+        pSource->fd = -1;
+        pSource->retired = pLoop->dispatching;
+        return;
+    }
+}
+
+static void Dispatch(struct EventSource *pSource, uint32_t events)
+{
+    uint64_t value = events;
+
+    switch (pSource->type) {
+    case EVENT_SOURCE_FD:
+        break;
+    case EVENT_SOURCE_TIMER:
+        if (read(pSource->fd, &value, sizeof(value)) != sizeof(value)) {
+            return;
+        }
+        break;
+    case EVENT_SOURCE_SIGNALS: {
+        struct signalfd_siginfo info;
+
+        if (read(pSource->fd, &info, sizeof(info)) != sizeof(info)) {
+            return;
+        }
+        value = info.ssi_signo;
+        break;
+    }
+    }
+
+    pSource->handler(pSource->data, value);
+}
+
+// Wait for and handle events until a handler calls StopEventLoop().
+void RunEventLoop(struct EventLoop *pLoop)
+{
+    pLoop->stop = 0;
+
+    while (!pLoop->stop) {
+        struct epoll_event events[MAX_EVENTS_PER_WAIT];
+        int count, i;
+
+        count = epoll_wait(pLoop->epollFd, events, MAX_EVENTS_PER_WAIT, -1);
+
+        if (count < 0 && errno != EINTR) {
+            Fatal("epoll_wait(2) failed: %s\n", strerror(errno));
+        }
+
+        pLoop->dispatching = 1;
+        for (i = 0; i < count; i++) {
+            struct EventSource *pSource = events[i].data.ptr;
+
+            if (pSource->handler != NULL) {
+                Dispatch(pSource, events[i].events);
+            }
+        }
+        pLoop->dispatching = 0;
+
+        for (i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+            pLoop->sources[i].retired = 0;
+        }
+    }
+}
+
+// Make RunEventLoop() return once the current events have been handled.
+void StopEventLoop(struct EventLoop *pLoop)
+{
+    pLoop->stop = 1;
+}
+
+void FiniEventLoop(struct EventLoop *pLoop)
+{
+    int i;
+
+    for (i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        if (pLoop->sources[i].handler != NULL) {
+            EventLoopRemoveFd(pLoop, pLoop->sources[i].fd);
+        }
+    }
+
+    close(pLoop->epollFd);
+}
@@ -0,0 +1,46 @@
+#if !defined(EVENTLOOP_H)
+#define EVENTLOOP_H
+
+#include <stdint.h>
+
+#define EVENT_LOOP_MAX_SOURCES 32
+
+/*
+ * Called with the epoll events of an fd, the number of expirations of a
+ * timer, or the number of a signal.
+ */
+typedef void (*EventHandler)(void *data, uint64_t value);
+
+enum EventSourceType {
+    EVENT_SOURCE_FD,            // owned by the caller
+    EVENT_SOURCE_TIMER,         // a timerfd owned by the loop
+    EVENT_SOURCE_SIGNALS,       // a signalfd owned by the loop
+};
+
+struct EventSource {
+    enum EventSourceType type;
+    int fd;
+    EventHandler handler;       // NULL if the slot is free
+    void *data;
+    int retired;                // removed while its events were being dispatched
+};
+
+struct EventLoop {
+    int epollFd;
+    int stop;
+    int dispatching;
+    struct EventSource sources[EVENT_LOOP_MAX_SOURCES];
+};
+
+void InitEventLoop(struct EventLoop *pLoop);
+void EventLoopAddFd(struct EventLoop *pLoop, int fd, EventHandler handler, void *data);
+int EventLoopAddTimer(struct EventLoop *pLoop, uint64_t periodNs,
+                      EventHandler handler, void *data);
+void EventLoopAddSignals(struct EventLoop *pLoop, const int *signals, int count,
+                         EventHandler handler, void *data);
+void EventLoopRemoveFd(struct EventLoop *pLoop, int fd);
+void RunEventLoop(struct EventLoop *pLoop);
+void StopEventLoop(struct EventLoop *pLoop);
+void FiniEventLoop(struct EventLoop *pLoop);
+
+#endif /* EVENTLOOP_H */
@@ -0,0 +1,263 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <xf86drm.h>
+
+#include "flip.h"
+#include "utils.h"
+
+/*
+ * Page flip completion tracking for EGL_NV_output_drm_flip_event.
+ *
+ * Each acquired frame is given a FlipSlot as its EGL_DRM_FLIP_EVENT_DATA_NV.
+ * When EGL's flip for that frame completes, the kernel queues a
+ * DRM_EVENT_FLIP_COMPLETE on the DRM fd carrying the slot pointer, the
+ * vblank sequence number and the vblank timestamp, which is when the
+ * frame started scanning out.
+ *
+ * With several heads, all their flip events arrive on the same DRM fd,
+ * so the fd is read by the main thread's event loop (see
+ * HandleFlipEvents()) rather than by any one render thread.  All
+ * trackers are updated under one lock, and render threads waiting for
+ * their flips are woken whenever events have been read.
+ */
+
+static pthread_mutex_t flipLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flipEventsRead = PTHREAD_COND_INITIALIZER;
+
+/*
+ * With vrr, flips are not tied to fixed vblanks, so instead of missed
+ * vblanks and jitter, the effective refresh rate is reported.
+ */
+void InitFlipTracker(struct FlipTracker *pTracker, int drmFd, double refreshRate, int vrr)
+{
+    uint64_t cap = 0;
+    int i;
+
+    memset(pTracker, 0, sizeof(*pTracker));
+
+    pTracker->drmFd = drmFd;
+    pTracker->refreshPeriodNs = (uint64_t)(1000000000.0 / refreshRate);
+    pTracker->vrr = vrr;
+    pTracker->latencyMinNs = UINT64_MAX;
+    pTracker->intervalMinNs = UINT64_MAX;
+
+    for (i = 0; i < FLIP_TRACKER_SLOTS; i++) {
+        pTracker->slots[i].pTracker = pTracker;
+    }
+
+    // Flip timestamps are only comparable with GetMonotonicNs() if
+    // the kernel reports them in CLOCK_MONOTONIC.
+    if (drmGetCap(drmFd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) != 0 || !cap) {
+        Warning("DRM flip timestamps are not CLOCK_MONOTONIC; latency will be wrong.\n");
+    }
+}
+
+/*
+ * Reserve a slot for the frame about to be acquired, and return the
+ * pointer to pass as EGL_DRM_FLIP_EVENT_DATA_NV.
+ */
+void *BeginFlip(struct FlipTracker *pTracker, uint64_t renderStartNs)
+{
+    struct FlipSlot *pSlot;
+
+    // Never hand out a slot the kernel still holds a pointer to.
+    WaitForFlips(pTracker, FLIP_TRACKER_SLOTS - 1);
+
+    pthread_mutex_lock(&flipLock);
+
+    do {
+        pSlot = &pTracker->slots[pTracker->nextSlot];
+        pTracker->nextSlot = (pTracker->nextSlot + 1) % FLIP_TRACKER_SLOTS;
+    } while (pSlot->pending);
+
+    pSlot->renderStartNs = renderStartNs;
+    pSlot->pending = 1;
+    pTracker->pendingFlips++;
+
+    pthread_mutex_unlock(&flipLock);
+
+    return pSlot;
+}
+
+/*
+ * Release a slot from BeginFlip() whose frame could not be acquired;
+ * no event will ever arrive for it.
+ */
+void CancelFlip(struct FlipTracker *pTracker, void *flipEventData)
+{
+    struct FlipSlot *pSlot = flipEventData;
+
+    pthread_mutex_lock(&flipLock);
+    pSlot->pending = 0;
+    pTracker->pendingFlips--;
+    pthread_mutex_unlock(&flipLock);
+}
+
+static void PageFlipHandler(int fd, unsigned int sequence,
+                            unsigned int tv_sec, unsigned int tv_usec,
+                            void *user_data)
+{
+    struct FlipSlot *pSlot = user_data;
+    struct FlipTracker *pTracker = pSlot->pTracker;
+    uint64_t flipNs = (uint64_t)tv_sec * 1000000000ull + (uint64_t)tv_usec * 1000ull;
+    uint64_t latencyNs = flipNs - pSlot->renderStartNs;
+
+    (void)fd;
+
+    pthread_mutex_lock(&flipLock);
+
+    if (pTracker->lastFlipNs != 0 && pTracker->vrr) {
+        uint64_t intervalNs = flipNs - pTracker->lastFlipNs;
+
+        pTracker->intervalSumNs += intervalNs;
+        if (intervalNs < pTracker->intervalMinNs) {
+            pTracker->intervalMinNs = intervalNs;
+        }
+        if (intervalNs > pTracker->intervalMaxNs) {
+            pTracker->intervalMaxNs = intervalNs;
+        }
+        pTracker->intervals++;
+    } else if (pTracker->lastFlipNs != 0) {
+        unsigned int vblanks = sequence - pTracker->lastSequence;
+        double deviationNs;
+
+        if (vblanks > 1) {
+            pTracker->missedVblanks += vblanks - 1;
+        }
+
+        /*
+         * Jitter is the deviation from the ideal interval for the number
+         * of vblanks that actually elapsed, so that missed vblanks (counted
+         * above) don't dominate it.
+         */
+        deviationNs = (double)(flipNs - pTracker->lastFlipNs) -
+                      (double)vblanks * (double)pTracker->refreshPeriodNs;
+        pTracker->jitterSumNs += deviationNs;
+        pTracker->jitterSumSqNs += deviationNs * deviationNs;
+        pTracker->intervals++;
+    }
+
+    pTracker->lastFlipNs = flipNs;
+    pTracker->lastSequence = sequence;
+
+    pTracker->flips++;
+    pTracker->latencySumNs += latencyNs;
+    if (latencyNs < pTracker->latencyMinNs) {
+        pTracker->latencyMinNs = latencyNs;
+    }
+    if (latencyNs > pTracker->latencyMaxNs) {
+        pTracker->latencyMaxNs = latencyNs;
+    }
+
+    pSlot->pending = 0;
+    pTracker->pendingFlips--;
+
+    pthread_mutex_unlock(&flipLock);
+}
+
+/*
+ * Read the flip events queued on a DRM fd; called by the event loop
+ * when the fd is readable.
+ */
+void HandleFlipEvents(int drmFd)
+{
+    drmEventContext eventContext = {
+        .version = 2,
+        .page_flip_handler = PageFlipHandler,
+    };
+
+    if (drmHandleEvent(drmFd, &eventContext) != 0) {
+        Fatal("Failed to read DRM events.\n");
+    }
+
+    pthread_mutex_lock(&flipLock);
+    pthread_cond_broadcast(&flipEventsRead);
+    pthread_mutex_unlock(&flipLock);
+}
+
+// Wait until no more than maxPending flips are outstanding.
+void WaitForFlips(struct FlipTracker *pTracker, unsigned int maxPending)
+{
+    pthread_mutex_lock(&flipLock);
+
+    while (pTracker->pendingFlips > maxPending) {
+        pthread_cond_wait(&flipEventsRead, &flipLock);
+    }
+
+    pthread_mutex_unlock(&flipLock);
+}
+
+/*
+ * Every 5 seconds, or with final set, for whatever the last report left.
+ * The counters are taken and reset under flipLock, and printed after it
+ * is released, so that a slow stdout never holds up the flip events of
+ * the other heads.
+ */
+void PrintFlipStats(struct FlipTracker *pTracker, int final)
+{
+    uint64_t now = GetMonotonicNs();
+    struct FlipTracker report;
+    double seconds, jitterMean, jitterRms = 0.0;
+
+    pthread_mutex_lock(&flipLock);
+
+    if (pTracker->reportStartNs == 0) {
+        pTracker->reportStartNs = now;
+    }
+
+    seconds = (now - pTracker->reportStartNs) / 1e9;
+
+    if ((final ? seconds <= 0.0 : seconds <= 5.0) || pTracker->flips == 0) {
+        pthread_mutex_unlock(&flipLock);
+        return;
+    }
+
+    report = *pTracker;
+
+    pTracker->reportStartNs = now;
+    pTracker->flips = 0;
+    pTracker->missedVblanks = 0;
+    pTracker->latencySumNs = 0;
+    pTracker->latencyMinNs = UINT64_MAX;
+    pTracker->latencyMaxNs = 0;
+    pTracker->intervals = 0;
+    pTracker->jitterSumNs = 0.0;
+    pTracker->jitterSumSqNs = 0.0;
+    pTracker->intervalSumNs = 0;
+    pTracker->intervalMinNs = UINT64_MAX;
+    pTracker->intervalMaxNs = 0;
+
+    pthread_mutex_unlock(&flipLock);
+
+    printf("%s%s%u flips in %3.1f seconds: render-to-scanout latency "
+           "avg %.3f ms, min %.3f ms, max %.3f ms; ",
+           report.name, report.name[0] ? ": " : "",
+           report.flips, seconds,
+           report.latencySumNs / 1e6 / report.flips,
+           report.latencyMinNs / 1e6,
+           report.latencyMaxNs / 1e6);
+
+    if (report.vrr) {
+        if (report.intervals > 0) {
+            printf("effective refresh avg %.2f Hz, min %.2f Hz, max %.2f Hz\n",
+                   1e9 * report.intervals / report.intervalSumNs,
+                   1e9 / report.intervalMaxNs,
+                   1e9 / report.intervalMinNs);
+        } else {
+            printf("effective refresh unknown\n");
+        }
+    } else {
+        if (report.intervals > 0) {
+            jitterMean = report.jitterSumNs / report.intervals;
+            jitterRms = sqrt(fabs(report.jitterSumSqNs / report.intervals -
+                                  jitterMean * jitterMean));
+        }
+
+        printf("%u missed vblanks; flip jitter %.1f us\n",
+               report.missedVblanks, jitterRms / 1e3);
+    }
+    fflush(stdout);
+}
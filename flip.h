@@ -0,0 +1,47 @@
+#if !defined(FLIP_H)
+#define FLIP_H
+
+#include <stdint.h>
+
+#define FLIP_TRACKER_SLOTS 4
+
+struct FlipTracker;
+
+// One frame handed to EGL as EGL_DRM_FLIP_EVENT_DATA_NV
+struct FlipSlot {
+    struct FlipTracker *pTracker;
+    uint64_t renderStartNs;
+    int pending;
+};
+
+struct FlipTracker {
+    char name[32];              // prefix for reports, if not empty
+    int drmFd;
+    uint64_t refreshPeriodNs;
+    int vrr;                    // adaptive sync: no fixed vblanks to miss
+    struct FlipSlot slots[FLIP_TRACKER_SLOTS];
+    unsigned int nextSlot;
+    unsigned int pendingFlips;
+
+    // Last completed flip, to measure intervals and missed vblanks
+    uint64_t lastFlipNs;
+    unsigned int lastSequence;
+
+    // Accumulated since the last report
+    uint64_t reportStartNs;
+    unsigned int flips;
+    unsigned int missedVblanks;
+    uint64_t latencySumNs, latencyMinNs, latencyMaxNs;
+    unsigned int intervals;
+    double jitterSumNs, jitterSumSqNs;
+    uint64_t intervalSumNs, intervalMinNs, intervalMaxNs;
+};
+
+void InitFlipTracker(struct FlipTracker *pTracker, int drmFd, double refreshRate, int vrr);
+void *BeginFlip(struct FlipTracker *pTracker, uint64_t renderStartNs);
+void CancelFlip(struct FlipTracker *pTracker, void *flipEventData);
+void HandleFlipEvents(int drmFd);
+void WaitForFlips(struct FlipTracker *pTracker, unsigned int maxPending);
+void PrintFlipStats(struct FlipTracker *pTracker, int final);
+
+#endif /* FLIP_H */
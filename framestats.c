@@ -0,0 +1,305 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "framestats.h"
+#include "utils.h"
+
+/*
+ * Per-frame timing statistics.
+ *
+ * Recording is meant to be cheap enough to leave on all the time: it
+ * reads CLOCK_MONOTONIC (a vDSO call, no syscall) and increments one
+ * histogram bucket; nothing is allocated, locked or printed per frame.
+ * Percentiles are computed from the histograms only when a report is
+ * due, once every 5 seconds.
+ */
+
+static const char *phaseNames[FRAME_PHASE_COUNT] = {
+    [FRAME_PHASE_SIMULATE] = "simulate",
+    [FRAME_PHASE_DRAW] = "draw",
+    [FRAME_PHASE_CAPTURE] = "capture",
+    [FRAME_PHASE_SWAP] = "swap",
+    [FRAME_PHASE_FRAME] = "frame",
+};
+
+static unsigned int BucketIndex(uint64_t ns)
+{
+    const unsigned int subBuckets = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+    unsigned int msb, index;
+
+    if (ns < subBuckets) {
+        return ns;
+    }
+
+    msb = 63 - __builtin_clzll(ns);
+    index = ((msb - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS) |
+            ((ns >> (msb - HISTOGRAM_SUB_BUCKET_BITS)) & (subBuckets - 1));
+
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// The largest value that falls into the given bucket.
+static uint64_t BucketUpperBound(unsigned int index)
+{
+    const unsigned int subBuckets = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+    unsigned int octave = index >> HISTOGRAM_SUB_BUCKET_BITS;
+    unsigned int sub = index & (subBuckets - 1);
+
+    if (octave == 0) {
+        return index;
+    }
+
+    return ((uint64_t)(subBuckets + sub + 1) << (octave - 1)) - 1;
+}
+
+static void HistogramRecord(struct Histogram *pHistogram, uint64_t ns)
+{
+    pHistogram->buckets[BucketIndex(ns)]++;
+    pHistogram->count++;
+    if (ns > pHistogram->maxNs) {
+        pHistogram->maxNs = ns;
+    }
+}
+
+static uint64_t HistogramPercentile(const struct Histogram *pHistogram, double percentile)
+{
+    uint64_t rank = (uint64_t)(percentile / 100.0 * pHistogram->count + 0.5);
+    uint64_t seen = 0, bound;
+    unsigned int i;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += pHistogram->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    bound = BucketUpperBound(i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1);
+
+    return bound < pHistogram->maxNs ? bound : pHistogram->maxNs;
+}
+
+static uint64_t GetCpuTimeNs(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * CPU time is only read when a report starts and ends, since it takes
+ * a syscall.  The process's includes that of any threads the GL
+ * implementation renders with, e.g. llvmpipe's.
+ */
+static void StartCpuTime(struct FrameStats *pStats)
+{
+    if (pStats->reportCpuTime) {
+        pStats->processCpuStartNs = GetCpuTimeNs(CLOCK_PROCESS_CPUTIME_ID);
+        pStats->threadCpuStartNs = GetCpuTimeNs(CLOCK_THREAD_CPUTIME_ID);
+    }
+}
+
+/*
+ * refreshRate is used to count frames that missed a vblank; pass 0 if
+ * the frame rate is not tied to a display.
+ */
+void InitFrameStats(struct FrameStats *pStats, double refreshRate)
+{
+    memset(pStats, 0, sizeof(*pStats));
+
+    if (refreshRate > 0.0) {
+        pStats->refreshPeriodNs = (uint64_t)(1000000000.0 / refreshRate);
+    }
+}
+
+/*
+ * With adaptive sync, a frame that misses the maximum refresh rate is
+ * shown as soon as it is ready rather than at the next vblank, so only
+ * frames slower than the minimum refresh rate, which the panel has to
+ * repeat, are counted; none are if minRefresh is 0 (unknown).  The
+ * report shows the effective refresh rate instead.
+ */
+void FrameStatsSetVrr(struct FrameStats *pStats, double minRefresh, double maxRefresh)
+{
+    pStats->vrr = 1;
+    pStats->vrrMinRefresh = minRefresh;
+    pStats->vrrMaxRefresh = maxRefresh;
+    pStats->refreshPeriodNs = minRefresh > 0.0 ? (uint64_t)(1000000000.0 / minRefresh) : 0;
+}
+
+void FrameStatsSetFifoLength(struct FrameStats *pStats, int fifoLength)
+{
+    pStats->fifoLength = fifoLength;
+}
+
+/*
+ * Sample the stream's frame counters (see QueryStreamFrames()) once per
+ * frame, after eglSwapBuffers().  The frames between the producer's and
+ * the consumer's are queued; at the measured frame rate, each adds a
+ * frame time of latency.  A mailbox consumer skips over frames that
+ * were replaced before they could be shown; those are counted as
+ * dropped.  A FIFO never drops frames, so consumer frame numbers that
+ * advance by more than one between samples only mean that it caught up.
+ */
+void FrameStatsRecordStream(struct FrameStats *pStats, uint64_t producerFrame,
+                            uint64_t consumerFrame)
+{
+    uint32_t depth = producerFrame > consumerFrame ? producerFrame - consumerFrame : 0;
+
+    if (pStats->fifoLength == 0 && pStats->lastConsumerFrame != 0 &&
+        consumerFrame > pStats->lastConsumerFrame + 1) {
+        pStats->droppedFrames += consumerFrame - pStats->lastConsumerFrame - 1;
+    }
+    pStats->lastConsumerFrame = consumerFrame;
+
+    pStats->queueDepthSum += depth;
+    if (depth > pStats->queueDepthMax) {
+        pStats->queueDepthMax = depth;
+    }
+    pStats->queueSamples++;
+}
+
+void FrameStatsBeginFrame(struct FrameStats *pStats)
+{
+    uint64_t now = GetMonotonicNs();
+
+    if (pStats->frameStartNs != 0) {
+        uint64_t frameNs = now - pStats->frameStartNs;
+
+        HistogramRecord(&pStats->phases[FRAME_PHASE_FRAME], frameNs);
+        pStats->frames++;
+
+        /*
+         * A vsynced frame that took longer than one and a half refresh
+         * periods was not ready for its vblank.  With adaptive sync, the
+         * period is the longest the panel can wait.
+         */
+        if (pStats->vrr) {
+            if (pStats->refreshPeriodNs != 0 && frameNs > pStats->refreshPeriodNs) {
+                pStats->missedFrames++;
+            }
+        } else if (pStats->refreshPeriodNs != 0 &&
+                   frameNs > pStats->refreshPeriodNs + pStats->refreshPeriodNs / 2) {
+            pStats->missedFrames++;
+        }
+    } else {
+        pStats->reportStartNs = now;
+        StartCpuTime(pStats);
+    }
+
+    pStats->frameStartNs = now;
+    pStats->phaseStartNs = now;
+}
+
+void FrameStatsEndPhase(struct FrameStats *pStats, enum FramePhase phase)
+{
+    uint64_t now = GetMonotonicNs();
+
+    HistogramRecord(&pStats->phases[phase], now - pStats->phaseStartNs);
+    pStats->phaseStartNs = now;
+}
+
+/*
+ * Print a report every 5 seconds.  With final set, after the last
+ * frame, end that frame and report whatever the last report left,
+ * however short, so that short runs are reported too.
+ */
+void PrintFrameStats(struct FrameStats *pStats, int final)
+{
+    double seconds;
+    int i;
+
+    if (final && pStats->frameStartNs != 0) {
+        FrameStatsBeginFrame(pStats);
+    }
+
+    if (pStats->frames == 0) {
+        return;
+    }
+
+    seconds = (pStats->frameStartNs - pStats->reportStartNs) / 1e9;
+
+    if (final ? seconds <= 0.0 : seconds <= 5.0) {
+        return;
+    }
+
+    // Keep the report in one piece when several heads print theirs.
+    flockfile(stdout);
+
+    printf("%s%s%u frames in %3.1f seconds = %6.3f FPS",
+           pStats->name, pStats->name[0] ? ": " : "",
+           pStats->frames, seconds, pStats->frames / seconds);
+    if (pStats->trianglesPerFrame != 0) {
+        printf(", %.2f Mtriangles/s",
+               (double)pStats->trianglesPerFrame * pStats->frames / seconds / 1e6);
+    }
+    if (pStats->vrr) {
+        const struct Histogram *pFrames = &pStats->phases[FRAME_PHASE_FRAME];
+
+        // The refresh rate follows the frame time, within the panel's range.
+        printf(", effective refresh p50 %.2f Hz, p99 %.2f Hz, %u below the %.0f-%.0f Hz range",
+               1e9 / HistogramPercentile(pFrames, 50.0),
+               1e9 / HistogramPercentile(pFrames, 99.0),
+               pStats->missedFrames, pStats->vrrMinRefresh, pStats->vrrMaxRefresh);
+    } else if (pStats->refreshPeriodNs != 0) {
+        printf(", %u over %.3f ms (1.5 refresh periods)", pStats->missedFrames,
+               (pStats->refreshPeriodNs + pStats->refreshPeriodNs / 2) / 1e6);
+    }
+    if (pStats->reportCpuTime) {
+        printf(", CPU %.3f ms/frame (%.3f ms on the render thread)",
+               (GetCpuTimeNs(CLOCK_PROCESS_CPUTIME_ID) - pStats->processCpuStartNs) /
+               1e6 / pStats->frames,
+               (GetCpuTimeNs(CLOCK_THREAD_CPUTIME_ID) - pStats->threadCpuStartNs) /
+               1e6 / pStats->frames);
+    }
+    printf("\n");
+
+    for (i = 0; i < FRAME_PHASE_COUNT; i++) {
+        const struct Histogram *pHistogram = &pStats->phases[i];
+
+        if (pHistogram->count == 0) {
+            continue;
+        }
+
+        printf("    %-8s p50 %8.3f ms  p95 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n",
+               phaseNames[i],
+               HistogramPercentile(pHistogram, 50.0) / 1e6,
+               HistogramPercentile(pHistogram, 95.0) / 1e6,
+               HistogramPercentile(pHistogram, 99.0) / 1e6,
+               pHistogram->maxNs / 1e6);
+    }
+
+    if (pStats->queueSamples > 0) {
+        double depth = (double)pStats->queueDepthSum / pStats->queueSamples;
+        char mode[16] = "mailbox";
+
+        if (pStats->fifoLength > 0) {
+            snprintf(mode, sizeof(mode), "FIFO-%d", pStats->fifoLength);
+        }
+
+        printf("    %-8s queue depth avg %.2f, max %u; %u dropped; "
+               "%.3f ms queueing latency\n",
+               mode, depth, pStats->queueDepthMax, pStats->droppedFrames,
+               depth * seconds / pStats->frames * 1e3);
+    }
+    fflush(stdout);
+
+    funlockfile(stdout);
+
+    memset(pStats->phases, 0, sizeof(pStats->phases));
+    pStats->frames = 0;
+    pStats->missedFrames = 0;
+    pStats->queueDepthSum = 0;
+    pStats->queueDepthMax = 0;
+    pStats->queueSamples = 0;
+    pStats->droppedFrames = 0;
+    pStats->reportStartNs = pStats->frameStartNs;
+    StartCpuTime(pStats);
+}
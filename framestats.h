@@ -0,0 +1,63 @@
+#if !defined(FRAMESTATS_H)
+#define FRAMESTATS_H
+
+#include <stdint.h>
+
+/*
+ * Log-bucketed histogram of nanosecond durations: values below 8 ns get
+ * their own bucket, and every power of two above that is split into 8
+ * linear sub-buckets, so any recorded value is within 12.5% of its
+ * bucket's bounds.  280 buckets reach past 60 seconds.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_BUCKETS 280
+
+struct Histogram {
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint64_t maxNs;
+};
+
+enum FramePhase {
+    FRAME_PHASE_SIMULATE,   // UpdateGears()
+    FRAME_PHASE_DRAW,       // DrawGears(), i.e. GL submission
+    FRAME_PHASE_CAPTURE,    // CaptureFrame(), if capturing
+    FRAME_PHASE_SWAP,       // time blocked in eglSwapBuffers()
+    FRAME_PHASE_FRAME,      // start of one frame to the start of the next
+    FRAME_PHASE_COUNT
+};
+
+struct FrameStats {
+    char name[32];              // prefix for reports, if not empty
+    uint64_t refreshPeriodNs;
+    int vrr;                    // adaptive sync: frames go out when ready
+    double vrrMinRefresh, vrrMaxRefresh;
+    uint64_t reportStartNs;
+    uint64_t frameStartNs;
+    uint64_t phaseStartNs;
+    uint32_t frames;
+    uint32_t missedFrames;
+    uint64_t trianglesPerFrame; // if set, throughput is reported too
+    int reportCpuTime;          // if set, CPU time per frame is reported too
+    uint64_t processCpuStartNs, threadCpuStartNs;
+    struct Histogram phases[FRAME_PHASE_COUNT];
+
+    // Stream queue statistics, from FrameStatsRecordStream()
+    int fifoLength;             // of the stream; 0 is mailbox
+    uint64_t lastConsumerFrame;
+    uint64_t queueDepthSum;
+    uint32_t queueDepthMax;
+    uint32_t queueSamples;
+    uint32_t droppedFrames;
+};
+
+void InitFrameStats(struct FrameStats *pStats, double refreshRate);
+void FrameStatsSetVrr(struct FrameStats *pStats, double minRefresh, double maxRefresh);
+void FrameStatsSetFifoLength(struct FrameStats *pStats, int fifoLength);
+void FrameStatsRecordStream(struct FrameStats *pStats, uint64_t producerFrame,
+                            uint64_t consumerFrame);
+void FrameStatsBeginFrame(struct FrameStats *pStats);
+void FrameStatsEndPhase(struct FrameStats *pStats, enum FramePhase phase);
+void PrintFrameStats(struct FrameStats *pStats, int final);
+
+#endif /* FRAMESTATS_H */
@@ -0,0 +1,581 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gearmesh.h"
+#include "utils.h"
+
+/*
+ * Gear mesh generation.
+ *
+ * This produces the same surfaces as the immediate mode gear() function
+ * of glxgears, as indexed triangles: faces that glxgears drew with flat
+ * shading get their own vertices with the face normal, so the mesh can
+ * be drawn with smooth shading throughout.
+ *
+ * Every vertex of a tooth lies at one of four angles (the start of the
+ * tooth, the two ends of its top land, and its end), so their sines and
+ * cosines are computed once per tooth up front rather than per vertex.
+ */
+
+// cos/sin of the four angles of one tooth
+struct ToothTrig {
+    float c[4];
+    float s[4];
+};
+
+struct MeshBuilder {
+    struct GearVertex *vertices;
+    uint32_t *indices;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+};
+
+static uint32_t AddVertex(struct MeshBuilder *pBuilder,
+                          float x, float y, float z,
+                          float nx, float ny, float nz)
+{
+    struct GearVertex *pVertex = &pBuilder->vertices[pBuilder->vertexCount];
+
+    pVertex->position[0] = x;
+    pVertex->position[1] = y;
+    pVertex->position[2] = z;
+    pVertex->normal[0] = nx;
+    pVertex->normal[1] = ny;
+    pVertex->normal[2] = nz;
+
+    return pBuilder->vertexCount++;
+}
+
+static void AddTriangle(struct MeshBuilder *pBuilder, uint32_t a, uint32_t b, uint32_t c)
+{
+    pBuilder->indices[pBuilder->indexCount++] = a;
+    pBuilder->indices[pBuilder->indexCount++] = b;
+    pBuilder->indices[pBuilder->indexCount++] = c;
+}
+
+// A point at radius r on the xy-plane, at an angle given by its cos/sin
+struct Point {
+    float x, y;
+};
+
+static struct Point At(float r, float c, float s)
+{
+    struct Point p = { r * c, r * s };
+
+    return p;
+}
+
+// A flat triangle in the plane z, in counter-clockwise order.
+static void AddFlatTriangle(struct MeshBuilder *pBuilder, float z, float nz,
+                            struct Point a, struct Point b, struct Point c)
+{
+    uint32_t i = AddVertex(pBuilder, a.x, a.y, z, 0.0f, 0.0f, nz);
+
+    AddVertex(pBuilder, b.x, b.y, z, 0.0f, 0.0f, nz);
+    AddVertex(pBuilder, c.x, c.y, z, 0.0f, 0.0f, nz);
+    AddTriangle(pBuilder, i, i + 1, i + 2);
+}
+
+// A flat quad in the plane z, in counter-clockwise order.
+static void AddFlatQuad(struct MeshBuilder *pBuilder, float z, float nz,
+                        struct Point a, struct Point b, struct Point c, struct Point d)
+{
+    uint32_t i = AddVertex(pBuilder, a.x, a.y, z, 0.0f, 0.0f, nz);
+
+    AddVertex(pBuilder, b.x, b.y, z, 0.0f, 0.0f, nz);
+    AddVertex(pBuilder, c.x, c.y, z, 0.0f, 0.0f, nz);
+    AddVertex(pBuilder, d.x, d.y, z, 0.0f, 0.0f, nz);
+    AddTriangle(pBuilder, i, i + 1, i + 2);
+    AddTriangle(pBuilder, i, i + 2, i + 3);
+}
+
+/*
+ * A quad parallel to the z axis, from the edge at a to the edge at b;
+ * na and nb are the xy normals at each edge.
+ */
+static void AddSideQuad(struct MeshBuilder *pBuilder, float halfWidth,
+                        struct Point a, struct Point b,
+                        float nax, float nay, float nbx, float nby)
+{
+    uint32_t i = AddVertex(pBuilder, a.x, a.y, halfWidth, nax, nay, 0.0f);
+
+    AddVertex(pBuilder, a.x, a.y, -halfWidth, nax, nay, 0.0f);
+    AddVertex(pBuilder, b.x, b.y, -halfWidth, nbx, nby, 0.0f);
+    AddVertex(pBuilder, b.x, b.y, halfWidth, nbx, nby, 0.0f);
+    AddTriangle(pBuilder, i, i + 1, i + 2);
+    AddTriangle(pBuilder, i, i + 2, i + 3);
+}
+
+// A flat side quad, with the normal facing outward from a to b
+static void AddSlopeQuad(struct MeshBuilder *pBuilder, float halfWidth,
+                         struct Point a, struct Point b)
+{
+    float u = b.x - a.x;
+    float v = b.y - a.y;
+    float len = sqrtf(u * u + v * v);
+
+    AddSideQuad(pBuilder, halfWidth, a, b, v / len, -u / len, v / len, -u / len);
+}
+
+// Radii and half width of a gear, as used by the tooth builder
+struct GearDims {
+    float r0, r1, r2, hw;
+};
+
+static struct GearDims GetGearDims(const struct GearShape *pShape)
+{
+    struct GearDims dims;
+
+    dims.r0 = pShape->innerRadius;
+    dims.r1 = pShape->outerRadius - pShape->toothDepth / 2.0f;
+    dims.r2 = pShape->outerRadius + pShape->toothDepth / 2.0f;
+    dims.hw = pShape->width * 0.5f;
+
+    return dims;
+}
+
+static void GetToothTrig(struct ToothTrig *t, double angle, double da)
+{
+    int j;
+
+    for (j = 0; j < 4; j++) {
+        t->c[j] = cos(angle + j * da);
+        t->s[j] = sin(angle + j * da);
+    }
+}
+
+// Add the faces of the tooth t, which ends where the tooth n starts.
+static void AddTooth(struct MeshBuilder *pBuilder, const struct GearDims *d,
+                     const struct ToothTrig *t, const struct ToothTrig *n)
+{
+    const float hw = d->hw;
+
+    // Points of this tooth, and the start of the next one
+    struct Point r0a = At(d->r0, t->c[0], t->s[0]);
+    struct Point r1a = At(d->r1, t->c[0], t->s[0]);
+    struct Point r2a1 = At(d->r2, t->c[1], t->s[1]);
+    struct Point r2a2 = At(d->r2, t->c[2], t->s[2]);
+    struct Point r1a3 = At(d->r1, t->c[3], t->s[3]);
+    struct Point r0n = At(d->r0, n->c[0], n->s[0]);
+    struct Point r1n = At(d->r1, n->c[0], n->s[0]);
+
+    // front face, and front side of the tooth
+    AddFlatTriangle(pBuilder, hw, 1.0f, r0a, r1a, r1a3);
+    AddFlatQuad(pBuilder, hw, 1.0f, r0a, r1a3, r1n, r0n);
+    AddFlatQuad(pBuilder, hw, 1.0f, r1a, r2a1, r2a2, r1a3);
+
+    // back face, and back side of the tooth
+    AddFlatTriangle(pBuilder, -hw, -1.0f, r1a, r0a, r1a3);
+    AddFlatQuad(pBuilder, -hw, -1.0f, r1a3, r0a, r0n, r1n);
+    AddFlatQuad(pBuilder, -hw, -1.0f, r1a3, r2a2, r2a1, r1a);
+
+    /*
+     * outward faces: rising flank, top land, falling flank and the
+     * bottom land up to the next tooth; glxgears lit both lands with
+     * the normal at the start of the tooth.
+     */
+    AddSlopeQuad(pBuilder, hw, r1a, r2a1);
+    AddSideQuad(pBuilder, hw, r2a1, r2a2, t->c[0], t->s[0], t->c[0], t->s[0]);
+    AddSlopeQuad(pBuilder, hw, r2a2, r1a3);
+    AddSideQuad(pBuilder, hw, r1a3, r1n, t->c[0], t->s[0], t->c[0], t->s[0]);
+
+    // inside radius cylinder, smooth shaded; -hw makes it face the axis
+    AddSideQuad(pBuilder, -hw, r0a, r0n, -t->c[0], -t->s[0], -n->c[0], -n->s[0]);
+}
+
+/*
+ * Write the gear's mesh to the given arrays, which must have room for
+ * GEAR_VERTICES_PER_TOOTH and GEAR_INDICES_PER_TOOTH entries per tooth.
+ * Indices are relative to the first vertex written.
+ *
+ * This is the straightforward scalar version; BuildGearMeshes() below
+ * produces the same meshes (up to rounding) much faster.
+ */
+void BuildGearMesh(const struct GearShape *pShape,
+                   struct GearVertex *vertices, uint32_t *indices)
+{
+    struct MeshBuilder builder = { vertices, indices, 0, 0 };
+    const struct GearDims dims = GetGearDims(pShape);
+    const int teeth = pShape->teeth;
+    const double da = 2.0 * M_PI / teeth / 4.0;
+    struct ToothTrig *trig;
+    int i;
+
+    trig = malloc(teeth * sizeof(*trig));
+
+    if (trig == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    for (i = 0; i < teeth; i++) {
+        GetToothTrig(&trig[i], i * 2.0 * M_PI / teeth, da);
+    }
+
+    for (i = 0; i < teeth; i++) {
+        AddTooth(&builder, &dims, &trig[i], &trig[(i + 1) % teeth]);
+    }
+
+    free(trig);
+}
+
+/*
+ * Batched mesh generation.
+ *
+ * Every tooth of a gear is the first tooth rotated about the z axis, and
+ * a rotation by (c, s) maps each float of the interleaved vertex data to
+ *
+ *     c * a + s * b + k
+ *
+ * with a, b and k fixed per float: for x that is (x, -y, 0), for y
+ * (y, x, 0), for z (0, 0, z), and the same for the normal.  So each gear
+ * builds its first tooth once, splits it into those three arrays, and
+ * every other tooth is a single multiply-add pass over contiguous floats
+ * with one cos/sin per tooth, which vectorizes without any shuffles.
+ * Indices are likewise the first tooth's indices plus a per-tooth base.
+ *
+ * The vector code uses GCC/Clang vector extensions, which compile to
+ * AVX, SSE or NEON depending on the target (build with -mavx to get the
+ * 8-wide path on x86), and to plain floats elsewhere.  Without
+ * optimization the vector temporaries all go through memory, and the
+ * batched path is slower than BuildGearMesh(); it only pays off at -O2
+ * (about twice as fast with AVX), which is why eglgears.c, built
+ * unoptimized by default, keeps using BuildGearMesh() and this is left
+ * to meshbench.
+ */
+#if defined(__AVX__)
+#define SIMD_LANES 8
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+#define SIMD_LANES 4
+#else
+#define SIMD_LANES 1
+#endif
+
+typedef float VFloat __attribute__((vector_size(SIMD_LANES * sizeof(float))));
+typedef uint32_t VUint __attribute__((vector_size(SIMD_LANES * sizeof(uint32_t))));
+
+#define TOOTH_FLOATS (GEAR_VERTICES_PER_TOOTH * 6)
+
+_Static_assert(sizeof(struct GearVertex) == 6 * sizeof(float),
+               "vertices are written as a flat float array");
+
+// Rounded up to a whole number of vectors
+#define TOOTH_FLOATS_PADDED \
+    ((TOOTH_FLOATS + SIMD_LANES - 1) / SIMD_LANES * SIMD_LANES)
+
+struct ToothTemplate {
+    _Alignas(VFloat) float a[TOOTH_FLOATS_PADDED];
+    _Alignas(VFloat) float b[TOOTH_FLOATS_PADDED];
+    _Alignas(VFloat) float k[TOOTH_FLOATS_PADDED];
+    uint32_t indices[GEAR_INDICES_PER_TOOTH];
+};
+
+static void BuildToothTemplate(const struct GearShape *pShape,
+                               struct ToothTemplate *pTemplate)
+{
+    struct GearVertex vertices[GEAR_VERTICES_PER_TOOTH];
+    struct MeshBuilder builder = { vertices, pTemplate->indices, 0, 0 };
+    const struct GearDims dims = GetGearDims(pShape);
+    const double da = 2.0 * M_PI / pShape->teeth / 4.0;
+    struct ToothTrig first, next;
+    int i;
+
+    GetToothTrig(&first, 0.0, da);
+    GetToothTrig(&next, 2.0 * M_PI / pShape->teeth, da);
+    AddTooth(&builder, &dims, &first, &next);
+
+    for (i = 0; i < GEAR_VERTICES_PER_TOOTH; i++) {
+        const float *p = vertices[i].position;
+        const float *n = vertices[i].normal;
+        float *a = &pTemplate->a[i * 6];
+        float *b = &pTemplate->b[i * 6];
+        float *k = &pTemplate->k[i * 6];
+
+        a[0] = p[0]; b[0] = -p[1]; k[0] = 0.0f;
+        a[1] = p[1]; b[1] = p[0];  k[1] = 0.0f;
+        a[2] = 0.0f; b[2] = 0.0f;  k[2] = p[2];
+        a[3] = n[0]; b[3] = -n[1]; k[3] = 0.0f;
+        a[4] = n[1]; b[4] = n[0];  k[4] = 0.0f;
+        a[5] = 0.0f; b[5] = 0.0f;  k[5] = n[2];
+    }
+
+    for (i = TOOTH_FLOATS; i < TOOTH_FLOATS_PADDED; i++) {
+        pTemplate->a[i] = pTemplate->b[i] = pTemplate->k[i] = 0.0f;
+    }
+}
+
+/*
+ * Write one gear; indices are offset by baseVertex.  The output is not
+ * aligned, and the last partial vector of each tooth is written with
+ * scalar code so that nothing past the tooth is touched.
+ */
+static void EmitGear(const struct GearShape *pShape,
+                     float *out, uint32_t *indices, uint32_t baseVertex)
+{
+    struct ToothTemplate template;
+    const int fullFloats = TOOTH_FLOATS / SIMD_LANES * SIMD_LANES;
+    const int fullIndices = GEAR_INDICES_PER_TOOTH / SIMD_LANES * SIMD_LANES;
+    int i, j;
+
+    BuildToothTemplate(pShape, &template);
+
+    for (i = 0; i < pShape->teeth; i++) {
+        const double angle = i * 2.0 * M_PI / pShape->teeth;
+        const float c = cos(angle);
+        const float s = sin(angle);
+        const uint32_t base = baseVertex + i * GEAR_VERTICES_PER_TOOTH;
+        const VFloat vc = (VFloat){ 0 } + c;
+        const VFloat vs = (VFloat){ 0 } + s;
+        const VUint vbase = (VUint){ 0 } + base;
+
+        for (j = 0; j < fullFloats; j += SIMD_LANES) {
+            VFloat a, b, k, r;
+
+            memcpy(&a, &template.a[j], sizeof(a));
+            memcpy(&b, &template.b[j], sizeof(b));
+            memcpy(&k, &template.k[j], sizeof(k));
+            r = vc * a + vs * b + k;
+            memcpy(&out[j], &r, sizeof(r));
+        }
+        for (; j < TOOTH_FLOATS; j++) {
+            out[j] = c * template.a[j] + s * template.b[j] + template.k[j];
+        }
+
+        for (j = 0; j < fullIndices; j += SIMD_LANES) {
+            VUint index;
+
+            memcpy(&index, &template.indices[j], sizeof(index));
+            index += vbase;
+            memcpy(&indices[j], &index, sizeof(index));
+        }
+        for (; j < GEAR_INDICES_PER_TOOTH; j++) {
+            indices[j] = template.indices[j] + base;
+        }
+
+        out += TOOTH_FLOATS;
+        indices += GEAR_INDICES_PER_TOOTH;
+    }
+}
+
+// Gears claimed by a worker at a time
+#define GEARS_PER_CLAIM 16
+
+struct GearMeshJob {
+    const struct GearShape *shapes;
+    int count;
+    struct GearVertex *vertices;
+    uint32_t *indices;
+    const size_t *firstVertex;   // per gear, count + 1 entries
+    const size_t *firstIndex;
+    atomic_int nextGear;
+};
+
+struct GearMeshPool {
+    int threadCount;            // including the caller of BuildGearMeshes()
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t workReady;
+    pthread_cond_t workDone;
+    unsigned int generation;
+    int busyWorkers;
+    int quit;
+    struct GearMeshJob *pJob;
+};
+
+static void RunGearMeshJob(struct GearMeshJob *pJob)
+{
+    for (;;) {
+        int first = atomic_fetch_add(&pJob->nextGear, GEARS_PER_CLAIM);
+        int last = first + GEARS_PER_CLAIM;
+        int i;
+
+        if (first >= pJob->count) {
+            break;
+        }
+        if (last > pJob->count) {
+            last = pJob->count;
+        }
+
+        for (i = first; i < last; i++) {
+            EmitGear(&pJob->shapes[i],
+                     (float *)&pJob->vertices[pJob->firstVertex[i]],
+                     &pJob->indices[pJob->firstIndex[i]],
+                     pJob->firstVertex[i]);
+        }
+    }
+}
+
+static void *GearMeshWorker(void *arg)
+{
+    struct GearMeshPool *pPool = arg;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pPool->lock);
+
+    for (;;) {
+        struct GearMeshJob *pJob;
+
+        while (!pPool->quit && pPool->generation == seen) {
+            pthread_cond_wait(&pPool->workReady, &pPool->lock);
+        }
+        if (pPool->quit) {
+            break;
+        }
+
+        seen = pPool->generation;
+        pJob = pPool->pJob;
+
+        pthread_mutex_unlock(&pPool->lock);
+        RunGearMeshJob(pJob);
+        pthread_mutex_lock(&pPool->lock);
+
+        if (--pPool->busyWorkers == 0) {
+            pthread_cond_signal(&pPool->workDone);
+        }
+    }
+
+    pthread_mutex_unlock(&pPool->lock);
+
+    return NULL;
+}
+
+/*
+ * Create a pool of threads for BuildGearMeshes(); threads counts the
+ * calling thread, and 0 or less uses one thread per online CPU.
+ */
+struct GearMeshPool *CreateGearMeshPool(int threads)
+{
+    struct GearMeshPool *pPool;
+    int i;
+
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads <= 0) {
+            threads = 1;
+        }
+    }
+
+    pPool = calloc(1, sizeof(*pPool));
+    if (pPool == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    pPool->threadCount = threads;
+    pPool->threads = calloc(threads, sizeof(*pPool->threads));
+    if (pPool->threads == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    pthread_mutex_init(&pPool->lock, NULL);
+    pthread_cond_init(&pPool->workReady, NULL);
+    pthread_cond_init(&pPool->workDone, NULL);
+
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&pPool->threads[i], NULL, GearMeshWorker, pPool) != 0) {
+            Fatal("Unable to create gear mesh worker thread.\n");
+        }
+    }
+
+    return pPool;
+}
+
+void DestroyGearMeshPool(struct GearMeshPool *pPool)
+{
+    int i;
+
+    pthread_mutex_lock(&pPool->lock);
+    pPool->quit = 1;
+    pthread_cond_broadcast(&pPool->workReady);
+    pthread_mutex_unlock(&pPool->lock);
+
+    for (i = 1; i < pPool->threadCount; i++) {
+        pthread_join(pPool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pPool->workDone);
+    pthread_cond_destroy(&pPool->workReady);
+    pthread_mutex_destroy(&pPool->lock);
+
+    free(pPool->threads);
+    free(pPool);
+}
+
+// Total number of vertices and indices of the given gears
+void GetGearMeshSize(const struct GearShape *shapes, int count,
+                     size_t *pVertexCount, size_t *pIndexCount)
+{
+    size_t teeth = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        teeth += shapes[i].teeth;
+    }
+
+    *pVertexCount = teeth * GEAR_VERTICES_PER_TOOTH;
+    *pIndexCount = teeth * GEAR_INDICES_PER_TOOTH;
+}
+
+/*
+ * Write the meshes of all the gears, one after the other, to arrays
+ * sized with GetGearMeshSize().  Unlike BuildGearMesh(), indices are
+ * relative to the first vertex of the array, so all gears can be drawn
+ * at once.  With a pool, the gears are split between its threads, each
+ * writing straight into the arrays; with NULL, they are all built on
+ * the calling thread.
+ */
+void BuildGearMeshes(struct GearMeshPool *pPool,
+                     const struct GearShape *shapes, int count,
+                     struct GearVertex *vertices, uint32_t *indices)
+{
+    struct GearMeshJob job;
+    size_t *offsets;
+    int i;
+
+    offsets = malloc(2 * (count + 1) * sizeof(*offsets));
+    if (offsets == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    job.shapes = shapes;
+    job.count = count;
+    job.vertices = vertices;
+    job.indices = indices;
+    job.firstVertex = offsets;
+    job.firstIndex = offsets + count + 1;
+    atomic_init(&job.nextGear, 0);
+
+    offsets[0] = offsets[count + 1] = 0;
+    for (i = 0; i < count; i++) {
+        offsets[i + 1] = offsets[i] + shapes[i].teeth * GEAR_VERTICES_PER_TOOTH;
+        offsets[count + 2 + i] =
+            offsets[count + 1 + i] + shapes[i].teeth * GEAR_INDICES_PER_TOOTH;
+    }
+
+    if (pPool == NULL || pPool->threadCount == 1) {
+        RunGearMeshJob(&job);
+        free(offsets);
+        return;
+    }
+
+    pthread_mutex_lock(&pPool->lock);
+    pPool->pJob = &job;
+    pPool->busyWorkers = pPool->threadCount - 1;
+    pPool->generation++;
+    pthread_cond_broadcast(&pPool->workReady);
+    pthread_mutex_unlock(&pPool->lock);
+
+    RunGearMeshJob(&job);
+
+    pthread_mutex_lock(&pPool->lock);
+    while (pPool->busyWorkers > 0) {
+        pthread_cond_wait(&pPool->workDone, &pPool->lock);
+    }
+    pPool->pJob = NULL;
+    pthread_mutex_unlock(&pPool->lock);
+
+    free(offsets);
+}
@@ -0,0 +1,44 @@
+#if !defined(GEARMESH_H)
+#define GEARMESH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Every tooth of a gear is made of the same faces, so a gear's mesh
+ * size depends only on its number of teeth.
+ */
+#define GEAR_VERTICES_PER_TOOTH 42
+#define GEAR_INDICES_PER_TOOTH 60
+
+// Interleaved vertex layout, as uploaded to the vertex buffer
+struct GearVertex {
+    float position[3];
+    float normal[3];
+};
+
+// Same parameters as the original glxgears gear() function
+struct GearShape {
+    float innerRadius;  // radius of hole at center
+    float outerRadius;  // radius at center of teeth
+    float width;
+    int teeth;
+    float toothDepth;
+};
+
+void BuildGearMesh(const struct GearShape *pShape,
+                   struct GearVertex *vertices, uint32_t *indices);
+
+// Worker threads for building many gears at once
+struct GearMeshPool;
+
+struct GearMeshPool *CreateGearMeshPool(int threads);
+void DestroyGearMeshPool(struct GearMeshPool *pPool);
+
+void GetGearMeshSize(const struct GearShape *shapes, int count,
+                     size_t *pVertexCount, size_t *pIndexCount);
+void BuildGearMeshes(struct GearMeshPool *pPool,
+                     const struct GearShape *shapes, int count,
+                     struct GearVertex *vertices, uint32_t *indices);
+
+#endif /* GEARMESH_H */
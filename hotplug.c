@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+
+#include "hotplug.h"
+#include "utils.h"
+
+/*
+ * Connector hotplug notification, straight from the kernel's uevents.
+ *
+ * When a DRM device's connectors may have changed, the kernel sends a
+ * uevent with SUBSYSTEM=drm and HOTPLUG=1 to the first multicast group
+ * of NETLINK_KOBJECT_UEVENT sockets; since Linux 5.6, it also names the
+ * connector, when it knows which one, with CONNECTOR=.  Listening there
+ * rather than through libudev needs no udevd, which embedded and kiosk
+ * systems often go without.
+ *
+ * The sender is not checked: an event only makes the caller probe the
+ * connectors again, so a forged one costs a probe and nothing else.
+ */
+
+// A uevent is at most a page of environment, plus its header.
+#define UEVENT_BUFFER_SIZE 8192
+
+/*
+ * Open a nonblocking socket receiving the kernel's uevents.  Returns -1,
+ * with a warning, if there is none to be had, e.g. in a container
+ * without its own network namespace's uevents.
+ */
+int OpenHotplugMonitor(void)
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = 1,
+    };
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        Warning("Unable to listen for hotplug events: %s\n", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Read the next uevent from the socket.  Returns 1 and fills in *pEvent
+ * if it was a DRM hotplug event, 0 if it was another kind, or -1 once
+ * none is left.
+ */
+int ReadHotplugEvent(int fd, struct HotplugEvent *pEvent)
+{
+    char buffer[UEVENT_BUFFER_SIZE];
+    unsigned int major = 0, minor = 0;
+    int drm = 0, hotplug = 0;
+    const char *pKey;
+    ssize_t size;
+
+    size = recv(fd, buffer, sizeof(buffer) - 1, 0);
+
+    if (size <= 0) {
+        return -1;
+    }
+    buffer[size] = '\0';
+
+    memset(pEvent, 0, sizeof(*pEvent));
+
+    // "action@devpath", then NUL-terminated KEY=value pairs
+    for (pKey = buffer + strlen(buffer) + 1; pKey < buffer + size;
+         pKey += strlen(pKey) + 1) {
+        if (strcmp(pKey, "SUBSYSTEM=drm") == 0) {
+            drm = 1;
+        } else if (strcmp(pKey, "HOTPLUG=1") == 0) {
+            hotplug = 1;
+        } else if (strncmp(pKey, "MAJOR=", 6) == 0) {
+            major = strtoul(pKey + 6, NULL, 10);
+        } else if (strncmp(pKey, "MINOR=", 6) == 0) {
+            minor = strtoul(pKey + 6, NULL, 10);
+        } else if (strncmp(pKey, "CONNECTOR=", 10) == 0) {
+            pEvent->connectorID = strtoul(pKey + 10, NULL, 10);
+        }
+    }
+
+    if (major != 0) {
+        pEvent->devnum = makedev(major, minor);
+    }
+
+    return drm && hotplug;
+}
@@ -0,0 +1,16 @@
+#if !defined(HOTPLUG_H)
+#define HOTPLUG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// A change on a DRM device's connectors, as announced by the kernel
+struct HotplugEvent {
+    dev_t devnum;               // of the DRM device node; 0 if not given
+    uint32_t connectorID;       // the connector that changed; 0 if not given
+};
+
+int OpenHotplugMonitor(void);
+int ReadHotplugEvent(int fd, struct HotplugEvent *pEvent);
+
+#endif /* HOTPLUG_H */
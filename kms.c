@@ -1,16 +1,20 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <xf86drmMode.h>
 #include <xf86drm.h>
 #include <drm/drm_mode.h>
 
 #include "kms.h"
+#include "kmsprops.h"
 #include "utils.h"
 
 // --- Fallback definitions for older libdrm versions ---
@@ -43,202 +47,432 @@ struct Config {
 typedef struct {
     uint32_t id;
     uint32_t object_id;
+    uint64_t initial_value; // Value before we touched the object
+    const struct KmsProperty *prop;
 } DrmProperty;
 
-struct PropertyIDs {
-    DrmProperty mode_id, active;
+// The plane properties that atomic requests set
+struct PlanePropertyIDs {
     DrmProperty fb_id, crtc_id;
     DrmProperty src_x, src_y, src_w, src_h;
     DrmProperty crtc_x, crtc_y, crtc_w, crtc_h;
+};
+
+struct PropertyIDs {
+    DrmProperty mode_id, active;
+    struct PlanePropertyIDs plane;
     DrmProperty connector_crtc_id;
     DrmProperty hdr_output_metadata;
     DrmProperty colorspace;
+    DrmProperty vrr_capable, edid;
+    DrmProperty vrr_enabled;
     DrmProperty eotf; // Will hold NV_CRTC_REGAMMA_TF
+    uint64_t eotf_pq; // NV_CRTC_REGAMMA_TF enum value for PQ
+    int has_eotf_pq;
+};
+
+// The plane's destination rectangle on the CRTC
+struct PlaneRect {
+    int x, y;
+    int width, height;
+};
+
+/*
+ * A dumb buffer put on a plane until its EGLStream's first frame
+ * replaces it; id is 0 once it has been released, or if the plane was
+ * already scanning out something else.
+ */
+struct KmsFb {
+    uint32_t id;
+    uint32_t handle;
+    uint64_t size;
+};
+
+// A dumb buffer for the planes of test-only commits, grown to fit each mode
+struct KmsTestFb {
+    struct KmsFb fb;
+    int width, height;
+};
+
+// An overlay plane shown with KmsShowOverlay()
+struct KmsOverlay {
+    uint32_t planeID;
+    struct KmsFb fb;
+    int width, height;          // of the source, i.e. of its stream's frames
+    struct PlanePropertyIDs propertyIDs;
+    struct PlaneRect rect;
+    struct PlaneRect pendingRect;
+    int dirty;
 };
 
-static void FindProperty(int drmFd, uint32_t object_id, uint32_t object_type, const char *prop_name, DrmProperty *property)
+/*
+ * State shared by all the heads set up by one SetMode() call: every
+ * head uses the same property tables, heads showing the same mode
+ * share its MODE_ID blob, and an overlay plane that several CRTCs can
+ * use goes to the first head that asks for it.  What SetMode() was
+ * asked for is kept for the heads KmsAddHead() lights up later.
+ *
+ * The lock serializes the entry points that use this shared state, so
+ * that render threads can change their heads while the main thread adds
+ * and removes others.
+ */
+struct KmsDevice {
+    int drmFd;
+    pthread_mutex_t lock;
+    struct KmsPropertyCache propertyCache;
+    struct KmsBlobCache blobCache;
+    uint32_t overlayPlanes[KMS_MAX_HEADS * KMS_MAX_OVERLAYS];
+    int overlayPlaneCount;
+    struct KmsOutput *outputs[KMS_MAX_HEADS];
+    int outputCount;
+    int maxOutputs;
+    int desiredWidth, desiredHeight, desiredRefresh;
+    int hdrEnabled, vrrEnabled;
+};
+
+// Everything needed to build further atomic requests after SetMode()
+struct KmsOutput {
+    int drmFd;
+    struct KmsDevice *pDevice;
+    struct Config config;
+    struct PropertyIDs propertyIDs;
+    uint32_t modeBlob;
+    uint32_t hdrMetadataBlob;
+    struct KmsFb initialFb;
+    int hdrEnabled;
+    int vrrEnabled;
+    struct PlaneRect planeRect;
+    struct PlaneRect pendingPlaneRect;
+    int dirty;
+    struct KmsOverlay overlays[KMS_MAX_OVERLAYS];
+    int overlayCount;
+    drmModePropertyBlobPtr edid; // the display's, kept to recognize it; NULL if none
+};
+
+static void FindProperty(struct KmsPropertyCache *pCache, uint32_t object_id, uint32_t object_type, const char *prop_name, DrmProperty *property)
 {
-    drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drmFd, object_id, object_type);
-    if (!props) return;
+    const struct KmsPropertyTable *pTable = GetPropertyTable(pCache, object_id, object_type);
+    const struct KmsProperty *pProperty;
 
-    for (uint32_t i = 0; i < props->count_props; i++) {
-        drmModePropertyPtr prop = drmModeGetProperty(drmFd, props->props[i]);
-        if (prop) {
-            if (strcmp(prop->name, prop_name) == 0) {
-                property->id = prop->prop_id;
-                property->object_id = object_id;
-                drmModeFreeProperty(prop);
-                break;
-            }
-            drmModeFreeProperty(prop);
-        }
+    if (!pTable) return;
+
+    pProperty = LookupProperty(pTable, prop_name);
+    if (pProperty) {
+        property->id = pProperty->id;
+        property->object_id = object_id;
+        property->initial_value = pProperty->value;
+        property->prop = pProperty;
     }
-    drmModeFreeObjectProperties(props);
 }
 
 // Helper to get an enum's value from its string name
-static uint64_t GetEnumValue(int drmFd, uint32_t prop_id, const char* enum_name) {
-    drmModePropertyPtr prop = drmModeGetProperty(drmFd, prop_id);
-    if (!prop) return 0;
-
-    for (int i = 0; i < prop->count_enums; i++) {
-        if (strcmp(prop->enums[i].name, enum_name) == 0) {
-            uint64_t value = prop->enums[i].value;
-            drmModeFreeProperty(prop);
-            return value;
-        }
-    }
+static int GetEnumValue(const DrmProperty *property, const char *enum_name, uint64_t *value)
+{
+    if (!property->prop) return 0;
 
-    drmModeFreeProperty(prop);
-    return 0; // Not found
+    return LookupEnumValue(property->prop, enum_name, value);
 }
 
 
-static void AssignPropertyIDs(int drmFd, const struct Config *pConfig, struct PropertyIDs *pPropertyIDs)
+static void AssignPlanePropertyIDs(struct KmsPropertyCache *pCache, uint32_t planeID, struct PlanePropertyIDs *pPropertyIDs)
+{
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "FB_ID", &pPropertyIDs->fb_id);
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "CRTC_ID", &pPropertyIDs->crtc_id);
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "SRC_X", &pPropertyIDs->src_x);
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "SRC_Y", &pPropertyIDs->src_y);
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "SRC_W", &pPropertyIDs->src_w);
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "SRC_H", &pPropertyIDs->src_h);
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "CRTC_X", &pPropertyIDs->crtc_x);
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "CRTC_Y", &pPropertyIDs->crtc_y);
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "CRTC_W", &pPropertyIDs->crtc_w);
+    FindProperty(pCache, planeID, DRM_MODE_OBJECT_PLANE, "CRTC_H", &pPropertyIDs->crtc_h);
+}
+
+static void AssignPropertyIDs(struct KmsPropertyCache *pCache, const struct Config *pConfig, struct PropertyIDs *pPropertyIDs)
 {
     // Find CRTC properties
-    FindProperty(drmFd, pConfig->crtcID, DRM_MODE_OBJECT_CRTC, "MODE_ID", &pPropertyIDs->mode_id);
-    FindProperty(drmFd, pConfig->crtcID, DRM_MODE_OBJECT_CRTC, "ACTIVE", &pPropertyIDs->active);
+    FindProperty(pCache, pConfig->crtcID, DRM_MODE_OBJECT_CRTC, "MODE_ID", &pPropertyIDs->mode_id);
+    FindProperty(pCache, pConfig->crtcID, DRM_MODE_OBJECT_CRTC, "ACTIVE", &pPropertyIDs->active);
 
     // Find Plane properties
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "FB_ID", &pPropertyIDs->fb_id);
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "CRTC_ID", &pPropertyIDs->crtc_id);
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "SRC_X", &pPropertyIDs->src_x);
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "SRC_Y", &pPropertyIDs->src_y);
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "SRC_W", &pPropertyIDs->src_w);
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "SRC_H", &pPropertyIDs->src_h);
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "CRTC_X", &pPropertyIDs->crtc_x);
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "CRTC_Y", &pPropertyIDs->crtc_y);
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "CRTC_W", &pPropertyIDs->crtc_w);
-    FindProperty(drmFd, pConfig->planeID, DRM_MODE_OBJECT_PLANE, "CRTC_H", &pPropertyIDs->crtc_h);
+    AssignPlanePropertyIDs(pCache, pConfig->planeID, &pPropertyIDs->plane);
 
     // Find Connector properties
-    FindProperty(drmFd, pConfig->connectorID, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", &pPropertyIDs->connector_crtc_id);
+    FindProperty(pCache, pConfig->connectorID, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", &pPropertyIDs->connector_crtc_id);
 
     // Find HDR properties
-    FindProperty(drmFd, pConfig->connectorID, DRM_MODE_OBJECT_CONNECTOR, "Colorspace", &pPropertyIDs->colorspace);
-    FindProperty(drmFd, pConfig->connectorID, DRM_MODE_OBJECT_CONNECTOR, "HDR_OUTPUT_METADATA", &pPropertyIDs->hdr_output_metadata);
+    FindProperty(pCache, pConfig->connectorID, DRM_MODE_OBJECT_CONNECTOR, "Colorspace", &pPropertyIDs->colorspace);
+    FindProperty(pCache, pConfig->connectorID, DRM_MODE_OBJECT_CONNECTOR, "HDR_OUTPUT_METADATA", &pPropertyIDs->hdr_output_metadata);
     
+    // Adaptive sync
+    FindProperty(pCache, pConfig->connectorID, DRM_MODE_OBJECT_CONNECTOR, "vrr_capable", &pPropertyIDs->vrr_capable);
+    FindProperty(pCache, pConfig->connectorID, DRM_MODE_OBJECT_CONNECTOR, "EDID", &pPropertyIDs->edid);
+    FindProperty(pCache, pConfig->crtcID, DRM_MODE_OBJECT_CRTC, "VRR_ENABLED", &pPropertyIDs->vrr_enabled);
+
     // NVIDIA specific EOTF property on the CRTC
-    FindProperty(drmFd, pConfig->crtcID, DRM_MODE_OBJECT_CRTC, "NV_CRTC_REGAMMA_TF", &pPropertyIDs->eotf);
-}
-
-// All other functions (CreateHdrMetadataBlob, PickConnector, etc.) remain the same.
-// ... (Insert the rest of the kms.c code from the previous response here) ...
-static void PickConnector(int drmFd,
-                          drmModeResPtr pModeRes,
-                          int desired_width, int desired_height, int desired_refresh,
-                          struct Config *pConfig)
-{
-    int i, j, k;
-
-    // Find a connected connector
-    for (i = 0; i < pModeRes->count_connectors; i++) {
-        drmModeConnectorPtr pConnector = drmModeGetConnector(drmFd, pModeRes->connectors[i]);
-        if (!pConnector) continue;
-
-        if (pConnector->connection == DRM_MODE_CONNECTED && pConnector->count_modes > 0) {
-            drmModeModeInfo *best_mode = NULL;
-
-            // Iterate through modes to find the best match
-            for (k = 0; k < pConnector->count_modes; k++) {
-                drmModeModeInfo *current_mode = &pConnector->modes[k];
-
-                if (desired_width > 0 && desired_height > 0) {
-                     if (current_mode->hdisplay == desired_width &&
-                         current_mode->vdisplay == desired_height) {
-                         if (desired_refresh > 0) {
-                             if(current_mode->vrefresh == desired_refresh) {
-                                best_mode = current_mode;
-                                break; // Exact match found
-                             }
-                         } else {
-                            if (!best_mode) {
-                                best_mode = current_mode;
-                            }
-                         }
-                     }
-                }
-            }
+    FindProperty(pCache, pConfig->crtcID, DRM_MODE_OBJECT_CRTC, "NV_CRTC_REGAMMA_TF", &pPropertyIDs->eotf);
 
-            if (!best_mode) {
-                 best_mode = &pConnector->modes[0];
-                 if (desired_width > 0) {
-                     printf("Desired mode (%dx%d @ %dHz) not found. Using default: %dx%d @ %dHz.\n",
-                            desired_width, desired_height, desired_refresh,
-                            best_mode->hdisplay, best_mode->vdisplay, best_mode->vrefresh);
-                 }
-            }
+    // Resolve enum values once, rather than every time a request is built
+    pPropertyIDs->has_eotf_pq = GetEnumValue(&pPropertyIDs->eotf, "PQ (Perceptual Quantizer)",
+                                             &pPropertyIDs->eotf_pq);
+}
 
-            pConfig->mode = *best_mode;
-            pConfig->connectorID = pModeRes->connectors[i];
-
-            drmModeEncoderPtr pEncoder = drmModeGetEncoder(drmFd, pConnector->encoders[0]);
-            if (pEncoder) {
-                for (j = 0; j < pModeRes->count_crtcs; j++) {
-                    if ((pEncoder->possible_crtcs & (1 << j))) {
-                        pConfig->crtcID = pModeRes->crtcs[j];
-                        pConfig->crtcIndex = j;
-                        break;
-                    }
-                }
-                drmModeFreeEncoder(pEncoder);
-            }
+/*
+ * The precise refresh rate of a mode, in Hz; vrefresh is rounded to an
+ * integer (e.g., 59.94 Hz is reported as 60).
+ */
+static double ModeRefreshRate(const drmModeModeInfo *pMode)
+{
+    double rate;
 
-            drmModeFreeConnector(pConnector);
+    if (pMode->htotal == 0 || pMode->vtotal == 0) {
+        return pMode->vrefresh;
+    }
 
-            if (pConfig->crtcID) {
-                return;
-            }
-        }
-        drmModeFreeConnector(pConnector);
+    rate = (pMode->clock * 1000.0) / ((double)pMode->htotal * pMode->vtotal);
+
+    if (pMode->flags & DRM_MODE_FLAG_INTERLACE) {
+        rate *= 2.0;
+    }
+    if (pMode->flags & DRM_MODE_FLAG_DBLSCAN) {
+        rate /= 2.0;
+    }
+    if (pMode->vscan > 1) {
+        rate /= pMode->vscan;
     }
 
-    Fatal("Could not find a suitable connector.\n");
+    return rate;
 }
-static uint64_t GetPropertyValue(
-    int drmFd,
-    uint32_t objectID,
-    uint32_t objectType,
-    const char *propName)
+
+// What a connector's modes are scored against
+struct ModeTarget {
+    int width, height;
+    double refresh;
+};
+
+// Weights of ModeCost(), from the most to the least significant
+#define MODE_COST_SIZE          1000000.0   // not the resolution asked for, or more
+#define MODE_COST_INTERLACE      100000.0   // interlaced or doublescan
+#define MODE_COST_PER_HZ           1000.0   // away from the refresh rate asked for
+#define MODE_COST_NOT_PREFERRED     100.0   // not the display's native mode
+
+/*
+ * Lower is better.  A refresh rate even slightly off the one asked for
+ * shows as judder, so it outweighs everything but the resolution and
+ * scan type; among otherwise equal modes, the preferred one wins, then
+ * the one with the lowest pixel clock (e.g., reduced blanking), which
+ * leaves the most bandwidth to the rest of the display engine.
+ */
+static double ModeCost(const drmModeModeInfo *pMode, const struct ModeTarget *pTarget)
 {
-    uint32_t i;
-    int found = 0;
-    uint64_t value = 0;
-    drmModeObjectPropertiesPtr pModeObjectProperties =
-        drmModeObjectGetProperties(drmFd, objectID, objectType);
+    double cost = pMode->clock / 1000000.0;
+    double refreshError = ModeRefreshRate(pMode) - pTarget->refresh;
+
+    if (pMode->hdisplay != pTarget->width || pMode->vdisplay != pTarget->height) {
+        double area = (double)pMode->hdisplay * pMode->vdisplay;
+        double targetArea = (double)pTarget->width * pTarget->height;
+
+        // The closer in size, the better
+        cost += MODE_COST_SIZE * (1.0 + fabs(area - targetArea) / targetArea);
+    }
+    if (pMode->flags & (DRM_MODE_FLAG_INTERLACE | DRM_MODE_FLAG_DBLSCAN)) {
+        cost += MODE_COST_INTERLACE;
+    }
+    if ((pMode->type & DRM_MODE_TYPE_PREFERRED) == 0) {
+        cost += MODE_COST_NOT_PREFERRED;
+    }
 
-    for (i = 0; i < pModeObjectProperties->count_props; i++) {
+    return cost + fabs(refreshError) * MODE_COST_PER_HZ;
+}
 
-        drmModePropertyPtr pProperty =
-            drmModeGetProperty(drmFd, pModeObjectProperties->props[i]);
+struct ScoredMode {
+    double cost;
+    int index;
+};
 
-        if (pProperty == NULL) {
-            Fatal("Unable to query property.\n");
-        }
+static int CompareScoredModes(const void *a, const void *b)
+{
+    const struct ScoredMode *pA = a, *pB = b;
 
-        if (strcmp(propName, pProperty->name) == 0) {
-            value = pModeObjectProperties->prop_values[i];
-            found = 1;
+    if (pA->cost != pB->cost) {
+        return pA->cost < pB->cost ? -1 : 1;
+    }
+
+    // Keep the kernel's order among equals
+    return pA->index - pB->index;
+}
+
+/*
+ * Return the connector's modes from best to worst for the desired mode;
+ * whatever is not given (0), or not available, is taken from the
+ * preferred mode.  The array is malloc()ed and has
+ * pConnector->count_modes entries.
+ */
+static drmModeModeInfo *RankModes(drmModeConnectorPtr pConnector,
+                                  int desired_width, int desired_height, int desired_refresh)
+{
+    const drmModeModeInfo *pPreferred = &pConnector->modes[0];
+    struct ModeTarget target;
+    struct ScoredMode *scored;
+    drmModeModeInfo *modes;
+    int i;
+
+    for (i = 0; i < pConnector->count_modes; i++) {
+        if (pConnector->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+            pPreferred = &pConnector->modes[i];
+            break;
         }
+    }
 
-        drmModeFreeProperty(pProperty);
+    target.width = pPreferred->hdisplay;
+    target.height = pPreferred->vdisplay;
+    target.refresh = ModeRefreshRate(pPreferred);
 
-        if (found) {
+    // A resolution the display does not have is no better than any other
+    for (i = 0; i < pConnector->count_modes; i++) {
+        if (pConnector->modes[i].hdisplay == desired_width &&
+            pConnector->modes[i].vdisplay == desired_height) {
+            target.width = desired_width;
+            target.height = desired_height;
             break;
         }
     }
+    if (desired_refresh > 0) {
+        target.refresh = desired_refresh;
+    }
+
+    scored = malloc(pConnector->count_modes * sizeof(*scored));
+    modes = malloc(pConnector->count_modes * sizeof(*modes));
+
+    if (scored == NULL || modes == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    for (i = 0; i < pConnector->count_modes; i++) {
+        scored[i].cost = ModeCost(&pConnector->modes[i], &target);
+        scored[i].index = i;
+    }
+
+    qsort(scored, pConnector->count_modes, sizeof(*scored), CompareScoredModes);
+
+    for (i = 0; i < pConnector->count_modes; i++) {
+        modes[i] = pConnector->modes[scored[i].index];
+    }
+
+    free(scored);
+
+    return modes;
+}
+
+/*
+ * If the connector is connected and can be driven by a CRTC not in
+ * usedCrtcs, fill in its connector and CRTC, and rank its modes into
+ * *pModes (see RankModes()).  Returns the number of modes, or 0.
+ */
+static int PickCrtc(int drmFd, drmModeResPtr pModeRes, uint32_t connectorID,
+                    uint32_t usedCrtcs,
+                    int desired_width, int desired_height, int desired_refresh,
+                    struct Config *pConfig, drmModeModeInfo **pModes)
+{
+    drmModeConnectorPtr pConnector = drmModeGetConnector(drmFd, connectorID);
+    drmModeEncoderPtr pEncoder;
+    int modeCount = 0, j;
+
+    if (!pConnector) return 0;
+
+    if (pConnector->connection != DRM_MODE_CONNECTED ||
+        pConnector->count_modes == 0 || pConnector->count_encoders == 0) {
+        drmModeFreeConnector(pConnector);
+        return 0;
+    }
+
+    pConfig->connectorID = connectorID;
+    pConfig->crtcID = 0;
+
+    /*
+     * Keep the CRTC already driving the connector, e.g. for the
+     * console, so that SetMode() can take over its scanout without a
+     * modeset.  Otherwise, another head may already be using the
+     * encoder's first CRTC.
+     */
+    pEncoder = drmModeGetEncoder(drmFd, pConnector->encoder_id ?
+                                 pConnector->encoder_id : pConnector->encoders[0]);
+    if (pEncoder) {
+        for (j = 0; j < pModeRes->count_crtcs; j++) {
+            if (pModeRes->crtcs[j] == pEncoder->crtc_id &&
+                (usedCrtcs & (1 << j)) == 0) {
+                pConfig->crtcID = pModeRes->crtcs[j];
+                pConfig->crtcIndex = j;
+                break;
+            }
+        }
+        for (j = 0; j < pModeRes->count_crtcs && pConfig->crtcID == 0; j++) {
+            if ((pEncoder->possible_crtcs & (1 << j)) &&
+                (usedCrtcs & (1 << j)) == 0) {
+                pConfig->crtcID = pModeRes->crtcs[j];
+                pConfig->crtcIndex = j;
+            }
+        }
+        drmModeFreeEncoder(pEncoder);
+    }
 
-    drmModeFreeObjectProperties(pModeObjectProperties);
+    if (pConfig->crtcID) {
+        modeCount = pConnector->count_modes;
+        *pModes = RankModes(pConnector, desired_width, desired_height, desired_refresh);
+    }
+
+    drmModeFreeConnector(pConnector);
+
+    return modeCount;
+}
+
+/*
+ * Find the next connector, starting at index *pNext, that PickCrtc()
+ * can drive.  Returns the number of its modes, or 0 once no connector
+ * is left.
+ */
+static int PickConnector(int drmFd,
+                         drmModeResPtr pModeRes,
+                         int *pNext, uint32_t usedCrtcs,
+                         int desired_width, int desired_height, int desired_refresh,
+                         struct Config *pConfig, drmModeModeInfo **pModes)
+{
+    int i, modeCount;
+
+    for (i = *pNext; i < pModeRes->count_connectors; i++) {
+        modeCount = PickCrtc(drmFd, pModeRes, pModeRes->connectors[i], usedCrtcs,
+                             desired_width, desired_height, desired_refresh,
+                             pConfig, pModes);
+        if (modeCount > 0) {
+            *pNext = i + 1;
+            return modeCount;
+        }
+    }
+
+    *pNext = i;
+
+    return 0;
+}
+static uint64_t GetPropertyValue(
+    struct KmsPropertyCache *pCache,
+    uint32_t objectID,
+    uint32_t objectType,
+    const char *propName)
+{
+    const struct KmsPropertyTable *pTable = GetPropertyTable(pCache, objectID, objectType);
+    const struct KmsProperty *pProperty;
 
-    if (!found) {
-        // This is not always a fatal error, some properties are optional.
-        // The caller must handle the zero return value.
+    if (pTable == NULL) {
+        Fatal("Unable to query properties of DRM-KMS object %u.\n", objectID);
     }
 
-    return value;
+    pProperty = LookupProperty(pTable, propName);
+
+    // This is not always a fatal error, some properties are optional.
+    // The caller must handle the zero return value.
+    return pProperty ? pProperty->value : 0;
 }
-static void PickPlane(int drmFd, struct Config *pConfig)
+static void PickPlane(int drmFd, struct KmsPropertyCache *pCache, struct Config *pConfig)
 {
     drmModePlaneResPtr pPlaneRes = drmModeGetPlaneResources(drmFd);
     uint32_t i;
@@ -264,7 +498,7 @@ static void PickPlane(int drmFd, struct Config *pConfig)
             continue;
         }
 
-        type = GetPropertyValue(drmFd, pPlaneRes->planes[i],
+        type = GetPropertyValue(pCache, pPlaneRes->planes[i],
                                 DRM_MODE_OBJECT_PLANE, "type");
 
         if (type == DRM_PLANE_TYPE_PRIMARY) {
@@ -279,10 +513,10 @@ static void PickPlane(int drmFd, struct Config *pConfig)
         Fatal("Could not find a suitable plane.\n");
     }
 }
-static uint32_t CreateHdrMetadataBlob(int drmFd)
+static uint32_t CreateHdrMetadataBlob(struct KmsBlobCache *pBlobCache)
 {
     struct hdr_output_metadata metadata = { 0 };
-    uint32_t blob_id = 0;
+    uint32_t blob_id;
 
     metadata.metadata_type = HDR_METADATA_TYPE1;
     metadata.hdmi_metadata_type1.eotf = HDMI_EOTF_SMPTE_ST2084;
@@ -305,42 +539,57 @@ static uint32_t CreateHdrMetadataBlob(int drmFd)
     metadata.hdmi_metadata_type1.max_cll = 1000;
     metadata.hdmi_metadata_type1.max_fall = 400;
 
-    if (drmModeCreatePropertyBlob(drmFd, &metadata, sizeof(metadata), &blob_id) != 0) {
+    // Only the first call creates a kernel blob; later ones share it.
+    blob_id = AcquireBlob(pBlobCache, &metadata, sizeof(metadata));
+    if (blob_id == 0) {
         Warning("Failed to create HDR metadata blob.\n");
-        return 0;
     }
 
     return blob_id;
 }
 
-static void AssignAtomicRequest(int drmFd,
-                                drmModeAtomicReqPtr pAtomic,
+/*
+ * Fill in an atomic request for the CRTC and connector, and for the
+ * plane if fb is not 0.  hdr_was_enabled tells whether the HDR
+ * properties need to be put back to their original values.
+ */
+static void AssignAtomicRequest(drmModeAtomicReqPtr pAtomic,
                                 const struct Config *pConfig,
                                 const struct PropertyIDs *pPropertyIDs,
-                                uint32_t modeID, uint32_t fb, int hdr_enabled)
+                                uint32_t modeID, uint32_t hdrMetadataID, uint32_t fb,
+                                int hdr_enabled, int hdr_was_enabled, int vrr_enabled)
 {
-    // --- THIS IS THE CRITICAL FIX for the "Invalid argument" error ---
-    // The previous code was using the property's object_id as the value.
-    // We need to use the actual width and height from the mode config.
-    // Source coordinates are in 16.16 fixed point.
-    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->src_w.object_id, pPropertyIDs->src_w.id, (uint64_t)pConfig->width << 16);
-    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->src_h.object_id, pPropertyIDs->src_h.id, (uint64_t)pConfig->height << 16);
-    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->crtc_w.object_id, pPropertyIDs->crtc_w.id, pConfig->width);
-    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->crtc_h.object_id, pPropertyIDs->crtc_h.id, pConfig->height);
-    // ----------------------------------------------------------------
+    if (fb) {
+        // --- THIS IS THE CRITICAL FIX for the "Invalid argument" error ---
+        // The previous code was using the property's object_id as the value.
+        // We need to use the actual width and height from the mode config.
+        // Source coordinates are in 16.16 fixed point.
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.src_w.object_id, pPropertyIDs->plane.src_w.id, (uint64_t)pConfig->width << 16);
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.src_h.object_id, pPropertyIDs->plane.src_h.id, (uint64_t)pConfig->height << 16);
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.crtc_w.object_id, pPropertyIDs->plane.crtc_w.id, pConfig->width);
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.crtc_h.object_id, pPropertyIDs->plane.crtc_h.id, pConfig->height);
+        // ----------------------------------------------------------------
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.src_x.object_id, pPropertyIDs->plane.src_x.id, 0);
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.src_y.object_id, pPropertyIDs->plane.src_y.id, 0);
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.crtc_x.object_id, pPropertyIDs->plane.crtc_x.id, 0);
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.crtc_y.object_id, pPropertyIDs->plane.crtc_y.id, 0);
+    }
 
     drmModeAtomicAddProperty(pAtomic, pPropertyIDs->mode_id.object_id, pPropertyIDs->mode_id.id, modeID);
     drmModeAtomicAddProperty(pAtomic, pPropertyIDs->active.object_id, pPropertyIDs->active.id, 1);
     drmModeAtomicAddProperty(pAtomic, pPropertyIDs->connector_crtc_id.object_id, pPropertyIDs->connector_crtc_id.id, pConfig->crtcID);
-    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->fb_id.object_id, pPropertyIDs->fb_id.id, fb);
-    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->crtc_id.object_id, pPropertyIDs->crtc_id.id, pConfig->crtcID);
+    if (pPropertyIDs->vrr_enabled.id) {
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->vrr_enabled.object_id, pPropertyIDs->vrr_enabled.id, vrr_enabled);
+    }
+    if (fb) {
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.fb_id.object_id, pPropertyIDs->plane.fb_id.id, fb);
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->plane.crtc_id.object_id, pPropertyIDs->plane.crtc_id.id, pConfig->crtcID);
+    }
     
     if (hdr_enabled) {
         if (pPropertyIDs->eotf.id) {
-            // Get the enum value for "PQ (Perceptual Quantizer)"
-            uint64_t pq_value = GetEnumValue(drmFd, pPropertyIDs->eotf.id, "PQ (Perceptual Quantizer)");
-            if (pq_value) {
-                drmModeAtomicAddProperty(pAtomic, pPropertyIDs->eotf.object_id, pPropertyIDs->eotf.id, pq_value);
+            if (pPropertyIDs->has_eotf_pq) {
+                drmModeAtomicAddProperty(pAtomic, pPropertyIDs->eotf.object_id, pPropertyIDs->eotf.id, pPropertyIDs->eotf_pq);
             } else {
                  Warning("Could not find 'PQ (Perceptual Quantizer)' enum for NV_CRTC_REGAMMA_TF.\n");
             }
@@ -356,57 +605,38 @@ static void AssignAtomicRequest(int drmFd,
         }
 
         if (pPropertyIDs->hdr_output_metadata.id) {
-            uint32_t blob_id = CreateHdrMetadataBlob(drmFd);
-            if (blob_id) {
-                drmModeAtomicAddProperty(pAtomic, pPropertyIDs->hdr_output_metadata.object_id, pPropertyIDs->hdr_output_metadata.id, blob_id);
+            if (hdrMetadataID) {
+                drmModeAtomicAddProperty(pAtomic, pPropertyIDs->hdr_output_metadata.object_id, pPropertyIDs->hdr_output_metadata.id, hdrMetadataID);
             }
         } else {
             Warning("HDR_OUTPUT_METADATA property not found.\n");
         }
+    } else if (hdr_was_enabled) {
+        // Back to what the CRTC and connector used before HDR was enabled
+        if (pPropertyIDs->eotf.id) {
+            drmModeAtomicAddProperty(pAtomic, pPropertyIDs->eotf.object_id, pPropertyIDs->eotf.id, pPropertyIDs->eotf.initial_value);
+        }
+        if (pPropertyIDs->colorspace.id) {
+            drmModeAtomicAddProperty(pAtomic, pPropertyIDs->colorspace.object_id, pPropertyIDs->colorspace.id, pPropertyIDs->colorspace.initial_value);
+        }
+        if (pPropertyIDs->hdr_output_metadata.id) {
+            drmModeAtomicAddProperty(pAtomic, pPropertyIDs->hdr_output_metadata.object_id, pPropertyIDs->hdr_output_metadata.id, 0);
+        }
     }
 }
-static void PickConfig(int drmFd, int desired_width, int desired_height, int desired_refresh, struct Config *pConfig)
-{
-    drmModeResPtr pModeRes;
-    int ret;
-
-    ret = drmSetClientCap(drmFd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
-
-    if (ret != 0) {
-        Fatal("DRM_CLIENT_CAP_UNIVERSAL_PLANES not available.\n");
-    }
-
-    ret = drmSetClientCap(drmFd, DRM_CLIENT_CAP_ATOMIC, 1);
-
-    if (ret != 0) {
-        Fatal("DRM_CLIENT_CAP_ATOMIC not available.\n");
-    }
-
-    pModeRes = drmModeGetResources(drmFd);
-
-    if (pModeRes == NULL) {
-        Fatal("Unable to query DRM-KMS resources.\n");
-    }
-
-    PickConnector(drmFd, pModeRes, desired_width, desired_height, desired_refresh, pConfig);
-
-    PickPlane(drmFd, pConfig);
-
-    drmModeFreeResources(pModeRes);
 
-    pConfig->width = pConfig->mode.hdisplay;
-    pConfig->height = pConfig->mode.vdisplay;
-}
-static uint32_t CreateFb(int drmFd, const struct Config *pConfig)
+/*
+ * Create a dumb buffer and an fb for it, without mapping it; its contents
+ * are undefined.
+ */
+static void AllocFb(int drmFd, int width, int height, struct KmsFb *pFb)
 {
     struct drm_mode_create_dumb createRequest = { 0 };
-    struct drm_mode_map_dumb mapRequest = { 0 };
-    uint8_t *map;
     uint32_t fb = 0;
     int ret;
 
-    createRequest.width = pConfig->width;
-    createRequest.height = pConfig->height;
+    createRequest.width = width;
+    createRequest.height = height;
     createRequest.bpp = 32;
 
     ret = drmIoctl(drmFd, DRM_IOCTL_MODE_CREATE_DUMB, &createRequest);
@@ -414,70 +644,1441 @@ static uint32_t CreateFb(int drmFd, const struct Config *pConfig)
         Fatal("Unable to create dumb buffer.\n");
     }
 
-    ret = drmModeAddFB(drmFd, pConfig->width, pConfig->height, 24, 32,
+    ret = drmModeAddFB(drmFd, width, height, 24, 32,
                        createRequest.pitch, createRequest.handle, &fb);
     if (ret) {
         Fatal("Unable to add fb.\n");
     }
 
-    mapRequest.handle = createRequest.handle;
+    pFb->id = fb;
+    pFb->handle = createRequest.handle;
+    pFb->size = createRequest.size;
+}
+
+/*
+ * Create a cleared dumb buffer to scan out until a stream's first frame
+ * arrives.  It is only mapped while it is being cleared, so that it
+ * takes no address space or resident memory in this process.
+ */
+static void CreateFb(int drmFd, int width, int height, struct KmsFb *pFb)
+{
+    struct drm_mode_map_dumb mapRequest = { 0 };
+    uint8_t *map;
+    int ret;
+
+    AllocFb(drmFd, width, height, pFb);
+
+    mapRequest.handle = pFb->handle;
 
     ret = drmIoctl(drmFd, DRM_IOCTL_MODE_MAP_DUMB, &mapRequest);
     if (ret) {
         Fatal("Unable to map dumb buffer.\n");
     }
 
-    map = mmap(0, createRequest.size, PROT_READ | PROT_WRITE, MAP_SHARED,
-               drmFd, mapRequest.offset);
+    map = mmap(0, pFb->size, PROT_READ | PROT_WRITE, MAP_SHARED, drmFd, mapRequest.offset);
     if (map == MAP_FAILED) {
         Fatal("Failed to mmap(2) fb.\n");
     }
 
-    memset(map, 0, createRequest.size);
+    memset(map, 0, pFb->size);
+    munmap(map, pFb->size);
+}
+
+static void DestroyFb(int drmFd, struct KmsFb *pFb)
+{
+    struct drm_mode_destroy_dumb destroyRequest = { 0 };
+
+    if (pFb->id == 0) {
+        return;
+    }
+
+    drmModeRmFB(drmFd, pFb->id);
 
-    return fb;
+    destroyRequest.handle = pFb->handle;
+    drmIoctl(drmFd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroyRequest);
+
+    memset(pFb, 0, sizeof(*pFb));
 }
-static uint32_t CreateModeID(int drmFd, const struct Config *pConfig)
+
+/*
+ * Make the test fb at least width x height; it is never shown, so it
+ * is left uncleared.
+ */
+static void GrowTestFb(int drmFd, struct KmsTestFb *pTestFb, int width, int height)
 {
-    uint32_t modeID = 0;
-    int ret = drmModeCreatePropertyBlob(drmFd,
-                                        &pConfig->mode, sizeof(pConfig->mode),
-                                        &modeID);
-    if (ret != 0) {
+    if (pTestFb->fb.id != 0 && width <= pTestFb->width && height <= pTestFb->height) {
+        return;
+    }
+
+    if (width < pTestFb->width) {
+        width = pTestFb->width;
+    }
+    if (height < pTestFb->height) {
+        height = pTestFb->height;
+    }
+
+    DestroyFb(drmFd, &pTestFb->fb);
+    AllocFb(drmFd, width, height, &pTestFb->fb);
+    pTestFb->width = width;
+    pTestFb->height = height;
+}
+
+static uint32_t CreateModeID(struct KmsBlobCache *pBlobCache, const struct Config *pConfig)
+{
+    uint32_t modeID = AcquireBlob(pBlobCache, &pConfig->mode, sizeof(pConfig->mode));
+
+    if (modeID == 0) {
         Fatal("Failed to create mode property.\n");
     }
 
     return modeID;
 }
-void SetMode(int drmFd, int desired_width, int desired_height, int desired_refresh, int hdr_enabled,
-             uint32_t *pPlaneID, int *pWidth, int *pHeight)
+
+/*
+ * Ask the kernel whether it would accept the modes of configs[] all at
+ * once, e.g. within the pixel clock limits of the CRTCs and the
+ * bandwidth they share, without touching the hardware.  Each primary
+ * plane shows testFb over the whole mode, as it will show a dumb buffer
+ * of the mode's size in the real commit, since drivers check the plane
+ * state against the mode too.  The MODE_ID blobs are kept in modeIDs[],
+ * so that the real commit reuses them.
+ */
+static int TestModeset(int drmFd, struct KmsDevice *pDevice,
+                       const struct Config *configs, int count, uint32_t *modeIDs,
+                       uint32_t testFb)
 {
-    struct Config config = { 0 };
-    struct PropertyIDs propertyIDs = { 0 };
     drmModeAtomicReqPtr pAtomic;
-    uint32_t modeID, fb;
-    int ret;
-    const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_NONBLOCK;
+    int ret, i;
 
-    PickConfig(drmFd, desired_width, desired_height, desired_refresh, &config);
-    AssignPropertyIDs(drmFd, &config, &propertyIDs);
-
-    modeID = CreateModeID(drmFd, &config);
-    fb = CreateFb(drmFd, &config);
     pAtomic = drmModeAtomicAlloc();
-    
-    AssignAtomicRequest(drmFd, pAtomic, &config, &propertyIDs, modeID, fb, hdr_enabled);
 
-    ret = drmModeAtomicCommit(drmFd, pAtomic, flags, NULL);
+    if (pAtomic == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    for (i = 0; i < count; i++) {
+        struct PropertyIDs propertyIDs = { 0 };
+
+        AssignPropertyIDs(&pDevice->propertyCache, &configs[i], &propertyIDs);
+
+        if (modeIDs[i] == 0) {
+            modeIDs[i] = CreateModeID(&pDevice->blobCache, &configs[i]);
+        }
+
+        AssignAtomicRequest(pAtomic, &configs[i], &propertyIDs, modeIDs[i], 0, testFb,
+                            0, 0, 0);
+    }
+
+    ret = drmModeAtomicCommit(drmFd, pAtomic,
+                              DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
     drmModeAtomicFree(pAtomic);
 
+    return ret;
+}
+
+/*
+ * Pick the mode of configs[count - 1]: the best ranked of modes[] that
+ * passes a test-only commit together with the configs before it.  If
+ * none does, the best ranked one is used anyway, and the real commit
+ * reports the error.  modeIDs[count - 1] gets a reference to its
+ * MODE_ID blob.  pTestFb is grown as needed, for the caller to destroy.
+ */
+static void PickMode(int drmFd, struct KmsDevice *pDevice,
+                     struct Config *configs, uint32_t *modeIDs, int count,
+                     const drmModeModeInfo *modes, int modeCount, struct KmsTestFb *pTestFb)
+{
+    struct Config *pConfig = &configs[count - 1];
+    int i;
+
+    for (i = 0; i < modeCount; i++) {
+        pConfig->mode = modes[i];
+        pConfig->width = modes[i].hdisplay;
+        pConfig->height = modes[i].vdisplay;
+        modeIDs[count - 1] = 0;
+
+        GrowTestFb(drmFd, pTestFb, pConfig->width, pConfig->height);
+
+        if (TestModeset(drmFd, pDevice, configs, count, modeIDs, pTestFb->fb.id) == 0) {
+            break;
+        }
+
+        ReleaseBlob(&pDevice->blobCache, modeIDs[count - 1]);
+    }
+
+    if (i == modeCount) {
+        Warning("No mode of connector %u passed a test commit.\n", pConfig->connectorID);
+        pConfig->mode = modes[0];
+        modeIDs[count - 1] = CreateModeID(&pDevice->blobCache, pConfig);
+    }
+
+    if (pDevice->desiredWidth > 0 &&
+        (pConfig->mode.hdisplay != pDevice->desiredWidth ||
+         pConfig->mode.vdisplay != pDevice->desiredHeight ||
+         (pDevice->desiredRefresh > 0 &&
+          fabs(ModeRefreshRate(&pConfig->mode) - pDevice->desiredRefresh) >= 0.5))) {
+        printf("Desired mode (%dx%d @ %dHz) not found on connector %u. Using %dx%d @ %.2fHz.\n",
+               pDevice->desiredWidth, pDevice->desiredHeight, pDevice->desiredRefresh,
+               pConfig->connectorID, pConfig->mode.hdisplay, pConfig->mode.vdisplay,
+               ModeRefreshRate(&pConfig->mode));
+    }
+
+    pConfig->width = pConfig->mode.hdisplay;
+    pConfig->height = pConfig->mode.vdisplay;
+}
+
+/*
+ * Pick a connector, CRTC, mode and primary plane for up to maxConfigs
+ * connected displays.  Returns how many were found; modeIDs[] holds a
+ * reference to each one's MODE_ID blob, for the caller to release.
+ *
+ * Each display gets the best ranked of its modes (see RankModes()) that
+ * passes a test-only commit together with the displays picked before
+ * it.  If none does, the best ranked one is used anyway, and the real
+ * commit reports the error.
+ */
+static int PickConfigs(int drmFd, struct KmsDevice *pDevice,
+                       struct Config *configs, uint32_t *modeIDs, int maxConfigs)
+{
+    drmModeResPtr pModeRes;
+    drmModeModeInfo *modes = NULL;
+    struct KmsTestFb testFb = { 0 };
+    uint32_t usedCrtcs = 0;
+    int next = 0, count = 0;
+    int modeCount, ret;
+
+    ret = drmSetClientCap(drmFd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+
     if (ret != 0) {
-        Fatal("Failed to set mode. Error: %s\n", strerror(-ret));
+        Fatal("DRM_CLIENT_CAP_UNIVERSAL_PLANES not available.\n");
+    }
+
+    ret = drmSetClientCap(drmFd, DRM_CLIENT_CAP_ATOMIC, 1);
+
+    if (ret != 0) {
+        Fatal("DRM_CLIENT_CAP_ATOMIC not available.\n");
+    }
+
+    pModeRes = drmModeGetResources(drmFd);
+
+    if (pModeRes == NULL) {
+        Fatal("Unable to query DRM-KMS resources.\n");
+    }
+
+    while (count < maxConfigs &&
+           (modeCount = PickConnector(drmFd, pModeRes, &next, usedCrtcs,
+                                      pDevice->desiredWidth, pDevice->desiredHeight,
+                                      pDevice->desiredRefresh,
+                                      &configs[count], &modes)) > 0) {
+        usedCrtcs |= 1 << configs[count].crtcIndex;
+
+        PickPlane(drmFd, &pDevice->propertyCache, &configs[count]);
+        PickMode(drmFd, pDevice, configs, modeIDs, count + 1, modes, modeCount, &testFb);
+
+        free(modes);
+        count++;
+    }
+
+    drmModeFreeResources(pModeRes);
+    DestroyFb(drmFd, &testFb.fb);
+
+    if (count == 0) {
+        Fatal("Could not find a suitable connector.\n");
     }
 
-    *pPlaneID = config.planeID;
-    *pWidth = config.width;
-    *pHeight = config.height;
+    return count;
+}
+
+// Whether two modes have the same timings, whatever their names and types
+static int ModesMatch(const drmModeModeInfo *pA, const drmModeModeInfo *pB)
+{
+    return pA->clock == pB->clock &&
+           pA->hdisplay == pB->hdisplay && pA->hsync_start == pB->hsync_start &&
+           pA->hsync_end == pB->hsync_end && pA->htotal == pB->htotal &&
+           pA->hskew == pB->hskew &&
+           pA->vdisplay == pB->vdisplay && pA->vsync_start == pB->vsync_start &&
+           pA->vsync_end == pB->vsync_end && pA->vtotal == pB->vtotal &&
+           pA->vscan == pB->vscan && pA->flags == pB->flags;
+}
+
+/*
+ * Whether the head's CRTC is already scanning out its mode on its
+ * connector, through its primary plane, as the console leaves it after
+ * boot.  If so, *pFb is set to the fb being scanned out, so that the
+ * plane can be taken over without a modeset.
+ */
+static int IsScanningOut(struct KmsOutput *pOutput, uint32_t *pFb)
+{
+    const struct PropertyIDs *pPropertyIDs = &pOutput->propertyIDs;
+    const struct Config *pConfig = &pOutput->config;
+    drmModeCrtcPtr pCrtc;
+    int match;
+
+    if (pPropertyIDs->connector_crtc_id.initial_value != pConfig->crtcID ||
+        pPropertyIDs->plane.crtc_id.initial_value != pConfig->crtcID ||
+        pPropertyIDs->plane.fb_id.initial_value == 0 ||
+        !pPropertyIDs->active.initial_value) {
+        return 0;
+    }
+
+    pCrtc = drmModeGetCrtc(pOutput->drmFd, pConfig->crtcID);
+
+    if (pCrtc == NULL) {
+        return 0;
+    }
+
+    match = pCrtc->mode_valid && ModesMatch(&pCrtc->mode, &pConfig->mode);
+
+    drmModeFreeCrtc(pCrtc);
+
+    if (match) {
+        *pFb = pPropertyIDs->plane.fb_id.initial_value;
+    }
 
-    printf("Mode set to %dx%d @ %dHz\n", config.width, config.height, config.mode.vrefresh);
-}
\ No newline at end of file
+    return match;
+}
+
+/*
+ * Commit the CRTC and connector state of the given heads (and their
+ * planes', for those with an fb) in a single atomic request, keeping
+ * references to the MODE_ID and HDR_OUTPUT_METADATA blobs the new state
+ * uses and dropping those of the state it replaced.
+ */
+static int CommitModeset(struct KmsOutput **outputs, int count, const uint32_t *fbs,
+                         int hdr_enabled, uint32_t flags)
+{
+    uint32_t modeIDs[KMS_MAX_HEADS], hdrMetadataIDs[KMS_MAX_HEADS];
+    drmModeAtomicReqPtr pAtomic;
+    int ret, i;
+
+    pAtomic = drmModeAtomicAlloc();
+
+    if (pAtomic == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    for (i = 0; i < count; i++) {
+        struct KmsOutput *pOutput = outputs[i];
+        struct KmsBlobCache *pBlobCache = &pOutput->pDevice->blobCache;
+
+        modeIDs[i] = CreateModeID(pBlobCache, &pOutput->config);
+        hdrMetadataIDs[i] = 0;
+        if (hdr_enabled && pOutput->propertyIDs.hdr_output_metadata.id) {
+            hdrMetadataIDs[i] = CreateHdrMetadataBlob(pBlobCache);
+        }
+
+        AssignAtomicRequest(pAtomic, &pOutput->config, &pOutput->propertyIDs,
+                            modeIDs[i], hdrMetadataIDs[i], fbs[i],
+                            hdr_enabled, pOutput->hdrEnabled, pOutput->vrrEnabled);
+    }
+
+    ret = drmModeAtomicCommit(outputs[0]->drmFd, pAtomic, flags, NULL);
+    drmModeAtomicFree(pAtomic);
+
+    for (i = 0; i < count; i++) {
+        struct KmsOutput *pOutput = outputs[i];
+        struct KmsBlobCache *pBlobCache = &pOutput->pDevice->blobCache;
+
+        if (ret != 0) {
+            ReleaseBlob(pBlobCache, modeIDs[i]);
+            ReleaseBlob(pBlobCache, hdrMetadataIDs[i]);
+            continue;
+        }
+
+        ReleaseBlob(pBlobCache, pOutput->modeBlob);
+        ReleaseBlob(pBlobCache, pOutput->hdrMetadataBlob);
+        pOutput->modeBlob = modeIDs[i];
+        pOutput->hdrMetadataBlob = hdrMetadataIDs[i];
+        pOutput->hdrEnabled = hdr_enabled;
+    }
+
+    return ret;
+}
+
+/*
+ * Read the vertical refresh range from the display range limits
+ * descriptor of an EDID.  Returns 0 if there is none.
+ */
+static int GetEdidRefreshRange(const drmModePropertyBlobRes *pBlob,
+                               double *pMinRefresh, double *pMaxRefresh)
+{
+    const uint8_t *edid;
+    int found = 0, i;
+
+    if (pBlob == NULL) {
+        return 0;
+    }
+
+    edid = pBlob->data;
+
+    // The four 18-byte descriptors of the base block
+    for (i = 0; i < 4 && pBlob->length >= 128 && !found; i++) {
+        const uint8_t *pDescriptor = &edid[54 + 18 * i];
+
+        if (pDescriptor[0] == 0 && pDescriptor[1] == 0 && pDescriptor[3] == 0xfd) {
+            // EDID 1.4 adds 255 to the rates according to byte 4.
+            *pMinRefresh = pDescriptor[5] + ((pDescriptor[4] & 0x3) == 0x3 ? 255 : 0);
+            *pMaxRefresh = pDescriptor[6] + ((pDescriptor[4] & 0x2) ? 255 : 0);
+            found = 1;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Decide whether the head can use adaptive sync, and over which range:
+ * the connector must report vrr_capable and the CRTC have VRR_ENABLED.
+ * The range comes from the EDID, capped at the mode's refresh rate, the
+ * fastest the panel is ever driven at; the minimum is 0 if unknown.
+ */
+static int SetUpVrr(struct KmsOutput *pOutput, struct KmsHead *pHead)
+{
+    const struct PropertyIDs *pPropertyIDs = &pOutput->propertyIDs;
+    double modeRefresh = ModeRefreshRate(&pOutput->config.mode);
+    double minRefresh = 0.0, maxRefresh = modeRefresh;
+
+    if (!pPropertyIDs->vrr_capable.initial_value || pPropertyIDs->vrr_enabled.id == 0) {
+        Warning("Connector %u does not support adaptive sync.\n", pOutput->config.connectorID);
+        return 0;
+    }
+
+    GetEdidRefreshRange(pOutput->edid, &minRefresh, &maxRefresh);
+
+    pHead->vrrMinRefresh = minRefresh;
+    pHead->vrrMaxRefresh = maxRefresh < modeRefresh ? maxRefresh : modeRefresh;
+
+    return 1;
+}
+
+static struct KmsOutput *NewOutput(struct KmsDevice *pDevice, const struct Config *pConfig)
+{
+    struct KmsOutput *pOutput = calloc(1, sizeof(*pOutput));
+
+    if (pOutput == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    pOutput->drmFd = pDevice->drmFd;
+    pOutput->pDevice = pDevice;
+    pOutput->config = *pConfig;
+    AssignPropertyIDs(&pDevice->propertyCache, &pOutput->config, &pOutput->propertyIDs);
+
+    /*
+     * The kernel replaces the EDID blob on every probe, and may free the
+     * old one, so the EDID is copied for ProbeConnectors() to compare.
+     */
+    if (pOutput->propertyIDs.edid.initial_value != 0) {
+        pOutput->edid = drmModeGetPropertyBlob(pDevice->drmFd,
+                                               pOutput->propertyIDs.edid.initial_value);
+    }
+
+    // The commit that lights it up puts the whole plane on the CRTC.
+    pOutput->planeRect.width = pConfig->width;
+    pOutput->planeRect.height = pConfig->height;
+    pOutput->pendingPlaneRect = pOutput->planeRect;
+
+    return pOutput;
+}
+
+// Fill in the head of a committed output, and print its mode.
+static void DescribeHead(struct KmsOutput *pOutput, int kept, struct KmsHead *pHead)
+{
+    pHead->pDevice = pOutput->pDevice;
+    pHead->pOutput = pOutput;
+    pHead->connectorID = pOutput->config.connectorID;
+    pHead->planeID = pOutput->config.planeID;
+    pHead->width = pOutput->config.width;
+    pHead->height = pOutput->config.height;
+    pHead->vrr = pOutput->vrrEnabled;
+
+    printf("%s %dx%d @ %.2fHz on connector %u",
+           kept ? "Mode kept at" : "Mode set to",
+           pOutput->config.width, pOutput->config.height,
+           ModeRefreshRate(&pOutput->config.mode), pOutput->config.connectorID);
+    if (pOutput->vrrEnabled) {
+        printf(", adaptive sync %.0f-%.0fHz", pHead->vrrMinRefresh, pHead->vrrMaxRefresh);
+    }
+    printf("\n");
+}
+
+/*
+ * Light up every connected display, up to maxHeads of them, with one
+ * atomic commit, and describe each in heads[].  Returns the number of
+ * heads, which is at least one.
+ *
+ * Each head has its own CRTC and primary plane; the desired mode is
+ * looked for on each of them.  With vrr_enabled, adaptive sync is
+ * switched on in the same commit for the heads that support it.
+ *
+ * Heads that are already showing their mode, e.g. on the console, keep
+ * the fb they are scanning out until the first frame replaces it, so
+ * that they don't go blank.  If none needs a modeset, the commit is made
+ * without DRM_MODE_ATOMIC_ALLOW_MODESET, and the full modeset is only
+ * made if the driver refuses it.
+ */
+int SetMode(int drmFd, int desired_width, int desired_height, int desired_refresh,
+            int hdr_enabled, int vrr_enabled, struct KmsHead *heads, int maxHeads)
+{
+    struct Config configs[KMS_MAX_HEADS];
+    struct KmsOutput *outputs[KMS_MAX_HEADS];
+    uint32_t fbs[KMS_MAX_HEADS] = { 0 }, modeIDs[KMS_MAX_HEADS];
+    int kept[KMS_MAX_HEADS];
+    struct KmsDevice *pDevice;
+    int count, modeset = 0, ret, i;
+    const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_NONBLOCK;
+
+    pDevice = calloc(1, sizeof(*pDevice));
+
+    if (pDevice == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    if (maxHeads > KMS_MAX_HEADS) {
+        maxHeads = KMS_MAX_HEADS;
+    }
+
+    pDevice->drmFd = drmFd;
+    pthread_mutex_init(&pDevice->lock, NULL);
+    InitPropertyCache(&pDevice->propertyCache, drmFd);
+    InitBlobCache(&pDevice->blobCache, drmFd);
+    pDevice->maxOutputs = maxHeads;
+    pDevice->desiredWidth = desired_width;
+    pDevice->desiredHeight = desired_height;
+    pDevice->desiredRefresh = desired_refresh;
+    pDevice->hdrEnabled = hdr_enabled;
+    pDevice->vrrEnabled = vrr_enabled;
+
+    count = PickConfigs(drmFd, pDevice, configs, modeIDs, maxHeads);
+
+    for (i = 0; i < count; i++) {
+        struct KmsOutput *pOutput = NewOutput(pDevice, &configs[i]);
+
+        memset(&heads[i], 0, sizeof(heads[i]));
+        if (vrr_enabled) {
+            pOutput->vrrEnabled = SetUpVrr(pOutput, &heads[i]);
+        }
+
+        kept[i] = IsScanningOut(pOutput, &fbs[i]);
+        if (!kept[i]) {
+            CreateFb(drmFd, pOutput->config.width, pOutput->config.height, &pOutput->initialFb);
+            fbs[i] = pOutput->initialFb.id;
+            modeset = 1;
+        }
+        outputs[i] = pOutput;
+    }
+
+    if (modeset) {
+        ret = CommitModeset(outputs, count, fbs, hdr_enabled, flags);
+    } else {
+        // The driver refuses this if anything else, e.g. HDR, needs a modeset.
+        ret = CommitModeset(outputs, count, fbs, hdr_enabled, DRM_MODE_ATOMIC_NONBLOCK);
+
+        if (ret != 0) {
+            for (i = 0; i < count; i++) {
+                CreateFb(drmFd, outputs[i]->config.width, outputs[i]->config.height,
+                         &outputs[i]->initialFb);
+                fbs[i] = outputs[i]->initialFb.id;
+                kept[i] = 0;
+            }
+            ret = CommitModeset(outputs, count, fbs, hdr_enabled, flags);
+        }
+    }
+
+    // The committed state holds its own references now
+    for (i = 0; i < count; i++) {
+        ReleaseBlob(&pDevice->blobCache, modeIDs[i]);
+    }
+
+    if (ret != 0) {
+        Fatal("Failed to set mode. Error: %s\n", strerror(-ret));
+    }
+
+    for (i = 0; i < count; i++) {
+        pDevice->outputs[pDevice->outputCount++] = outputs[i];
+        DescribeHead(outputs[i], kept[i], &heads[i]);
+    }
+
+    return count;
+}
+
+static struct KmsOutput *FindOutput(const struct KmsDevice *pDevice, uint32_t connectorID)
+{
+    int i;
+
+    for (i = 0; i < pDevice->outputCount; i++) {
+        if (pDevice->outputs[i]->config.connectorID == connectorID) {
+            return pDevice->outputs[i];
+        }
+    }
+
+    return NULL;
+}
+
+// The value of a property in a connector's drmModeConnector, or 0
+static uint64_t GetConnectorValue(drmModeConnectorPtr pConnector, uint32_t propID)
+{
+    int i;
+
+    for (i = 0; i < pConnector->count_props; i++) {
+        if (pConnector->props[i] == propID) {
+            return pConnector->prop_values[i];
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Whether the connector now reports another display than the output was
+ * set up for.  Blob IDs are only a shortcut: the same display gets a new
+ * EDID blob each time it is probed, so the contents are compared.
+ */
+static int EdidChanged(const struct KmsOutput *pOutput, drmModeConnectorPtr pConnector)
+{
+    drmModePropertyBlobPtr pBlob;
+    uint64_t blobID;
+    int changed;
+
+    if (pOutput->propertyIDs.edid.id == 0) {
+        return 0;
+    }
+
+    blobID = GetConnectorValue(pConnector, pOutput->propertyIDs.edid.id);
+    if (blobID == pOutput->propertyIDs.edid.initial_value) {
+        return 0;
+    }
+    if (blobID == 0 || pOutput->edid == NULL) {
+        return 1;
+    }
+
+    pBlob = drmModeGetPropertyBlob(pOutput->drmFd, blobID);
+    changed = pBlob == NULL || pBlob->length != pOutput->edid->length ||
+              memcmp(pBlob->data, pOutput->edid->data, pBlob->length) != 0;
+    drmModeFreePropertyBlob(pBlob);
+
+    return changed;
+}
+
+/*
+ * Compare the connectors of the device's DRM fd with its heads, after
+ * a hotplug event, and list in changes[] (up to maxChanges) those whose
+ * head must be added, removed, or replaced because another display was
+ * plugged in between two probes.  Returns how many were listed.
+ *
+ * Only connectorID is looked at if it is not 0, e.g. when the event
+ * names the connector; that one is probed again, which can take tens
+ * of milliseconds to read the EDID over DDC.  Otherwise, every connector
+ * is checked against the state the kernel already has, without probing.
+ */
+static int ProbeConnectors(struct KmsDevice *pDevice, uint32_t connectorID,
+                           struct KmsConnectorChange *changes, int maxChanges)
+{
+    drmModeResPtr pModeRes = NULL;
+    int count = 0, total = 1, i;
+
+    if (connectorID == 0) {
+        pModeRes = drmModeGetResources(pDevice->drmFd);
+
+        if (pModeRes == NULL) {
+            Warning("Unable to query DRM-KMS resources.\n");
+            return 0;
+        }
+        total = pModeRes->count_connectors;
+    }
+
+    for (i = 0; i < total && count < maxChanges; i++) {
+        uint32_t id = pModeRes ? pModeRes->connectors[i] : connectorID;
+        struct KmsOutput *pOutput = FindOutput(pDevice, id);
+        drmModeConnectorPtr pConnector = pModeRes ?
+            drmModeGetConnectorCurrent(pDevice->drmFd, id) :
+            drmModeGetConnector(pDevice->drmFd, id);
+        int connected = pConnector && pConnector->connection == DRM_MODE_CONNECTED;
+
+        changes[count].connectorID = id;
+
+        if (pOutput != NULL && !connected) {
+            changes[count++].type = KMS_CONNECTOR_UNPLUGGED;
+        } else if (pOutput != NULL && EdidChanged(pOutput, pConnector)) {
+            changes[count++].type = KMS_CONNECTOR_REPLACED;
+        } else if (pOutput == NULL && connected) {
+            changes[count++].type = KMS_CONNECTOR_PLUGGED;
+        }
+
+        drmModeFreeConnector(pConnector);
+    }
+
+    drmModeFreeResources(pModeRes);
+
+    return count;
+}
+
+int KmsProbeConnectors(struct KmsDevice *pDevice, uint32_t connectorID,
+                       struct KmsConnectorChange *changes, int maxChanges)
+{
+    int count;
+
+    pthread_mutex_lock(&pDevice->lock);
+    count = ProbeConnectors(pDevice, connectorID, changes, maxChanges);
+    pthread_mutex_unlock(&pDevice->lock);
+
+    return count;
+}
+
+/*
+ * Light up a display plugged in after SetMode(), the way SetMode() would
+ * have, on a CRTC and primary plane no other head uses, and describe it
+ * in *pHead.  The other heads keep running: only the new CRTC, its
+ * connector and plane are in the commit.  Returns 0 on success, or a
+ * negative errno, e.g. -ENOSPC if no CRTC is left.
+ */
+static int AddHead(struct KmsDevice *pDevice, uint32_t connectorID, struct KmsHead *pHead)
+{
+    struct KmsPropertyCache *pCache = &pDevice->propertyCache;
+    struct Config config = { 0 };
+    struct KmsOutput *pOutput;
+    drmModeResPtr pModeRes;
+    drmModeModeInfo *modes = NULL;
+    struct KmsTestFb testFb = { 0 };
+    uint32_t usedCrtcs = 0, modeID = 0, fb;
+    int modeCount, ret, i;
+
+    if (pDevice->outputCount == pDevice->maxOutputs) {
+        return -ENOSPC;
+    }
+
+    for (i = 0; i < pDevice->outputCount; i++) {
+        usedCrtcs |= 1 << pDevice->outputs[i]->config.crtcIndex;
+    }
+
+    pModeRes = drmModeGetResources(pDevice->drmFd);
+
+    if (pModeRes == NULL) {
+        return -errno;
+    }
+
+    modeCount = PickCrtc(pDevice->drmFd, pModeRes, connectorID, usedCrtcs,
+                         pDevice->desiredWidth, pDevice->desiredHeight,
+                         pDevice->desiredRefresh, &config, &modes);
+    drmModeFreeResources(pModeRes);
+
+    if (modeCount == 0) {
+        return config.connectorID ? -ENOSPC : -ENODEV;
+    }
+
+    // What was cached for these objects is from before the display left.
+    InvalidatePropertyTable(pCache, connectorID, DRM_MODE_OBJECT_CONNECTOR);
+    InvalidatePropertyTable(pCache, config.crtcID, DRM_MODE_OBJECT_CRTC);
+
+    PickPlane(pDevice->drmFd, pCache, &config);
+    InvalidatePropertyTable(pCache, config.planeID, DRM_MODE_OBJECT_PLANE);
+
+    PickMode(pDevice->drmFd, pDevice, &config, &modeID, 1, modes, modeCount, &testFb);
+    DestroyFb(pDevice->drmFd, &testFb.fb);
+    free(modes);
+
+    pOutput = NewOutput(pDevice, &config);
+
+    memset(pHead, 0, sizeof(*pHead));
+    if (pDevice->vrrEnabled) {
+        pOutput->vrrEnabled = SetUpVrr(pOutput, pHead);
+    }
+
+    CreateFb(pDevice->drmFd, config.width, config.height, &pOutput->initialFb);
+    fb = pOutput->initialFb.id;
+
+    ret = CommitModeset(&pOutput, 1, &fb, pDevice->hdrEnabled,
+                        DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_NONBLOCK);
+    ReleaseBlob(&pDevice->blobCache, modeID);
+
+    if (ret != 0) {
+        Warning("Failed to set mode on connector %u. Error: %s\n", connectorID,
+                strerror(-ret));
+        DestroyFb(pDevice->drmFd, &pOutput->initialFb);
+        drmModeFreePropertyBlob(pOutput->edid);
+        free(pOutput);
+        return ret;
+    }
+
+    pDevice->outputs[pDevice->outputCount++] = pOutput;
+    DescribeHead(pOutput, 0, pHead);
+
+    return 0;
+}
+
+int KmsAddHead(struct KmsDevice *pDevice, uint32_t connectorID, struct KmsHead *pHead)
+{
+    int ret;
+
+    pthread_mutex_lock(&pDevice->lock);
+    ret = AddHead(pDevice, connectorID, pHead);
+    pthread_mutex_unlock(&pDevice->lock);
+
+    return ret;
+}
+
+static void AddPlaneOff(drmModeAtomicReqPtr pAtomic, const struct PlanePropertyIDs *pPropertyIDs)
+{
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->fb_id.object_id, pPropertyIDs->fb_id.id, 0);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->crtc_id.object_id, pPropertyIDs->crtc_id.id, 0);
+}
+
+// Free what the output holds, and drop it from its device.
+static void FreeOutput(struct KmsOutput *pOutput)
+{
+    struct KmsDevice *pDevice = pOutput->pDevice;
+    int i, j;
+
+    DestroyFb(pOutput->drmFd, &pOutput->initialFb);
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        DestroyFb(pOutput->drmFd, &pOutput->overlays[i].fb);
+
+        for (j = 0; j < pDevice->overlayPlaneCount; j++) {
+            if (pDevice->overlayPlanes[j] == pOutput->overlays[i].planeID) {
+                pDevice->overlayPlanes[j] = pDevice->overlayPlanes[--pDevice->overlayPlaneCount];
+                break;
+            }
+        }
+    }
+
+    ReleaseBlob(&pDevice->blobCache, pOutput->modeBlob);
+    ReleaseBlob(&pDevice->blobCache, pOutput->hdrMetadataBlob);
+
+    for (i = 0; i < pDevice->outputCount; i++) {
+        if (pDevice->outputs[i] == pOutput) {
+            pDevice->outputs[i] = pDevice->outputs[--pDevice->outputCount];
+            break;
+        }
+    }
+
+    drmModeFreePropertyBlob(pOutput->edid);
+    free(pOutput);
+}
+
+/*
+ * Turn off the head's CRTC and planes, e.g. once its display has been
+ * unplugged, and free it, so that its CRTC and overlay planes can go to
+ * a head added later.  Its EGLStreams must be gone; the other heads keep
+ * running, as only this head's objects are in the commit.
+ */
+void KmsRemoveHead(struct KmsHead *pHead)
+{
+    struct KmsOutput *pOutput = pHead->pOutput;
+    struct KmsDevice *pDevice = pOutput->pDevice;
+    const struct PropertyIDs *pPropertyIDs = &pOutput->propertyIDs;
+    drmModeAtomicReqPtr pAtomic;
+    int ret, i;
+
+    pthread_mutex_lock(&pDevice->lock);
+
+    pAtomic = drmModeAtomicAlloc();
+
+    if (pAtomic == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    AddPlaneOff(pAtomic, &pPropertyIDs->plane);
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        AddPlaneOff(pAtomic, &pOutput->overlays[i].propertyIDs);
+    }
+
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->connector_crtc_id.object_id, pPropertyIDs->connector_crtc_id.id, 0);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->active.object_id, pPropertyIDs->active.id, 0);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->mode_id.object_id, pPropertyIDs->mode_id.id, 0);
+    if (pOutput->vrrEnabled) {
+        drmModeAtomicAddProperty(pAtomic, pPropertyIDs->vrr_enabled.object_id, pPropertyIDs->vrr_enabled.id, 0);
+    }
+    if (pOutput->hdrEnabled) {
+        if (pPropertyIDs->eotf.id) {
+            drmModeAtomicAddProperty(pAtomic, pPropertyIDs->eotf.object_id, pPropertyIDs->eotf.id, pPropertyIDs->eotf.initial_value);
+        }
+        if (pPropertyIDs->colorspace.id) {
+            drmModeAtomicAddProperty(pAtomic, pPropertyIDs->colorspace.object_id, pPropertyIDs->colorspace.id, pPropertyIDs->colorspace.initial_value);
+        }
+        if (pPropertyIDs->hdr_output_metadata.id) {
+            drmModeAtomicAddProperty(pAtomic, pPropertyIDs->hdr_output_metadata.object_id, pPropertyIDs->hdr_output_metadata.id, 0);
+        }
+    }
+
+    // Don't wait a frame for the CRTC to go off; the blobs and fbs are
+    // kept alive by the kernel until it has.
+    ret = drmModeAtomicCommit(pOutput->drmFd, pAtomic,
+                              DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_NONBLOCK, NULL);
+    drmModeAtomicFree(pAtomic);
+
+    if (ret != 0) {
+        Warning("Failed to turn off connector %u. Error: %s\n",
+                pOutput->config.connectorID, strerror(-ret));
+    }
+
+    FreeOutput(pOutput);
+    pHead->pOutput = NULL;
+
+    pthread_mutex_unlock(&pDevice->lock);
+}
+
+// The precise refresh rate of the mode that was set, in Hz
+double KmsGetRefreshRate(const struct KmsOutput *pOutput)
+{
+    return ModeRefreshRate(&pOutput->config.mode);
+}
+
+/*
+ * The CLOCK_MONOTONIC time of the CRTC's most recent vblank, from which
+ * later ones can be predicted with KmsGetRefreshRate().  Returns 0 on
+ * success, or a negative errno.
+ */
+int KmsGetLastVblank(const struct KmsOutput *pOutput, uint64_t *pNs)
+{
+    uint64_t sequence;
+    int ret;
+
+    // libdrm passes on the ioctl's -1, with errno set.
+    ret = drmCrtcGetSequence(pOutput->drmFd, pOutput->config.crtcID, &sequence, pNs);
+
+    return ret == -1 ? -errno : ret;
+}
+
+/*
+ * Queue a new destination rectangle for the plane.  It is applied by
+ * the next KmsCommitPendingState(), so that it takes effect together
+ * with the frame acquired right after that commit.
+ */
+void KmsSetPlaneRect(struct KmsOutput *pOutput, int x, int y, int width, int height)
+{
+    pOutput->pendingPlaneRect.x = x;
+    pOutput->pendingPlaneRect.y = y;
+    pOutput->pendingPlaneRect.width = width;
+    pOutput->pendingPlaneRect.height = height;
+
+    pOutput->dirty = memcmp(&pOutput->pendingPlaneRect, &pOutput->planeRect,
+                            sizeof(pOutput->planeRect)) != 0;
+}
+
+/*
+ * Find an overlay plane the head's CRTC can use that no head has taken,
+ * from the *pNext'th plane of the device on; *pNext is moved past it, so
+ * that the next call finds another one.
+ */
+static uint32_t FindOverlayPlane(struct KmsOutput *pOutput, uint32_t *pNext)
+{
+    struct KmsDevice *pDevice = pOutput->pDevice;
+    drmModePlaneResPtr pPlaneRes = drmModeGetPlaneResources(pOutput->drmFd);
+    uint32_t planeID = 0, i;
+    int j;
+
+    if (pPlaneRes == NULL) {
+        Fatal("Unable to query DRM-KMS plane resources\n");
+    }
+
+    for (i = *pNext; i < pPlaneRes->count_planes && planeID == 0; i++) {
+        drmModePlanePtr pPlane = drmModeGetPlane(pOutput->drmFd, pPlaneRes->planes[i]);
+        uint32_t crtcs;
+
+        if (pPlane == NULL) {
+            Fatal("Unable to query DRM-KMS plane %d\n", i);
+        }
+
+        crtcs = pPlane->possible_crtcs;
+
+        drmModeFreePlane(pPlane);
+
+        if ((crtcs & (1 << pOutput->config.crtcIndex)) == 0 ||
+            GetPropertyValue(&pDevice->propertyCache, pPlaneRes->planes[i],
+                             DRM_MODE_OBJECT_PLANE, "type") != DRM_PLANE_TYPE_OVERLAY) {
+            continue;
+        }
+
+        for (j = 0; j < pDevice->overlayPlaneCount; j++) {
+            if (pDevice->overlayPlanes[j] == pPlaneRes->planes[i]) {
+                break;
+            }
+        }
+
+        if (j == pDevice->overlayPlaneCount) {
+            planeID = pPlaneRes->planes[i];
+        }
+    }
+
+    *pNext = i;
+    drmModeFreePlaneResources(pPlaneRes);
+
+    return planeID;
+}
+
+static void AddPlaneRect(drmModeAtomicReqPtr pAtomic, const struct PlanePropertyIDs *pPropertyIDs,
+                         const struct PlaneRect *pRect)
+{
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->crtc_x.object_id, pPropertyIDs->crtc_x.id, pRect->x);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->crtc_y.object_id, pPropertyIDs->crtc_y.id, pRect->y);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->crtc_w.object_id, pPropertyIDs->crtc_w.id, pRect->width);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->crtc_h.object_id, pPropertyIDs->crtc_h.id, pRect->height);
+}
+
+// Put the given overlay plane on screen for ShowOverlay().
+static int ShowOverlayPlane(struct KmsOutput *pOutput, uint32_t planeID,
+                            int x, int y, int width, int height)
+{
+    struct KmsDevice *pDevice = pOutput->pDevice;
+    struct KmsOverlay *pOverlay;
+    const struct PlanePropertyIDs *pPropertyIDs;
+    drmModeAtomicReqPtr pAtomic;
+    int ret;
+
+    pOverlay = &pOutput->overlays[pOutput->overlayCount];
+    memset(pOverlay, 0, sizeof(*pOverlay));
+    pOverlay->planeID = planeID;
+    CreateFb(pOutput->drmFd, width, height, &pOverlay->fb);
+    pOverlay->rect.x = x;
+    pOverlay->rect.y = y;
+    pOverlay->rect.width = width;
+    pOverlay->rect.height = height;
+    pOverlay->pendingRect = pOverlay->rect;
+    pOverlay->width = width;
+    pOverlay->height = height;
+    AssignPlanePropertyIDs(&pDevice->propertyCache, planeID, &pOverlay->propertyIDs);
+    pPropertyIDs = &pOverlay->propertyIDs;
+
+    pAtomic = drmModeAtomicAlloc();
+
+    if (pAtomic == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    // Source coordinates are in 16.16 fixed point.
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->fb_id.object_id, pPropertyIDs->fb_id.id, pOverlay->fb.id);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->crtc_id.object_id, pPropertyIDs->crtc_id.id, pOutput->config.crtcID);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->src_x.object_id, pPropertyIDs->src_x.id, 0);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->src_y.object_id, pPropertyIDs->src_y.id, 0);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->src_w.object_id, pPropertyIDs->src_w.id, (uint64_t)width << 16);
+    drmModeAtomicAddProperty(pAtomic, pPropertyIDs->src_h.object_id, pPropertyIDs->src_h.id, (uint64_t)height << 16);
+    AddPlaneRect(pAtomic, pPropertyIDs, &pOverlay->rect);
+
+    ret = drmModeAtomicCommit(pOutput->drmFd, pAtomic, 0, NULL);
+    drmModeAtomicFree(pAtomic);
+
+    if (ret != 0) {
+        Warning("Failed to show overlay plane %u. Error: %s\n", planeID, strerror(-ret));
+        DestroyFb(pOutput->drmFd, &pOverlay->fb);
+        return ret;
+    }
+
+    pDevice->overlayPlanes[pDevice->overlayPlaneCount++] = planeID;
+    pOutput->overlayCount++;
+
+    return 0;
+}
+
+/*
+ * Put an overlay plane of the head's CRTC on screen at the given
+ * rectangle, with a source of the same size, so that an EGLStream of
+ * its own can be connected to it (see SetUpStreamSurface()); the display
+ * engine then composites it over the primary plane.  A plane the driver
+ * refuses leaves the next free one to try.  Returns 0 and sets *pPlaneID,
+ * or -ENOSPC if the CRTC has no overlay plane left, or the negative
+ * errno of the last plane's commit if none was accepted.
+ */
+static int ShowOverlay(struct KmsOutput *pOutput, int x, int y, int width, int height,
+                       uint32_t *pPlaneID)
+{
+    uint32_t planeID, next = 0;
+    int ret = -ENOSPC;
+
+    if (pOutput->overlayCount == KMS_MAX_OVERLAYS) {
+        return -ENOSPC;
+    }
+
+    while ((planeID = FindOverlayPlane(pOutput, &next)) != 0) {
+        ret = ShowOverlayPlane(pOutput, planeID, x, y, width, height);
+        if (ret == 0) {
+            *pPlaneID = planeID;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+int KmsShowOverlay(struct KmsOutput *pOutput, int x, int y, int width, int height,
+                   uint32_t *pPlaneID)
+{
+    int ret;
+
+    pthread_mutex_lock(&pOutput->pDevice->lock);
+    ret = ShowOverlay(pOutput, x, y, width, height, pPlaneID);
+    pthread_mutex_unlock(&pOutput->pDevice->lock);
+
+    return ret;
+}
+
+/*
+ * Like KmsSetPlaneRect(), for the overlay shown by the given call to
+ * KmsShowOverlay(), counting from 0; the source is scaled to the new
+ * rectangle.
+ */
+void KmsSetOverlayRect(struct KmsOutput *pOutput, int overlay, int x, int y, int width, int height)
+{
+    struct KmsOverlay *pOverlay = &pOutput->overlays[overlay];
+
+    pOverlay->pendingRect.x = x;
+    pOverlay->pendingRect.y = y;
+    pOverlay->pendingRect.width = width;
+    pOverlay->pendingRect.height = height;
+
+    pOverlay->dirty = memcmp(&pOverlay->pendingRect, &pOverlay->rect,
+                             sizeof(pOverlay->rect)) != 0;
+}
+
+/*
+ * Commit any KMS state queued since the last call, without a modeset.
+ *
+ * With manual stream acquisition (see AcquireFrame()), this is called
+ * after eglSwapBuffers() and before the new frame is acquired: the
+ * EGLOutputLayer consumer issues its own flip for the plane's FB_ID,
+ * so the frame cannot be part of our request, but committing without
+ * DRM_MODE_ATOMIC_NONBLOCK guarantees the plane state is latched
+ * before the frame that was rendered for it reaches the screen.
+ *
+ * The primary and overlay planes' changes go in one request, so that
+ * they take effect at the same vblank.  Nothing is sent to the kernel
+ * when no state has changed.  Returns 0, or the negative errno of a
+ * commit the kernel refused, in which case the planes keep their state.
+ */
+int KmsCommitPendingState(struct KmsOutput *pOutput)
+{
+    drmModeAtomicReqPtr pAtomic;
+    int dirty = pOutput->dirty;
+    int ret, i;
+
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        dirty |= pOutput->overlays[i].dirty;
+    }
+
+    if (!dirty) {
+        return 0;
+    }
+
+    pAtomic = drmModeAtomicAlloc();
+
+    if (pAtomic == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    if (pOutput->dirty) {
+        AddPlaneRect(pAtomic, &pOutput->propertyIDs.plane, &pOutput->pendingPlaneRect);
+    }
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        if (pOutput->overlays[i].dirty) {
+            AddPlaneRect(pAtomic, &pOutput->overlays[i].propertyIDs,
+                         &pOutput->overlays[i].pendingRect);
+        }
+    }
+
+    ret = drmModeAtomicCommit(pOutput->drmFd, pAtomic, 0, NULL);
+    drmModeAtomicFree(pAtomic);
+
+    if (ret != 0) {
+        // Keep showing the previous state; the caller may queue another rect.
+        Warning("Failed to commit plane state. Error: %s\n", strerror(-ret));
+        pOutput->pendingPlaneRect = pOutput->planeRect;
+        for (i = 0; i < pOutput->overlayCount; i++) {
+            pOutput->overlays[i].pendingRect = pOutput->overlays[i].rect;
+        }
+    } else {
+        pOutput->planeRect = pOutput->pendingPlaneRect;
+        for (i = 0; i < pOutput->overlayCount; i++) {
+            pOutput->overlays[i].rect = pOutput->overlays[i].pendingRect;
+        }
+    }
+
+    pOutput->dirty = 0;
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        pOutput->overlays[i].dirty = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Move a rectangle on a CRTC of one size to the same place on a CRTC of
+ * another size, scaling it along.
+ */
+static void ScaleRect(struct PlaneRect *pRect, int oldWidth, int oldHeight,
+                      int newWidth, int newHeight)
+{
+    pRect->x = (int64_t)pRect->x * newWidth / oldWidth;
+    pRect->y = (int64_t)pRect->y * newHeight / oldHeight;
+    pRect->width = (int64_t)pRect->width * newWidth / oldWidth;
+    pRect->height = (int64_t)pRect->height * newHeight / oldHeight;
+}
+
+// One attempt of ChangeMode(), with or without DRM_MODE_ATOMIC_TEST_ONLY
+static int CommitModeChange(struct KmsOutput *pOutput, const struct Config *pConfig,
+                            uint32_t modeID, uint32_t hdrMetadataID, uint32_t fb,
+                            int hdr_enabled, const struct PlaneRect *overlayRects,
+                            const struct KmsFb *overlayFbs, uint32_t flags)
+{
+    drmModeAtomicReqPtr pAtomic;
+    int ret, i;
+
+    pAtomic = drmModeAtomicAlloc();
+
+    if (pAtomic == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    AssignAtomicRequest(pAtomic, pConfig, &pOutput->propertyIDs, modeID, hdrMetadataID, fb,
+                        hdr_enabled, pOutput->hdrEnabled, pOutput->vrrEnabled);
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        const struct PlanePropertyIDs *pPropertyIDs = &pOutput->overlays[i].propertyIDs;
+
+        AddPlaneRect(pAtomic, pPropertyIDs, &overlayRects[i]);
+        if (overlayFbs[i].id != 0) {
+            drmModeAtomicAddProperty(pAtomic, pPropertyIDs->fb_id.object_id, pPropertyIDs->fb_id.id, overlayFbs[i].id);
+        }
+    }
+
+    ret = drmModeAtomicCommit(pOutput->drmFd, pAtomic, flags, NULL);
+    drmModeAtomicFree(pAtomic);
+
+    return ret;
+}
+
+static int ChangeMode(struct KmsOutput *pOutput, int width, int height, int refresh,
+                      int hdr_enabled, int new_streams, struct KmsHead *pHead)
+{
+    struct KmsBlobCache *pBlobCache = &pOutput->pDevice->blobCache;
+    struct PlaneRect overlayRects[KMS_MAX_OVERLAYS];
+    struct KmsFb overlayFbs[KMS_MAX_OVERLAYS] = { { 0 } };
+    struct Config config = pOutput->config;
+    struct KmsFb fb = { 0 };
+    drmModeConnectorPtr pConnector;
+    drmModeModeInfo *modes;
+    uint32_t modeID = 0, hdrMetadataID = 0;
+    int modeCount, ret = -EINVAL, i;
+
+    if (width > 0) {
+        pConnector = drmModeGetConnectorCurrent(pOutput->drmFd, config.connectorID);
+
+        if (pConnector == NULL || pConnector->count_modes == 0) {
+            drmModeFreeConnector(pConnector);
+            return -ENODEV;
+        }
+
+        modeCount = pConnector->count_modes;
+        modes = RankModes(pConnector, width, height, refresh);
+        drmModeFreeConnector(pConnector);
+
+        // RankModes() falls back to the preferred size; don't.
+        if (modes[0].hdisplay != width || modes[0].vdisplay != height) {
+            free(modes);
+            return -ENOENT;
+        }
+    } else {
+        modeCount = 1;
+        modes = malloc(sizeof(*modes));
+
+        if (modes == NULL) {
+            Fatal("Memory allocation failure.\n");
+        }
+        modes[0] = config.mode;
+    }
+
+    config.width = modes[0].hdisplay;
+    config.height = modes[0].vdisplay;
+
+    if (new_streams || config.width != pOutput->config.width ||
+        config.height != pOutput->config.height) {
+        CreateFb(pOutput->drmFd, config.width, config.height, &fb);
+    }
+
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        struct KmsOverlay *pOverlay = &pOutput->overlays[i];
+
+        overlayRects[i] = pOverlay->rect;
+        ScaleRect(&overlayRects[i], pOutput->config.width, pOutput->config.height,
+                  config.width, config.height);
+        if (new_streams) {
+            CreateFb(pOutput->drmFd, pOverlay->width, pOverlay->height, &overlayFbs[i]);
+        }
+    }
+
+    if (hdr_enabled && pOutput->propertyIDs.hdr_output_metadata.id) {
+        hdrMetadataID = CreateHdrMetadataBlob(pBlobCache);
+    }
+
+    // The best ranked refresh rate of the size that the driver accepts
+    for (i = 0; i < modeCount && modes[i].hdisplay == config.width &&
+                modes[i].vdisplay == config.height; i++) {
+        config.mode = modes[i];
+        modeID = CreateModeID(pBlobCache, &config);
+
+        ret = CommitModeChange(pOutput, &config, modeID, hdrMetadataID, fb.id, hdr_enabled,
+                               overlayRects, overlayFbs,
+                               DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET);
+        if (ret == 0) {
+            ret = CommitModeChange(pOutput, &config, modeID, hdrMetadataID, fb.id,
+                                   hdr_enabled, overlayRects, overlayFbs,
+                                   DRM_MODE_ATOMIC_ALLOW_MODESET);
+        }
+        if (ret == 0) {
+            break;
+        }
+
+        ReleaseBlob(pBlobCache, modeID);
+    }
+
+    free(modes);
+
+    if (ret != 0) {
+        ReleaseBlob(pBlobCache, hdrMetadataID);
+        DestroyFb(pOutput->drmFd, &fb);
+        for (i = 0; i < pOutput->overlayCount; i++) {
+            DestroyFb(pOutput->drmFd, &overlayFbs[i]);
+        }
+        return ret;
+    }
+
+    ReleaseBlob(pBlobCache, pOutput->modeBlob);
+    ReleaseBlob(pBlobCache, pOutput->hdrMetadataBlob);
+    pOutput->modeBlob = modeID;
+    pOutput->hdrMetadataBlob = hdrMetadataID;
+    pOutput->hdrEnabled = hdr_enabled;
+    pOutput->config = config;
+
+    if (fb.id != 0) {
+        DestroyFb(pOutput->drmFd, &pOutput->initialFb);
+        pOutput->initialFb = fb;
+        pOutput->planeRect.x = 0;
+        pOutput->planeRect.y = 0;
+        pOutput->planeRect.width = config.width;
+        pOutput->planeRect.height = config.height;
+        pOutput->pendingPlaneRect = pOutput->planeRect;
+        pOutput->dirty = 0;
+    }
+
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        struct KmsOverlay *pOverlay = &pOutput->overlays[i];
+
+        pOverlay->rect = overlayRects[i];
+        pOverlay->pendingRect = overlayRects[i];
+        pOverlay->dirty = 0;
+        if (overlayFbs[i].id != 0) {
+            DestroyFb(pOutput->drmFd, &pOverlay->fb);
+            pOverlay->fb = overlayFbs[i];
+        }
+    }
+
+    if (pOutput->vrrEnabled) {
+        SetUpVrr(pOutput, pHead);
+    }
+    DescribeHead(pOutput, 0, pHead);
+
+    return 0;
+}
+
+/*
+ * Change the head's mode and HDR state at runtime, in a single atomic
+ * commit.  The mode is the best ranked (see RankModes()) of the
+ * connector's width x height modes that passes a test-only commit;
+ * refresh may be 0 for that of the preferred mode, and a width of 0
+ * keeps the current mode.
+ *
+ * If the size stays the same and new_streams is 0, the plane keeps
+ * scanning out the EGLStream.  Otherwise the commit puts a cleared dumb
+ * buffer of the new size on it, and with new_streams, one on each
+ * overlay too, so that the caller can replace the streams, which were
+ * made for the old state, without the planes going dark; they are
+ * released by KmsReleaseInitialFbs() like SetMode()'s.  Overlays keep
+ * their place on the display, scaled to the new size.
+ *
+ * Returns 0 and updates *pHead on success, or a negative errno, e.g.
+ * -ENOENT if the connector has no mode of that size, with the display
+ * left as it was.
+ */
+int KmsChangeMode(struct KmsOutput *pOutput, int width, int height, int refresh,
+                  int hdr_enabled, int new_streams, struct KmsHead *pHead)
+{
+    int ret;
+
+    pthread_mutex_lock(&pOutput->pDevice->lock);
+    ret = ChangeMode(pOutput, width, height, refresh, hdr_enabled, new_streams, pHead);
+    pthread_mutex_unlock(&pOutput->pDevice->lock);
+
+    return ret;
+}
+
+// Release the fb if the plane has moved on to another one.
+static int ReleaseFbIfReplaced(int drmFd, uint32_t planeID, struct KmsFb *pFb)
+{
+    drmModePlanePtr pPlane;
+
+    if (pFb->id == 0) {
+        return 1;
+    }
+
+    pPlane = drmModeGetPlane(drmFd, planeID);
+
+    if (pPlane == NULL || pPlane->fb_id == pFb->id) {
+        drmModeFreePlane(pPlane);
+        return 0;
+    }
+
+    drmModeFreePlane(pPlane);
+    DestroyFb(drmFd, pFb);
+
+    return 1;
+}
+
+/*
+ * Destroy the dumb buffers that SetMode() and KmsShowOverlay() put on
+ * the head's planes, once the streams' frames have replaced them, as
+ * they are only needed for the initial commits.  Call it after frames
+ * have been presented until it returns 1, when none are left.
+ *
+ * Destroying an fb that a plane is still scanning out would turn the
+ * plane off, so each one is checked against its plane's current FB_ID.
+ */
+int KmsReleaseInitialFbs(struct KmsOutput *pOutput)
+{
+    int released, i;
+
+    released = ReleaseFbIfReplaced(pOutput->drmFd, pOutput->config.planeID,
+                                   &pOutput->initialFb);
+
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        released &= ReleaseFbIfReplaced(pOutput->drmFd, pOutput->overlays[i].planeID,
+                                        &pOutput->overlays[i].fb);
+    }
+
+    return released;
+}
+
+// Bytes of dumb buffers the head still holds
+uint64_t KmsGetFbMemory(const struct KmsOutput *pOutput)
+{
+    uint64_t size = pOutput->initialFb.size;
+    int i;
+
+    for (i = 0; i < pOutput->overlayCount; i++) {
+        size += pOutput->overlays[i].fb.size;
+    }
+
+    return size;
+}
+
+/*
+ * Free everything SetMode() and KmsAddHead() created for the device's
+ * heads, once all their EGLStreams are gone: the remaining dumb
+ * buffers, the blobs and the caches.  The displays are left in their
+ * mode, for the next DRM master to take over.
+ */
+void KmsTearDown(struct KmsDevice *pDevice)
+{
+    while (pDevice->outputCount > 0) {
+        FreeOutput(pDevice->outputs[0]);
+    }
+
+    FreeBlobCache(&pDevice->blobCache);
+    FreePropertyCache(&pDevice->propertyCache);
+    free(pDevice);
+}
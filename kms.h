@@ -23,8 +23,60 @@
 #if !defined(KMS_H)
 #define KMS_H
 
-void SetMode(int drmFd, int desired_width, int desired_height, int desired_refresh, int hdr_enabled,
-             uint32_t *pPlaneID, int *pWidth, int *pHeight);
+#include <stdint.h>
+
+#define KMS_MAX_HEADS 8
+#define KMS_MAX_OVERLAYS 3   // per head
+
+struct KmsDevice;
+struct KmsOutput;
+
+// One display lit up by SetMode() or KmsAddHead()
+struct KmsHead {
+    struct KmsDevice *pDevice;              // shared by the heads of one DRM fd
+    struct KmsOutput *pOutput;
+    uint32_t connectorID;
+    uint32_t planeID;
+    int width, height;
+    int vrr;                                // adaptive sync is on
+    double vrrMinRefresh, vrrMaxRefresh;    // its range in Hz; min is 0 if unknown
+};
+
+// A connector whose head must change, found by KmsProbeConnectors()
+struct KmsConnectorChange {
+    uint32_t connectorID;
+    enum {
+        KMS_CONNECTOR_PLUGGED,      // connected, without a head
+        KMS_CONNECTOR_UNPLUGGED,    // has a head, but is disconnected
+        KMS_CONNECTOR_REPLACED,     // has a head, but shows another display now
+    } type;
+};
+
+int SetMode(int drmFd, int desired_width, int desired_height, int desired_refresh,
+            int hdr_enabled, int vrr_enabled, struct KmsHead *heads, int maxHeads);
+
+int KmsProbeConnectors(struct KmsDevice *pDevice, uint32_t connectorID,
+                       struct KmsConnectorChange *changes, int maxChanges);
+int KmsAddHead(struct KmsDevice *pDevice, uint32_t connectorID, struct KmsHead *pHead);
+void KmsRemoveHead(struct KmsHead *pHead);
+
+double KmsGetRefreshRate(const struct KmsOutput *pOutput);
+int KmsGetLastVblank(const struct KmsOutput *pOutput, uint64_t *pNs);
+
+int KmsChangeMode(struct KmsOutput *pOutput, int width, int height, int refresh,
+                  int hdr_enabled, int new_streams, struct KmsHead *pHead);
+
+void KmsSetPlaneRect(struct KmsOutput *pOutput, int x, int y, int width, int height);
+int KmsCommitPendingState(struct KmsOutput *pOutput);
+
+int KmsShowOverlay(struct KmsOutput *pOutput, int x, int y, int width, int height,
+                   uint32_t *pPlaneID);
+void KmsSetOverlayRect(struct KmsOutput *pOutput, int overlay, int x, int y, int width, int height);
+
+int KmsReleaseInitialFbs(struct KmsOutput *pOutput);
+uint64_t KmsGetFbMemory(const struct KmsOutput *pOutput);
+
+void KmsTearDown(struct KmsDevice *pDevice);
 
 #endif /* KMS_H */
 
@@ -0,0 +1,387 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drmMode.h>
+
+#include "kmsprops.h"
+#include "utils.h"
+
+/*
+ * Looking up a property by name with plain libdrm costs a
+ * drmModeObjectGetProperties() ioctl plus one drmModeGetProperty()
+ * ioctl per property of the object, every time.  The cache below
+ * brings that down to one drmModeObjectGetProperties() per object and
+ * one drmModeGetProperty() per distinct property ID for the lifetime
+ * of the cache, and name lookups are hash probes.
+ */
+
+#define INITIAL_INFO_SLOTS 64
+
+// FNV-1a
+static uint32_t HashBytes(const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static uint32_t HashName(const char *name)
+{
+    return HashBytes(name, strlen(name));
+}
+
+void InitPropertyCache(struct KmsPropertyCache *pCache, int drmFd)
+{
+    memset(pCache, 0, sizeof(*pCache));
+
+    pCache->drmFd = drmFd;
+    pCache->infoMask = INITIAL_INFO_SLOTS - 1;
+    pCache->infos = calloc(INITIAL_INFO_SLOTS, sizeof(*pCache->infos));
+
+    if (pCache->infos == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+}
+
+void FreePropertyCache(struct KmsPropertyCache *pCache)
+{
+    uint32_t i;
+
+    for (i = 0; i < pCache->tableCount; i++) {
+        free(pCache->tables[i]->props);
+        free(pCache->tables[i]->hashSlots);
+        free(pCache->tables[i]);
+    }
+    free(pCache->tables);
+
+    for (i = 0; i <= pCache->infoMask; i++) {
+        if (pCache->infos[i] != NULL) {
+            drmModeFreeProperty(pCache->infos[i]);
+        }
+    }
+    free(pCache->infos);
+
+    memset(pCache, 0, sizeof(*pCache));
+}
+
+static void InsertInfo(drmModePropertyPtr *infos, uint32_t mask, drmModePropertyPtr pInfo)
+{
+    uint32_t slot = pInfo->prop_id & mask;
+
+    while (infos[slot] != NULL) {
+        slot = (slot + 1) & mask;
+    }
+
+    infos[slot] = pInfo;
+}
+
+static const drmModePropertyRes *GetPropertyInfo(struct KmsPropertyCache *pCache,
+                                                 uint32_t propID)
+{
+    drmModePropertyPtr pInfo;
+    uint32_t slot = propID & pCache->infoMask;
+
+    while (pCache->infos[slot] != NULL) {
+        if (pCache->infos[slot]->prop_id == propID) {
+            return pCache->infos[slot];
+        }
+        slot = (slot + 1) & pCache->infoMask;
+    }
+
+    pInfo = drmModeGetProperty(pCache->drmFd, propID);
+
+    if (pInfo == NULL) {
+        return NULL;
+    }
+
+    // Keep the load factor at or below one half.
+    if ((pCache->infoCount + 1) * 2 > pCache->infoMask + 1) {
+        uint32_t newMask = (pCache->infoMask << 1) | 1;
+        drmModePropertyPtr *newInfos = calloc(newMask + 1, sizeof(*newInfos));
+        uint32_t i;
+
+        if (newInfos == NULL) {
+            Fatal("Memory allocation failure.\n");
+        }
+
+        for (i = 0; i <= pCache->infoMask; i++) {
+            if (pCache->infos[i] != NULL) {
+                InsertInfo(newInfos, newMask, pCache->infos[i]);
+            }
+        }
+
+        free(pCache->infos);
+        pCache->infos = newInfos;
+        pCache->infoMask = newMask;
+    }
+
+    InsertInfo(pCache->infos, pCache->infoMask, pInfo);
+    pCache->infoCount++;
+
+    return pInfo;
+}
+
+static struct KmsPropertyTable *LoadPropertyTable(struct KmsPropertyCache *pCache,
+                                                  uint32_t objectID, uint32_t objectType)
+{
+    drmModeObjectPropertiesPtr pObjectProperties;
+    struct KmsPropertyTable *pTable;
+    uint32_t i, slots = 8;
+
+    pObjectProperties = drmModeObjectGetProperties(pCache->drmFd, objectID, objectType);
+
+    if (pObjectProperties == NULL) {
+        return NULL;
+    }
+
+    while (slots < pObjectProperties->count_props * 2) {
+        slots <<= 1;
+    }
+
+    pTable = calloc(1, sizeof(*pTable));
+    if (pTable != NULL) {
+        pTable->props = calloc(pObjectProperties->count_props, sizeof(*pTable->props));
+        pTable->hashSlots = calloc(slots, sizeof(*pTable->hashSlots));
+    }
+
+    if (pTable == NULL || pTable->props == NULL || pTable->hashSlots == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    pTable->objectID = objectID;
+    pTable->objectType = objectType;
+    pTable->hashMask = slots - 1;
+
+    for (i = 0; i < pObjectProperties->count_props; i++) {
+        const drmModePropertyRes *pInfo =
+            GetPropertyInfo(pCache, pObjectProperties->props[i]);
+        struct KmsProperty *pProperty;
+        uint32_t slot;
+
+        if (pInfo == NULL) {
+            continue;
+        }
+
+        pProperty = &pTable->props[pTable->count];
+        pProperty->name = pInfo->name;
+        pProperty->id = pInfo->prop_id;
+        pProperty->flags = pInfo->flags;
+        pProperty->value = pObjectProperties->prop_values[i];
+        pProperty->hash = HashName(pInfo->name);
+        pProperty->pInfo = pInfo;
+
+        slot = pProperty->hash & pTable->hashMask;
+        while (pTable->hashSlots[slot] != 0) {
+            slot = (slot + 1) & pTable->hashMask;
+        }
+        pTable->hashSlots[slot] = ++pTable->count;
+    }
+
+    drmModeFreeObjectProperties(pObjectProperties);
+
+    return pTable;
+}
+
+/*
+ * Return the property table of a KMS object, fetching it on first use.
+ * Returns NULL if the object's properties cannot be queried.
+ */
+const struct KmsPropertyTable *GetPropertyTable(struct KmsPropertyCache *pCache,
+                                                uint32_t objectID, uint32_t objectType)
+{
+    struct KmsPropertyTable *pTable, **newTables;
+    uint32_t i;
+
+    for (i = 0; i < pCache->tableCount; i++) {
+        if (pCache->tables[i]->objectID == objectID &&
+            pCache->tables[i]->objectType == objectType) {
+            return pCache->tables[i];
+        }
+    }
+
+    pTable = LoadPropertyTable(pCache, objectID, objectType);
+
+    if (pTable == NULL) {
+        return NULL;
+    }
+
+    newTables = realloc(pCache->tables, (pCache->tableCount + 1) * sizeof(*newTables));
+
+    if (newTables == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    pCache->tables = newTables;
+    pCache->tables[pCache->tableCount++] = pTable;
+
+    return pTable;
+}
+
+/*
+ * Drop the cached table of an object, e.g. one about to be reused for
+ * a new head, so that the next GetPropertyTable() fetches its current
+ * values.  Pointers into the old table must no longer be in use.
+ */
+void InvalidatePropertyTable(struct KmsPropertyCache *pCache,
+                             uint32_t objectID, uint32_t objectType)
+{
+    uint32_t i;
+
+    for (i = 0; i < pCache->tableCount; i++) {
+        struct KmsPropertyTable *pTable = pCache->tables[i];
+
+        if (pTable->objectID == objectID && pTable->objectType == objectType) {
+            free(pTable->props);
+            free(pTable->hashSlots);
+            free(pTable);
+            pCache->tables[i] = pCache->tables[--pCache->tableCount];
+            return;
+        }
+    }
+}
+
+/*
+ * Find a property of the object by name; returns NULL if the object
+ * does not have it.
+ */
+const struct KmsProperty *LookupProperty(const struct KmsPropertyTable *pTable,
+                                         const char *name)
+{
+    uint32_t hash = HashName(name);
+    uint32_t slot = hash & pTable->hashMask;
+
+    while (pTable->hashSlots[slot] != 0) {
+        const struct KmsProperty *pProperty = &pTable->props[pTable->hashSlots[slot] - 1];
+
+        if (pProperty->hash == hash && strcmp(pProperty->name, name) == 0) {
+            return pProperty;
+        }
+        slot = (slot + 1) & pTable->hashMask;
+    }
+
+    return NULL;
+}
+
+/*
+ * Find the value of an enum property's entry by name, from the cached
+ * property metadata.  Returns 0 if the property has no such entry.
+ */
+int LookupEnumValue(const struct KmsProperty *pProperty, const char *enumName,
+                    uint64_t *pValue)
+{
+    int i;
+
+    for (i = 0; i < pProperty->pInfo->count_enums; i++) {
+        if (strcmp(pProperty->pInfo->enums[i].name, enumName) == 0) {
+            *pValue = pProperty->pInfo->enums[i].value;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void InitBlobCache(struct KmsBlobCache *pCache, int drmFd)
+{
+    memset(pCache, 0, sizeof(*pCache));
+
+    pCache->drmFd = drmFd;
+}
+
+void FreeBlobCache(struct KmsBlobCache *pCache)
+{
+    uint32_t i;
+
+    for (i = 0; i < pCache->count; i++) {
+        drmModeDestroyPropertyBlob(pCache->drmFd, pCache->blobs[i].id);
+        free(pCache->blobs[i].data);
+    }
+    free(pCache->blobs);
+
+    memset(pCache, 0, sizeof(*pCache));
+}
+
+/*
+ * Return a blob holding the given data, creating it if no live blob
+ * has the same contents.  Each successful call must be balanced by a
+ * ReleaseBlob().  Returns 0 if the blob cannot be created.
+ */
+uint32_t AcquireBlob(struct KmsBlobCache *pCache, const void *data, size_t size)
+{
+    uint32_t hash = HashBytes(data, size);
+    struct KmsBlob *pBlob, *newBlobs;
+    uint32_t i, blobID = 0;
+
+    for (i = 0; i < pCache->count; i++) {
+        pBlob = &pCache->blobs[i];
+
+        if (pBlob->hash == hash && pBlob->size == size &&
+            memcmp(pBlob->data, data, size) == 0) {
+            pBlob->refs++;
+            return pBlob->id;
+        }
+    }
+
+    if (drmModeCreatePropertyBlob(pCache->drmFd, data, size, &blobID) != 0) {
+        return 0;
+    }
+
+    newBlobs = realloc(pCache->blobs, (pCache->count + 1) * sizeof(*newBlobs));
+
+    if (newBlobs == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    pCache->blobs = newBlobs;
+    pBlob = &pCache->blobs[pCache->count++];
+    pBlob->id = blobID;
+    pBlob->refs = 1;
+    pBlob->hash = hash;
+    pBlob->size = size;
+    pBlob->data = malloc(size);
+
+    if (pBlob->data == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    memcpy(pBlob->data, data, size);
+
+    return blobID;
+}
+
+/*
+ * Drop a reference from AcquireBlob(), destroying the kernel blob when
+ * it was the last one.  Releasing blob 0 is a no-op.
+ */
+void ReleaseBlob(struct KmsBlobCache *pCache, uint32_t blobID)
+{
+    uint32_t i;
+
+    if (blobID == 0) {
+        return;
+    }
+
+    for (i = 0; i < pCache->count; i++) {
+        struct KmsBlob *pBlob = &pCache->blobs[i];
+
+        if (pBlob->id != blobID) {
+            continue;
+        }
+
+        if (--pBlob->refs == 0) {
+            drmModeDestroyPropertyBlob(pCache->drmFd, pBlob->id);
+            free(pBlob->data);
+            pCache->blobs[i] = pCache->blobs[--pCache->count];
+        }
+        return;
+    }
+
+    Warning("Releasing unknown property blob %u.\n", blobID);
+}
@@ -0,0 +1,84 @@
+#if !defined(KMSPROPS_H)
+#define KMSPROPS_H
+
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+// One property of a KMS object, with the value it had when fetched
+struct KmsProperty {
+    const char *name;
+    uint32_t id;
+    uint32_t flags;
+    uint64_t value;
+    uint32_t hash;
+    const drmModePropertyRes *pInfo; // name, flags and enum list
+};
+
+// All properties of one KMS object, indexed by name hash
+struct KmsPropertyTable {
+    uint32_t objectID;
+    uint32_t objectType;
+    uint32_t count;
+    struct KmsProperty *props;
+    uint32_t hashMask;
+    uint32_t *hashSlots; // index into props plus one; zero is empty
+};
+
+/*
+ * Property metadata is the same for every object that has a given
+ * property (e.g., all planes share one "type" property), so it is
+ * fetched once per property ID, and each object's table is fetched
+ * once per object.
+ */
+struct KmsPropertyCache {
+    int drmFd;
+
+    uint32_t infoMask;
+    uint32_t infoCount;
+    drmModePropertyPtr *infos; // open addressed by property ID
+
+    uint32_t tableCount;
+    struct KmsPropertyTable **tables;
+};
+
+/*
+ * Property blobs (MODE_ID, HDR_OUTPUT_METADATA, ...) created through
+ * the cache are shared by content and reference counted, so that
+ * re-issuing the same state does not create new kernel objects, and a
+ * blob is destroyed once the last state referencing it is replaced.
+ */
+struct KmsBlob {
+    uint32_t id;
+    uint32_t refs;
+    uint32_t hash;
+    size_t size;
+    void *data;
+};
+
+struct KmsBlobCache {
+    int drmFd;
+    uint32_t count;
+    struct KmsBlob *blobs;
+};
+
+void InitPropertyCache(struct KmsPropertyCache *pCache, int drmFd);
+void FreePropertyCache(struct KmsPropertyCache *pCache);
+
+const struct KmsPropertyTable *GetPropertyTable(struct KmsPropertyCache *pCache,
+                                                uint32_t objectID, uint32_t objectType);
+
+void InvalidatePropertyTable(struct KmsPropertyCache *pCache,
+                             uint32_t objectID, uint32_t objectType);
+
+const struct KmsProperty *LookupProperty(const struct KmsPropertyTable *pTable,
+                                         const char *name);
+
+int LookupEnumValue(const struct KmsProperty *pProperty, const char *enumName,
+                    uint64_t *pValue);
+
+void InitBlobCache(struct KmsBlobCache *pCache, int drmFd);
+void FreeBlobCache(struct KmsBlobCache *pCache);
+uint32_t AcquireBlob(struct KmsBlobCache *pCache, const void *data, size_t size);
+void ReleaseBlob(struct KmsBlobCache *pCache, uint32_t blobID);
+
+#endif /* KMSPROPS_H */
@@ -24,29 +24,1245 @@
 #include "egl.h"
 #include "kms.h"
 #include "eglgears.h"
+#include "flip.h"
+#include "framestats.h"
+#include "schedule.h"
+#include "capture.h"
+#include "eventloop.h"
+#include "hotplug.h"
+#include "control.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <stdlib.h> // For atoi
 #include <stdio.h>  // For printf
 #include <string.h> // For strcmp
+#include <unistd.h> // For close
 
 /*
  * Example code demonstrating how to connect EGL to DRM KMS using
  * EGLStreams.
  */
 
-int main(int argc, char *argv[])
+/*
+ * A change asked for on the control socket, applied by the head's render
+ * thread between frames; -1 keeps the current setting.
+ */
+struct HeadChange {
+    unsigned int client;        // to reply to
+    int width, height;          // 0 keeps the mode
+    int refresh;                // 0 for that of the preferred mode
+    int hdr_enabled;
+    int fifo_length;
+    int plane;                  // to move: 0 the primary plane, 1 the first overlay...; -1 none
+    int planeX, planeY, planeWidth, planeHeight;
+};
+
+// One display, driven by its own render thread and EGL context
+struct Head {
+    pthread_t thread;
+    int gpu;
+    int gpuCount;
+    int index;
+    int headCount;
+    struct KmsHead kms;
+    EGLDisplay eglDpy;
+    int drmFd;
+    int hdr_enabled;
+    int manual_acquire;
+    int flip_events;
+    int fifo_length;
+    int late_latch;
+    int fixed_timestep;
+    unsigned int max_frames;    // 0 to render until a signal
+    const char *capture_path;   // only set for the first head
+    unsigned int capture_frames;
+    int stress_instances;
+    int overlayCount;
+    uint32_t overlayPlaneIDs[KMS_MAX_OVERLAYS];
+    int overlayWidth, overlayHeight;
+    int inUse;                  // the slot holds a head, running or not
+    int running;                // its thread has not been joined yet
+    int hotplugged;             // plugged in after startup
+    volatile sig_atomic_t stop; // its display was unplugged or replaced
+    volatile sig_atomic_t exited;
+    atomic_uint frames;         // rendered so far
+    // Guarded by controlLock, as the main thread reads them for "stats"
+    double refresh;
+    volatile sig_atomic_t changePending;
+    struct HeadChange change;
+    int replyPending;           // the change is done; reply is for its client
+    char reply[CONTROL_MAX_LINE];
+};
+
+#define MAX_HEADS (MAX_EGL_DEVICES * KMS_MAX_HEADS)
+
+// What the event loop needs to light up the displays plugged into a GPU
+struct Gpu {
+    int drmFd;
+    dev_t devnum;               // of the DRM device node; 0 if it is not one
+    EGLDisplay eglDpy;
+    struct KmsDevice *pKms;
+    int canChangeHdr;           // see EglCanChangeConfig()
+    int canFifo;                // EGL_KHR_stream_fifo
+};
+
+// Connector changes handled per hotplug event
+#define MAX_CONNECTOR_CHANGES 16
+
+// How often the event loop reports the memory footprint
+#define TELEMETRY_PERIOD_NS 10000000000ull
+
+// Set by SIGINT or SIGTERM, to make the render threads stop and clean up
+static volatile sig_atomic_t quit;
+
+static void HandleQuitSignal(int signal)
+{
+    (void)signal;
+    quit = 1;
+}
+
+// Written by each render thread as it exits, to wake the event loop
+static int headExitFd = -1;
+static int runningHeads;
+static int finishedHeads;       // exited on their own, after --frames
+
+static struct Gpu gpus[MAX_EGL_DEVICES];
+static int gpuCount;
+static struct Head heads[MAX_HEADS];
+static struct Head headDefaults; // the options every head starts with
+static int overlaysPerHead;
+static int hotplugFd = -1;
+
+static pthread_mutex_t memoryLock = PTHREAD_MUTEX_INITIALIZER;
+static int headsWithInitialFbs;
+
+// The --control socket, if any, and the changes sent on it
+static struct ControlServer control;
+static pthread_mutex_t controlLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Written by a render thread once it has applied a change
+static int changeDoneFd = -1;
+
+static void PrintMemory(const char *when)
+{
+    printf("Memory %s: %.1f MB resident\n", when, GetResidentBytes() / 1e6);
+    fflush(stdout);
+}
+
+// The --present name of a stream FIFO length
+static const char *PresentName(int fifo_length)
+{
+    switch (fifo_length) {
+    case 0:
+        return "mailbox";
+    case 2:
+        return "fifo2";
+    default:
+        return "fifo3";
+    }
+}
+
+/* Event loop handlers; they run on the main thread. */
+
+static void QuitOnSignal(void *data, uint64_t signal)
+{
+    struct EventLoop *pLoop = data;
+
+    (void)signal;
+    quit = 1;
+
+    // With every display unplugged, no head is left to exit.
+    if (runningHeads == 0) {
+        StopEventLoop(pLoop);
+    }
+}
+
+static void ReadFlipEvents(void *data, uint64_t events)
+{
+    (void)events;
+    HandleFlipEvents(*(const int *)data);
+}
+
+static void ProbeGpu(int gpu, uint32_t connectorID);
+
+/*
+ * Send the reply to the head's last change from the control socket once
+ * its render thread has applied it, or an error if the thread exited
+ * first.
+ */
+static void SendChangeReply(struct Head *pHead)
+{
+    pthread_mutex_lock(&controlLock);
+    if (pHead->replyPending) {
+        ControlReply(&control, pHead->change.client, "%s", pHead->reply);
+        pHead->replyPending = 0;
+    } else if (pHead->changePending && pHead->exited) {
+        ControlReply(&control, pHead->change.client, "error: connector %u stopped",
+                     pHead->kms.connectorID);
+        pHead->changePending = 0;
+    }
+    pthread_mutex_unlock(&controlLock);
+}
+
+static void ChangesDone(void *data, uint64_t events)
+{
+    eventfd_t count;
+    int i;
+
+    (void)data;
+    (void)events;
+
+    eventfd_read(changeDoneFd, &count);
+
+    for (i = 0; i < MAX_HEADS; i++) {
+        if (heads[i].inUse) {
+            SendChangeReply(&heads[i]);
+        }
+    }
+}
+
+/*
+ * Take down a head whose display was unplugged or replaced, now that
+ * its thread is gone, and light its connector up again if a display is
+ * there, e.g. one plugged back in while the thread was stopping.
+ */
+static void RemoveHead(struct Head *pHead)
+{
+    uint32_t connectorID = pHead->kms.connectorID;
+
+    KmsRemoveHead(&pHead->kms);
+    pHead->inUse = 0;
+    printf("Head on connector %u removed\n", connectorID);
+
+    ProbeGpu(pHead->gpu, connectorID);
+}
+
+/*
+ * Join the heads that have exited.  The loop stops once none is left
+ * running, unless they were all stopped by unplugging their displays:
+ * then it waits for one to be plugged in.
+ */
+static void HeadsExited(void *data, uint64_t events)
+{
+    struct EventLoop *pLoop = data;
+    eventfd_t count;
+    int i;
+
+    (void)events;
+
+    eventfd_read(headExitFd, &count);
+
+    for (i = 0; i < MAX_HEADS; i++) {
+        struct Head *pHead = &heads[i];
+
+        if (!pHead->running || !pHead->exited) {
+            continue;
+        }
+
+        pthread_join(pHead->thread, NULL);
+        pHead->running = 0;
+        runningHeads--;
+        SendChangeReply(pHead);
+
+        if (!pHead->stop) {
+            finishedHeads++;
+        } else if (!quit) {
+            RemoveHead(pHead);
+        }
+    }
+
+    if (runningHeads == 0 && (quit || finishedHeads > 0)) {
+        StopEventLoop(pLoop);
+    }
+}
+
+static void ReportTelemetry(void *data, uint64_t expirations)
+{
+    uint64_t *pElapsedNs = data;
+    char when[32];
+
+    *pElapsedNs += expirations * TELEMETRY_PERIOD_NS;
+    snprintf(when, sizeof(when), "after %.0f s", *pElapsedNs / 1e9);
+    PrintMemory(when);
+}
+
+/*
+ * Called by each head once its initial dumb buffers are gone; the last
+ * one reports the memory footprint without them.
+ */
+static void InitialFbsReleased(void)
+{
+    pthread_mutex_lock(&memoryLock);
+    if (--headsWithInitialFbs == 0) {
+        PrintMemory("once the initial framebuffers were released");
+    }
+    pthread_mutex_unlock(&memoryLock);
+}
+
+/*
+ * Start the head's frame statistics, and its flip tracking and frame
+ * scheduling if used, over for its current mode.
+ */
+static void InitHeadStats(struct Head *pHead, struct FrameStats *pStats,
+                          struct FrameScheduler *pScheduler, struct FlipTracker *pTracker)
+{
+    double refresh = KmsGetRefreshRate(pHead->kms.pOutput);
+
+    if (pHead->flip_events) {
+        InitFlipTracker(pTracker, pHead->drmFd, refresh, pHead->kms.vrr);
+    }
+    InitFrameScheduler(pScheduler, refresh);
+
+    InitFrameStats(pStats, refresh);
+    if (pHead->kms.vrr) {
+        FrameStatsSetVrr(pStats, pHead->kms.vrrMinRefresh, pHead->kms.vrrMaxRefresh);
+    }
+    FrameStatsSetFifoLength(pStats, pHead->fifo_length);
+    pStats->trianglesPerFrame = GearsTrianglesPerFrame();
+
+    // Tell the heads' reports apart, but keep single-head output as it was
+    if (pHead->gpuCount > 1) {
+        snprintf(pStats->name, sizeof(pStats->name), "gpu %d head %d (connector %u)",
+                 pHead->gpu, pHead->index, pHead->kms.connectorID);
+    } else if (pHead->headCount > 1) {
+        snprintf(pStats->name, sizeof(pStats->name), "head %d (connector %u)",
+                 pHead->index, pHead->kms.connectorID);
+    }
+    memcpy(pTracker->name, pStats->name, sizeof(pTracker->name));
+    memcpy(pScheduler->name, pStats->name, sizeof(pScheduler->name));
+}
+
+/*
+ * Apply the change sent on the control socket, between two frames: the
+ * new mode and HDR state go out in one atomic commit, and only then are
+ * the streams that no longer fit replaced, the primary plane's if the
+ * size changed, and every plane's if HDR or the FIFO length did, since
+ * both are fixed when a stream is created.  The planes show a dumb
+ * buffer in between (see KmsChangeMode()), rather than going dark.
+ *
+ * surfaces[0] and streams[0] are the primary plane's, followed by the
+ * overlays'.  Returns 1 if anything changed, after which the caller
+ * starts its statistics over; pHead->stop is set if the head cannot
+ * render any more.
+ */
+static int ApplyChange(struct Head *pHead, const struct HeadChange *pChange,
+                       EGLContext eglContext, EGLSurface *surfaces, EGLStreamKHR *streams)
+{
+    EGLDisplay eglDpy = pHead->eglDpy;
+    struct KmsHead kms = pHead->kms;
+    char reply[CONTROL_MAX_LINE];
+    int hdr_enabled, fifo_length, newStreams, resized, ret, i;
+
+    hdr_enabled = pChange->hdr_enabled >= 0 ? pChange->hdr_enabled : pHead->hdr_enabled;
+    fifo_length = pChange->fifo_length >= 0 ? pChange->fifo_length : pHead->fifo_length;
+    newStreams = hdr_enabled != pHead->hdr_enabled || fifo_length != pHead->fifo_length;
+
+    ret = KmsChangeMode(pHead->kms.pOutput, pChange->width, pChange->height, pChange->refresh,
+                        hdr_enabled, newStreams, &kms);
+
+    if (ret == 0) {
+        resized = kms.width != pHead->kms.width || kms.height != pHead->kms.height;
+
+        if (resized || newStreams) {
+            DestroyStreamSurface(eglDpy, surfaces[0], streams[0]);
+            surfaces[0] = SetUpStreamSurface(eglDpy, kms.planeID, kms.width, kms.height,
+                                             hdr_enabled, pHead->manual_acquire,
+                                             fifo_length, &streams[0]);
+        }
+        for (i = 0; i < pHead->overlayCount && newStreams; i++) {
+            DestroyStreamSurface(eglDpy, surfaces[1 + i], streams[1 + i]);
+            surfaces[1 + i] = SetUpStreamSurface(eglDpy, pHead->overlayPlaneIDs[i],
+                                                 pHead->overlayWidth, pHead->overlayHeight,
+                                                 hdr_enabled, pHead->manual_acquire,
+                                                 fifo_length, &streams[1 + i]);
+        }
+
+        /*
+         * The mode is committed by now, so there is no going back: a head
+         * that cannot draw into its new surface is taken down instead.
+         */
+        if (!eglMakeCurrent(eglDpy, surfaces[0], surfaces[0], eglContext)) {
+            snprintf(reply, sizeof(reply),
+                     "error: connector %u cannot render after the change (0x%04x); stopping it",
+                     kms.connectorID, eglGetError());
+            pHead->stop = 1;
+            ret = -EIO;
+        } else {
+            if (resized) {
+                ResizeGears(kms.width, kms.height);
+            }
+
+            snprintf(reply, sizeof(reply),
+                     "ok: connector %u at %dx%d @ %.2fHz, hdr %s, present %s",
+                     kms.connectorID, kms.width, kms.height, KmsGetRefreshRate(kms.pOutput),
+                     hdr_enabled ? "on" : "off", PresentName(fifo_length));
+        }
+    } else {
+        snprintf(reply, sizeof(reply), "error: connector %u refused the change: %s",
+                 kms.connectorID, ret == -ENOENT ? "no such mode" : strerror(-ret));
+    }
+
+    pthread_mutex_lock(&controlLock);
+    if (ret == 0) {
+        pHead->kms.width = kms.width;
+        pHead->kms.height = kms.height;
+        pHead->kms.vrrMinRefresh = kms.vrrMinRefresh;
+        pHead->kms.vrrMaxRefresh = kms.vrrMaxRefresh;
+        pHead->hdr_enabled = hdr_enabled;
+        pHead->fifo_length = fifo_length;
+        pHead->refresh = KmsGetRefreshRate(kms.pOutput);
+    }
+    memcpy(pHead->reply, reply, sizeof(reply));
+    pHead->replyPending = 1;
+    pHead->changePending = 0;
+    pthread_mutex_unlock(&controlLock);
+
+    eventfd_write(changeDoneFd, 1);
+
+    return ret == 0;
+}
+
+/*
+ * Reply to a plane change from the control socket, once the commit that
+ * carries it (see KmsCommitPendingState()) has returned ret.
+ */
+static void FinishPlaneChange(struct Head *pHead, const struct HeadChange *pChange, int ret)
+{
+    char plane[24] = "plane";
+
+    if (pChange->plane > 0) {
+        snprintf(plane, sizeof(plane), "overlay %d", pChange->plane);
+    }
+
+    pthread_mutex_lock(&controlLock);
+    if (ret == 0) {
+        snprintf(pHead->reply, sizeof(pHead->reply), "ok: connector %u %s at %dx%d+%d+%d",
+                 pHead->kms.connectorID, plane, pChange->planeWidth,
+                 pChange->planeHeight, pChange->planeX, pChange->planeY);
+    } else {
+        snprintf(pHead->reply, sizeof(pHead->reply),
+                 "error: connector %u refused the plane change: %s",
+                 pHead->kms.connectorID, strerror(-ret));
+    }
+    pHead->replyPending = 1;
+    pHead->changePending = 0;
+    pthread_mutex_unlock(&controlLock);
+
+    eventfd_write(changeDoneFd, 1);
+}
+
+static void *RenderHead(void *arg)
+{
+    struct Head *pHead = arg;
+    struct KmsOutput *pOutput = pHead->kms.pOutput;
+    EGLDisplay eglDpy = pHead->eglDpy;
+    EGLSurface surfaces[1 + KMS_MAX_OVERLAYS];      // primary plane, then overlays
+    EGLStreamKHR streams[1 + KMS_MAX_OVERLAYS];
+    EGLContext eglContext;
+    struct FlipTracker flipTracker;
+    struct FrameStats frameStats;
+    struct FrameScheduler scheduler;
+    int scheduling = pHead->late_latch;
+    struct Capture *pCapture = NULL;
+    int fbsReleased = 0, fbsCounted = pHead->hotplugged;
+    unsigned int frames = 0;
+    int i;
+
+    surfaces[0] = SetUpEgl(eglDpy, pHead->kms.planeID, pHead->kms.width, pHead->kms.height,
+                           pHead->hdr_enabled, pHead->manual_acquire, pHead->fifo_length,
+                           &streams[0]);
+    eglContext = eglGetCurrentContext();
+
+    for (i = 0; i < pHead->overlayCount; i++) {
+        surfaces[1 + i] = SetUpStreamSurface(eglDpy, pHead->overlayPlaneIDs[i],
+                                             pHead->overlayWidth, pHead->overlayHeight,
+                                             pHead->hdr_enabled, pHead->manual_acquire,
+                                             pHead->fifo_length, &streams[1 + i]);
+    }
+
+    /*
+     * Frames are started just in time for a vblank, as predicted from
+     * the last one; with adaptive sync, they go out when ready anyway.
+     */
+    if (scheduling && pHead->kms.vrr) {
+        Warning("Connector %u has adaptive sync enabled; its frames are not scheduled.\n",
+                pHead->kms.connectorID);
+        scheduling = 0;
+    }
+
+    InitGears(pHead->kms.width, pHead->kms.height, pHead->stress_instances);
+    if (pHead->fixed_timestep) {
+        SetGearsTimestep(1.0 / KmsGetRefreshRate(pOutput));
+    }
+    if (pHead->capture_path != NULL) {
+        pCapture = CreateCapture(pHead->capture_path, pHead->kms.width, pHead->kms.height,
+                                 KmsGetRefreshRate(pOutput), pHead->capture_frames,
+                                 pHead->fixed_timestep || pHead->max_frames > 0);
+    }
+    InitHeadStats(pHead, &frameStats, &scheduler, &flipTracker);
+
+    while (!quit && !pHead->stop &&
+           (pHead->max_frames == 0 || frames < pHead->max_frames)) {
+        struct HeadChange change = { .plane = -1 };
+        uint64_t renderStartNs;
+        uint64_t producerFrame, consumerFrame;
+        uint64_t vblankNs;
+        int changing = pHead->changePending;
+        int ret;
+
+        if (changing) {
+            pthread_mutex_lock(&controlLock);
+            change = pHead->change;
+            pthread_mutex_unlock(&controlLock);
+        }
+
+        // A plane change goes out with this frame; see below.
+        if (change.plane == 0) {
+            KmsSetPlaneRect(pOutput, change.planeX, change.planeY,
+                            change.planeWidth, change.planeHeight);
+        } else if (change.plane > 0) {
+            KmsSetOverlayRect(pOutput, change.plane - 1, change.planeX, change.planeY,
+                              change.planeWidth, change.planeHeight);
+        } else if (changing) {
+            // EGL must not flip a frame of the old streams after the commit.
+            if (pHead->flip_events) {
+                WaitForFlips(&flipTracker, 0);
+            }
+            if (ApplyChange(pHead, &change, eglContext, surfaces, streams)) {
+                if (pHead->fixed_timestep) {
+                    SetGearsTimestep(1.0 / KmsGetRefreshRate(pOutput));
+                }
+                InitHeadStats(pHead, &frameStats, &scheduler, &flipTracker);
+                fbsReleased = 0;
+            } else if (pHead->stop) {
+                continue;
+            }
+        }
+
+        if (scheduling && KmsGetLastVblank(pOutput, &vblankNs) != 0) {
+            Warning("Cannot get the vblank time of connector %u; "
+                    "its frames are no longer scheduled.\n", pHead->kms.connectorID);
+            scheduling = 0;
+        }
+        if (scheduling) {
+            WaitForFrameDeadline(&scheduler, vblankNs);
+        }
+
+        FrameStatsBeginFrame(&frameStats);
+        renderStartNs = frameStats.frameStartNs;
+
+        UpdateGears();
+        FrameStatsEndPhase(&frameStats, FRAME_PHASE_SIMULATE);
+        if (pHead->overlayCount > 0) {
+            eglMakeCurrent(eglDpy, surfaces[0], surfaces[0], eglContext);
+        }
+        DrawGears();
+        FrameStatsEndPhase(&frameStats, FRAME_PHASE_DRAW);
+        if (pCapture != NULL) {
+            CaptureFrame(pCapture);
+            FrameStatsEndPhase(&frameStats, FRAME_PHASE_CAPTURE);
+        }
+        eglSwapBuffers(eglDpy, surfaces[0]);
+        FrameStatsEndPhase(&frameStats, FRAME_PHASE_SWAP);
+        if (QueryStreamFrames(eglDpy, streams[0], &producerFrame, &consumerFrame)) {
+            FrameStatsRecordStream(&frameStats, producerFrame, consumerFrame);
+        }
+
+        // Each overlay plane gets its own frame, composited by the display.
+        for (i = 0; i < pHead->overlayCount; i++) {
+            eglMakeCurrent(eglDpy, surfaces[1 + i], surfaces[1 + i], eglContext);
+            DrawOverlay(i, pHead->overlayWidth, pHead->overlayHeight);
+            eglSwapBuffers(eglDpy, surfaces[1 + i]);
+        }
+
+        /*
+         * Latch any queued plane state first, so that with manual
+         * acquire, the frame just rendered is flipped in with the state
+         * it expects; otherwise the consumer picks the frame up at about
+         * the same vblank.
+         */
+        ret = KmsCommitPendingState(pOutput);
+        if (change.plane >= 0) {
+            FinishPlaneChange(pHead, &change, ret);
+        }
+
+        if (pHead->manual_acquire) {
+            void *flipEventData = NULL;
+
+            if (pHead->flip_events) {
+                // Wait for the previous flip, so EGL never has two queued.
+                WaitForFlips(&flipTracker, 0);
+                flipEventData = BeginFlip(&flipTracker, renderStartNs);
+            }
+
+            if (!AcquireFrame(eglDpy, streams[0], flipEventData) &&
+                flipEventData != NULL) {
+                CancelFlip(&flipTracker, flipEventData);
+            }
+
+            for (i = 0; i < pHead->overlayCount; i++) {
+                AcquireFrame(eglDpy, streams[1 + i], NULL);
+            }
+
+            if (pHead->flip_events) {
+                PrintFlipStats(&flipTracker, 0);
+            }
+        }
+
+        if (scheduling) {
+            FinishGears();
+            FrameReady(&scheduler);
+            PrintScheduleStats(&scheduler, 0);
+        }
+
+        // A mode change puts new ones up; only the first are counted.
+        if (!fbsReleased && KmsReleaseInitialFbs(pOutput)) {
+            fbsReleased = 1;
+            if (!fbsCounted) {
+                InitialFbsReleased();
+                fbsCounted = 1;
+            }
+        }
+
+        PrintFrameStats(&frameStats, 0);
+        frames++;
+        atomic_store(&pHead->frames, frames);
+    }
+
+    PrintFrameStats(&frameStats, 1);
+    if (scheduling) {
+        PrintScheduleStats(&scheduler, 1);
+    }
+
+    // The kernel must not be left holding pointers to our flip slots.
+    if (pHead->flip_events) {
+        WaitForFlips(&flipTracker, 0);
+        PrintFlipStats(&flipTracker, 1);
+    }
+
+    if (pCapture != NULL) {
+        DestroyCapture(pCapture);
+    }
+
+    TearDownEgl(eglDpy, eglContext, surfaces, streams, 1 + pHead->overlayCount);
+
+    pHead->exited = 1;
+    eventfd_write(headExitFd, 1);
+
+    return NULL;
+}
+
+/*
+ * Render with no display, as fast as the GPU (or a software renderer)
+ * allows, into a pbuffer of the given size; see SetUpOffscreenEgl().
+ */
+static void RenderOffscreen(int width, int height, int stress_instances,
+                            int fixed_timestep, unsigned int max_frames,
+                            const char *capture_path, unsigned int capture_frames)
 {
     EGLDisplay eglDpy;
-    EGLDeviceEXT eglDevice;
-    int drmFd, width, height;
+    EGLSurface eglSurface = SetUpOffscreenEgl(width, height, &eglDpy);
+    EGLContext eglContext = eglGetCurrentContext();
+    struct FrameStats frameStats;
+    struct Capture *pCapture = NULL;
+    unsigned int frames;
+
+    InitGears(width, height, stress_instances);
+    if (fixed_timestep) {
+        SetGearsTimestep(1.0 / 60.0);
+    }
+    if (capture_path != NULL) {
+        pCapture = CreateCapture(capture_path, width, height, 60.0, capture_frames,
+                                 fixed_timestep || max_frames > 0);
+    }
+    InitFrameStats(&frameStats, 0.0);
+    frameStats.trianglesPerFrame = GearsTrianglesPerFrame();
+    frameStats.reportCpuTime = 1;
+
+    for (frames = 0; !quit && (max_frames == 0 || frames < max_frames); frames++) {
+        FrameStatsBeginFrame(&frameStats);
+
+        UpdateGears();
+        FrameStatsEndPhase(&frameStats, FRAME_PHASE_SIMULATE);
+        DrawGears();
+        FrameStatsEndPhase(&frameStats, FRAME_PHASE_DRAW);
+        if (pCapture != NULL) {
+            CaptureFrame(pCapture);
+            FrameStatsEndPhase(&frameStats, FRAME_PHASE_CAPTURE);
+        }
+
+        /*
+         * Nothing consumes a pbuffer's frames, so wait for each to be
+         * rendered: otherwise the frame rate would only be that of GL
+         * submission, with frames piling up in the command queue.
+         */
+        eglSwapBuffers(eglDpy, eglSurface);
+        FinishGears();
+        FrameStatsEndPhase(&frameStats, FRAME_PHASE_SWAP);
+
+        PrintFrameStats(&frameStats, 0);
+    }
+
+    PrintFrameStats(&frameStats, 1);
+
+    if (pCapture != NULL) {
+        DestroyCapture(pCapture);
+    }
+    TearDownEgl(eglDpy, eglContext, &eglSurface, NULL, 1);
+    eglTerminate(eglDpy);
+}
+
+/*
+ * Put up to count overlay planes on the head, a quarter of its size
+ * each, stacked along its right edge.
+ */
+static void ShowOverlays(struct Head *pHead, int count)
+{
+    const int margin = pHead->kms.height / 32;
+    int i;
+
+    pHead->overlayWidth = pHead->kms.width / 4;
+    pHead->overlayHeight = pHead->kms.height / 4;
+
+    for (i = 0; i < count; i++) {
+        uint32_t planeID;
+        int ret = KmsShowOverlay(pHead->kms.pOutput,
+                                 pHead->kms.width - pHead->overlayWidth - margin,
+                                 margin + i * (pHead->overlayHeight + margin),
+                                 pHead->overlayWidth, pHead->overlayHeight, &planeID);
+
+        if (ret == -ENOSPC) {
+            Warning("Connector %u has only %d overlay planes.\n", pHead->kms.connectorID, i);
+            break;
+        } else if (ret != 0) {
+            Warning("Showing overlay %d on connector %u failed: %s\n", i,
+                    pHead->kms.connectorID, strerror(-ret));
+            break;
+        }
+
+        pHead->overlayPlaneIDs[pHead->overlayCount++] = planeID;
+    }
+}
+
+static void InitHead(struct Head *pHead, int gpu, int index, int headCount,
+                     const struct KmsHead *pKmsHead)
+{
+    *pHead = headDefaults;
+    pHead->gpu = gpu;
+    pHead->gpuCount = gpuCount;
+    pHead->index = index;
+    pHead->headCount = headCount;
+    pHead->kms = *pKmsHead;
+    pHead->eglDpy = gpus[gpu].eglDpy;
+    pHead->drmFd = gpus[gpu].drmFd;
+    pHead->inUse = 1;
+    pHead->refresh = KmsGetRefreshRate(pKmsHead->pOutput);
+}
+
+static void StartHead(struct Head *pHead)
+{
+    if (pthread_create(&pHead->thread, NULL, RenderHead, pHead) != 0) {
+        Fatal("Unable to create render thread for connector %u.\n", pHead->kms.connectorID);
+    }
+
+    pHead->running = 1;
+    runningHeads++;
+}
+
+static struct Head *FindHead(int gpu, uint32_t connectorID)
+{
+    int i;
+
+    for (i = 0; i < MAX_HEADS; i++) {
+        if (heads[i].inUse && heads[i].gpu == gpu &&
+            heads[i].kms.connectorID == connectorID) {
+            return &heads[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Light up a display plugged into the GPU, and start rendering to it,
+ * while the other heads keep running.
+ */
+static void PlugHead(int gpu, uint32_t connectorID)
+{
+    struct Head *pHead = NULL;
+    struct KmsHead kmsHead;
+    uint32_t usedIndices = 0;
+    int index = 0, headCount = 1, ret, i;
+
+    for (i = 0; i < MAX_HEADS; i++) {
+        if (!heads[i].inUse) {
+            if (pHead == NULL) {
+                pHead = &heads[i];
+            }
+        } else if (heads[i].gpu == gpu) {
+            usedIndices |= 1 << heads[i].index;
+            headCount++;
+        }
+    }
+
+    // Every render thread slot may still be held by heads shutting down.
+    if (pHead == NULL) {
+        Warning("No render thread left for connector %u.\n", connectorID);
+        return;
+    }
+
+    while (usedIndices & (1 << index)) {
+        index++;
+    }
+
+    ret = KmsAddHead(gpus[gpu].pKms, connectorID, &kmsHead);
+
+    if (ret == -ENOSPC) {
+        Warning("No CRTC or --heads left for connector %u.\n", connectorID);
+    }
+    if (ret != 0) {
+        return;
+    }
+
+    InitHead(pHead, gpu, index, headCount, &kmsHead);
+    pHead->hotplugged = 1;
+    ShowOverlays(pHead, overlaysPerHead);
+    StartHead(pHead);
+}
+
+/*
+ * Bring the GPU's heads in line with its connectors: heads whose display
+ * was unplugged or replaced are told to stop, and are taken down by
+ * HeadsExited() once they have, since their threads need the loop to
+ * read their last flip events; newly connected displays are lit up.
+ */
+static void ProbeGpu(int gpu, uint32_t connectorID)
+{
+    struct KmsConnectorChange changes[MAX_CONNECTOR_CHANGES];
+    int count, i;
+
+    if (quit) {
+        return;
+    }
+
+    count = KmsProbeConnectors(gpus[gpu].pKms, connectorID, changes, ARRAY_LEN(changes));
+
+    for (i = 0; i < count; i++) {
+        struct Head *pHead = FindHead(gpu, changes[i].connectorID);
+
+        switch (changes[i].type) {
+        case KMS_CONNECTOR_PLUGGED:
+            printf("Connector %u plugged in\n", changes[i].connectorID);
+            PlugHead(gpu, changes[i].connectorID);
+            break;
+        case KMS_CONNECTOR_UNPLUGGED:
+        case KMS_CONNECTOR_REPLACED:
+            if (pHead == NULL || !pHead->running || pHead->stop) {
+                break;
+            }
+            printf("Connector %u %s\n", changes[i].connectorID,
+                   changes[i].type == KMS_CONNECTOR_UNPLUGGED ?
+                   "unplugged" : "has a new display");
+            pHead->stop = 1;
+            break;
+        }
+    }
+}
+
+static void HandleHotplug(void *data, uint64_t events)
+{
+    struct HotplugEvent event;
+    int ret, gpu;
+
+    (void)data;
+    (void)events;
+
+    while ((ret = ReadHotplugEvent(hotplugFd, &event)) >= 0) {
+        for (gpu = 0; gpu < gpuCount && ret > 0; gpu++) {
+            // A device without a number is a fake one; see tools/fakedrm.c.
+            if (event.devnum == gpus[gpu].devnum || event.devnum == 0 ||
+                gpus[gpu].devnum == 0) {
+                ProbeGpu(gpu, event.connectorID);
+            }
+        }
+    }
+}
+
+/*
+ * Find the running head a control command names with "CONNECTOR" or
+ * "GPU:CONNECTOR", or the only one if it names none.  Replies with an
+ * error if there is no such head.
+ */
+static struct Head *FindControlledHead(unsigned int client, const char *name)
+{
+    struct Head *pFound = NULL;
+    unsigned int connectorID = 0;
+    int gpu = -1, count = 0, i;
+
+    if (name != NULL && sscanf(name, "%d:%u", &gpu, &connectorID) != 2) {
+        gpu = -1;
+        if (sscanf(name, "%u", &connectorID) != 1) {
+            ControlReply(&control, client, "error: %s is not a connector", name);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < MAX_HEADS; i++) {
+        struct Head *pHead = &heads[i];
+
+        if (!pHead->running || pHead->stop ||
+            (name != NULL && (pHead->kms.connectorID != connectorID ||
+                              (gpu >= 0 && pHead->gpu != gpu)))) {
+            continue;
+        }
+
+        pFound = pHead;
+        count++;
+    }
+
+    if (count == 0) {
+        ControlReply(&control, client, "error: no display%s%s", name ? " on " : "",
+                     name ? name : "");
+        return NULL;
+    }
+    if (count > 1) {
+        ControlReply(&control, client, "error: %d displays; name one with %s", count,
+                     name ? "GPU:CONNECTOR" : "CONNECTOR");
+        return NULL;
+    }
+
+    return pFound;
+}
+
+static void ReplyStats(unsigned int client)
+{
+    int i;
+
+    pthread_mutex_lock(&controlLock);
+    for (i = 0; i < MAX_HEADS; i++) {
+        const struct Head *pHead = &heads[i];
+        char gpu[16] = "";
+
+        if (!pHead->running) {
+            continue;
+        }
+        if (gpuCount > 1) {
+            snprintf(gpu, sizeof(gpu), "gpu %d ", pHead->gpu);
+        }
+
+        ControlReply(&control, client,
+                     "%sconnector %u: %dx%d @ %.2fHz, hdr %s, present %s, vrr %s, %u frames",
+                     gpu, pHead->kms.connectorID, pHead->kms.width, pHead->kms.height,
+                     pHead->refresh, pHead->hdr_enabled ? "on" : "off",
+                     PresentName(pHead->fifo_length), pHead->kms.vrr ? "on" : "off",
+                     atomic_load(&pHead->frames));
+    }
+    pthread_mutex_unlock(&controlLock);
+
+    ControlReply(&control, client, "memory: %.1f MB resident", GetResidentBytes() / 1e6);
+    ControlReply(&control, client, "ok");
+}
+
+/*
+ * Whether the head can take the change, as far as the main thread can
+ * tell; settings it already has are dropped from it.  Call it with
+ * controlLock held.  Returns an error for the client, or NULL.
+ */
+static const char *CheckChange(const struct Head *pHead, struct HeadChange *pChange)
+{
+    const struct Gpu *pGpu = &gpus[pHead->gpu];
+
+    if (pHead->changePending) {
+        return "busy: the last change is still being applied";
+    }
+
+    if (pChange->hdr_enabled == pHead->hdr_enabled) {
+        pChange->hdr_enabled = -1;
+    }
+    if (pChange->fifo_length == pHead->fifo_length) {
+        pChange->fifo_length = -1;
+    }
+
+    if (pChange->width > 0 && pHead->capture_path != NULL) {
+        return "error: the captured display keeps its mode";
+    }
+    if (pChange->hdr_enabled >= 0 && !pGpu->canChangeHdr) {
+        return "error: switching HDR requires EGL_KHR_no_config_context";
+    }
+    if (pChange->fifo_length > 0 && (pHead->manual_acquire || pHead->late_latch)) {
+        return "error: fifo2 and fifo3 cannot be combined with --manual-acquire, "
+               "--flip-events or --late-latch";
+    }
+    if (pChange->fifo_length > 0 && !pGpu->canFifo) {
+        return "error: fifo2 and fifo3 require EGL_KHR_stream_fifo";
+    }
+    if (pChange->plane > pHead->overlayCount) {
+        return "error: no such overlay on the display";
+    }
+
+    return NULL;
+}
+
+/*
+ * Handle a command from the control socket.  Changes are handed to the
+ * head's render thread, which applies them before its next frame; the
+ * reply is sent once it has (see ChangesDone()).  Each command's reply
+ * ends with a line starting with "ok", "error" or "busy".
+ */
+static void HandleControl(void *data, unsigned int client, char *line)
+{
+    struct HeadChange change = {
+        .client = client, .hdr_enabled = -1, .fifo_length = -1, .plane = -1,
+    };
+    char *save = NULL;
+    char *command = strtok_r(line, " \t", &save);
+    char *arg = strtok_r(NULL, " \t", &save);
+    char *name = strtok_r(NULL, " \t", &save);
+    struct Head *pHead;
+    const char *reply;
+
+    (void)data;
+
+    if (command == NULL) {
+        return;
+    }
+
+    if (strcmp(command, "help") == 0) {
+        ControlReply(&control, client, "mode WIDTHxHEIGHT[@REFRESH] [CONNECTOR]");
+        ControlReply(&control, client, "hdr on|off [CONNECTOR]");
+        ControlReply(&control, client, "present mailbox|fifo2|fifo3 [CONNECTOR]");
+        ControlReply(&control, client, "plane WIDTHxHEIGHT+X+Y [CONNECTOR]");
+        ControlReply(&control, client, "overlay N WIDTHxHEIGHT+X+Y [CONNECTOR]");
+        ControlReply(&control, client, "stats");
+        ControlReply(&control, client, "ok");
+        return;
+    } else if (strcmp(command, "stats") == 0) {
+        ReplyStats(client);
+        return;
+    } else if (strcmp(command, "mode") == 0 && arg != NULL) {
+        int n = sscanf(arg, "%dx%d@%d", &change.width, &change.height, &change.refresh);
+
+        if (n < 2 || change.width <= 0 || change.height <= 0 || change.refresh < 0) {
+            ControlReply(&control, client, "error: mode takes WIDTHxHEIGHT[@REFRESH]");
+            return;
+        }
+    } else if (strcmp(command, "hdr") == 0 && arg != NULL) {
+        if (strcmp(arg, "on") == 0) {
+            change.hdr_enabled = 1;
+        } else if (strcmp(arg, "off") == 0) {
+            change.hdr_enabled = 0;
+        } else {
+            ControlReply(&control, client, "error: hdr takes on or off");
+            return;
+        }
+    } else if (strcmp(command, "present") == 0 && arg != NULL) {
+        if (strcmp(arg, "mailbox") == 0) {
+            change.fifo_length = 0;
+        } else if (strcmp(arg, "fifo2") == 0) {
+            change.fifo_length = 2;
+        } else if (strcmp(arg, "fifo3") == 0) {
+            change.fifo_length = 3;
+        } else {
+            ControlReply(&control, client, "error: present takes mailbox, fifo2 or fifo3");
+            return;
+        }
+    } else if ((strcmp(command, "plane") == 0 || strcmp(command, "overlay") == 0) &&
+               arg != NULL) {
+        const char *rect = arg;
+
+        // Overlays are numbered as --overlays counts them, from 1.
+        if (strcmp(command, "overlay") == 0) {
+            if (sscanf(arg, "%d", &change.plane) != 1 || change.plane < 1 || name == NULL) {
+                ControlReply(&control, client, "error: overlay takes N WIDTHxHEIGHT+X+Y");
+                return;
+            }
+            rect = name;
+            name = strtok_r(NULL, " \t", &save);
+        } else {
+            change.plane = 0;
+        }
+
+        if (sscanf(rect, "%dx%d+%d+%d", &change.planeWidth, &change.planeHeight,
+                   &change.planeX, &change.planeY) != 4 ||
+            change.planeWidth <= 0 || change.planeHeight <= 0) {
+            ControlReply(&control, client, "error: %s takes %sWIDTHxHEIGHT+X+Y", command,
+                         change.plane > 0 ? "N " : "");
+            return;
+        }
+    } else {
+        ControlReply(&control, client, "error: unknown command; try help");
+        return;
+    }
+
+    pHead = FindControlledHead(client, name);
+    if (pHead == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&controlLock);
+    reply = CheckChange(pHead, &change);
+    if (reply == NULL && change.width == 0 && change.hdr_enabled < 0 &&
+        change.fifo_length < 0 && change.plane < 0) {
+        reply = "ok: unchanged";
+    }
+    if (reply == NULL) {
+        pHead->change = change;
+        pHead->changePending = 1;
+    }
+    pthread_mutex_unlock(&controlLock);
+
+    if (reply != NULL) {
+        ControlReply(&control, client, "%s", reply);
+    }
+}
+
+static dev_t GetDevnum(int drmFd)
+{
+    struct stat st;
+
+    if (fstat(drmFd, &st) != 0 || !S_ISCHR(st.st_mode)) {
+        return 0;
+    }
+
+    return st.st_rdev;
+}
+
+/*
+ * Open the DRM device of each EGL device that matches one of the
+ * selectors (all of them if there are none), and return how many
+ * were kept.
+ */
+static int OpenGpus(const char **selectors, int selectorCount,
+                    EGLDeviceEXT *eglDevices, int *drmFds)
+{
+    EGLDeviceEXT devices[MAX_EGL_DEVICES];
+    int deviceCount, count = 0;
+    int i, j;
+
+    deviceCount = GetEglDevices(devices, MAX_EGL_DEVICES);
+
+    for (i = 0; i < deviceCount; i++) {
+        int drmFd = GetDrmFd(devices[i]);
+        int selected = selectorCount == 0;
+
+        for (j = 0; j < selectorCount && !selected; j++) {
+            selected = EglDeviceMatches(devices[i], drmFd, selectors[j]);
+        }
+
+        if (!selected) {
+            close(drmFd);
+            continue;
+        }
+
+        eglDevices[count] = devices[i];
+        drmFds[count] = drmFd;
+        count++;
+    }
+
+    if (count == 0) {
+        Fatal("No EGL device matches the --device options.\n");
+    }
+
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    EGLDeviceEXT eglDevices[MAX_EGL_DEVICES];
+    int drmFds[MAX_EGL_DEVICES];
+    const char *selectors[MAX_EGL_DEVICES];
+    int selectorCount = 0;
     int desired_width = 0, desired_height = 0, desired_refresh = 0;
     int hdr_enabled = 0;
-    uint32_t planeID = 0;
-    EGLSurface eglSurface;
+    int vrr_enabled = 0;
+    int manual_acquire = 0;
+    int flip_events = 0;
+    int fifo_length = 0;
+    int late_latch = 0;
+    int offscreen = 0;
+    const char *capture_path = NULL;
+    const char *control_path = NULL;
+    int capture_frames = 0;
+    int fixed_timestep = 0;
+    int max_frames = 0;
+    int stress_instances = 0;
+    int overlays = 0;
+    int max_heads = KMS_MAX_HEADS;
+    struct sigaction quitAction = { .sa_handler = HandleQuitSignal };
+    static const int quitSignals[] = { SIGINT, SIGTERM };
+    struct EventLoop eventLoop;
+    uint64_t telemetryNs = 0;
+    uint64_t startResident, fbBytes = 0;
+    int headCount = 0, gpu, i;
 
     // Argument parsing
-    for (int i = 1; i < argc; ++i) {
+    for (i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--hdr") == 0) {
             hdr_enabled = 1;
+        } else if (strcmp(argv[i], "--vrr") == 0) {
+            vrr_enabled = 1;
+        } else if (strcmp(argv[i], "--manual-acquire") == 0) {
+            manual_acquire = 1;
+        } else if (strcmp(argv[i], "--flip-events") == 0) {
+            // Flip events can only be requested when acquiring manually
+            manual_acquire = 1;
+            flip_events = 1;
+        } else if (strcmp(argv[i], "--present") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+
+            if (strcmp(mode, "mailbox") == 0) {
+                fifo_length = 0;
+            } else if (strcmp(mode, "fifo2") == 0) {
+                fifo_length = 2;
+            } else if (strcmp(mode, "fifo3") == 0) {
+                fifo_length = 3;
+            } else {
+                Fatal("--present takes mailbox, fifo2 or fifo3.\n");
+            }
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--capture-frames") == 0 && i + 1 < argc) {
+            capture_frames = atoi(argv[++i]);
+            if (capture_frames < 1) {
+                Fatal("--capture-frames takes a count of at least 1.\n");
+            }
+        } else if (strcmp(argv[i], "--fixed-timestep") == 0) {
+            fixed_timestep = 1;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            max_frames = atoi(argv[++i]);
+            if (max_frames < 1) {
+                Fatal("--frames takes a count of at least 1.\n");
+            }
+        } else if (strcmp(argv[i], "--offscreen") == 0) {
+            offscreen = 1;
+        } else if (strcmp(argv[i], "--late-latch") == 0) {
+            late_latch = 1;
+        } else if (strcmp(argv[i], "--stress") == 0 && i + 1 < argc) {
+            stress_instances = atoi(argv[++i]);
+            if (stress_instances < 1 || stress_instances > 100000) {
+                Fatal("--stress takes a gear count from 1 to 100000.\n");
+            }
+        } else if (strcmp(argv[i], "--overlays") == 0 && i + 1 < argc) {
+            overlays = atoi(argv[++i]);
+            if (overlays < 1 || overlays > KMS_MAX_OVERLAYS) {
+                Fatal("--overlays takes a count from 1 to %d.\n", KMS_MAX_OVERLAYS);
+            }
+        } else if (strcmp(argv[i], "--heads") == 0 && i + 1 < argc) {
+            max_heads = atoi(argv[++i]);
+            if (max_heads < 1 || max_heads > KMS_MAX_HEADS) {
+                Fatal("--heads takes a count from 1 to %d.\n", KMS_MAX_HEADS);
+            }
+        } else if (strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
+            control_path = argv[++i];
+        } else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+            if (selectorCount == MAX_EGL_DEVICES) {
+                Fatal("At most %d --device options can be given.\n", MAX_EGL_DEVICES);
+            }
+            selectors[selectorCount++] = argv[++i];
         } else if (i + 2 < argc && desired_width == 0) {
             desired_width = atoi(argv[i]);
             desired_height = atoi(argv[++i]);
@@ -54,28 +1270,187 @@ int main(int argc, char *argv[])
         }
     }
 
+    /*
+     * A FIFO hands frames to the display in order, one per refresh; an
+     * application acquiring each frame itself would defeat that.
+     */
+    if (fifo_length > 0 && manual_acquire) {
+        Fatal("--present fifo2 and fifo3 cannot be combined with "
+              "--manual-acquire or --flip-events.\n");
+    }
+    if (fifo_length > 0 && late_latch) {
+        Fatal("--late-latch cannot be combined with --present fifo2 or fifo3, "
+              "whose frames wait in the queue.\n");
+    }
+
+    // Capture every frame rendered, unless told otherwise.
+    if (capture_frames == 0) {
+        capture_frames = max_frames > 0 ? max_frames : 300;
+    }
+
+    if (offscreen) {
+        if (hdr_enabled || vrr_enabled || manual_acquire || fifo_length > 0 ||
+            late_latch || overlays > 0 || selectorCount > 0 || control_path != NULL) {
+            Fatal("--offscreen cannot be combined with options for displays.\n");
+        }
+        if (desired_width <= 0 || desired_height <= 0) {
+            desired_width = 1920;
+            desired_height = 1080;
+        }
+
+        printf("Offscreen %d,%d\n", desired_width, desired_height);
+        sigaction(SIGINT, &quitAction, NULL);
+        sigaction(SIGTERM, &quitAction, NULL);
+        RenderOffscreen(desired_width, desired_height, stress_instances,
+                        fixed_timestep, max_frames, capture_path, capture_frames);
+
+        return 0;
+    }
+
     if (hdr_enabled) {
         printf("HDR %d,%d @%d requested\n", desired_width, desired_height, desired_refresh);
     } else {
         printf("%d,%d @%d requested\n", desired_width, desired_height, desired_refresh);
     }
+    startResident = GetResidentBytes();
     GetEglExtensionFunctionPointers();
-    eglDevice = GetEglDevice();
-    drmFd = GetDrmFd(eglDevice);
+    gpuCount = OpenGpus(selectors, selectorCount, eglDevices, drmFds);
 
-    SetMode(drmFd, desired_width, desired_height, desired_refresh, hdr_enabled,
-            &planeID, &width, &height);
+    headDefaults.hdr_enabled = hdr_enabled;
+    headDefaults.manual_acquire = manual_acquire;
+    headDefaults.flip_events = flip_events;
+    headDefaults.fifo_length = fifo_length;
+    headDefaults.late_latch = late_latch;
+    headDefaults.fixed_timestep = fixed_timestep;
+    headDefaults.max_frames = max_frames;
+    headDefaults.stress_instances = stress_instances;
+    overlaysPerHead = overlays;
 
-    eglDpy = GetEglDisplay(eglDevice, drmFd);
-    eglSurface = SetUpEgl(eglDpy, planeID, width, height, hdr_enabled);
+    /*
+     * Each GPU is an independent pipeline: its own DRM fd, atomic
+     * commit and EGLDisplay, with a render thread per head.
+     */
+    for (gpu = 0; gpu < gpuCount; gpu++) {
+        struct KmsHead kmsHeads[KMS_MAX_HEADS];
+        int gpuHeads;
 
-    InitGears(width, height);
+        printf("GPU %d: %s\n", gpu,
+               pEglQueryDeviceStringEXT(eglDevices[gpu], EGL_DRM_DEVICE_FILE_EXT));
 
-    while (1) {
-        DrawGears();
-        eglSwapBuffers(eglDpy, eglSurface);
-        PrintFps();
+        gpuHeads = SetMode(drmFds[gpu], desired_width, desired_height, desired_refresh,
+                           hdr_enabled, vrr_enabled, kmsHeads, max_heads);
+
+        gpus[gpu].drmFd = drmFds[gpu];
+        gpus[gpu].devnum = GetDevnum(drmFds[gpu]);
+        gpus[gpu].eglDpy = GetEglDisplay(eglDevices[gpu], drmFds[gpu]);
+        gpus[gpu].pKms = kmsHeads[0].pDevice;
+        gpus[gpu].canChangeHdr = EglCanChangeConfig(gpus[gpu].eglDpy);
+        gpus[gpu].canFifo =
+            ExtensionIsSupported(eglQueryString(gpus[gpu].eglDpy, EGL_EXTENSIONS),
+                                 "EGL_KHR_stream_fifo");
+
+        if (flip_events) {
+            CheckFlipEventSupport(gpus[gpu].eglDpy);
+        }
+
+        for (i = 0; i < gpuHeads; i++) {
+            struct Head *pHead = &heads[headCount++];
+
+            InitHead(pHead, gpu, i, gpuHeads, &kmsHeads[i]);
+            ShowOverlays(pHead, overlays);
+        }
+    }
+
+    if (capture_path != NULL) {
+        if (headCount > 1) {
+            Warning("Only the first head is captured.\n");
+        }
+        heads[0].capture_path = capture_path;
+        heads[0].capture_frames = capture_frames;
     }
 
+    /*
+     * The initial dumb buffers are only needed until each head's first
+     * frame replaces them; they are released then (see RenderHead()).
+     */
+    for (i = 0; i < headCount; i++) {
+        fbBytes += KmsGetFbMemory(heads[i].kms.pOutput);
+    }
+    printf("Memory after modesetting: %.1f MB resident (%.1f MB before), "
+           "%.1f MB of initial dumb buffers\n",
+           GetResidentBytes() / 1e6, startResident / 1e6, fbBytes / 1e6);
+    headsWithInitialFbs = headCount;
+
+    /*
+     * The main thread only runs the event loop, while the render threads
+     * draw.  Signals are blocked before they are created, so that only
+     * the loop receives them.
+     */
+    InitEventLoop(&eventLoop);
+    EventLoopAddSignals(&eventLoop, quitSignals, ARRAY_LEN(quitSignals),
+                        QuitOnSignal, &eventLoop);
+    EventLoopAddTimer(&eventLoop, TELEMETRY_PERIOD_NS, ReportTelemetry, &telemetryNs);
+
+    // Nothing arrives on the DRM fds but the flip events asked for.
+    if (flip_events) {
+        for (gpu = 0; gpu < gpuCount; gpu++) {
+            EventLoopAddFd(&eventLoop, gpus[gpu].drmFd, ReadFlipEvents, &gpus[gpu].drmFd);
+        }
+    }
+
+    // Without it, displays are only picked up at startup.
+    hotplugFd = OpenHotplugMonitor();
+    if (hotplugFd >= 0) {
+        EventLoopAddFd(&eventLoop, hotplugFd, HandleHotplug, NULL);
+    }
+
+    headExitFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (headExitFd < 0) {
+        Fatal("Unable to create an eventfd.\n");
+    }
+    EventLoopAddFd(&eventLoop, headExitFd, HeadsExited, &eventLoop);
+
+    if (control_path != NULL) {
+        changeDoneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (changeDoneFd < 0) {
+            Fatal("Unable to create an eventfd.\n");
+        }
+        EventLoopAddFd(&eventLoop, changeDoneFd, ChangesDone, NULL);
+        OpenControlServer(&control, &eventLoop, control_path, HandleControl, NULL);
+    }
+
+    for (i = 0; i < headCount; i++) {
+        StartHead(&heads[i]);
+    }
+
+    /*
+     * The render threads run until a signal asks them to quit, or they
+     * have rendered --frames; the loop keeps reading flip events until
+     * the last one has exited, since they wait for their flips first.
+     * Meanwhile, heads come and go as displays are plugged and unplugged.
+     */
+    RunEventLoop(&eventLoop);
+
+    if (control_path != NULL) {
+        CloseControlServer(&control);
+    }
+    FiniEventLoop(&eventLoop);
+    close(headExitFd);
+    if (changeDoneFd >= 0) {
+        close(changeDoneFd);
+    }
+    if (hotplugFd >= 0) {
+        close(hotplugFd);
+    }
+
+    // Every thread has been joined by HeadsExited().
+    for (gpu = 0; gpu < gpuCount; gpu++) {
+        KmsTearDown(gpus[gpu].pKms);
+        eglTerminate(gpus[gpu].eglDpy);
+        close(gpus[gpu].drmFd);
+    }
+
+    PrintMemory("after teardown");
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "schedule.h"
+#include "utils.h"
+
+/*
+ * Deadline-driven frame scheduling ("late latching").
+ *
+ * Rendering as fast as eglSwapBuffers() allows samples the animation up
+ * to a refresh period before the frame reaches the display.  Instead,
+ * each frame is started as late as it can be while still making the
+ * next vblank: at the vblank, less the predicted render cost, less a
+ * safety margin.  The render thread sleeps the rest of the period.
+ *
+ * The render cost predicted is the largest of the last SCHEDULE_HISTORY
+ * frames, so that one slow frame makes the next ones start earlier
+ * until it has aged out.  The margin covers what that misses: it
+ * doubles whenever a frame is not ready by its vblank, and shrinks by
+ * 1/8 after every second of frames that were.
+ */
+
+#define MIN_MARGIN_NS 250000ull
+
+static void SleepUntil(uint64_t ns)
+{
+    struct timespec ts = {
+        .tv_sec = ns / 1000000000ull,
+        .tv_nsec = ns % 1000000000ull,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+void InitFrameScheduler(struct FrameScheduler *pScheduler, double refreshRate)
+{
+    int i;
+
+    memset(pScheduler, 0, sizeof(*pScheduler));
+
+    pScheduler->refreshPeriodNs = (uint64_t)(1000000000.0 / refreshRate);
+    pScheduler->marginNs = pScheduler->refreshPeriodNs / 16;
+
+    // Start conservatively, until there is a history to go by.
+    for (i = 0; i < SCHEDULE_HISTORY; i++) {
+        pScheduler->costsNs[i] = pScheduler->refreshPeriodNs / 4;
+    }
+}
+
+/*
+ * Sleep until it is time to start rendering for the first vblank after
+ * lastVblankNs that the frame can still make, and that no earlier frame
+ * was meant for.
+ */
+void WaitForFrameDeadline(struct FrameScheduler *pScheduler, uint64_t lastVblankNs)
+{
+    const uint64_t periodNs = pScheduler->refreshPeriodNs;
+    uint64_t now = GetMonotonicNs();
+    uint64_t deadlineNs = lastVblankNs + periodNs;
+    uint64_t leadNs;
+    int i;
+
+    pScheduler->predictedNs = 0;
+    for (i = 0; i < SCHEDULE_HISTORY; i++) {
+        if (pScheduler->costsNs[i] > pScheduler->predictedNs) {
+            pScheduler->predictedNs = pScheduler->costsNs[i];
+        }
+    }
+    leadNs = pScheduler->predictedNs + pScheduler->marginNs;
+
+    // Vblank timestamps jitter a little, so compare to half a period.
+    while (deadlineNs < now + leadNs ||
+           deadlineNs < pScheduler->deadlineNs + periodNs / 2) {
+        deadlineNs += periodNs;
+    }
+
+    SleepUntil(deadlineNs - leadNs);
+
+    pScheduler->deadlineNs = deadlineNs;
+    pScheduler->wakeNs = GetMonotonicNs();
+}
+
+/*
+ * Called once the frame has been handed to the display: learn its render
+ * cost, and whether it made its vblank.
+ */
+void FrameReady(struct FrameScheduler *pScheduler)
+{
+    uint64_t now = GetMonotonicNs();
+    uint64_t costNs = now - pScheduler->wakeNs;
+    uint64_t latencyNs = pScheduler->deadlineNs - pScheduler->wakeNs;
+
+    pScheduler->costsNs[pScheduler->nextCost] = costNs;
+    pScheduler->nextCost = (pScheduler->nextCost + 1) % SCHEDULE_HISTORY;
+
+    if (now > pScheduler->deadlineNs) {
+        pScheduler->missedDeadlines++;
+        pScheduler->onTimeFrames = 0;
+        pScheduler->marginNs *= 2;
+        if (pScheduler->marginNs > pScheduler->refreshPeriodNs / 2) {
+            pScheduler->marginNs = pScheduler->refreshPeriodNs / 2;
+        }
+        // The frame goes out a vblank later than planned.
+        latencyNs += pScheduler->refreshPeriodNs;
+    } else if (++pScheduler->onTimeFrames * pScheduler->refreshPeriodNs >= 1000000000ull) {
+        pScheduler->onTimeFrames = 0;
+        pScheduler->marginNs -= pScheduler->marginNs / 8;
+        if (pScheduler->marginNs < MIN_MARGIN_NS) {
+            pScheduler->marginNs = MIN_MARGIN_NS;
+        }
+    }
+
+    pScheduler->frames++;
+    pScheduler->latencySumNs += latencyNs;
+    if (latencyNs > pScheduler->latencyMaxNs) {
+        pScheduler->latencyMaxNs = latencyNs;
+    }
+    if (costNs > pScheduler->costMaxNs) {
+        pScheduler->costMaxNs = costNs;
+    }
+}
+
+// Every 5 seconds, or with final set, for whatever the last report left
+void PrintScheduleStats(struct FrameScheduler *pScheduler, int final)
+{
+    uint64_t now = GetMonotonicNs();
+    double seconds;
+
+    if (pScheduler->reportStartNs == 0) {
+        pScheduler->reportStartNs = now;
+    }
+
+    seconds = (now - pScheduler->reportStartNs) / 1e9;
+
+    if ((final ? seconds <= 0.0 : seconds <= 5.0) || pScheduler->frames == 0) {
+        return;
+    }
+
+    printf("%s%s%u frames scheduled in %3.1f seconds: sample-to-scanout latency "
+           "avg %.3f ms, max %.3f ms; render cost predicted %.3f ms, max %.3f ms; "
+           "margin %.3f ms; %u missed deadlines\n",
+           pScheduler->name, pScheduler->name[0] ? ": " : "",
+           pScheduler->frames, seconds,
+           pScheduler->latencySumNs / 1e6 / pScheduler->frames,
+           pScheduler->latencyMaxNs / 1e6,
+           pScheduler->predictedNs / 1e6,
+           pScheduler->costMaxNs / 1e6,
+           pScheduler->marginNs / 1e6,
+           pScheduler->missedDeadlines);
+    fflush(stdout);
+
+    pScheduler->reportStartNs = now;
+    pScheduler->frames = 0;
+    pScheduler->missedDeadlines = 0;
+    pScheduler->latencySumNs = 0;
+    pScheduler->latencyMaxNs = 0;
+    pScheduler->costMaxNs = 0;
+}
@@ -0,0 +1,34 @@
+#if !defined(SCHEDULE_H)
+#define SCHEDULE_H
+
+#include <stdint.h>
+
+#define SCHEDULE_HISTORY 32     // frames whose render cost predicts the next
+
+struct FrameScheduler {
+    char name[32];              // prefix for reports, if not empty
+    uint64_t refreshPeriodNs;
+
+    uint64_t costsNs[SCHEDULE_HISTORY];
+    unsigned int nextCost;
+    uint64_t predictedNs;       // render cost the current frame was started for
+    uint64_t marginNs;          // slack left on top of the prediction
+    unsigned int onTimeFrames;  // since the margin last grew
+
+    uint64_t wakeNs;            // when the current frame was started
+    uint64_t deadlineNs;        // the vblank it is meant for
+
+    // Accumulated since the last report
+    uint64_t reportStartNs;
+    unsigned int frames;
+    unsigned int missedDeadlines;
+    uint64_t latencySumNs, latencyMaxNs;
+    uint64_t costMaxNs;
+};
+
+void InitFrameScheduler(struct FrameScheduler *pScheduler, double refreshRate);
+void WaitForFrameDeadline(struct FrameScheduler *pScheduler, uint64_t lastVblankNs);
+void FrameReady(struct FrameScheduler *pScheduler);
+void PrintScheduleStats(struct FrameScheduler *pScheduler, int final);
+
+#endif /* SCHEDULE_H */
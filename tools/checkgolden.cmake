@@ -0,0 +1,64 @@
+# Render a fixed number of deterministic frames offscreen and compare them
+# against the golden capture checked in under tests/golden, frame by
+# frame, with imagecmp.  Run by ctest; see BUILD_IMAGE_COMPARE in
+# CMakeLists.txt.  A missing golden capture fails the test.
+#
+# With UPDATE set, as by the update-goldens target, the capture replaces
+# the golden one instead, e.g. after an intended change to the rendering.
+#
+# Expects EXAMPLE, GOLDEN (a .tar.xz holding one capture named like
+# CANDIDATE), CANDIDATE, WIDTH, HEIGHT and FRAMES, and unless UPDATE is
+# set, IMAGECMP and MIN_PSNR.
+
+get_filename_component(candidateDir "${CANDIDATE}" DIRECTORY)
+get_filename_component(candidateName "${CANDIDATE}" NAME)
+
+if(NOT UPDATE AND NOT EXISTS "${GOLDEN}")
+    message(FATAL_ERROR "No golden capture ${GOLDEN}; build the update-goldens target to make one")
+endif()
+
+execute_process(
+    COMMAND "${EXAMPLE}" --offscreen ${WIDTH} ${HEIGHT} 0 --fixed-timestep
+            --frames ${FRAMES} --capture "${CANDIDATE}"
+    RESULT_VARIABLE ret
+)
+if(NOT ret EQUAL 0)
+    message(FATAL_ERROR "Rendering ${FRAMES} frames offscreen failed: ${ret}")
+endif()
+
+if(UPDATE)
+    get_filename_component(goldenDir "${GOLDEN}" DIRECTORY)
+    file(MAKE_DIRECTORY "${goldenDir}")
+    execute_process(
+        COMMAND "${CMAKE_COMMAND}" -E tar cJf "${GOLDEN}" --mtime=1970-01-01 "${candidateName}"
+        WORKING_DIRECTORY "${candidateDir}"
+        RESULT_VARIABLE ret
+    )
+    if(NOT ret EQUAL 0)
+        message(FATAL_ERROR "Unable to write ${GOLDEN}: ${ret}")
+    endif()
+    message(STATUS "Saved ${CANDIDATE} as ${GOLDEN}")
+    return()
+endif()
+
+file(REMOVE_RECURSE "${candidateDir}/golden")
+file(MAKE_DIRECTORY "${candidateDir}/golden")
+execute_process(
+    COMMAND "${CMAKE_COMMAND}" -E tar xJf "${GOLDEN}"
+    WORKING_DIRECTORY "${candidateDir}/golden"
+    RESULT_VARIABLE ret
+)
+if(NOT ret EQUAL 0 OR NOT EXISTS "${candidateDir}/golden/${candidateName}")
+    message(FATAL_ERROR "${GOLDEN} holds no ${candidateName}")
+endif()
+
+# Any channel may differ, e.g. at edges rasterized by another llvmpipe
+# build, as long as the frame as a whole stays within MIN_PSNR.
+execute_process(
+    COMMAND "${IMAGECMP}" ${WIDTH} ${HEIGHT} "${candidateDir}/golden/${candidateName}"
+            "${CANDIDATE}" 255 ${MIN_PSNR}
+    RESULT_VARIABLE ret
+)
+if(NOT ret EQUAL 0)
+    message(FATAL_ERROR "${CANDIDATE} differs from ${GOLDEN}")
+endif()
@@ -0,0 +1,2031 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "fakedrm.h"
+
+#define MAX_OBJECT_PROPS 32
+#define MAX_ENUMS 12
+#define MAX_MODES 16
+#define MAX_EVENTS 16
+#define MAX_POLL_FDS 8
+#define MAX_HOTPLUGS 32
+
+struct FakePropInfo {
+    uint32_t id;
+    uint32_t flags;
+    char name[DRM_PROP_NAME_LEN];
+    int count_enums;
+    struct drm_mode_property_enum enums[MAX_ENUMS];
+    uint64_t range[2];
+};
+
+struct FakeObject {
+    uint32_t id;
+    uint32_t type;
+    int count_props;
+    uint32_t props[MAX_OBJECT_PROPS];
+    uint64_t values[MAX_OBJECT_PROPS];
+};
+
+struct FakeConnector {
+    uint32_t id;
+    uint32_t encoderID;
+    int connected;
+    uint32_t edid; // blob shown again when replugged, if any
+    int active; // scanning out its first mode when the topology is loaded
+    int count_modes;
+    drmModeModeInfo modes[MAX_MODES];
+};
+
+struct FakeEncoder {
+    uint32_t id;
+    uint32_t possibleCrtcs;
+};
+
+struct FakePlane {
+    uint32_t id;
+    uint32_t possibleCrtcs;
+};
+
+struct FakeBlob {
+    uint32_t id;
+    size_t size;
+    void *data;
+};
+
+struct FakeDumb {
+    uint32_t handle;
+    uint64_t size;
+    uint64_t offset; // into the "device" file
+};
+
+struct FakeEvent {
+    uint32_t crtcID;
+    void *userData;
+    uint64_t timeNs;
+    unsigned int sequence;
+};
+
+struct FakeDevice {
+    int loaded;
+    uint32_t nextID;
+
+    int count_infos;
+    struct FakePropInfo *infos;
+    int count_objects;
+    struct FakeObject *objects;
+
+    int count_crtcs;
+    uint32_t *crtcs;
+    uint64_t *crtcFlipNs;           // last flip queued on each CRTC,
+    unsigned int *crtcSequences;    // for adaptive sync
+    int count_connectors;
+    struct FakeConnector *connectors;
+    int count_encoders;
+    struct FakeEncoder *encoders;
+    int count_planes;
+    struct FakePlane *planes;
+    int count_blobs;
+    struct FakeBlob *blobs;
+    int count_fbs;
+    uint32_t *fbs;
+    int count_dumbs;
+    struct FakeDumb *dumbs;
+    uint64_t dumbEnd; // of the last dumb buffer's backing, if full size
+
+    uint32_t maxClock; // in kHz; modes above it fail atomic checks, if set
+
+    uint64_t epochNs; // vblank 0 of every CRTC
+    int count_events;
+    struct FakeEvent events[MAX_EVENTS];
+
+    struct FakeDrmStats stats;
+};
+
+struct _drmModeAtomicReq {
+    int cursor;
+    int size;
+    struct {
+        uint32_t objectID;
+        uint32_t propertyID;
+        uint64_t value;
+    } *items;
+};
+
+static struct FakeDevice dev;
+
+/*
+ * epoll refuses regular files, which the fake device is, so a DRM fd
+ * added to an epoll set is swapped for a dup of a timerfd that expires
+ * when the earliest pending flip completes (see epoll_ctl() below).
+ * These belong to the process rather than the topology.
+ */
+static int eventTimer = -1;
+static int count_pollFds;
+static struct {
+    int drmFd;
+    int timerFd;
+} pollFds[MAX_POLL_FDS];
+
+/*
+ * Number of ioctls the real libdrm issues for each call; queries that
+ * return variable length arrays first ask for the sizes.
+ */
+static const struct {
+    const char *name;
+    unsigned int ioctls;
+} callInfo[FAKE_DRM_CALL_COUNT] = {
+    [FAKE_DRM_GET_RESOURCES] = { "drmModeGetResources", 2 },
+    [FAKE_DRM_GET_CONNECTOR] = { "drmModeGetConnector", 2 },
+    [FAKE_DRM_GET_ENCODER] = { "drmModeGetEncoder", 1 },
+    [FAKE_DRM_GET_CRTC] = { "drmModeGetCrtc", 1 },
+    [FAKE_DRM_GET_PLANE_RESOURCES] = { "drmModeGetPlaneResources", 2 },
+    [FAKE_DRM_GET_PLANE] = { "drmModeGetPlane", 2 },
+    [FAKE_DRM_OBJECT_GET_PROPERTIES] = { "drmModeObjectGetProperties", 2 },
+    [FAKE_DRM_GET_PROPERTY] = { "drmModeGetProperty", 2 },
+    [FAKE_DRM_GET_PROPERTY_BLOB] = { "drmModeGetPropertyBlob", 2 },
+    [FAKE_DRM_CREATE_PROPERTY_BLOB] = { "drmModeCreatePropertyBlob", 1 },
+    [FAKE_DRM_DESTROY_PROPERTY_BLOB] = { "drmModeDestroyPropertyBlob", 1 },
+    [FAKE_DRM_ATOMIC_COMMIT] = { "drmModeAtomicCommit", 1 },
+    [FAKE_DRM_ADD_FB] = { "drmModeAddFB", 1 },
+    [FAKE_DRM_RM_FB] = { "drmModeRmFB", 1 },
+    [FAKE_DRM_IOCTL] = { "drmIoctl", 1 },
+    [FAKE_DRM_CAP] = { "drmSetClientCap/drmGetCap", 1 },
+    [FAKE_DRM_READ_EVENTS] = { "drmHandleEvent", 0 },
+    [FAKE_DRM_GET_SEQUENCE] = { "drmCrtcGetSequence", 1 },
+};
+
+/*
+ * Properties of each object type, roughly what current drivers expose,
+ * so that property lookups cost about as much as on real hardware.
+ * Enum entries take the value of their position in the list.
+ */
+struct PropTemplate {
+    const char *name;
+    uint32_t flags;
+    const char *enums[MAX_ENUMS];
+};
+
+static const struct PropTemplate crtcProps[] = {
+    { "ACTIVE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "MODE_ID", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "OUT_FENCE_PTR", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "VRR_ENABLED", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "DEGAMMA_LUT", DRM_MODE_PROP_BLOB, { NULL } },
+    { "DEGAMMA_LUT_SIZE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, { NULL } },
+    { "CTM", DRM_MODE_PROP_BLOB, { NULL } },
+    { "GAMMA_LUT", DRM_MODE_PROP_BLOB, { NULL } },
+    { "GAMMA_LUT_SIZE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, { NULL } },
+    { "NV_CRTC_REGAMMA_TF", DRM_MODE_PROP_ENUM,
+      { "Default", "sRGB", "PQ (Perceptual Quantizer)", NULL } },
+};
+
+static const struct PropTemplate planeProps[] = {
+    { "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE,
+      { "Overlay", "Primary", "Cursor", NULL } },
+    { "FB_ID", DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "IN_FENCE_FD", DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "CRTC_ID", DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "SRC_X", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "SRC_Y", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "SRC_W", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "SRC_H", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "CRTC_X", DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "CRTC_Y", DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "CRTC_W", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "CRTC_H", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "IN_FORMATS", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE, { NULL } },
+    { "rotation", DRM_MODE_PROP_BITMASK, { "rotate-0", NULL } },
+    { "zpos", DRM_MODE_PROP_RANGE, { NULL } },
+    { "alpha", DRM_MODE_PROP_RANGE, { NULL } },
+    { "pixel blend mode", DRM_MODE_PROP_ENUM, { "None", "Pre-multiplied", "Coverage", NULL } },
+};
+
+static const struct PropTemplate connectorProps[] = {
+    { "EDID", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE, { NULL } },
+    { "DPMS", DRM_MODE_PROP_ENUM, { "On", "Standby", "Suspend", "Off", NULL } },
+    { "link-status", DRM_MODE_PROP_ENUM, { "Good", "Bad", NULL } },
+    { "non-desktop", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, { NULL } },
+    { "TILE", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE, { NULL } },
+    { "CRTC_ID", DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC, { NULL } },
+    { "max bpc", DRM_MODE_PROP_RANGE, { NULL } },
+    { "Colorspace", DRM_MODE_PROP_ENUM,
+      { "Default", "SMPTE_170M_YCC", "BT709_YCC", "XVYCC_601", "XVYCC_709",
+        "SYCC_601", "opYCC_601", "opRGB", "BT2020_CYCC", "BT2020_RGB",
+        "BT2020_YCC", NULL } },
+    { "HDR_OUTPUT_METADATA", DRM_MODE_PROP_BLOB, { NULL } },
+    { "vrr_capable", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, { NULL } },
+};
+
+static void Count(enum FakeDrmCall call)
+{
+    dev.stats.calls[call]++;
+    dev.stats.ioctls += callInfo[call].ioctls;
+}
+
+static void *Alloc(size_t size)
+{
+    void *ptr = calloc(1, size ? size : 1);
+
+    if (ptr == NULL) {
+        fprintf(stderr, "fakedrm: out of memory\n");
+        abort();
+    }
+
+    return ptr;
+}
+
+static void *Grow(void *array, int count, size_t elementSize)
+{
+    void *ptr = realloc(array, (count + 1) * elementSize);
+
+    if (ptr == NULL) {
+        fprintf(stderr, "fakedrm: out of memory\n");
+        abort();
+    }
+
+    memset((char *)ptr + count * elementSize, 0, elementSize);
+
+    return ptr;
+}
+
+static struct FakePropInfo *FindInfo(uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < dev.count_infos; i++) {
+        if (dev.infos[i].id == id) {
+            return &dev.infos[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Property IDs are per device, shared by every object with that property.
+static uint32_t RegisterProperty(const struct PropTemplate *pTemplate)
+{
+    struct FakePropInfo *pInfo;
+    int i;
+
+    for (i = 0; i < dev.count_infos; i++) {
+        if (strcmp(dev.infos[i].name, pTemplate->name) == 0) {
+            return dev.infos[i].id;
+        }
+    }
+
+    dev.infos = Grow(dev.infos, dev.count_infos, sizeof(*dev.infos));
+    pInfo = &dev.infos[dev.count_infos++];
+
+    pInfo->id = dev.nextID++;
+    pInfo->flags = pTemplate->flags;
+    snprintf(pInfo->name, sizeof(pInfo->name), "%s", pTemplate->name);
+    pInfo->range[1] = UINT32_MAX;
+
+    for (i = 0; i < MAX_ENUMS && pTemplate->enums[i] != NULL; i++) {
+        pInfo->enums[i].value = i;
+        snprintf(pInfo->enums[i].name, sizeof(pInfo->enums[i].name), "%s",
+                 pTemplate->enums[i]);
+    }
+    pInfo->count_enums = i;
+
+    return pInfo->id;
+}
+
+static struct FakeObject *FindObject(uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < dev.count_objects; i++) {
+        if (dev.objects[i].id == id) {
+            return &dev.objects[i];
+        }
+    }
+
+    return NULL;
+}
+
+static uint32_t AddObject(uint32_t type, const struct PropTemplate *templates, int count)
+{
+    struct FakeObject *pObject;
+    int i;
+
+    dev.objects = Grow(dev.objects, dev.count_objects, sizeof(*dev.objects));
+    pObject = &dev.objects[dev.count_objects++];
+
+    pObject->id = dev.nextID++;
+    pObject->type = type;
+
+    for (i = 0; i < count && i < MAX_OBJECT_PROPS; i++) {
+        pObject->props[i] = RegisterProperty(&templates[i]);
+    }
+    pObject->count_props = i;
+
+    return pObject->id;
+}
+
+static int FindObjectProperty(const struct FakeObject *pObject, const char *name)
+{
+    int i;
+
+    for (i = 0; i < pObject->count_props; i++) {
+        if (strcmp(FindInfo(pObject->props[i])->name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void SetObjectProperty(uint32_t objectID, const char *name, uint64_t value)
+{
+    struct FakeObject *pObject = FindObject(objectID);
+    int i = FindObjectProperty(pObject, name);
+
+    if (i >= 0) {
+        pObject->values[i] = value;
+    }
+}
+
+static uint64_t GetObjectProperty(uint32_t objectID, const char *name)
+{
+    struct FakeObject *pObject = FindObject(objectID);
+    int i = pObject ? FindObjectProperty(pObject, name) : -1;
+
+    return i >= 0 ? pObject->values[i] : 0;
+}
+
+static uint64_t NowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Make the polled fds readable once the earliest pending flip is due.
+static void ArmEventTimer(void)
+{
+    struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+    uint64_t firstNs = UINT64_MAX;
+    int i;
+
+    if (eventTimer < 0) {
+        return;
+    }
+
+    for (i = 0; i < dev.count_events; i++) {
+        if (dev.events[i].timeNs < firstNs) {
+            firstNs = dev.events[i].timeNs;
+        }
+    }
+
+    // A zero expiry disarms the timer, and clears any expiration.
+    if (firstNs != UINT64_MAX) {
+        spec.it_value.tv_sec = firstNs / 1000000000ull;
+        spec.it_value.tv_nsec = firstNs % 1000000000ull;
+    }
+    timerfd_settime(eventTimer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static int IsPolled(int fd)
+{
+    int i;
+
+    for (i = 0; i < count_pollFds; i++) {
+        if (pollFds[i].drmFd == fd) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Drop the current topology; call counts carry over.
+static void Reset(void)
+{
+    struct FakeDrmStats stats = dev.stats;
+    int i;
+
+    for (i = 0; i < dev.count_blobs; i++) {
+        free(dev.blobs[i].data);
+    }
+    free(dev.blobs);
+    free(dev.infos);
+    free(dev.objects);
+    free(dev.crtcs);
+    free(dev.crtcFlipNs);
+    free(dev.crtcSequences);
+    free(dev.connectors);
+    free(dev.encoders);
+    free(dev.planes);
+    free(dev.fbs);
+    free(dev.dumbs);
+
+    memset(&dev, 0, sizeof(dev));
+    dev.stats = stats;
+    dev.nextID = 1;
+    dev.loaded = 1;
+    dev.epochNs = NowNs();
+
+    ArmEventTimer();
+}
+
+static uint32_t AddBlob(const void *data, size_t size)
+{
+    struct FakeBlob *pBlob;
+
+    dev.blobs = Grow(dev.blobs, dev.count_blobs, sizeof(*dev.blobs));
+    pBlob = &dev.blobs[dev.count_blobs++];
+    pBlob->id = dev.nextID++;
+    pBlob->size = size;
+    pBlob->data = Alloc(size);
+    memcpy(pBlob->data, data, size);
+
+    return pBlob->id;
+}
+
+/*
+ * A minimal EDID 1.4 base block: just the header and a display range
+ * limits descriptor carrying the adaptive sync range.
+ */
+static uint32_t AddVrrEdid(int minRefresh, int maxRefresh)
+{
+    uint8_t edid[128] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+    uint8_t *pRange = &edid[54];
+    uint8_t sum = 0;
+    int i;
+
+    edid[18] = 1;
+    edid[19] = 4;
+
+    pRange[3] = 0xfd;
+    if (maxRefresh > 255) {
+        pRange[4] |= 0x2;
+        maxRefresh -= 255;
+    }
+    pRange[5] = minRefresh;
+    pRange[6] = maxRefresh;
+
+    for (i = 0; i < 127; i++) {
+        sum += edid[i];
+    }
+    edid[127] = -sum;
+
+    return AddBlob(edid, sizeof(edid));
+}
+
+// Generate timings with a fixed blanking interval for the given refresh.
+static int ParseMode(const char *str, drmModeModeInfo *pMode)
+{
+    int width, height;
+    double refresh = 60.0;
+
+    if (sscanf(str, "%dx%d@%lf", &width, &height, &refresh) < 2 ||
+        width <= 0 || height <= 0 || refresh <= 0.0) {
+        return -EINVAL;
+    }
+
+    memset(pMode, 0, sizeof(*pMode));
+    pMode->hdisplay = width;
+    pMode->hsync_start = width + 48;
+    pMode->hsync_end = width + 80;
+    pMode->htotal = width + 160;
+    pMode->vdisplay = height;
+    pMode->vsync_start = height + 3;
+    pMode->vsync_end = height + 8;
+    pMode->vtotal = height + (height / 25 > 20 ? height / 25 : 20);
+    pMode->clock = (uint32_t)lround(pMode->htotal * (double)pMode->vtotal * refresh / 1000.0);
+    pMode->vrefresh = (uint32_t)lround(refresh);
+    pMode->type = DRM_MODE_TYPE_DRIVER;
+    snprintf(pMode->name, sizeof(pMode->name), "%dx%d", width, height);
+
+    return 0;
+}
+
+static int AddConnector(char *modes)
+{
+    struct FakeConnector *pConnector;
+    struct FakeEncoder *pEncoder;
+    char *saveptr = NULL, *token;
+
+    dev.connectors = Grow(dev.connectors, dev.count_connectors, sizeof(*dev.connectors));
+    pConnector = &dev.connectors[dev.count_connectors++];
+    pConnector->id = AddObject(DRM_MODE_OBJECT_CONNECTOR, connectorProps,
+                               sizeof(connectorProps) / sizeof(connectorProps[0]));
+    pConnector->connected = 1;
+
+    for (token = strtok_r(modes, " \t", &saveptr); token != NULL;
+         token = strtok_r(NULL, " \t", &saveptr)) {
+
+        if (strcmp(token, "disconnected") == 0) {
+            pConnector->connected = 0;
+            continue;
+        }
+
+        if (strcmp(token, "active") == 0) {
+            pConnector->active = 1;
+            continue;
+        }
+
+        if (strncmp(token, "vrr=", 4) == 0) {
+            int minRefresh, maxRefresh;
+
+            if (sscanf(token + 4, "%d-%d", &minRefresh, &maxRefresh) != 2 ||
+                minRefresh <= 0 || maxRefresh < minRefresh || maxRefresh > 510) {
+                return -EINVAL;
+            }
+            SetObjectProperty(pConnector->id, "vrr_capable", 1);
+            SetObjectProperty(pConnector->id, "EDID", AddVrrEdid(minRefresh, maxRefresh));
+            continue;
+        }
+
+        if (pConnector->count_modes == MAX_MODES ||
+            ParseMode(token, &pConnector->modes[pConnector->count_modes]) != 0) {
+            return -EINVAL;
+        }
+        pConnector->count_modes++;
+    }
+
+    // Disconnected connectors get modes too, for when they are plugged in.
+    if (pConnector->count_modes == 0) {
+        ParseMode("1920x1080@60", &pConnector->modes[0]);
+        pConnector->count_modes = 1;
+    }
+    if (pConnector->count_modes > 0) {
+        pConnector->modes[0].type |= DRM_MODE_TYPE_PREFERRED;
+    }
+
+    // One encoder per connector; possible CRTCs are filled in later.
+    dev.encoders = Grow(dev.encoders, dev.count_encoders, sizeof(*dev.encoders));
+    pEncoder = &dev.encoders[dev.count_encoders++];
+    pEncoder->id = dev.nextID++;
+    pConnector->encoderID = pEncoder->id;
+
+    return 0;
+}
+
+/*
+ * Leave the connector lit up on the CRTC with the given index, as the
+ * console would after boot: the CRTC shows the connector's preferred
+ * mode, and its primary plane scans out an fb of that size.
+ */
+static void LightUpConnector(const struct FakeConnector *pConnector, int crtc, int overlays)
+{
+    uint32_t crtcID = dev.crtcs[crtc];
+    uint32_t planeID = dev.planes[crtc * (overlays + 1)].id;
+    const drmModeModeInfo *pMode = &pConnector->modes[0];
+
+    dev.fbs = Grow(dev.fbs, dev.count_fbs, sizeof(*dev.fbs));
+    dev.fbs[dev.count_fbs] = dev.nextID++;
+
+    SetObjectProperty(crtcID, "ACTIVE", 1);
+    SetObjectProperty(crtcID, "MODE_ID", AddBlob(pMode, sizeof(*pMode)));
+    SetObjectProperty(pConnector->id, "CRTC_ID", crtcID);
+    SetObjectProperty(planeID, "FB_ID", dev.fbs[dev.count_fbs++]);
+    SetObjectProperty(planeID, "CRTC_ID", crtcID);
+    SetObjectProperty(planeID, "SRC_W", (uint64_t)pMode->hdisplay << 16);
+    SetObjectProperty(planeID, "SRC_H", (uint64_t)pMode->vdisplay << 16);
+    SetObjectProperty(planeID, "CRTC_W", pMode->hdisplay);
+    SetObjectProperty(planeID, "CRTC_H", pMode->vdisplay);
+}
+
+/*
+ * Replace the current topology with the one described; see fakedrm.h
+ * for the format.  Returns 0 on success or -EINVAL.
+ */
+int FakeDrmLoadTopology(const char *description)
+{
+    char *copy, *line, *saveptr = NULL;
+    int crtcs = -1, overlays = 1, active = 0, ret = 0, i, j;
+
+    Reset();
+
+    copy = strdup(description ? description : "");
+    if (copy == NULL) {
+        return -ENOMEM;
+    }
+
+    for (line = strtok_r(copy, "\n", &saveptr); line != NULL && ret == 0;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        char *comment = strchr(line, '#');
+        char keyword[32];
+        int consumed = 0;
+
+        if (comment) {
+            *comment = '\0';
+        }
+
+        if (sscanf(line, " %31s %n", keyword, &consumed) < 1) {
+            continue;
+        }
+
+        if (strcmp(keyword, "crtcs") == 0) {
+            ret = sscanf(line + consumed, "%d", &crtcs) == 1 ? 0 : -EINVAL;
+        } else if (strcmp(keyword, "overlays") == 0) {
+            ret = sscanf(line + consumed, "%d", &overlays) == 1 ? 0 : -EINVAL;
+        } else if (strcmp(keyword, "connector") == 0) {
+            ret = AddConnector(line + consumed);
+        } else if (strcmp(keyword, "maxclock") == 0) {
+            ret = sscanf(line + consumed, "%u", &dev.maxClock) == 1 ? 0 : -EINVAL;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+
+    free(copy);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (dev.count_connectors == 0) {
+        char mode[] = "1920x1080@60";
+        AddConnector(mode);
+    }
+
+    if (crtcs < 0) {
+        crtcs = dev.count_connectors;
+    }
+    if (crtcs > 32) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < crtcs; i++) {
+        uint32_t crtcID = AddObject(DRM_MODE_OBJECT_CRTC, crtcProps,
+                                    sizeof(crtcProps) / sizeof(crtcProps[0]));
+
+        dev.crtcs = Grow(dev.crtcs, dev.count_crtcs, sizeof(*dev.crtcs));
+        dev.crtcFlipNs = Grow(dev.crtcFlipNs, dev.count_crtcs, sizeof(*dev.crtcFlipNs));
+        dev.crtcSequences = Grow(dev.crtcSequences, dev.count_crtcs,
+                                 sizeof(*dev.crtcSequences));
+        dev.crtcs[dev.count_crtcs++] = crtcID;
+
+        // A primary plane plus the requested overlays, all tied to this CRTC
+        for (j = 0; j <= overlays; j++) {
+            struct FakePlane *pPlane;
+
+            dev.planes = Grow(dev.planes, dev.count_planes, sizeof(*dev.planes));
+            pPlane = &dev.planes[dev.count_planes++];
+            pPlane->id = AddObject(DRM_MODE_OBJECT_PLANE, planeProps,
+                                   sizeof(planeProps) / sizeof(planeProps[0]));
+            pPlane->possibleCrtcs = 1u << i;
+
+            SetObjectProperty(pPlane->id, "type",
+                              j == 0 ? DRM_PLANE_TYPE_PRIMARY : DRM_PLANE_TYPE_OVERLAY);
+            SetObjectProperty(pPlane->id, "zpos", j);
+            SetObjectProperty(pPlane->id, "alpha", 0xffff);
+        }
+    }
+
+    // Every encoder can drive every CRTC.
+    for (i = 0; i < dev.count_encoders; i++) {
+        dev.encoders[i].possibleCrtcs = (crtcs == 32) ? UINT32_MAX : (1u << crtcs) - 1;
+    }
+
+    for (i = 0; i < dev.count_connectors; i++) {
+        SetObjectProperty(dev.connectors[i].id, "DPMS", 0);
+        SetObjectProperty(dev.connectors[i].id, "max bpc", 8);
+
+        if (dev.connectors[i].active && dev.connectors[i].connected) {
+            if (active == crtcs) {
+                return -EINVAL;
+            }
+            LightUpConnector(&dev.connectors[i], active++, overlays);
+        }
+    }
+
+    return 0;
+}
+
+int FakeDrmLoadTopologyFile(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char *description;
+    long size;
+    int ret;
+
+    if (file == NULL) {
+        return -errno;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    description = Alloc(size + 1);
+    if (fread(description, 1, size, file) != (size_t)size) {
+        size = 0;
+    }
+    description[size] = '\0';
+    fclose(file);
+
+    ret = FakeDrmLoadTopology(description);
+    free(description);
+
+    return ret;
+}
+
+/*
+ * Entry points that use the device hold this lock for their whole body,
+ * so that several render threads can call into the library at once.
+ * It is recursive since some entry points call others.
+ */
+static pthread_mutex_t deviceLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static void UnlockDevice(int *pLocked)
+{
+    (void)pLocked;
+    pthread_mutex_unlock(&deviceLock);
+}
+
+#define LOCK_DEVICE() \
+    int deviceLocked __attribute__((cleanup(UnlockDevice), unused)) = \
+        pthread_mutex_lock(&deviceLock)
+
+static void StartHotplugSchedule(const char *schedule);
+
+// Load FAKEDRM_TOPOLOGY (or the default) on first use when preloaded.
+static void EnsureLoaded(void)
+{
+    const char *path;
+
+    if (dev.loaded) {
+        return;
+    }
+
+    path = getenv("FAKEDRM_TOPOLOGY");
+
+    if (path != NULL && FakeDrmLoadTopologyFile(path) != 0) {
+        fprintf(stderr, "fakedrm: unable to load topology from %s\n", path);
+        exit(1);
+    }
+
+    if (path == NULL) {
+        FakeDrmLoadTopology(NULL);
+    }
+
+    if (getenv("FAKEDRM_HOTPLUG") != NULL) {
+        StartHotplugSchedule(getenv("FAKEDRM_HOTPLUG"));
+    }
+}
+
+void FakeDrmGetStats(struct FakeDrmStats *pStats)
+{
+    *pStats = dev.stats;
+}
+
+void FakeDrmResetStats(void)
+{
+    memset(&dev.stats, 0, sizeof(dev.stats));
+}
+
+const char *FakeDrmCallName(enum FakeDrmCall call)
+{
+    return callInfo[call].name;
+}
+
+__attribute__((destructor))
+static void PrintStatsAtExit(void)
+{
+    int i;
+
+    if (getenv("FAKEDRM_STATS") == NULL || !dev.loaded) {
+        return;
+    }
+
+    fprintf(stderr, "fakedrm: %lu ioctls\n", dev.stats.ioctls);
+    for (i = 0; i < FAKE_DRM_CALL_COUNT; i++) {
+        if (dev.stats.calls[i] != 0) {
+            fprintf(stderr, "fakedrm:   %-28s %lu\n", callInfo[i].name, dev.stats.calls[i]);
+        }
+    }
+}
+
+
+/* libdrm entry points */
+
+int drmSetClientCap(int fd, uint64_t capability, uint64_t value)
+{
+    (void)fd; (void)capability; (void)value;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_CAP);
+
+    return 0;
+}
+
+int drmGetCap(int fd, uint64_t capability, uint64_t *value)
+{
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_CAP);
+
+    switch (capability) {
+    case DRM_CAP_DUMB_BUFFER:
+    case DRM_CAP_TIMESTAMP_MONOTONIC:
+        *value = 1;
+        return 0;
+    default:
+        *value = 0;
+        return -EINVAL;
+    }
+}
+
+static struct FakeDumb *FindDumb(uint32_t handle)
+{
+    int i;
+
+    for (i = 0; i < dev.count_dumbs; i++) {
+        if (dev.dumbs[i].handle == handle) {
+            return &dev.dumbs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Dumb buffers report a single page as their size, so that mapping and
+ * clearing them costs the same for every mode, unless
+ * FAKEDRM_DUMB_MEMORY is set: then each has its real size and backing
+ * of its own, so that the memory it takes shows up when it is mapped.
+ * The mapping is backed by the "device" file itself, which must be a
+ * regular file or memfd; destroying a buffer frees its backing.
+ */
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+    static uint32_t nextHandle = 1;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_IOCTL);
+
+    if (request == DRM_IOCTL_MODE_CREATE_DUMB) {
+        struct drm_mode_create_dumb *pCreate = arg;
+        struct FakeDumb *pDumb;
+
+        pCreate->handle = nextHandle++;
+        pCreate->pitch = pCreate->width * ((pCreate->bpp + 7) / 8);
+        pCreate->size = 4096;
+
+        dev.dumbs = Grow(dev.dumbs, dev.count_dumbs, sizeof(*dev.dumbs));
+        pDumb = &dev.dumbs[dev.count_dumbs++];
+        pDumb->handle = pCreate->handle;
+
+        if (getenv("FAKEDRM_DUMB_MEMORY") != NULL) {
+            pCreate->size = ((uint64_t)pCreate->pitch * pCreate->height + 4095) & ~4095ull;
+            pDumb->offset = dev.dumbEnd;
+            dev.dumbEnd += pCreate->size;
+        }
+        pDumb->size = pCreate->size;
+        return 0;
+    }
+
+    if (request == DRM_IOCTL_MODE_MAP_DUMB) {
+        struct drm_mode_map_dumb *pMap = arg;
+        struct FakeDumb *pDumb = FindDumb(pMap->handle);
+        struct stat st;
+
+        if (pDumb == NULL) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (uint64_t)st.st_size < pDumb->offset + pDumb->size &&
+            ftruncate(fd, pDumb->offset + pDumb->size) != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        pMap->offset = pDumb->offset;
+        return 0;
+    }
+
+    if (request == DRM_IOCTL_MODE_DESTROY_DUMB) {
+        struct drm_mode_destroy_dumb *pDestroy = arg;
+        struct FakeDumb *pDumb = FindDumb(pDestroy->handle);
+
+        if (pDumb == NULL) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        if (getenv("FAKEDRM_DUMB_MEMORY") != NULL) {
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      pDumb->offset, pDumb->size);
+        }
+        *pDumb = dev.dumbs[--dev.count_dumbs];
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+drmModeResPtr drmModeGetResources(int fd)
+{
+    drmModeResPtr pRes;
+    int i;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_RESOURCES);
+
+    pRes = Alloc(sizeof(*pRes));
+    pRes->count_crtcs = dev.count_crtcs;
+    pRes->crtcs = Alloc(dev.count_crtcs * sizeof(uint32_t));
+    memcpy(pRes->crtcs, dev.crtcs, dev.count_crtcs * sizeof(uint32_t));
+
+    pRes->count_connectors = dev.count_connectors;
+    pRes->connectors = Alloc(dev.count_connectors * sizeof(uint32_t));
+    for (i = 0; i < dev.count_connectors; i++) {
+        pRes->connectors[i] = dev.connectors[i].id;
+    }
+
+    pRes->count_encoders = dev.count_encoders;
+    pRes->encoders = Alloc(dev.count_encoders * sizeof(uint32_t));
+    for (i = 0; i < dev.count_encoders; i++) {
+        pRes->encoders[i] = dev.encoders[i].id;
+    }
+
+    pRes->count_fbs = dev.count_fbs;
+    pRes->fbs = Alloc(dev.count_fbs * sizeof(uint32_t));
+    memcpy(pRes->fbs, dev.fbs, dev.count_fbs * sizeof(uint32_t));
+
+    pRes->max_width = pRes->max_height = 16384;
+
+    return pRes;
+}
+
+void drmModeFreeResources(drmModeResPtr ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    free(ptr->fbs);
+    free(ptr->crtcs);
+    free(ptr->connectors);
+    free(ptr->encoders);
+    free(ptr);
+}
+
+static drmModeConnectorPtr GetConnector(uint32_t connectorId)
+{
+    drmModeConnectorPtr pConnector;
+    struct FakeObject *pObject;
+    int i;
+
+    for (i = 0; i < dev.count_connectors; i++) {
+        if (dev.connectors[i].id == connectorId) {
+            break;
+        }
+    }
+
+    if (i == dev.count_connectors) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    pObject = FindObject(connectorId);
+    pConnector = Alloc(sizeof(*pConnector));
+    pConnector->connector_id = connectorId;
+    pConnector->connector_type_id = i + 1;
+    pConnector->connection = dev.connectors[i].connected ? DRM_MODE_CONNECTED : DRM_MODE_DISCONNECTED;
+    pConnector->mmWidth = dev.connectors[i].connected ? 600 : 0;
+    pConnector->mmHeight = dev.connectors[i].connected ? 340 : 0;
+
+    pConnector->count_modes = dev.connectors[i].connected ? dev.connectors[i].count_modes : 0;
+    pConnector->modes = Alloc(pConnector->count_modes * sizeof(drmModeModeInfo));
+    memcpy(pConnector->modes, dev.connectors[i].modes,
+           pConnector->count_modes * sizeof(drmModeModeInfo));
+
+    pConnector->count_encoders = 1;
+    pConnector->encoders = Alloc(sizeof(uint32_t));
+    pConnector->encoders[0] = dev.connectors[i].encoderID;
+    if (GetObjectProperty(connectorId, "CRTC_ID") != 0) {
+        pConnector->encoder_id = dev.connectors[i].encoderID;
+    }
+
+    pConnector->count_props = pObject->count_props;
+    pConnector->props = Alloc(pObject->count_props * sizeof(uint32_t));
+    pConnector->prop_values = Alloc(pObject->count_props * sizeof(uint64_t));
+    memcpy(pConnector->props, pObject->props, pObject->count_props * sizeof(uint32_t));
+    memcpy(pConnector->prop_values, pObject->values, pObject->count_props * sizeof(uint64_t));
+
+    return pConnector;
+}
+
+drmModeConnectorPtr drmModeGetConnector(int fd, uint32_t connectorId)
+{
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_CONNECTOR);
+
+    return GetConnector(connectorId);
+}
+
+drmModeConnectorPtr drmModeGetConnectorCurrent(int fd, uint32_t connectorId)
+{
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_CONNECTOR);
+
+    return GetConnector(connectorId);
+}
+
+void drmModeFreeConnector(drmModeConnectorPtr ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    free(ptr->modes);
+    free(ptr->encoders);
+    free(ptr->props);
+    free(ptr->prop_values);
+    free(ptr);
+}
+
+drmModeEncoderPtr drmModeGetEncoder(int fd, uint32_t encoder_id)
+{
+    drmModeEncoderPtr pEncoder;
+    int i;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_ENCODER);
+
+    for (i = 0; i < dev.count_encoders; i++) {
+        if (dev.encoders[i].id == encoder_id) {
+            pEncoder = Alloc(sizeof(*pEncoder));
+            pEncoder->encoder_id = encoder_id;
+            pEncoder->possible_crtcs = dev.encoders[i].possibleCrtcs;
+            pEncoder->crtc_id = GetObjectProperty(dev.connectors[i].id, "CRTC_ID");
+            return pEncoder;
+        }
+    }
+
+    errno = ENOENT;
+    return NULL;
+}
+
+void drmModeFreeEncoder(drmModeEncoderPtr ptr)
+{
+    free(ptr);
+}
+
+static struct FakeBlob *FindBlob(uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < dev.count_blobs; i++) {
+        if (dev.blobs[i].id == id) {
+            return &dev.blobs[i];
+        }
+    }
+
+    return NULL;
+}
+
+drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtcId)
+{
+    drmModeCrtcPtr pCrtc;
+    struct FakeBlob *pModeBlob;
+    int i;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_CRTC);
+
+    if (FindObject(crtcId) == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    pCrtc = Alloc(sizeof(*pCrtc));
+    pCrtc->crtc_id = crtcId;
+    pCrtc->gamma_size = 1024;
+
+    pModeBlob = FindBlob(GetObjectProperty(crtcId, "MODE_ID"));
+    if (GetObjectProperty(crtcId, "ACTIVE") && pModeBlob != NULL &&
+        pModeBlob->size == sizeof(drmModeModeInfo)) {
+        memcpy(&pCrtc->mode, pModeBlob->data, sizeof(pCrtc->mode));
+        pCrtc->mode_valid = 1;
+        pCrtc->width = pCrtc->mode.hdisplay;
+        pCrtc->height = pCrtc->mode.vdisplay;
+    }
+
+    // The legacy buffer_id is the FB of the CRTC's primary plane.
+    for (i = 0; i < dev.count_planes; i++) {
+        if (GetObjectProperty(dev.planes[i].id, "CRTC_ID") == crtcId &&
+            GetObjectProperty(dev.planes[i].id, "type") == DRM_PLANE_TYPE_PRIMARY) {
+            pCrtc->buffer_id = GetObjectProperty(dev.planes[i].id, "FB_ID");
+        }
+    }
+
+    return pCrtc;
+}
+
+void drmModeFreeCrtc(drmModeCrtcPtr ptr)
+{
+    free(ptr);
+}
+
+drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+{
+    drmModePlaneResPtr pPlaneRes;
+    int i;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_PLANE_RESOURCES);
+
+    pPlaneRes = Alloc(sizeof(*pPlaneRes));
+    pPlaneRes->count_planes = dev.count_planes;
+    pPlaneRes->planes = Alloc(dev.count_planes * sizeof(uint32_t));
+    for (i = 0; i < dev.count_planes; i++) {
+        pPlaneRes->planes[i] = dev.planes[i].id;
+    }
+
+    return pPlaneRes;
+}
+
+void drmModeFreePlaneResources(drmModePlaneResPtr ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    free(ptr->planes);
+    free(ptr);
+}
+
+drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
+{
+    static const uint32_t formats[] = {
+        0x34325258, // XR24
+        0x30335258, // XR30
+    };
+    drmModePlanePtr pPlane;
+    int i;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_PLANE);
+
+    for (i = 0; i < dev.count_planes; i++) {
+        if (dev.planes[i].id == plane_id) {
+            pPlane = Alloc(sizeof(*pPlane));
+            pPlane->plane_id = plane_id;
+            pPlane->possible_crtcs = dev.planes[i].possibleCrtcs;
+            pPlane->crtc_id = GetObjectProperty(plane_id, "CRTC_ID");
+            pPlane->fb_id = GetObjectProperty(plane_id, "FB_ID");
+            pPlane->count_formats = sizeof(formats) / sizeof(formats[0]);
+            pPlane->formats = Alloc(sizeof(formats));
+            memcpy(pPlane->formats, formats, sizeof(formats));
+            return pPlane;
+        }
+    }
+
+    errno = ENOENT;
+    return NULL;
+}
+
+void drmModeFreePlane(drmModePlanePtr ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    free(ptr->formats);
+    free(ptr);
+}
+
+drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd, uint32_t object_id,
+                                                      uint32_t object_type)
+{
+    drmModeObjectPropertiesPtr pProperties;
+    struct FakeObject *pObject;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_OBJECT_GET_PROPERTIES);
+
+    pObject = FindObject(object_id);
+
+    if (pObject == NULL ||
+        (object_type != DRM_MODE_OBJECT_ANY && pObject->type != object_type)) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    pProperties = Alloc(sizeof(*pProperties));
+    pProperties->count_props = pObject->count_props;
+    pProperties->props = Alloc(pObject->count_props * sizeof(uint32_t));
+    pProperties->prop_values = Alloc(pObject->count_props * sizeof(uint64_t));
+    memcpy(pProperties->props, pObject->props, pObject->count_props * sizeof(uint32_t));
+    memcpy(pProperties->prop_values, pObject->values, pObject->count_props * sizeof(uint64_t));
+
+    return pProperties;
+}
+
+void drmModeFreeObjectProperties(drmModeObjectPropertiesPtr ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    free(ptr->props);
+    free(ptr->prop_values);
+    free(ptr);
+}
+
+drmModePropertyPtr drmModeGetProperty(int fd, uint32_t propertyId)
+{
+    struct FakePropInfo *pInfo;
+    drmModePropertyPtr pProperty;
+    int i;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_PROPERTY);
+
+    pInfo = FindInfo(propertyId);
+
+    if (pInfo == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    pProperty = Alloc(sizeof(*pProperty));
+    pProperty->prop_id = pInfo->id;
+    pProperty->flags = pInfo->flags;
+    memcpy(pProperty->name, pInfo->name, sizeof(pProperty->name));
+
+    if (pInfo->count_enums > 0) {
+        pProperty->count_enums = pInfo->count_enums;
+        pProperty->enums = Alloc(pInfo->count_enums * sizeof(*pProperty->enums));
+        memcpy(pProperty->enums, pInfo->enums, pInfo->count_enums * sizeof(*pProperty->enums));
+
+        pProperty->count_values = pInfo->count_enums;
+        pProperty->values = Alloc(pInfo->count_enums * sizeof(uint64_t));
+        for (i = 0; i < pInfo->count_enums; i++) {
+            pProperty->values[i] = pInfo->enums[i].value;
+        }
+    } else if (pInfo->flags & (DRM_MODE_PROP_RANGE | DRM_MODE_PROP_SIGNED_RANGE)) {
+        pProperty->count_values = 2;
+        pProperty->values = Alloc(2 * sizeof(uint64_t));
+        memcpy(pProperty->values, pInfo->range, sizeof(pInfo->range));
+    }
+
+    return pProperty;
+}
+
+void drmModeFreeProperty(drmModePropertyPtr ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    free(ptr->values);
+    free(ptr->enums);
+    free(ptr->blob_ids);
+    free(ptr);
+}
+
+int drmModeCreatePropertyBlob(int fd, const void *data, size_t size, uint32_t *id)
+{
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_CREATE_PROPERTY_BLOB);
+
+    if (size == 0) {
+        return -EINVAL;
+    }
+
+    *id = AddBlob(data, size);
+
+    return 0;
+}
+
+int drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+    struct FakeBlob *pBlob;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_DESTROY_PROPERTY_BLOB);
+
+    pBlob = FindBlob(id);
+
+    if (pBlob == NULL) {
+        return -ENOENT;
+    }
+
+    free(pBlob->data);
+    *pBlob = dev.blobs[--dev.count_blobs];
+
+    return 0;
+}
+
+drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+    drmModePropertyBlobPtr pResult;
+    struct FakeBlob *pBlob;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_PROPERTY_BLOB);
+
+    pBlob = FindBlob(blob_id);
+
+    if (pBlob == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    pResult = Alloc(sizeof(*pResult));
+    pResult->id = pBlob->id;
+    pResult->length = pBlob->size;
+    pResult->data = Alloc(pBlob->size);
+    memcpy(pResult->data, pBlob->data, pBlob->size);
+
+    return pResult;
+}
+
+void drmModeFreePropertyBlob(drmModePropertyBlobPtr ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    free(ptr->data);
+    free(ptr);
+}
+
+int drmModeAddFB(int fd, uint32_t width, uint32_t height, uint8_t depth,
+                 uint8_t bpp, uint32_t pitch, uint32_t bo_handle, uint32_t *buf_id)
+{
+    (void)fd; (void)depth; (void)bpp; (void)pitch; (void)bo_handle;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_ADD_FB);
+
+    if (width == 0 || height == 0) {
+        return -EINVAL;
+    }
+
+    dev.fbs = Grow(dev.fbs, dev.count_fbs, sizeof(*dev.fbs));
+    dev.fbs[dev.count_fbs] = dev.nextID++;
+    *buf_id = dev.fbs[dev.count_fbs++];
+
+    return 0;
+}
+
+int drmModeRmFB(int fd, uint32_t bufferId)
+{
+    int i;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_RM_FB);
+
+    for (i = 0; i < dev.count_fbs; i++) {
+        if (dev.fbs[i] == bufferId) {
+            dev.fbs[i] = dev.fbs[--dev.count_fbs];
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+drmModeAtomicReqPtr drmModeAtomicAlloc(void)
+{
+    return Alloc(sizeof(struct _drmModeAtomicReq));
+}
+
+drmModeAtomicReqPtr drmModeAtomicDuplicate(drmModeAtomicReqPtr req)
+{
+    drmModeAtomicReqPtr pCopy = drmModeAtomicAlloc();
+
+    pCopy->cursor = pCopy->size = req->cursor;
+    pCopy->items = Alloc(req->cursor * sizeof(*req->items));
+    memcpy(pCopy->items, req->items, req->cursor * sizeof(*req->items));
+
+    return pCopy;
+}
+
+int drmModeAtomicMerge(drmModeAtomicReqPtr base, drmModeAtomicReqPtr augment)
+{
+    int i;
+
+    for (i = 0; i < augment->cursor; i++) {
+        drmModeAtomicAddProperty(base, augment->items[i].objectID,
+                                 augment->items[i].propertyID,
+                                 augment->items[i].value);
+    }
+
+    return 0;
+}
+
+void drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+    if (req == NULL) {
+        return;
+    }
+
+    free(req->items);
+    free(req);
+}
+
+int drmModeAtomicGetCursor(drmModeAtomicReqPtr req)
+{
+    return req->cursor;
+}
+
+void drmModeAtomicSetCursor(drmModeAtomicReqPtr req, int cursor)
+{
+    req->cursor = cursor;
+}
+
+int drmModeAtomicAddProperty(drmModeAtomicReqPtr req, uint32_t object_id,
+                             uint32_t property_id, uint64_t value)
+{
+    if (req == NULL) {
+        return -EINVAL;
+    }
+
+    if (req->cursor == req->size) {
+        int size = req->size ? req->size * 2 : 16;
+        void *items = realloc(req->items, size * sizeof(*req->items));
+
+        if (items == NULL) {
+            return -ENOMEM;
+        }
+        req->items = items;
+        req->size = size;
+    }
+
+    req->items[req->cursor].objectID = object_id;
+    req->items[req->cursor].propertyID = property_id;
+    req->items[req->cursor].value = value;
+
+    return ++req->cursor;
+}
+
+// The CRTC affected by a commit, directly or through a plane or connector.
+static uint32_t CommitCrtc(drmModeAtomicReqPtr req)
+{
+    int i;
+
+    for (i = 0; i < req->cursor; i++) {
+        struct FakeObject *pObject = FindObject(req->items[i].objectID);
+
+        if (pObject->type == DRM_MODE_OBJECT_CRTC) {
+            return pObject->id;
+        }
+        if (GetObjectProperty(pObject->id, "CRTC_ID") != 0) {
+            return GetObjectProperty(pObject->id, "CRTC_ID");
+        }
+    }
+
+    return dev.count_crtcs > 0 ? dev.crtcs[0] : 0;
+}
+
+// Refresh period of the CRTC's current mode; 60 Hz if it has none.
+static uint64_t CrtcPeriodNs(uint32_t crtcID)
+{
+    struct FakeBlob *pModeBlob = FindBlob(GetObjectProperty(crtcID, "MODE_ID"));
+    const drmModeModeInfo *pMode;
+
+    if (pModeBlob == NULL || pModeBlob->size != sizeof(*pMode)) {
+        return 16666667;
+    }
+
+    pMode = pModeBlob->data;
+    if (pMode->clock == 0) {
+        return 16666667;
+    }
+
+    return (uint64_t)pMode->htotal * pMode->vtotal * 1000000ull / pMode->clock;
+}
+
+/*
+ * Flips complete at the CRTC's next vblank, and at most one flip per
+ * CRTC completes per vblank.  With VRR_ENABLED, the panel waits for
+ * the flip instead: it completes at once, but no sooner than one
+ * period of the mode after the previous one.
+ */
+static void QueueFlipEvent(uint32_t crtcID, void *userData)
+{
+    uint64_t periodNs = CrtcPeriodNs(crtcID);
+    uint64_t now = NowNs();
+    uint64_t vblank = (now - dev.epochNs + periodNs - 1) / periodNs;
+    struct FakeEvent *pEvent;
+    int i, crtc;
+
+    for (crtc = 0; dev.crtcs[crtc] != crtcID; crtc++);
+
+    pEvent = &dev.events[dev.count_events++];
+    pEvent->crtcID = crtcID;
+    pEvent->userData = userData;
+
+    if (GetObjectProperty(crtcID, "VRR_ENABLED")) {
+        uint64_t earliestNs = dev.crtcFlipNs[crtc] + periodNs;
+
+        pEvent->sequence = dev.crtcSequences[crtc] + 1;
+        pEvent->timeNs = now > earliestNs ? now : earliestNs;
+    } else {
+        if (vblank == 0) {
+            vblank = 1;
+        }
+
+        for (i = 0; i < dev.count_events - 1; i++) {
+            if (dev.events[i].crtcID == crtcID && dev.events[i].sequence >= vblank) {
+                vblank = dev.events[i].sequence + 1;
+            }
+        }
+
+        pEvent->sequence = vblank;
+        pEvent->timeNs = dev.epochNs + vblank * periodNs;
+    }
+
+    dev.crtcFlipNs[crtc] = pEvent->timeNs;
+    dev.crtcSequences[crtc] = pEvent->sequence;
+}
+
+// Whether a MODE_ID value names a mode the CRTC cannot drive
+static int ExceedsMaxClock(uint64_t modeID)
+{
+    struct FakeBlob *pModeBlob = FindBlob(modeID);
+    const drmModeModeInfo *pMode;
+
+    if (dev.maxClock == 0 || pModeBlob == NULL || pModeBlob->size != sizeof(*pMode)) {
+        return 0;
+    }
+
+    pMode = pModeBlob->data;
+
+    return pMode->clock > dev.maxClock;
+}
+
+/*
+ * Whether setting the property would change a CRTC's mode or active
+ * state, or route a connector to another CRTC, which takes
+ * DRM_MODE_ATOMIC_ALLOW_MODESET.  Modes are compared by content, since
+ * a new blob holding the current mode is no modeset.
+ */
+static int NeedsModeset(const struct FakeObject *pObject, const struct FakePropInfo *pInfo,
+                        uint64_t value)
+{
+    uint64_t current = GetObjectProperty(pObject->id, pInfo->name);
+
+    if (pObject->type == DRM_MODE_OBJECT_CRTC && strcmp(pInfo->name, "MODE_ID") == 0) {
+        struct FakeBlob *pCurrent = FindBlob(current);
+        struct FakeBlob *pNew = FindBlob(value);
+
+        if (pCurrent == NULL || pNew == NULL) {
+            return pCurrent != pNew;
+        }
+
+        return pCurrent->size != pNew->size ||
+               memcmp(pCurrent->data, pNew->data, pNew->size) != 0;
+    }
+
+    if ((pObject->type == DRM_MODE_OBJECT_CRTC && strcmp(pInfo->name, "ACTIVE") == 0) ||
+        (pObject->type == DRM_MODE_OBJECT_CONNECTOR && strcmp(pInfo->name, "CRTC_ID") == 0)) {
+        return value != current;
+    }
+
+    return 0;
+}
+
+/*
+ * Check that every property in the request exists on its object and is
+ * writable, that no mode exceeds the pixel clock limit, and that only
+ * requests with DRM_MODE_ATOMIC_ALLOW_MODESET make modesets, then apply
+ * the values unless DRM_MODE_ATOMIC_TEST_ONLY.
+ */
+int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags, void *user_data)
+{
+    int i, j;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_ATOMIC_COMMIT);
+
+    for (i = 0; i < req->cursor; i++) {
+        struct FakeObject *pObject = FindObject(req->items[i].objectID);
+        struct FakePropInfo *pInfo = FindInfo(req->items[i].propertyID);
+
+        if (pObject == NULL || pInfo == NULL) {
+            return -ENOENT;
+        }
+
+        for (j = 0; j < pObject->count_props; j++) {
+            if (pObject->props[j] == pInfo->id) {
+                break;
+            }
+        }
+
+        if (j == pObject->count_props || (pInfo->flags & DRM_MODE_PROP_IMMUTABLE)) {
+            return -EINVAL;
+        }
+
+        if ((pInfo->flags & DRM_MODE_PROP_BLOB) && req->items[i].value != 0 &&
+            FindBlob(req->items[i].value) == NULL) {
+            return -EINVAL;
+        }
+
+        if (pObject->type == DRM_MODE_OBJECT_CRTC && strcmp(pInfo->name, "MODE_ID") == 0 &&
+            ExceedsMaxClock(req->items[i].value)) {
+            return -EINVAL;
+        }
+
+        if (!(flags & DRM_MODE_ATOMIC_ALLOW_MODESET) &&
+            NeedsModeset(pObject, pInfo, req->items[i].value)) {
+            return -EINVAL;
+        }
+    }
+
+    if (flags & DRM_MODE_ATOMIC_TEST_ONLY) {
+        return 0;
+    }
+
+    for (i = 0; i < req->cursor; i++) {
+        struct FakeObject *pObject = FindObject(req->items[i].objectID);
+
+        for (j = 0; j < pObject->count_props; j++) {
+            if (pObject->props[j] == req->items[i].propertyID) {
+                pObject->values[j] = req->items[i].value;
+            }
+        }
+    }
+
+    if (flags & DRM_MODE_PAGE_FLIP_EVENT) {
+        if (dev.count_events == MAX_EVENTS) {
+            return -EBUSY;
+        }
+        QueueFlipEvent(CommitCrtc(req), user_data);
+        ArmEventTimer();
+    }
+
+    return 0;
+}
+
+/*
+ * Like a blocking read(2) of the DRM fd: wait for the earliest queued
+ * flip to complete, then deliver every flip that has completed by then,
+ * timestamped with its vblank.  Returns at once if nothing is queued,
+ * or if the fd is polled and nothing is due yet, since another fd
+ * sharing the queue may have been handed the events it was woken for.
+ */
+int drmHandleEvent(int fd, drmEventContextPtr evctx)
+{
+    struct FakeEvent events[MAX_EVENTS];
+    uint64_t firstNs = UINT64_MAX;
+    struct timespec ts;
+    int i, count;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_READ_EVENTS);
+
+    if (dev.count_events == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < dev.count_events; i++) {
+        if (dev.events[i].timeNs < firstNs) {
+            firstNs = dev.events[i].timeNs;
+        }
+    }
+
+    if (firstNs > NowNs() && IsPolled(fd)) {
+        return 0;
+    }
+
+    // Let other threads flip while this one waits.
+    ts.tv_sec = firstNs / 1000000000ull;
+    ts.tv_nsec = firstNs % 1000000000ull;
+    pthread_mutex_unlock(&deviceLock);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    pthread_mutex_lock(&deviceLock);
+
+    firstNs = NowNs();
+
+    // Handlers may queue new flips, so take the due events off first.
+    count = dev.count_events;
+    memcpy(events, dev.events, count * sizeof(events[0]));
+    dev.count_events = 0;
+
+    for (i = 0; i < count; i++) {
+        if (events[i].timeNs > firstNs) {
+            dev.events[dev.count_events++] = events[i];
+        }
+    }
+    ArmEventTimer();
+
+    for (i = 0; i < count; i++) {
+        struct FakeEvent event = events[i];
+        unsigned int sec = event.timeNs / 1000000000ull;
+        unsigned int usec = (event.timeNs % 1000000000ull) / 1000;
+
+        if (event.timeNs > firstNs) {
+            continue;
+        }
+
+        if (evctx->version >= 3 && evctx->page_flip_handler2 != NULL) {
+            evctx->page_flip_handler2(fd, event.sequence, sec, usec, event.crtcID, event.userData);
+        } else if (evctx->page_flip_handler != NULL) {
+            evctx->page_flip_handler(fd, event.sequence, sec, usec, event.userData);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * The sequence number and time of the CRTC's most recent vblank, counted
+ * at the rate of its mode from the same epoch as flip events.
+ */
+int drmCrtcGetSequence(int fd, uint32_t crtcId, uint64_t *sequence, uint64_t *ns)
+{
+    struct FakeObject *pObject;
+    uint64_t periodNs, vblank;
+
+    (void)fd;
+
+    LOCK_DEVICE();
+    EnsureLoaded();
+    Count(FAKE_DRM_GET_SEQUENCE);
+
+    pObject = FindObject(crtcId);
+    if (pObject == NULL || pObject->type != DRM_MODE_OBJECT_CRTC) {
+        return -ENOENT;
+    }
+    if (!GetObjectProperty(crtcId, "ACTIVE")) {
+        return -EINVAL;
+    }
+
+    periodNs = CrtcPeriodNs(crtcId);
+    vblank = (NowNs() - dev.epochNs) / periodNs;
+
+    if (sequence != NULL) {
+        *sequence = vblank;
+    }
+    if (ns != NULL) {
+        *ns = dev.epochNs + vblank * periodNs;
+    }
+
+    return 0;
+}
+
+
+/* libc entry points */
+
+/*
+ * Watch a fake DRM fd through a dup of the event timer; see eventTimer.
+ * Any other regular file is one too, since nothing else would be
+ * given to epoll.
+ */
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    static int (*pRealEpollCtl)(int, int, int, struct epoll_event *);
+    struct stat st;
+    int ret, i;
+
+    if (pRealEpollCtl == NULL) {
+        pRealEpollCtl = (int (*)(int, int, int, struct epoll_event *))
+            dlsym(RTLD_NEXT, "epoll_ctl");
+    }
+
+    ret = pRealEpollCtl(epfd, op, fd, event);
+    if (ret == 0 || errno != EPERM || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return ret;
+    }
+
+    LOCK_DEVICE();
+
+    for (i = 0; i < count_pollFds && pollFds[i].drmFd != fd; i++);
+
+    if (i == count_pollFds) {
+        if (count_pollFds == MAX_POLL_FDS) {
+            errno = ENOSPC;
+            return -1;
+        }
+        if (eventTimer < 0) {
+            eventTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        }
+        pollFds[i].drmFd = fd;
+        pollFds[i].timerFd = eventTimer < 0 ? -1 : fcntl(eventTimer, F_DUPFD_CLOEXEC, 0);
+        if (pollFds[i].timerFd < 0) {
+            return -1;
+        }
+        count_pollFds++;
+        ArmEventTimer();
+    }
+
+    return pRealEpollCtl(epfd, op, pollFds[i].timerFd, event);
+}
+
+
+/* Hotplug simulation */
+
+/*
+ * Broadcast the uevent the kernel sends when a connector's status
+ * changes, to the NETLINK_KOBJECT_UEVENT group listeners bind to.  The
+ * device has no major and minor number to give, being a regular file.
+ * Sending needs CAP_NET_ADMIN, hence root.
+ */
+static void SendHotplugUevent(uint32_t connectorID)
+{
+    static const char devpath[] = "/devices/platform/fakedrm/drm/card0";
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    char message[256];
+    int fd, size;
+
+    size = snprintf(message, sizeof(message),
+                    "change@%s%cACTION=change%cDEVPATH=%s%cSUBSYSTEM=drm%c"
+                    "HOTPLUG=1%cCONNECTOR=%u", devpath, 0, 0, devpath, 0, 0, 0,
+                    connectorID) + 1;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0 || sendto(fd, message, size, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "fakedrm: unable to send a hotplug uevent: %s\n", strerror(errno));
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/*
+ * Plug a display into the connector, or unplug it, and announce it as
+ * the kernel would.  The connector keeps its modes; its EDID goes away
+ * while unplugged, and comes back as a new blob, as after a probe.
+ * Plugging a connector that is already connected probes it again: the
+ * same EDID gets a new blob.  Returns 0, or -ENOENT if there is no such
+ * connector.
+ */
+int FakeDrmSetConnected(uint32_t connectorID, int connected)
+{
+    struct FakeConnector *pConnector = NULL;
+    int i;
+
+    {
+        LOCK_DEVICE();
+        EnsureLoaded();
+
+        for (i = 0; i < dev.count_connectors; i++) {
+            if (dev.connectors[i].id == connectorID) {
+                pConnector = &dev.connectors[i];
+            }
+        }
+
+        if (pConnector == NULL) {
+            return -ENOENT;
+        }
+
+        if (pConnector->connected && connected) {
+            const struct FakeBlob *pBlob = FindBlob(GetObjectProperty(connectorID, "EDID"));
+
+            if (pBlob != NULL) {
+                SetObjectProperty(connectorID, "EDID", AddBlob(pBlob->data, pBlob->size));
+            }
+        } else if (pConnector->connected && !connected) {
+            pConnector->edid = GetObjectProperty(connectorID, "EDID");
+            SetObjectProperty(connectorID, "EDID", 0);
+        } else if (!pConnector->connected && connected && pConnector->edid != 0) {
+            const struct FakeBlob *pBlob = FindBlob(pConnector->edid);
+
+            SetObjectProperty(connectorID, "EDID", AddBlob(pBlob->data, pBlob->size));
+        }
+        pConnector->connected = connected;
+    }
+
+    SendHotplugUevent(connectorID);
+
+    return 0;
+}
+
+static struct {
+    uint64_t timeNs;            // after the topology was loaded
+    uint32_t connectorID;
+    int connected;
+} hotplugs[MAX_HOTPLUGS];
+static int count_hotplugs;
+
+static void *RunHotplugSchedule(void *arg)
+{
+    uint64_t startNs = NowNs();
+    int i;
+
+    (void)arg;
+
+    for (i = 0; i < count_hotplugs; i++) {
+        uint64_t ns = startNs + hotplugs[i].timeNs;
+        struct timespec ts = { ns / 1000000000ull, ns % 1000000000ull };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+
+        if (FakeDrmSetConnected(hotplugs[i].connectorID, hotplugs[i].connected) != 0) {
+            fprintf(stderr, "fakedrm: no connector %u to hotplug\n", hotplugs[i].connectorID);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Plug and unplug displays on a schedule of "seconds:connector:on|off"
+ * entries, in time order, e.g. FAKEDRM_HOTPLUG="3:15:off 6:15:on".
+ */
+static void StartHotplugSchedule(const char *schedule)
+{
+    pthread_t thread;
+    const char *p = schedule;
+    int used;
+
+    while (count_hotplugs < MAX_HOTPLUGS) {
+        double seconds;
+        unsigned int connectorID;
+        char state[4];
+
+        if (sscanf(p, " %lf:%u:%3[a-z]%n", &seconds, &connectorID, state, &used) != 3 ||
+            (strcmp(state, "on") != 0 && strcmp(state, "off") != 0)) {
+            break;
+        }
+        p += used;
+
+        hotplugs[count_hotplugs].timeNs = (uint64_t)(seconds * 1e9);
+        hotplugs[count_hotplugs].connectorID = connectorID;
+        hotplugs[count_hotplugs].connected = strcmp(state, "on") == 0;
+        count_hotplugs++;
+    }
+
+    if (sscanf(p, " %*c") != EOF) {
+        fprintf(stderr, "fakedrm: invalid FAKEDRM_HOTPLUG entry: %s\n", p);
+        exit(1);
+    }
+
+    if (count_hotplugs > 0 && pthread_create(&thread, NULL, RunHotplugSchedule, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,91 @@
+#if !defined(FAKEDRM_H)
+#define FAKEDRM_H
+
+#include <stdint.h>
+
+/*
+ * In-process stand-in for the parts of libdrm used by kms.c, serving a
+ * configurable KMS topology instead of talking to a kernel driver.
+ *
+ * It is either linked in place of libdrm (see kmsbench.c), or built as
+ * libfakedrm.so and loaded with LD_PRELOAD in front of the real libdrm,
+ * in which case the topology is read from the file named by the
+ * FAKEDRM_TOPOLOGY environment variable, and call counts are printed at
+ * exit if FAKEDRM_STATS is set.  With FAKEDRM_DUMB_MEMORY set, dumb
+ * buffers take as much memory as on real hardware while mapped.
+ *
+ * Topology descriptions are line based; '#' starts a comment:
+ *
+ *   crtcs <n>                   number of CRTCs (default: one per connector)
+ *   overlays <n>                overlay planes per CRTC (default: 1)
+ *   connector <mode>...         a connected connector, e.g.
+ *                               "connector 3840x2160@60 1920x1080@59.94";
+ *                               the first mode is the preferred one;
+ *                               a "vrr=48-144" token makes it adaptive
+ *                               sync capable over that refresh range,
+ *                               and an "active" token leaves its first
+ *                               mode set and scanned out, as by the
+ *                               console
+ *   connector disconnected [<mode>...]
+ *                               a connector with nothing plugged in; the
+ *                               modes are those of the display plugged
+ *                               in by FakeDrmSetConnected()
+ *   maxclock <kHz>              highest pixel clock a CRTC can drive;
+ *                               atomic commits of faster modes fail
+ *
+ * Without a description, a single 1920x1080@60 connector is served.
+ *
+ * Commits requesting a page flip event complete at the CRTC's next
+ * vblank, derived from the refresh rate of its mode, and
+ * drmHandleEvent() blocks until the earliest pending flip completes.
+ * On CRTCs with VRR_ENABLED set, flips complete as soon as they are
+ * committed, at most once per period of the mode.  drmCrtcGetSequence()
+ * reports the last of the CRTC's fixed vblanks.  A DRM fd added to an
+ * epoll set is watched through a timerfd that expires when the earliest
+ * pending flip completes, as epoll refuses the regular file the fake
+ * device is.
+ *
+ * FakeDrmSetConnected() plugs a display into a connector, or unplugs
+ * it, and broadcasts the hotplug uevent the kernel would (which takes
+ * root).  When preloaded, FAKEDRM_HOTPLUG schedules such changes, in
+ * seconds after the topology is loaded, e.g. "3:15:off 6:15:on" to
+ * unplug connector 15 for three seconds; "on" for a connected connector
+ * probes it again, as a cable glitch would.
+ */
+
+enum FakeDrmCall {
+    FAKE_DRM_GET_RESOURCES,
+    FAKE_DRM_GET_CONNECTOR,
+    FAKE_DRM_GET_ENCODER,
+    FAKE_DRM_GET_CRTC,
+    FAKE_DRM_GET_PLANE_RESOURCES,
+    FAKE_DRM_GET_PLANE,
+    FAKE_DRM_OBJECT_GET_PROPERTIES,
+    FAKE_DRM_GET_PROPERTY,
+    FAKE_DRM_GET_PROPERTY_BLOB,
+    FAKE_DRM_CREATE_PROPERTY_BLOB,
+    FAKE_DRM_DESTROY_PROPERTY_BLOB,
+    FAKE_DRM_ATOMIC_COMMIT,
+    FAKE_DRM_ADD_FB,
+    FAKE_DRM_RM_FB,
+    FAKE_DRM_IOCTL,
+    FAKE_DRM_CAP,
+    FAKE_DRM_READ_EVENTS,
+    FAKE_DRM_GET_SEQUENCE,
+    FAKE_DRM_CALL_COUNT
+};
+
+struct FakeDrmStats {
+    unsigned long calls[FAKE_DRM_CALL_COUNT];
+    unsigned long ioctls; // what the calls would have cost with the real libdrm
+};
+
+int FakeDrmLoadTopology(const char *description);
+int FakeDrmLoadTopologyFile(const char *path);
+int FakeDrmSetConnected(uint32_t connectorID, int connected);
+
+void FakeDrmGetStats(struct FakeDrmStats *pStats);
+void FakeDrmResetStats(void);
+const char *FakeDrmCallName(enum FakeDrmCall call);
+
+#endif /* FAKEDRM_H */
@@ -0,0 +1,237 @@
+/*
+ * Compare a capture against a golden one, frame by frame, e.g. to check
+ * that rendering is unchanged after a driver or code change.  Both are
+ * raw RGBA captures (see --capture) of the same size, best made with
+ * --fixed-timestep and --frames, so that runs render the same frames.
+ *
+ * Usage: imagecmp width height golden candidate [tolerance [min-psnr]]
+ *
+ * A frame fails if any 8-bit channel differs from the golden frame by
+ * more than tolerance (default 0), or if its PSNR is below min-psnr dB
+ * (default 0, i.e. not checked).  Each failing frame is printed, and
+ * the exit status is 1 if any failed, the frame counts differ, or there
+ * is no frame to compare, e.g. from a capture that wrote nothing.
+ *
+ * The files are read through mmap, and compared a block at a time with
+ * memcmp(), so that the identical parts that make up most of a passing
+ * frame go at memory bandwidth.  Blocks that differ are diffed over
+ * whole vectors of channels with GCC/Clang vector extensions, which
+ * compile to AVX2, SSE2 or NEON as the target allows (build with -mavx2
+ * for the 32-byte path on x86).  Either way, thousands of 4K frames
+ * take seconds.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#if defined(__AVX2__)
+#define SIMD_BYTES 32
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+#define SIMD_BYTES 16
+#else
+#define SIMD_BYTES 8
+#endif
+
+typedef uint8_t VByte __attribute__((vector_size(SIMD_BYTES)));
+typedef uint16_t VWord __attribute__((vector_size(SIMD_BYTES * 2)));
+typedef uint32_t VDword __attribute__((vector_size(SIMD_BYTES * 4)));
+
+/*
+ * Squares of 8-bit differences are summed in 32-bit lanes, which hold
+ * this many vectors' worth before they have to be flushed to 64 bits.
+ */
+#define VECTORS_PER_FLUSH 65536
+
+// Compared with memcmp() before diffing; a whole number of vectors
+#define BLOCK_BYTES 4096
+
+struct FrameDiff {
+    unsigned int maxDiff;
+    uint64_t overTolerance;     // channels
+    uint64_t squaredError;
+};
+
+static const uint8_t *MapCapture(const char *path, size_t *pSize)
+{
+    struct stat st;
+    void *ptr;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        Fatal("Unable to open %s: %s\n", path, strerror(errno));
+    }
+
+    *pSize = st.st_size;
+    if (st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+        Fatal("Unable to map %s: %s\n", path, strerror(errno));
+    }
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+    close(fd);
+
+    return ptr;
+}
+
+static void DiffFrame(const uint8_t *golden, const uint8_t *candidate, size_t size,
+                      uint8_t tolerance, struct FrameDiff *pDiff)
+{
+    const size_t fullBytes = size / SIMD_BYTES * SIMD_BYTES;
+    VByte maxDiff = { 0 };
+    VDword over = { 0 }, squares = { 0 };
+    unsigned int vectors = 0;
+    size_t i;
+    int lane;
+
+    memset(pDiff, 0, sizeof(*pDiff));
+
+    for (i = 0; i < fullBytes; i += SIMD_BYTES) {
+        VByte a, b, diff, bigger;
+        VWord diff16;
+
+        if (i % BLOCK_BYTES == 0 && i + BLOCK_BYTES <= fullBytes &&
+            memcmp(golden + i, candidate + i, BLOCK_BYTES) == 0) {
+            i += BLOCK_BYTES - SIMD_BYTES;
+            continue;
+        }
+
+        // Captures need not be aligned to a vector.
+        memcpy(&a, golden + i, SIMD_BYTES);
+        memcpy(&b, candidate + i, SIMD_BYTES);
+
+        bigger = (VByte)(a > b);
+        diff = ((a - b) & bigger) | ((b - a) & ~bigger);
+
+        bigger = (VByte)(diff > maxDiff);
+        maxDiff = (diff & bigger) | (maxDiff & ~bigger);
+
+        over += __builtin_convertvector((VByte)(diff > tolerance) & 1, VDword);
+        diff16 = __builtin_convertvector(diff, VWord);
+        squares += __builtin_convertvector(diff16 * diff16, VDword);
+
+        if (++vectors == VECTORS_PER_FLUSH) {
+            for (lane = 0; lane < SIMD_BYTES; lane++) {
+                pDiff->squaredError += squares[lane];
+            }
+            squares = (VDword){ 0 };
+            vectors = 0;
+        }
+    }
+
+    for (lane = 0; lane < SIMD_BYTES; lane++) {
+        if (maxDiff[lane] > pDiff->maxDiff) {
+            pDiff->maxDiff = maxDiff[lane];
+        }
+        pDiff->overTolerance += over[lane];
+        pDiff->squaredError += squares[lane];
+    }
+
+    for (; i < size; i++) {
+        unsigned int diff = abs(golden[i] - candidate[i]);
+
+        if (diff > pDiff->maxDiff) {
+            pDiff->maxDiff = diff;
+        }
+        pDiff->overTolerance += diff > tolerance;
+        pDiff->squaredError += diff * diff;
+    }
+}
+
+// Peak signal-to-noise ratio in dB; infinite for identical frames
+static double Psnr(const struct FrameDiff *pDiff, size_t size)
+{
+    double mse = (double)pDiff->squaredError / size;
+
+    return mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : INFINITY;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint8_t *golden, *candidate;
+    size_t goldenSize, candidateSize, frameSize;
+    unsigned int frames, frame, failed = 0;
+    int width, height, tolerance = 0;
+    double minPsnr = 0.0, worstPsnr = INFINITY;
+    uint64_t startNs, elapsedNs;
+
+    if (argc < 5) {
+        fprintf(stderr, "Usage: %s width height golden candidate "
+                "[tolerance [min-psnr]]\n", argv[0]);
+        return 2;
+    }
+
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+    if (argc > 5) {
+        tolerance = atoi(argv[5]);
+    }
+    if (argc > 6) {
+        minPsnr = atof(argv[6]);
+    }
+    if (width <= 0 || height <= 0 || tolerance < 0 || tolerance > 255) {
+        Fatal("Invalid size or tolerance.\n");
+    }
+
+    frameSize = (size_t)width * height * 4;
+    golden = MapCapture(argv[3], &goldenSize);
+    candidate = MapCapture(argv[4], &candidateSize);
+
+    if (goldenSize % frameSize != 0 || candidateSize % frameSize != 0) {
+        Fatal("The captures are not made of %dx%d RGBA frames.\n", width, height);
+    }
+    if (goldenSize != candidateSize) {
+        printf("%s has %zu frames, %s has %zu\n", argv[3], goldenSize / frameSize,
+               argv[4], candidateSize / frameSize);
+        failed++;
+    }
+    frames = (goldenSize < candidateSize ? goldenSize : candidateSize) / frameSize;
+    if (frames == 0) {
+        printf("No frames to compare.\n");
+        return 1;
+    }
+
+    startNs = GetMonotonicNs();
+
+    for (frame = 0; frame < frames; frame++) {
+        struct FrameDiff diff;
+        double psnr;
+
+        DiffFrame(golden + frame * frameSize, candidate + frame * frameSize,
+                  frameSize, tolerance, &diff);
+        psnr = Psnr(&diff, frameSize);
+
+        if (psnr < worstPsnr) {
+            worstPsnr = psnr;
+        }
+
+        if (diff.overTolerance > 0 || psnr < minPsnr) {
+            printf("frame %u: max difference %u, %llu channels over %d, PSNR %.2f dB\n",
+                   frame, diff.maxDiff, (unsigned long long)diff.overTolerance,
+                   tolerance, psnr);
+            failed++;
+        }
+    }
+
+    elapsedNs = GetMonotonicNs() - startNs;
+
+    printf("%u frames compared in %.3f s (%.0f MB/s, %d-byte vectors): "
+           "%u failed, worst PSNR %.2f dB\n",
+           frames, elapsedNs / 1e9, 2.0 * frames * frameSize / 1e6 / (elapsedNs / 1e9),
+           SIMD_BYTES, failed, worstPsnr);
+
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Measure the startup cost of SetMode() against fake KMS topologies with
+ * 1 to 16 connectors: wall time per call, and the number of ioctls the
+ * same calls would have issued through the real libdrm.
+ *
+ * Usage: kmsbench [iterations]
+ *
+ * Every topology has one connected display, behind the other
+ * (disconnected) connectors as on a docking station, one CRTC per
+ * connector, and a primary plus three overlay planes per CRTC, so that
+ * both connector and plane selection scale with the connector count.
+ * Each call is torn down again with KmsTearDown(), outside the timing and
+ * the counts, so every iteration starts from a fresh fake device.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fakedrm.h"
+#include "kms.h"
+#include "utils.h"
+
+#define MAX_CONNECTORS 16
+
+static void AddStats(struct FakeDrmStats *pTotal, const struct FakeDrmStats *pStats)
+{
+    int call;
+
+    for (call = 0; call < FAKE_DRM_CALL_COUNT; call++) {
+        pTotal->calls[call] += pStats->calls[call];
+    }
+    pTotal->ioctls += pStats->ioctls;
+}
+
+static void BuildTopology(char *buf, size_t size, int connectors)
+{
+    int len, i;
+
+    len = snprintf(buf, size, "crtcs %d\noverlays 3\n", connectors);
+
+    for (i = 0; i < connectors - 1; i++) {
+        len += snprintf(buf + len, size - len, "connector disconnected\n");
+    }
+
+    snprintf(buf + len, size - len,
+             "connector 3840x2160@60 3840x2160@59.94 2560x1440@144 "
+             "2560x1440@60 1920x1080@120 1920x1080@60 1280x720@60\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 100;
+    int drmFd, nullFd, stdoutFd;
+    int connectors, i;
+
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+        if (iterations <= 0) {
+            Fatal("Usage: %s [iterations]\n", argv[0]);
+        }
+    }
+
+    // CreateFb() mmaps the dumb buffer through the device fd.
+    drmFd = memfd_create("fakedrm", 0);
+    nullFd = open("/dev/null", O_WRONLY);
+    stdoutFd = dup(STDOUT_FILENO);
+
+    if (drmFd < 0 || nullFd < 0 || stdoutFd < 0) {
+        Fatal("Unable to set up file descriptors.\n");
+    }
+
+    printf("connectors    min us    avg us  ioctls/call  (GetConnector GetPlane GetProperty"
+           " ObjectGetProperties AtomicCommit)\n");
+
+    for (connectors = 1; connectors <= MAX_CONNECTORS; connectors++) {
+        char topology[2048];
+        struct FakeDrmStats stats = { 0 };
+        uint64_t totalNs = 0, minNs = UINT64_MAX;
+
+        BuildTopology(topology, sizeof(topology), connectors);
+
+        fflush(stdout);
+        dup2(nullFd, STDOUT_FILENO);
+
+        for (i = 0; i < iterations; i++) {
+            struct KmsHead heads[KMS_MAX_HEADS];
+            struct FakeDrmStats callStats;
+            uint64_t start, ns;
+
+            if (FakeDrmLoadTopology(topology) != 0) {
+                Fatal("Invalid topology:\n%s", topology);
+            }
+            FakeDrmResetStats();
+
+            start = GetMonotonicNs();
+            SetMode(drmFd, 1920, 1080, 60, 0, 0, heads, KMS_MAX_HEADS);
+            ns = GetMonotonicNs() - start;
+
+            FakeDrmGetStats(&callStats);
+            AddStats(&stats, &callStats);
+
+            // Every topology has a connected display, so there is a head.
+            KmsTearDown(heads[0].pDevice);
+
+            totalNs += ns;
+            if (ns < minNs) {
+                minNs = ns;
+            }
+        }
+
+        fflush(stdout);
+        dup2(stdoutFd, STDOUT_FILENO);
+
+        printf("%10d %9.1f %9.1f %12.1f  (%lu %lu %lu %lu %lu)\n", connectors,
+               minNs / 1e3, totalNs / 1e3 / iterations,
+               (double)stats.ioctls / iterations,
+               stats.calls[FAKE_DRM_GET_CONNECTOR] / iterations,
+               stats.calls[FAKE_DRM_GET_PLANE] / iterations,
+               stats.calls[FAKE_DRM_GET_PROPERTY] / iterations,
+               stats.calls[FAKE_DRM_OBJECT_GET_PROPERTIES] / iterations,
+               stats.calls[FAKE_DRM_ATOMIC_COMMIT] / iterations);
+    }
+
+    close(stdoutFd);
+    close(nullFd);
+    close(drmFd);
+
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Measure gear mesh generation on the CPU: the scalar BuildGearMesh()
+ * one gear at a time, as eglgears has always built its gears, against
+ * BuildGearMeshes() on one thread and on a worker pool, for a scene of
+ * random gears with different teeth counts and radii.
+ *
+ * Usage: meshbench [gears [threads]]
+ *
+ * threads defaults to one per online CPU.  The batched meshes are also
+ * checked against the scalar ones, so a broken vector path shows up as a
+ * large max error rather than as a fast result.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gearmesh.h"
+#include "utils.h"
+
+#define RUNS 5
+
+static void RandomShapes(struct GearShape *shapes, int count)
+{
+    int i;
+
+    srand(1);
+
+    for (i = 0; i < count; i++) {
+        float inner = 0.5f + 1.5f * rand() / RAND_MAX;
+
+        shapes[i].innerRadius = inner;
+        shapes[i].outerRadius = inner + 1.0f + 3.0f * rand() / RAND_MAX;
+        shapes[i].width = 0.5f + 1.5f * rand() / RAND_MAX;
+        shapes[i].teeth = 8 + rand() % 57;
+        shapes[i].toothDepth = 0.3f + 0.5f * rand() / RAND_MAX;
+    }
+}
+
+static void BuildScalar(const struct GearShape *shapes, int count,
+                        struct GearVertex *vertices, uint32_t *indices)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        BuildGearMesh(&shapes[i], vertices, indices);
+        vertices += shapes[i].teeth * GEAR_VERTICES_PER_TOOTH;
+        indices += shapes[i].teeth * GEAR_INDICES_PER_TOOTH;
+    }
+}
+
+// Best of RUNS, in ns
+static uint64_t TimeBuild(struct GearMeshPool *pPool, int scalar,
+                          const struct GearShape *shapes, int count,
+                          struct GearVertex *vertices, uint32_t *indices)
+{
+    uint64_t best = UINT64_MAX;
+    int run;
+
+    for (run = 0; run < RUNS; run++) {
+        uint64_t start = GetMonotonicNs();
+        uint64_t ns;
+
+        if (scalar) {
+            BuildScalar(shapes, count, vertices, indices);
+        } else {
+            BuildGearMeshes(pPool, shapes, count, vertices, indices);
+        }
+
+        ns = GetMonotonicNs() - start;
+        if (ns < best) {
+            best = ns;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Largest difference between the scalar and batched vertices; returns
+ * -1 if any index differs once the scalar ones are made absolute.
+ */
+static float Compare(const struct GearShape *shapes, int count,
+                     const struct GearVertex *scalarVertices,
+                     const uint32_t *scalarIndices,
+                     const struct GearVertex *vertices, const uint32_t *indices)
+{
+    size_t firstVertex = 0, v = 0, n = 0;
+    float maxError = 0.0f;
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        size_t vertexCount = shapes[i].teeth * GEAR_VERTICES_PER_TOOTH;
+        size_t indexCount = shapes[i].teeth * GEAR_INDICES_PER_TOOTH;
+        size_t end;
+
+        for (end = v + vertexCount; v < end; v++) {
+            for (j = 0; j < 3; j++) {
+                float dp = fabsf(scalarVertices[v].position[j] - vertices[v].position[j]);
+                float dn = fabsf(scalarVertices[v].normal[j] - vertices[v].normal[j]);
+
+                maxError = fmaxf(maxError, fmaxf(dp, dn));
+            }
+        }
+
+        for (end = n + indexCount; n < end; n++) {
+            if (scalarIndices[n] + firstVertex != indices[n]) {
+                return -1.0f;
+            }
+        }
+
+        firstVertex += vertexCount;
+    }
+
+    return maxError;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 2000;
+    int threads = 0;
+    struct GearShape *shapes;
+    struct GearVertex *scalarVertices, *vertices;
+    uint32_t *scalarIndices, *indices;
+    struct GearMeshPool *pPool;
+    size_t vertexCount, indexCount;
+    uint64_t scalarNs, batchNs, poolNs;
+    float maxError;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        threads = atoi(argv[2]);
+    }
+    if (count <= 0 || argc > 3) {
+        Fatal("Usage: %s [gears [threads]]\n", argv[0]);
+    }
+
+    shapes = malloc(count * sizeof(*shapes));
+    if (shapes == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    RandomShapes(shapes, count);
+    GetGearMeshSize(shapes, count, &vertexCount, &indexCount);
+
+    scalarVertices = malloc(vertexCount * sizeof(*scalarVertices));
+    scalarIndices = malloc(indexCount * sizeof(*scalarIndices));
+    vertices = malloc(vertexCount * sizeof(*vertices));
+    indices = malloc(indexCount * sizeof(*indices));
+
+    if (scalarVertices == NULL || scalarIndices == NULL ||
+        vertices == NULL || indices == NULL) {
+        Fatal("Memory allocation failure.\n");
+    }
+
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    pPool = CreateGearMeshPool(threads);
+
+    scalarNs = TimeBuild(NULL, 1, shapes, count, scalarVertices, scalarIndices);
+    batchNs = TimeBuild(NULL, 0, shapes, count, vertices, indices);
+    poolNs = TimeBuild(pPool, 0, shapes, count, vertices, indices);
+
+    maxError = Compare(shapes, count, scalarVertices, scalarIndices,
+                       vertices, indices);
+
+    printf("%d gears, %zu vertices, %zu indices, %.1f MB\n", count,
+           vertexCount, indexCount,
+           (vertexCount * sizeof(*vertices) + indexCount * sizeof(*indices)) / 1e6);
+    printf("%-24s %10s %14s %8s\n", "", "ms", "Mvertices/s", "speedup");
+    printf("%-24s %10.2f %14.1f %8.2f\n", "BuildGearMesh (scalar)",
+           scalarNs / 1e6, vertexCount * 1e3 / scalarNs, 1.0);
+    printf("%-24s %10.2f %14.1f %8.2f\n", "BuildGearMeshes",
+           batchNs / 1e6, vertexCount * 1e3 / batchNs, (double)scalarNs / batchNs);
+    printf("BuildGearMeshes (%2d thr) %10.2f %14.1f %8.2f\n", threads,
+           poolNs / 1e6, vertexCount * 1e3 / poolNs, (double)scalarNs / poolNs);
+
+    if (maxError < 0.0f) {
+        Fatal("Batched indices differ from BuildGearMesh().\n");
+    }
+    printf("max vertex error vs scalar: %g\n", maxError);
+
+    DestroyGearMeshPool(pPool);
+
+    free(indices);
+    free(vertices);
+    free(scalarIndices);
+    free(scalarVertices);
+    free(shapes);
+
+    return 0;
+}
@@ -0,0 +1,1130 @@
+/*
+ * Stub EGL implementation for running eglstreams-kms-example without a
+ * GPU.  Build it as libstubegl.so and load it with LD_PRELOAD, together
+ * with libfakedrm.so (see fakedrm.h) in place of a real KMS device.
+ *
+ * It provides one EGLDevice supporting EGL_EXT_device_drm per DRM device
+ * file named, up to STUB_MAX_DEVICES, and the output layer and stream
+ * entry points that GetEglExtensionFunctionPointers() loads, for up to
+ * STUB_MAX_STREAMS streams used from any number of threads.  No
+ * rendering happens; GL calls go to GLVND's no-op dispatch since no real
+ * context is ever made current.  Instead, frames take simulated time:
+ *
+ *   STUBEGL_DRM_DEVICE       comma-separated DRM device files, one per
+ *                            device (default: /dev/dri/card0)
+ *   STUBEGL_REFRESH_HZ       vblank rate of streams whose plane has no
+ *                            mode set through libdrm (default: 60)
+ *   STUBEGL_SWAP_US          GPU time per frame, spent in
+ *                            eglSwapBuffers() (default: 1000)
+ *   STUBEGL_SWAP_JITTER_US   uniformly distributed extra GPU time per
+ *                            frame, to exercise frame pacing (default: 0)
+ *   STUBEGL_STATS            if set, print frame counts at exit
+ *
+ * Frames are latched at vblanks, which are multiples of the refresh
+ * period of the plane's CRTC's mode from the last vblank libdrm reported
+ * for it when the stream was connected (from library load if it reported
+ * none), or, if the CRTC has VRR_ENABLED set, as soon as they are ready
+ * but at most once per refresh period.  With auto acquire, the stream
+ * holds one frame: eglSwapBuffers() blocks until the previous frame has
+ * been latched, or with EGL_STREAM_FIFO_LENGTH_KHR set, until there is
+ * room for the frame in the FIFO, whose frames are latched at successive
+ * vblanks.  With manual acquire, eglSwapBuffers() replaces a frame that
+ * was not acquired, and an acquire waits for the previous flip to
+ * complete.  An acquire carrying EGL_DRM_FLIP_EVENT_DATA_NV instead
+ * flips the plane through libdrm with an atomic commit requesting a page
+ * flip event, as the NVIDIA implementation does, and returns without
+ * waiting.
+ *
+ * Each stream's consumer has an fb of its own standing in for its
+ * buffers, which replaces whatever the plane was scanning out as soon
+ * as the first frame is handed to it, and is removed when the stream
+ * is destroyed.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/* Not yet in all Khronos headers; see egl.c */
+#if !defined(EGL_DRM_MASTER_FD_EXT)
+#define EGL_DRM_MASTER_FD_EXT                   0x333C
+#endif
+#if !defined(EGL_CONSUMER_AUTO_ACQUIRE_EXT)
+#define EGL_CONSUMER_AUTO_ACQUIRE_EXT           0x332B
+#endif
+#if !defined(EGL_RESOURCE_BUSY_EXT)
+#define EGL_RESOURCE_BUSY_EXT                   0x3353
+#endif
+#if !defined(EGL_DRM_FLIP_EVENT_DATA_NV)
+#define EGL_DRM_FLIP_EVENT_DATA_NV              0x333E
+#endif
+
+#define STUB_EXPORT __attribute__((visibility("default")))
+
+static const char clientExtensions[] =
+    "EGL_EXT_client_extensions EGL_EXT_device_base EGL_EXT_device_enumeration "
+    "EGL_EXT_device_query EGL_EXT_platform_base EGL_EXT_platform_device";
+
+static const char deviceExtensions[] = "EGL_EXT_device_drm";
+
+static const char displayExtensions[] =
+    "EGL_EXT_output_base EGL_EXT_output_drm EGL_KHR_stream "
+    "EGL_EXT_stream_consumer_egloutput EGL_KHR_stream_producer_eglsurface "
+    "EGL_EXT_stream_acquire_mode EGL_NV_stream_attrib EGL_NV_output_drm_flip_event "
+    "EGL_KHR_stream_fifo EGL_KHR_no_config_context";
+
+#define STUB_MAX_DEVICES 4
+#define STUB_MAX_STREAMS 8
+#define STUB_MAX_FIFO_LENGTH 8
+
+/*
+ * The device and display handles are the addresses of the two chars,
+ * so that they are distinct non-NULL values that are easy to check.
+ */
+struct StubDevice {
+    char device;
+    char display;
+    const char *drmDevice;
+    int drmFd;              // from EGL_DRM_MASTER_FD_EXT
+};
+
+// A layer's handle is its address
+struct StubLayer {
+    struct StubDevice *pDevice;
+    uint32_t planeID;
+};
+
+struct StubStream {
+    int inUse;
+    struct StubDevice *pDevice;
+    char surface;           // the producer surface's handle is its address
+    int autoAcquire;
+    uint32_t planeID;       // of the consumer layer; 0 until connected
+    uint32_t fbPropertyID;  // the plane's FB_ID, for flips through libdrm
+    uint32_t fb;            // the consumer's, once connected
+    int fbShown;            // fb has been put on the plane
+    int frameQueued;        // produced but not yet latched or acquired
+    uint64_t latchNs;       // vblank at which the last frame is scanned out
+    int fifoLength;         // EGL_STREAM_FIFO_LENGTH_KHR; 0 is mailbox
+    uint64_t fifo[STUB_MAX_FIFO_LENGTH]; // latch times of queued frames, oldest first
+    int fifoCount;
+    uint64_t producerFrame; // number of the last frame produced, from 1
+    uint64_t consumerFrame; // number of the frame being scanned out
+    int vrr;                // the plane's CRTC has VRR_ENABLED set
+    uint64_t epochNs;       // a vblank of the plane's CRTC, in phase with the rest
+    uint64_t periodNs;      // of the CRTC's mode
+    uint64_t modeID;        // the CRTC's MODE_ID blob the timing was taken from
+};
+
+struct StubState {
+    int initialized;
+
+    struct StubDevice devices[STUB_MAX_DEVICES];
+    int deviceCount;
+    uint64_t periodNs;
+    uint64_t swapNs;
+    uint64_t swapJitterNs;
+    uint64_t epochNs;
+    unsigned int seed;
+
+    struct StubLayer layers[STUB_MAX_STREAMS];
+    struct StubStream streams[STUB_MAX_STREAMS];
+
+    unsigned long swaps, acquires, dropped, busy, flips;
+};
+
+// Handles are addresses of these, like those of devices and displays.
+static char config, context;
+static struct StubState stub;
+
+/*
+ * Stream state and statistics are only touched with this held; it is
+ * dropped while a thread sleeps for simulated GPU time or a vblank.
+ * As in EGL, the error is per thread.
+ */
+static pthread_mutex_t stubLock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local EGLint lastError = EGL_SUCCESS;
+
+static uint64_t NowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void SleepUntil(uint64_t ns)
+{
+    struct timespec ts = {
+        .tv_sec = ns / 1000000000ull,
+        .tv_nsec = ns % 1000000000ull,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// The first vblank of the stream's plane after the given time.
+static uint64_t NextVblank(const struct StubStream *pStream, uint64_t ns)
+{
+    uint64_t vblank = (ns - pStream->epochNs) / pStream->periodNs + 1;
+
+    return pStream->epochNs + vblank * pStream->periodNs;
+}
+
+/*
+ * When a frame handed to the consumer at the given time is scanned out:
+ * at the next vblank, or with adaptive sync at once, but no sooner than
+ * one refresh period after the previous frame.
+ */
+static uint64_t NextLatch(const struct StubStream *pStream, uint64_t ns)
+{
+    if (pStream->vrr) {
+        uint64_t earliestNs = pStream->latchNs + pStream->periodNs;
+
+        return ns > earliestNs ? ns : earliestNs;
+    }
+
+    return NextVblank(pStream, ns);
+}
+
+static double GetEnvDouble(const char *name, double defaultValue)
+{
+    const char *value = getenv(name);
+
+    return value ? atof(value) : defaultValue;
+}
+
+static void Init(void)
+{
+    char *drmDevices, *name, *saveptr;
+    double refresh;
+
+    if (stub.initialized) {
+        return;
+    }
+
+    refresh = GetEnvDouble("STUBEGL_REFRESH_HZ", 60.0);
+    if (refresh <= 0.0) {
+        refresh = 60.0;
+    }
+
+    // One device per comma-separated file name
+    drmDevices = getenv("STUBEGL_DRM_DEVICE");
+    drmDevices = strdup(drmDevices != NULL ? drmDevices : "/dev/dri/card0");
+    for (name = strtok_r(drmDevices, ",", &saveptr);
+         name != NULL && stub.deviceCount < STUB_MAX_DEVICES;
+         name = strtok_r(NULL, ",", &saveptr)) {
+        stub.devices[stub.deviceCount].drmDevice = name;
+        stub.devices[stub.deviceCount].drmFd = -1;
+        stub.deviceCount++;
+    }
+
+    stub.periodNs = (uint64_t)(1e9 / refresh);
+    stub.swapNs = (uint64_t)(GetEnvDouble("STUBEGL_SWAP_US", 1000.0) * 1000.0);
+    stub.swapJitterNs = (uint64_t)(GetEnvDouble("STUBEGL_SWAP_JITTER_US", 0.0) * 1000.0);
+    stub.epochNs = NowNs();
+    stub.seed = 1;
+    stub.initialized = 1;
+}
+
+static EGLBoolean Fail(EGLint error)
+{
+    lastError = error;
+    return EGL_FALSE;
+}
+
+static EGLBoolean Succeed(void)
+{
+    lastError = EGL_SUCCESS;
+    return EGL_TRUE;
+}
+
+static struct StubDevice *FindDevice(EGLDeviceEXT dev)
+{
+    int i;
+
+    for (i = 0; i < stub.deviceCount; i++) {
+        if (dev == &stub.devices[i].device) {
+            return &stub.devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct StubDevice *FindDisplay(EGLDisplay dpy)
+{
+    int i;
+
+    for (i = 0; i < stub.deviceCount; i++) {
+        if (dpy == &stub.devices[i].display) {
+            return &stub.devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct StubStream *FindStream(EGLStreamKHR stream)
+{
+    int i;
+
+    for (i = 0; i < STUB_MAX_STREAMS; i++) {
+        if (stream == &stub.streams[i] && stub.streams[i].inUse) {
+            return &stub.streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct StubStream *FindSurfaceStream(EGLSurface surf)
+{
+    int i;
+
+    for (i = 0; i < STUB_MAX_STREAMS; i++) {
+        if (surf == &stub.streams[i].surface && stub.streams[i].inUse) {
+            return &stub.streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+__attribute__((destructor))
+static void PrintStatsAtExit(void)
+{
+    if (getenv("STUBEGL_STATS") == NULL || !stub.initialized) {
+        return;
+    }
+
+    fprintf(stderr, "stubegl: %lu swaps, %lu acquires (%lu busy), %lu flips through DRM, "
+            "%lu frames replaced before display\n",
+            stub.swaps, stub.acquires, stub.busy, stub.flips, stub.dropped);
+}
+
+
+/* Core EGL */
+
+STUB_EXPORT EGLint eglGetError(void)
+{
+    EGLint error = lastError;
+
+    lastError = EGL_SUCCESS;
+
+    return error;
+}
+
+STUB_EXPORT const char *eglQueryString(EGLDisplay dpy, EGLint name)
+{
+    Init();
+
+    if (dpy == EGL_NO_DISPLAY) {
+        if (name == EGL_EXTENSIONS) {
+            return clientExtensions;
+        }
+        lastError = EGL_BAD_DISPLAY;
+        return NULL;
+    }
+
+    switch (name) {
+    case EGL_EXTENSIONS:
+        return displayExtensions;
+    case EGL_VENDOR:
+        return "eglstreams-kms-example stub";
+    case EGL_VERSION:
+        return "1.5 stub";
+    case EGL_CLIENT_APIS:
+        return "OpenGL";
+    default:
+        lastError = EGL_BAD_PARAMETER;
+        return NULL;
+    }
+}
+
+STUB_EXPORT EGLDisplay eglGetDisplay(EGLNativeDisplayType display_id)
+{
+    (void)display_id;
+
+    return EGL_NO_DISPLAY;
+}
+
+STUB_EXPORT EGLBoolean eglInitialize(EGLDisplay dpy, EGLint *major, EGLint *minor)
+{
+    Init();
+
+    if (FindDisplay(dpy) == NULL) {
+        return Fail(EGL_BAD_DISPLAY);
+    }
+
+    if (major) {
+        *major = 1;
+    }
+    if (minor) {
+        *minor = 5;
+    }
+
+    return Succeed();
+}
+
+STUB_EXPORT EGLBoolean eglTerminate(EGLDisplay dpy)
+{
+    return FindDisplay(dpy) != NULL ? Succeed() : Fail(EGL_BAD_DISPLAY);
+}
+
+STUB_EXPORT EGLBoolean eglBindAPI(EGLenum api)
+{
+    return api == EGL_OPENGL_API ? Succeed() : Fail(EGL_BAD_PARAMETER);
+}
+
+STUB_EXPORT EGLBoolean eglChooseConfig(EGLDisplay dpy, const EGLint *attrib_list,
+                                       EGLConfig *configs, EGLint config_size,
+                                       EGLint *num_config)
+{
+    (void)attrib_list;
+
+    if (FindDisplay(dpy) == NULL) {
+        return Fail(EGL_BAD_DISPLAY);
+    }
+
+    *num_config = 0;
+    if (configs != NULL && config_size > 0) {
+        configs[0] = &config;
+        *num_config = 1;
+    }
+
+    return Succeed();
+}
+
+STUB_EXPORT EGLBoolean eglGetConfigAttrib(EGLDisplay dpy, EGLConfig cfg,
+                                          EGLint attribute, EGLint *value)
+{
+    if (FindDisplay(dpy) == NULL || cfg != &config) {
+        return Fail(EGL_BAD_CONFIG);
+    }
+
+    switch (attribute) {
+    case EGL_SURFACE_TYPE:
+        *value = EGL_STREAM_BIT_KHR | EGL_PBUFFER_BIT;
+        return Succeed();
+    case EGL_RENDERABLE_TYPE:
+        *value = EGL_OPENGL_BIT;
+        return Succeed();
+    case EGL_RED_SIZE:
+    case EGL_GREEN_SIZE:
+    case EGL_BLUE_SIZE:
+        *value = 8;
+        return Succeed();
+    default:
+        *value = 0;
+        return Succeed();
+    }
+}
+
+STUB_EXPORT EGLContext eglCreateContext(EGLDisplay dpy, EGLConfig cfg,
+                                        EGLContext share_context, const EGLint *attrib_list)
+{
+    (void)share_context;
+    (void)attrib_list;
+
+    if (FindDisplay(dpy) == NULL || (cfg != &config && cfg != EGL_NO_CONFIG_KHR)) {
+        lastError = EGL_BAD_CONFIG;
+        return EGL_NO_CONTEXT;
+    }
+
+    lastError = EGL_SUCCESS;
+    return &context;
+}
+
+STUB_EXPORT EGLBoolean eglDestroyContext(EGLDisplay dpy, EGLContext ctx)
+{
+    return (FindDisplay(dpy) != NULL && ctx == &context) ? Succeed() : Fail(EGL_BAD_CONTEXT);
+}
+
+STUB_EXPORT EGLBoolean eglMakeCurrent(EGLDisplay dpy, EGLSurface draw, EGLSurface read,
+                                      EGLContext ctx)
+{
+    (void)draw;
+    (void)read;
+    (void)ctx;
+
+    return FindDisplay(dpy) != NULL ? Succeed() : Fail(EGL_BAD_DISPLAY);
+}
+
+STUB_EXPORT EGLContext eglGetCurrentContext(void)
+{
+    return &context;
+}
+
+STUB_EXPORT EGLBoolean eglDestroySurface(EGLDisplay dpy, EGLSurface surf)
+{
+    EGLBoolean ret;
+
+    pthread_mutex_lock(&stubLock);
+    ret = (FindDisplay(dpy) != NULL && FindSurfaceStream(surf) != NULL) ?
+          Succeed() : Fail(EGL_BAD_SURFACE);
+    pthread_mutex_unlock(&stubLock);
+
+    return ret;
+}
+
+STUB_EXPORT EGLBoolean eglSwapInterval(EGLDisplay dpy, EGLint interval)
+{
+    (void)interval;
+
+    return FindDisplay(dpy) != NULL ? Succeed() : Fail(EGL_BAD_DISPLAY);
+}
+
+// Put the consumer's fb on the plane, with the stream's first frame.
+static void ShowConsumerFb(struct StubStream *pStream)
+{
+    drmModeAtomicReqPtr pAtomic;
+
+    if (pStream->fbShown || pStream->fb == 0) {
+        return;
+    }
+
+    pAtomic = drmModeAtomicAlloc();
+    if (pAtomic == NULL) {
+        return;
+    }
+
+    drmModeAtomicAddProperty(pAtomic, pStream->planeID, pStream->fbPropertyID, pStream->fb);
+    if (drmModeAtomicCommit(pStream->pDevice->drmFd, pAtomic,
+                            DRM_MODE_ATOMIC_NONBLOCK, NULL) == 0) {
+        pStream->fbShown = 1;
+    }
+    drmModeAtomicFree(pAtomic);
+}
+
+/*
+ * Retire the frames of an auto acquire stream's FIFO that have been
+ * latched by the given time.  Called with stubLock held.
+ */
+static void RetireLatchedFrames(struct StubStream *pStream, uint64_t ns)
+{
+    int latched = 0;
+
+    while (latched < pStream->fifoCount && pStream->fifo[latched] <= ns) {
+        latched++;
+    }
+
+    pStream->consumerFrame += latched;
+    pStream->fifoCount -= latched;
+    memmove(pStream->fifo, pStream->fifo + latched, pStream->fifoCount * sizeof(pStream->fifo[0]));
+}
+
+static void UpdatePlaneTiming(struct StubStream *pStream);
+
+/*
+ * Spend the simulated GPU time of one frame, then hand the frame to
+ * the stream.
+ */
+STUB_EXPORT EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surf)
+{
+    struct StubStream *pStream;
+    uint64_t gpuNs = stub.swapNs;
+    uint64_t now, latchNs;
+
+    pthread_mutex_lock(&stubLock);
+
+    pStream = FindSurfaceStream(surf);
+    if (FindDisplay(dpy) == NULL || pStream == NULL) {
+        pthread_mutex_unlock(&stubLock);
+        return Fail(EGL_BAD_SURFACE);
+    }
+
+    if (stub.swapJitterNs > 0) {
+        gpuNs += (uint64_t)((double)rand_r(&stub.seed) / RAND_MAX * stub.swapJitterNs);
+    }
+
+    pthread_mutex_unlock(&stubLock);
+    SleepUntil(NowNs() + gpuNs);
+    UpdatePlaneTiming(pStream);
+    pthread_mutex_lock(&stubLock);
+
+    stub.swaps++;
+    pStream->producerFrame++;
+
+    if (pStream->autoAcquire) {
+        /*
+         * A mailbox stream holds one frame: wait for the previous one to
+         * latch.  A FIFO waits for its oldest frame when it is full, and
+         * each frame latches at the vblank after the one before it.
+         */
+        const int capacity = pStream->fifoLength > 0 ? pStream->fifoLength : 1;
+
+        now = NowNs();
+        RetireLatchedFrames(pStream, now);
+        if (pStream->fifoCount == capacity) {
+            latchNs = pStream->fifo[0];
+            pthread_mutex_unlock(&stubLock);
+            SleepUntil(latchNs);
+            pthread_mutex_lock(&stubLock);
+            now = NowNs();
+            RetireLatchedFrames(pStream, now);
+        }
+        pStream->latchNs = NextLatch(pStream, now > pStream->latchNs ? now : pStream->latchNs);
+        pStream->fifo[pStream->fifoCount++] = pStream->latchNs;
+        pthread_mutex_unlock(&stubLock);
+        ShowConsumerFb(pStream);
+        return Succeed();
+    }
+
+    if (pStream->frameQueued) {
+        stub.dropped++;
+    }
+    pStream->frameQueued = 1;
+
+    pthread_mutex_unlock(&stubLock);
+
+    return Succeed();
+}
+
+static __eglMustCastToProperFunctionPointerType LookupProc(const char *procname);
+
+STUB_EXPORT __eglMustCastToProperFunctionPointerType eglGetProcAddress(const char *procname)
+{
+    Init();
+
+    return LookupProc(procname);
+}
+
+
+/* EGL_EXT_device_base */
+
+static EGLBoolean StubQueryDevicesEXT(EGLint max_devices, EGLDeviceEXT *devices,
+                                      EGLint *num_devices)
+{
+    int i;
+
+    *num_devices = stub.deviceCount;
+
+    if (devices != NULL) {
+        for (i = 0; i < max_devices && i < stub.deviceCount; i++) {
+            devices[i] = &stub.devices[i].device;
+        }
+        *num_devices = i;
+    }
+
+    return Succeed();
+}
+
+static const char *StubQueryDeviceStringEXT(EGLDeviceEXT dev, EGLint name)
+{
+    struct StubDevice *pDevice = FindDevice(dev);
+
+    if (pDevice == NULL) {
+        lastError = EGL_BAD_DEVICE_EXT;
+        return NULL;
+    }
+
+    switch (name) {
+    case EGL_EXTENSIONS:
+        return deviceExtensions;
+    case EGL_DRM_DEVICE_FILE_EXT:
+        return pDevice->drmDevice;
+    default:
+        lastError = EGL_BAD_PARAMETER;
+        return NULL;
+    }
+}
+
+static EGLDisplay StubGetPlatformDisplayEXT(EGLenum platform, void *native_display,
+                                            const EGLint *attrib_list)
+{
+    struct StubDevice *pDevice = FindDevice(native_display);
+    int i;
+
+    if (platform != EGL_PLATFORM_DEVICE_EXT || pDevice == NULL) {
+        lastError = EGL_BAD_PARAMETER;
+        return EGL_NO_DISPLAY;
+    }
+
+    for (i = 0; attrib_list != NULL && attrib_list[i] != EGL_NONE; i += 2) {
+        if (attrib_list[i] == EGL_DRM_MASTER_FD_EXT) {
+            pDevice->drmFd = attrib_list[i + 1];
+        }
+    }
+
+    lastError = EGL_SUCCESS;
+    return &pDevice->display;
+}
+
+
+/* EGL_EXT_output_base */
+
+static EGLBoolean StubGetOutputLayersEXT(EGLDisplay dpy, const EGLAttrib *attrib_list,
+                                         EGLOutputLayerEXT *layers, EGLint max_layers,
+                                         EGLint *num_layers)
+{
+    struct StubDevice *pDevice = FindDisplay(dpy);
+    uint32_t planeID = 0;
+    int i;
+
+    if (pDevice == NULL) {
+        return Fail(EGL_BAD_DISPLAY);
+    }
+
+    for (i = 0; attrib_list != NULL && attrib_list[i] != EGL_NONE; i += 2) {
+        if (attrib_list[i] == EGL_DRM_PLANE_EXT) {
+            planeID = attrib_list[i + 1];
+        }
+    }
+
+    // One layer per plane, created when first asked for
+    pthread_mutex_lock(&stubLock);
+    for (i = 0; i < STUB_MAX_STREAMS; i++) {
+        struct StubLayer *pLayer = &stub.layers[i];
+
+        if (pLayer->planeID == 0) {
+            pLayer->pDevice = pDevice;
+            pLayer->planeID = planeID;
+        }
+        if (pLayer->pDevice == pDevice && pLayer->planeID == planeID) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stubLock);
+
+    *num_layers = 0;
+    if (planeID == 0 || i == STUB_MAX_STREAMS) {
+        return Succeed();
+    }
+
+    if (layers != NULL && max_layers > 0) {
+        layers[0] = &stub.layers[i];
+        *num_layers = 1;
+    }
+
+    return Succeed();
+}
+
+
+/* EGL_KHR_stream and friends */
+
+static EGLStreamKHR StubCreateStreamKHR(EGLDisplay dpy, const EGLint *attrib_list)
+{
+    struct StubDevice *pDevice = FindDisplay(dpy);
+    struct StubStream *pStream;
+    int i;
+
+    if (pDevice == NULL) {
+        lastError = EGL_BAD_DISPLAY;
+        return EGL_NO_STREAM_KHR;
+    }
+
+    pthread_mutex_lock(&stubLock);
+
+    for (i = 0; i < STUB_MAX_STREAMS && stub.streams[i].inUse; i++);
+
+    if (i == STUB_MAX_STREAMS) {
+        pthread_mutex_unlock(&stubLock);
+        lastError = EGL_BAD_ALLOC;
+        return EGL_NO_STREAM_KHR;
+    }
+
+    pStream = &stub.streams[i];
+    memset(pStream, 0, sizeof(*pStream));
+    pStream->inUse = 1;
+    pStream->epochNs = stub.epochNs;
+    pStream->periodNs = stub.periodNs;
+    pStream->pDevice = pDevice;
+    pStream->autoAcquire = 1;
+
+    for (i = 0; attrib_list != NULL && attrib_list[i] != EGL_NONE; i += 2) {
+        if (attrib_list[i] == EGL_CONSUMER_AUTO_ACQUIRE_EXT) {
+            pStream->autoAcquire = attrib_list[i + 1];
+        } else if (attrib_list[i] == EGL_STREAM_FIFO_LENGTH_KHR) {
+            if (attrib_list[i + 1] < 0 || attrib_list[i + 1] > STUB_MAX_FIFO_LENGTH) {
+                pStream->inUse = 0;
+                pthread_mutex_unlock(&stubLock);
+                lastError = EGL_BAD_PARAMETER;
+                return EGL_NO_STREAM_KHR;
+            }
+            pStream->fifoLength = attrib_list[i + 1];
+        }
+    }
+
+    pthread_mutex_unlock(&stubLock);
+
+    lastError = EGL_SUCCESS;
+    return pStream;
+}
+
+static EGLBoolean StubDestroyStreamKHR(EGLDisplay dpy, EGLStreamKHR stream)
+{
+    struct StubStream *pStream;
+    uint32_t fb = 0;
+
+    pthread_mutex_lock(&stubLock);
+    pStream = FindStream(stream);
+    if (pStream != NULL) {
+        pStream->inUse = 0;
+        fb = pStream->fb;
+    }
+    pthread_mutex_unlock(&stubLock);
+
+    if (pStream == NULL || FindDisplay(dpy) != pStream->pDevice) {
+        return Fail(EGL_BAD_STREAM_KHR);
+    }
+
+    if (fb != 0) {
+        drmModeRmFB(pStream->pDevice->drmFd, fb);
+    }
+
+    return Succeed();
+}
+
+/*
+ * Find a property of a KMS object through libdrm, and its current value
+ * if pValue is not NULL.  Returns the property ID, or 0.
+ */
+static uint32_t FindDrmProperty(int drmFd, uint32_t objectID, uint32_t objectType,
+                                const char *name, uint64_t *pValue)
+{
+    drmModeObjectPropertiesPtr pProperties;
+    uint32_t i, propertyID = 0;
+
+    if (drmFd < 0) {
+        return 0;
+    }
+
+    pProperties = drmModeObjectGetProperties(drmFd, objectID, objectType);
+    if (pProperties == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < pProperties->count_props && propertyID == 0; i++) {
+        drmModePropertyPtr pProperty = drmModeGetProperty(drmFd, pProperties->props[i]);
+
+        if (pProperty != NULL && strcmp(pProperty->name, name) == 0) {
+            propertyID = pProperty->prop_id;
+            if (pValue != NULL) {
+                *pValue = pProperties->prop_values[i];
+            }
+        }
+        drmModeFreeProperty(pProperty);
+    }
+
+    drmModeFreeObjectProperties(pProperties);
+
+    return propertyID;
+}
+
+/*
+ * Take the vblank timing of the CRTC the plane is on: whether it has
+ * adaptive sync enabled, and the rate and phase of its vblanks, so that
+ * frames latch when the display says they do.
+ */
+static void GetPlaneTiming(struct StubStream *pStream, int drmFd, uint32_t planeID)
+{
+    uint64_t crtcID = 0, vrrEnabled = 0, sequence;
+    drmModeCrtcPtr pCrtc;
+
+    pStream->epochNs = stub.epochNs;
+    pStream->periodNs = stub.periodNs;
+    pStream->modeID = 0;
+
+    FindDrmProperty(drmFd, planeID, DRM_MODE_OBJECT_PLANE, "CRTC_ID", &crtcID);
+    if (crtcID != 0) {
+        FindDrmProperty(drmFd, crtcID, DRM_MODE_OBJECT_CRTC, "MODE_ID", &pStream->modeID);
+        FindDrmProperty(drmFd, crtcID, DRM_MODE_OBJECT_CRTC, "VRR_ENABLED", &vrrEnabled);
+        if (drmCrtcGetSequence(drmFd, crtcID, &sequence, &pStream->epochNs) != 0) {
+            pStream->epochNs = stub.epochNs;
+        }
+
+        pCrtc = drmModeGetCrtc(drmFd, crtcID);
+        if (pCrtc != NULL && pCrtc->mode_valid && pCrtc->mode.clock != 0) {
+            pStream->periodNs = (uint64_t)pCrtc->mode.htotal * pCrtc->mode.vtotal *
+                                1000000ull / pCrtc->mode.clock;
+        }
+        drmModeFreeCrtc(pCrtc);
+    }
+
+    pStream->vrr = vrrEnabled != 0;
+}
+
+/*
+ * Take the timing again if the plane's CRTC has been given another mode
+ * since, as a stream outlives a modeset that keeps its size.
+ */
+static void UpdatePlaneTiming(struct StubStream *pStream)
+{
+    int drmFd = pStream->pDevice->drmFd;
+    uint64_t crtcID = 0, modeID = 0;
+
+    if (pStream->planeID == 0 || drmFd < 0) {
+        return;
+    }
+
+    FindDrmProperty(drmFd, pStream->planeID, DRM_MODE_OBJECT_PLANE, "CRTC_ID", &crtcID);
+    if (crtcID != 0) {
+        FindDrmProperty(drmFd, crtcID, DRM_MODE_OBJECT_CRTC, "MODE_ID", &modeID);
+    }
+
+    if (modeID != pStream->modeID) {
+        GetPlaneTiming(pStream, drmFd, pStream->planeID);
+    }
+}
+
+static EGLBoolean StubStreamConsumerOutputEXT(EGLDisplay dpy, EGLStreamKHR stream,
+                                              EGLOutputLayerEXT outputLayer)
+{
+    const struct StubLayer *pLayer = outputLayer;
+    struct StubStream *pStream;
+
+    pthread_mutex_lock(&stubLock);
+    pStream = FindStream(stream);
+    pthread_mutex_unlock(&stubLock);
+
+    if (pStream == NULL || FindDisplay(dpy) != pStream->pDevice ||
+        pLayer < &stub.layers[0] || pLayer >= &stub.layers[STUB_MAX_STREAMS] ||
+        pLayer->pDevice != pStream->pDevice) {
+        return Fail(EGL_BAD_MATCH);
+    }
+
+    pStream->planeID = pLayer->planeID;
+    pStream->fbPropertyID = FindDrmProperty(pStream->pDevice->drmFd, pLayer->planeID,
+                                            DRM_MODE_OBJECT_PLANE, "FB_ID", NULL);
+    GetPlaneTiming(pStream, pStream->pDevice->drmFd, pLayer->planeID);
+
+    if (pStream->pDevice->drmFd >= 0 && pStream->fbPropertyID != 0 &&
+        drmModeAddFB(pStream->pDevice->drmFd, 1, 1, 24, 32, 4, 0, &pStream->fb) != 0) {
+        pStream->fb = 0;
+    }
+
+    return Succeed();
+}
+
+static EGLSurface StubCreateStreamProducerSurfaceKHR(EGLDisplay dpy, EGLConfig cfg,
+                                                     EGLStreamKHR stream,
+                                                     const EGLint *attrib_list)
+{
+    struct StubStream *pStream;
+
+    (void)attrib_list;
+
+    pthread_mutex_lock(&stubLock);
+    pStream = FindStream(stream);
+    pthread_mutex_unlock(&stubLock);
+
+    if (pStream == NULL || FindDisplay(dpy) != pStream->pDevice || cfg != &config) {
+        lastError = EGL_BAD_MATCH;
+        return EGL_NO_SURFACE;
+    }
+
+    lastError = EGL_SUCCESS;
+    return &pStream->surface;
+}
+
+/*
+ * Commit the consumer's fb, or without one the plane's current fb, with
+ * a page flip event, so that the application receives the event for
+ * this frame from libdrm.
+ */
+static EGLBoolean FlipThroughDrm(struct StubStream *pStream, void *flipEventData)
+{
+    drmModeAtomicReqPtr pAtomic;
+    drmModePlanePtr pPlane;
+    uint32_t fb = 0;
+    int ret;
+
+    const int drmFd = pStream->pDevice->drmFd;
+
+    if (drmFd < 0 || pStream->fbPropertyID == 0) {
+        return Fail(EGL_BAD_ACCESS);
+    }
+
+    fb = pStream->fb;
+    if (fb == 0 && (pPlane = drmModeGetPlane(drmFd, pStream->planeID)) != NULL) {
+        fb = pPlane->fb_id;
+        drmModeFreePlane(pPlane);
+    }
+
+    pAtomic = drmModeAtomicAlloc();
+    if (pAtomic == NULL) {
+        return Fail(EGL_BAD_ALLOC);
+    }
+
+    drmModeAtomicAddProperty(pAtomic, pStream->planeID, pStream->fbPropertyID, fb);
+    ret = drmModeAtomicCommit(drmFd, pAtomic,
+                              DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+                              flipEventData);
+    drmModeAtomicFree(pAtomic);
+
+    if (ret != 0) {
+        return Fail(ret == -EBUSY ? EGL_RESOURCE_BUSY_EXT : EGL_BAD_ACCESS);
+    }
+
+    pStream->fbShown = pStream->fb != 0;
+
+    pthread_mutex_lock(&stubLock);
+    stub.flips++;
+    pthread_mutex_unlock(&stubLock);
+
+    return Succeed();
+}
+
+/*
+ * A stream is only ever acquired from by one thread, so only finding
+ * it and the statistics need the lock.
+ */
+static EGLBoolean Acquire(EGLDisplay dpy, EGLStreamKHR stream, void *flipEventData)
+{
+    struct StubStream *pStream;
+    uint64_t now;
+
+    pthread_mutex_lock(&stubLock);
+
+    pStream = FindStream(stream);
+    if (FindDisplay(dpy) == NULL || pStream == NULL) {
+        pthread_mutex_unlock(&stubLock);
+        return Fail(EGL_BAD_STREAM_KHR);
+    }
+
+    if (pStream->autoAcquire) {
+        pthread_mutex_unlock(&stubLock);
+        return Fail(EGL_BAD_STATE_KHR);
+    }
+
+    stub.acquires++;
+
+    if (!pStream->frameQueued) {
+        stub.busy++;
+        pthread_mutex_unlock(&stubLock);
+        return Fail(EGL_RESOURCE_BUSY_EXT);
+    }
+
+    pthread_mutex_unlock(&stubLock);
+
+    if (flipEventData != NULL) {
+        if (!FlipThroughDrm(pStream, flipEventData)) {
+            return EGL_FALSE;
+        }
+        pStream->frameQueued = 0;
+        pStream->consumerFrame = pStream->producerFrame;
+        return EGL_TRUE;
+    }
+
+    UpdatePlaneTiming(pStream);
+
+    // Only one flip may be pending.
+    now = NowNs();
+    if (pStream->latchNs > now) {
+        SleepUntil(pStream->latchNs);
+        now = pStream->latchNs;
+    }
+    pStream->latchNs = NextLatch(pStream, now);
+    pStream->frameQueued = 0;
+    pStream->consumerFrame = pStream->producerFrame;
+    ShowConsumerFb(pStream);
+
+    return Succeed();
+}
+
+static EGLBoolean StubStreamConsumerAcquireKHR(EGLDisplay dpy, EGLStreamKHR stream)
+{
+    return Acquire(dpy, stream, NULL);
+}
+
+static EGLBoolean StubStreamConsumerAcquireAttribNV(EGLDisplay dpy, EGLStreamKHR stream,
+                                                    const EGLAttrib *attrib_list)
+{
+    void *flipEventData = NULL;
+    int i;
+
+    for (i = 0; attrib_list != NULL && attrib_list[i] != EGL_NONE; i += 2) {
+        if (attrib_list[i] == EGL_DRM_FLIP_EVENT_DATA_NV) {
+            flipEventData = (void *)attrib_list[i + 1];
+        }
+    }
+
+    return Acquire(dpy, stream, flipEventData);
+}
+
+/*
+ * Frame numbers count the frames produced into the stream from 1; the
+ * consumer's is that of the frame being scanned out, so the frames in
+ * between are queued, and any it skips were replaced before display.
+ */
+static EGLBoolean StubQueryStreamu64KHR(EGLDisplay dpy, EGLStreamKHR stream,
+                                        EGLenum attribute, EGLuint64KHR *value)
+{
+    struct StubStream *pStream;
+    EGLBoolean ret = EGL_TRUE;
+
+    pthread_mutex_lock(&stubLock);
+
+    pStream = FindStream(stream);
+    if (FindDisplay(dpy) == NULL || pStream == NULL) {
+        pthread_mutex_unlock(&stubLock);
+        return Fail(EGL_BAD_STREAM_KHR);
+    }
+
+    if (pStream->autoAcquire) {
+        RetireLatchedFrames(pStream, NowNs());
+    }
+
+    switch (attribute) {
+    case EGL_PRODUCER_FRAME_KHR:
+        *value = pStream->producerFrame;
+        break;
+    case EGL_CONSUMER_FRAME_KHR:
+        *value = pStream->consumerFrame;
+        break;
+    default:
+        ret = EGL_FALSE;
+        break;
+    }
+
+    pthread_mutex_unlock(&stubLock);
+
+    return ret ? Succeed() : Fail(EGL_BAD_ATTRIBUTE);
+}
+
+static __eglMustCastToProperFunctionPointerType LookupProc(const char *procname)
+{
+    static const struct {
+        const char *name;
+        __eglMustCastToProperFunctionPointerType proc;
+    } procs[] = {
+#define PROC(name, func) { name, (__eglMustCastToProperFunctionPointerType)func }
+        PROC("eglQueryDevicesEXT", StubQueryDevicesEXT),
+        PROC("eglQueryDeviceStringEXT", StubQueryDeviceStringEXT),
+        PROC("eglGetPlatformDisplayEXT", StubGetPlatformDisplayEXT),
+        PROC("eglGetOutputLayersEXT", StubGetOutputLayersEXT),
+        PROC("eglCreateStreamKHR", StubCreateStreamKHR),
+        PROC("eglDestroyStreamKHR", StubDestroyStreamKHR),
+        PROC("eglQueryStreamu64KHR", StubQueryStreamu64KHR),
+        PROC("eglStreamConsumerOutputEXT", StubStreamConsumerOutputEXT),
+        PROC("eglCreateStreamProducerSurfaceKHR", StubCreateStreamProducerSurfaceKHR),
+        PROC("eglStreamConsumerAcquireKHR", StubStreamConsumerAcquireKHR),
+        PROC("eglStreamConsumerAcquireAttribNV", StubStreamConsumerAcquireAttribNV),
+        PROC("eglGetError", eglGetError),
+        PROC("eglQueryString", eglQueryString),
+        PROC("eglSwapBuffers", eglSwapBuffers),
+#undef PROC
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(procs) / sizeof(procs[0]); i++) {
+        if (strcmp(procs[i].name, procname) == 0) {
+            return procs[i].proc;
+        }
+    }
+
+    return NULL;
+}
@@ -28,7 +28,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
-#include <sys/time.h>
+#include <time.h>
 
 
 void Fatal(const char *format, ...)
@@ -56,38 +56,48 @@ void Warning(const char *format, ...)
 }
 
 
-double GetTime(void)
+/*
+ * CLOCK_MONOTONIC in nanoseconds; the same clock DRM uses for vblank
+ * and page flip timestamps when DRM_CAP_TIMESTAMP_MONOTONIC is set.
+ */
+uint64_t GetMonotonicNs(void)
 {
-    struct timeval tv;
-    struct timezone tz;
+    struct timespec ts;
 
-    gettimeofday(&tv, &tz);
-    return (tv.tv_sec) + (tv.tv_usec / 1000000.0);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
 
-void PrintFps(void)
+/*
+ * Resident set size of the process, from /proc/self/statm; 0 if it
+ * cannot be read.
+ */
+uint64_t GetResidentBytes(void)
 {
-    static int frames = 0;
-    static double startTime = -1;
-    double seconds, currentTime = GetTime();
+    FILE *file = fopen("/proc/self/statm", "r");
+    unsigned long long size, resident = 0;
 
-    if (startTime < 0) {
-        startTime = currentTime;
+    if (file == NULL) {
+        return 0;
     }
 
-    frames++;
+    if (fscanf(file, "%llu %llu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(file);
+
+    return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
 
-    seconds = currentTime - startTime;
 
-    if (seconds > 5.0) {
-        double fps = frames / seconds;
-        printf("%d frames in %3.1f seconds = %6.3f FPS\n",
-               frames, seconds, fps);
-        fflush(stdout);
-        startTime = currentTime;
-        frames = 0;
-    }
+/*
+ * Seconds on the monotonic clock, so animation is not affected by
+ * changes to the wall clock.
+ */
+double GetTime(void)
+{
+    return GetMonotonicNs() / 1000000000.0;
 }
 
 
@@ -142,8 +152,12 @@ PFNEGLQUERYDEVICESTRINGEXTPROC pEglQueryDeviceStringEXT = NULL;
 PFNEGLGETPLATFORMDISPLAYEXTPROC pEglGetPlatformDisplayEXT = NULL;
 PFNEGLGETOUTPUTLAYERSEXTPROC pEglGetOutputLayersEXT = NULL;
 PFNEGLCREATESTREAMKHRPROC pEglCreateStreamKHR = NULL;
+PFNEGLDESTROYSTREAMKHRPROC pEglDestroyStreamKHR = NULL;
+PFNEGLQUERYSTREAMU64KHRPROC pEglQueryStreamu64KHR = NULL;
 PFNEGLSTREAMCONSUMEROUTPUTEXTPROC pEglStreamConsumerOutputEXT = NULL;
 PFNEGLCREATESTREAMPRODUCERSURFACEKHRPROC pEglCreateStreamProducerSurfaceKHR = NULL;
+PFNEGLSTREAMCONSUMERACQUIREKHRPROC pEglStreamConsumerAcquireKHR = NULL;
+PFNEGLSTREAMCONSUMERACQUIREATTRIBNVPROC pEglStreamConsumerAcquireAttribNV = NULL;
 
 void GetEglExtensionFunctionPointers(void)
 {
@@ -162,9 +176,21 @@ void GetEglExtensionFunctionPointers(void)
     pEglCreateStreamKHR = (PFNEGLCREATESTREAMKHRPROC)
         GetProcAddress("eglCreateStreamKHR");
 
+    pEglDestroyStreamKHR = (PFNEGLDESTROYSTREAMKHRPROC)
+        GetProcAddress("eglDestroyStreamKHR");
+
+    pEglQueryStreamu64KHR = (PFNEGLQUERYSTREAMU64KHRPROC)
+        GetProcAddress("eglQueryStreamu64KHR");
+
     pEglStreamConsumerOutputEXT = (PFNEGLSTREAMCONSUMEROUTPUTEXTPROC)
         GetProcAddress("eglStreamConsumerOutputEXT");
 
     pEglCreateStreamProducerSurfaceKHR = (PFNEGLCREATESTREAMPRODUCERSURFACEKHRPROC)
         GetProcAddress("eglCreateStreamProducerSurfaceKHR");
+
+    pEglStreamConsumerAcquireKHR = (PFNEGLSTREAMCONSUMERACQUIREKHRPROC)
+        GetProcAddress("eglStreamConsumerAcquireKHR");
+
+    pEglStreamConsumerAcquireAttribNV = (PFNEGLSTREAMCONSUMERACQUIREATTRIBNVPROC)
+        GetProcAddress("eglStreamConsumerAcquireAttribNV");
 }
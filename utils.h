@@ -23,16 +23,24 @@
 #if !defined(UTILS_H)
 #define UTILS_H
 
+#include <stdint.h>
+
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 
+/* XXX khronos eglext.h does not yet have EGL_NV_stream_attrib */
+#if !defined(EGL_NV_stream_attrib)
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLSTREAMCONSUMERACQUIREATTRIBNVPROC) (EGLDisplay dpy, EGLStreamKHR stream, const EGLAttrib *attrib_list);
+#endif
+
 #define ARRAY_LEN(_arr) (sizeof(_arr) / sizeof(_arr[0]))
 
 void Fatal(const char *format, ...);
 void Warning(const char *format, ...);
 
 double GetTime(void);
-void PrintFps(void);
+uint64_t GetMonotonicNs(void);
+uint64_t GetResidentBytes(void);
 
 EGLBoolean ExtensionIsSupported(
     const char *extensionString,
@@ -45,7 +53,11 @@ extern PFNEGLQUERYDEVICESTRINGEXTPROC pEglQueryDeviceStringEXT;
 extern PFNEGLGETPLATFORMDISPLAYEXTPROC pEglGetPlatformDisplayEXT;
 extern PFNEGLGETOUTPUTLAYERSEXTPROC pEglGetOutputLayersEXT;
 extern PFNEGLCREATESTREAMKHRPROC pEglCreateStreamKHR;
+extern PFNEGLDESTROYSTREAMKHRPROC pEglDestroyStreamKHR;
+extern PFNEGLQUERYSTREAMU64KHRPROC pEglQueryStreamu64KHR;
 extern PFNEGLSTREAMCONSUMEROUTPUTEXTPROC pEglStreamConsumerOutputEXT;
 extern PFNEGLCREATESTREAMPRODUCERSURFACEKHRPROC pEglCreateStreamProducerSurfaceKHR;
+extern PFNEGLSTREAMCONSUMERACQUIREKHRPROC pEglStreamConsumerAcquireKHR;
+extern PFNEGLSTREAMCONSUMERACQUIREATTRIBNVPROC pEglStreamConsumerAcquireAttribNV;
 
 #endif /* UTILS_H */
\ No newline at end of file